@@ -7,6 +7,8 @@ MODULE_DESCRIPTION("RMT BE policy set");
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Sergio Leon <gaixas1@gmail.com>");
 
+static ATOMIC_NOTIFIER_HEAD(be_bp_chain);
+
 /// Main functions
 
 
@@ -17,7 +19,7 @@ static struct ps_base * f_policy_create(struct rina_component * component){
 	struct rmt_config * rmt_cfg;
 	struct base_config * conf;
 	
-	rmt_i = rmt_from_component(component);
+	rmt_i = component ? rmt_from_component(component) : NULL;
 	
 	ps_i = rkzalloc(sizeof(struct rmt_ps), GFP_ATOMIC);
 	if (!ps_i) {
@@ -31,15 +33,33 @@ static struct ps_base * f_policy_create(struct rina_component * component){
 	}
 	
 	conf->max_count = 100;
-	conf->ecn_th = 50;
+	rmt_mark_init(&conf->mark, RMT_MARK_DEQUEUE, 50);
+	rmt_bp_init(&conf->bp);
+	conf->shared_size = 0;
+	conf->dt_alpha = 100;
+	atomic_set(&conf->shared_used, 0);
+	conf->voq = 0;
+	conf->shards = 0;
+	conf->shard_bits = 0;
+	conf->cut_through = 0;
+	conf->dualq = 0;
+	conf->step_us = 1000;
+	conf->target_us = 15000;
+	conf->tupdate_us = 16000;
+	conf->alpha = 41;
+	conf->beta = 819;
+	conf->coupling = 2;
+	conf->tshift_us = 40000;
+	INIT_LIST_HEAD(&conf->l4s_L);
 	INIT_LIST_HEAD(&conf->port_L);
-	INIT_LIST_HEAD(&conf->buffer_L);
+	rmt_pool_init(&conf->buffer, sizeof(struct q_entry));
+	INIT_LIST_HEAD(&conf->qos_L);
 
 	ps_i->base.set_policy_set_param = f_set_policy_set_param;
 	ps_i->dm = rmt_i;
 	ps_i->priv = conf;
 
-	rmt_cfg = rmt_config_get(rmt_i);
+	rmt_cfg = rmt_i ? rmt_config_get(rmt_i) : NULL;
 	if (rmt_cfg) {
 		policy_for_each(rmt_cfg->policy_set, conf, f_policy_base_config_apply);
 	} else {
@@ -61,7 +81,8 @@ static void f_policy_destroy(struct ps_base * bps) {
 	struct rmt_ps * ps_i;
 	struct base_config * conf;
 	struct port_instance * port_i;
-	struct q_entry * entry_i;
+	struct qos_reserve * qos_i;
+	struct qos_l4s * l4s_i;
 
 	if (!bps) {
 		LOG_ERR("Error on rmt policy destroy. Some modules not set.");
@@ -79,14 +100,25 @@ static void f_policy_destroy(struct ps_base * bps) {
 	// Delete all remaining port instances
 	while(!list_empty(&conf->port_L)) {
 		port_i = list_first_entry(&conf->port_L, struct port_instance, L);
-		f_free_port_instance(port_i);
+		f_free_port_instance(conf, port_i);
 	}
 	
 	// Empty buffers
-	while(!list_empty(&conf->buffer_L)) {
-		entry_i = list_first_entry(&conf->buffer_L, struct q_entry, L);
-		list_del(&entry_i->L);
-		rkfree(entry_i);
+	if(conf->buffer.misses) {
+		LOG_INFO("Buffer pool was empty on %llu enqueues", conf->buffer.misses);
+	}
+	rmt_pool_destroy(&conf->buffer);
+	
+	// Remove QoS reserves
+	while(!list_empty(&conf->qos_L)) {
+		qos_i = list_first_entry(&conf->qos_L, struct qos_reserve, L);
+		list_del(&qos_i->L);
+		rkfree(qos_i);
+	}
+	while(!list_empty(&conf->l4s_L)) {
+		l4s_i = list_first_entry(&conf->l4s_L, struct qos_l4s, L);
+		list_del(&l4s_i->L);
+		rkfree(l4s_i);
 	}
 	
 	// Delete base structure
@@ -98,6 +130,10 @@ int f_rmt_enqueue_policy(struct rmt_ps *ps_i, struct rmt_n1_port * P, struct pdu
 	struct base_config * conf;
 	struct port_instance * port_i;
 	struct q_entry * entry_i;
+	struct list_head * head;
+	struct rmt_voq * voq;
+	struct port_shard * shard;
+	atomic_t * pool;
 	
 	if (!ps_i || !ps_i->priv || !P || !PDU) {
 		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_tx");
@@ -115,29 +151,85 @@ int f_rmt_enqueue_policy(struct rmt_ps *ps_i, struct rmt_n1_port * P, struct pdu
 		return RMT_PS_ENQ_ERR;
 	}
 	
-	if(port_i->count >= conf->max_count) {
+#ifdef RMT_PS_ENQ_SEND
+	// Nothing waiting and the port can transmit, let the RMT send it now
+	if(conf->cut_through && f_port_count(conf, port_i) == 0 && P->state == N1_PORT_STATE_ENABLED) {
+		return RMT_PS_ENQ_SEND;
+	}
+#endif
+	
+	shard = port_i->shards ? f_shard_of(conf, port_i, PDU) : NULL;
+	pool = NULL;
+	if(conf->shared_size) {
+		pool = f_shared_admit(conf, port_i, PDU);
+		if(!pool) {
+			LOG_INFO("Shared buffer threshold exceeded, dropping PDU");
+			pdu_destroy(PDU);
+			return RMT_PS_ENQ_DROP;
+		}
+	} else if(shard ? READ_ONCE(shard->count) >= (conf->max_count + conf->shards - 1) >> conf->shard_bits
+			&& f_port_count(conf, port_i) >= conf->max_count
+		: port_i->count >= conf->max_count) {
 		LOG_INFO("Length exceeded for queue, dropping PDU");
 		pdu_destroy(PDU);
 		return RMT_PS_ENQ_DROP;
 	}	
 	
-	if(list_empty(&conf->buffer_L)) {
-		entry_i = rkzalloc(sizeof(struct q_entry), GFP_ATOMIC);
-	} else {
-		entry_i = list_first_entry(&conf->buffer_L, struct q_entry, L);
-		list_del(&entry_i->L);
-	}
-	
+	entry_i = rmt_pool_get(&conf->buffer);
 	if(!entry_i) {
 		LOG_ERR("Cannot allocate buffer, dropping PDU");
+		if(pool) {
+			atomic_dec(pool);
+		}
 		pdu_destroy(PDU);
 		return RMT_PS_ENQ_DROP;
 	}
 
 	entry_i->data = PDU;
-	list_add_tail(&entry_i->L, &port_i->Q);
+	entry_i->pool = pool;
+	entry_i->len = pdu_len(PDU);
+	if(conf->dualq || conf->mark.metric == RMT_MARK_SOJOURN) {
+		entry_i->enq_ns = ktime_get_ns();
+	}
+	if(shard) {
+		f_shard_push(conf, port_i, shard, entry_i);
+		f_shard_bp(conf, port_i);
+		if(RMT_CHECK_ENABLED) {
+			f_check_port(conf, port_i);
+		}
+		return RMT_PS_ENQ_SCHED;
+	}
+	
+	head = &port_i->Q;
+	if(conf->dualq) {
+		if(f_dualq_is_l4s(conf, PDU)) {
+			list_add_tail(&entry_i->L, &port_i->QL);
+			port_i->count_l++;
+		} else {
+			list_add_tail(&entry_i->L, &port_i->Q);
+		}
+	} else if(port_i->voq) {
+		voq = rmt_voq_get(port_i->voq, pci_destination(pdu_pci_get_ro(PDU)));
+		rmt_voq_push(port_i->voq, voq, &entry_i->L);
+		head = &voq->Q;
+	} else {
+		list_add_tail(&entry_i->L, &port_i->Q);
+	}
 
 	port_i->count++;
+	port_i->bytes += entry_i->len;
+	
+	// Sojourn at enqueue is the one of the head of the queue
+	if(!conf->dualq && conf->mark.point == RMT_MARK_ENQUEUE
+		&& rmt_mark_check(&conf->mark, f_mark_value(conf, port_i,
+			list_first_entry(head, struct q_entry, L), entry_i->enq_ns))) {
+		rmt_mark_pdu(PDU);
+	}
+	
+	rmt_bp_update(&conf->bp, &port_i->bp_paused, &be_bp_chain, P, port_i->count);
+	if(RMT_CHECK_ENABLED) {
+		f_check_port(conf, port_i);
+	}
 	
 	LOG_DBG("PDU enqueued");
 	return RMT_PS_ENQ_SCHED;
@@ -148,8 +240,10 @@ struct pdu * f_rmt_dequeue_policy(struct rmt_ps * ps_i, struct rmt_n1_port * P)
 	struct port_instance * port_i;
 	struct pdu * PDU;
 	struct q_entry * entry_i;
-    struct pci * pci;
-	unsigned long pci_flags;
+	struct list_head * node;
+	struct port_shard * shard;
+	uint_t i;
+	u32 value;
 	
 	if (!ps_i || !P) {
 		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_rx");
@@ -164,18 +258,68 @@ struct pdu * f_rmt_dequeue_policy(struct rmt_ps * ps_i, struct rmt_n1_port * P)
 		return NULL;
 	}
 	
+	if(conf->dualq) {
+		entry_i = f_dualq_dequeue(conf, port_i);
+		if(!entry_i) {
+			return NULL;
+		}
+		PDU = entry_i->data;
+		port_i->bytes -= entry_i->len;
+		f_shared_release(entry_i);
+		rmt_pool_put(&conf->buffer, entry_i);
+		rmt_bp_update(&conf->bp, &port_i->bp_paused, &be_bp_chain, P, port_i->count);
+		if(RMT_CHECK_ENABLED) {
+			f_check_port(conf, port_i);
+		}
+		return PDU;
+	}
+	
+	// Round robin over the shards, the flows of one shard stay in order
+	if(port_i->shards) {
+		PDU = NULL;
+		for(i = 0; !PDU && i < conf->shards; i++) {
+			shard = port_i->shards + ((port_i->next_shard + i) & (conf->shards - 1));
+			if(READ_ONCE(shard->count)) {
+				PDU = f_shard_serve(conf, port_i, shard);
+			}
+		}
+		port_i->next_shard = (port_i->next_shard + i) & (conf->shards - 1);
+		f_shard_bp(conf, port_i);
+		if(RMT_CHECK_ENABLED) {
+			f_check_port(conf, port_i);
+		}
+		return PDU;
+	}
+	
 	PDU = NULL;
-	if(!list_empty(&port_i->Q)) {
+	entry_i = NULL;
+	if(port_i->voq) {
+		node = rmt_voq_pop(port_i->voq);
+		if(node) {
+			entry_i = list_entry(node, struct q_entry, L);
+		}
+	} else if(!list_empty(&port_i->Q)) {
 		entry_i = list_first_entry(&port_i->Q, struct q_entry, L);
 		list_del(&entry_i->L);
+	}
+	if(entry_i) {
 		PDU = entry_i->data;
-		list_add(&entry_i->L, &conf->buffer_L);
 		port_i->count--;
-	}
-	if(PDU != NULL && port_i->count > conf->ecn_th) {
-		pci = pdu_pci_get_rw(PDU);	
-		pci_flags = pci_flags_get(pci);
-		pci_flags_set(pci, pci_flags |= PDU_FLAGS_EXPLICIT_CONGESTION);
+		port_i->bytes -= entry_i->len;
+		value = 0;
+		if(conf->mark.point == RMT_MARK_DEQUEUE) {
+			value = f_mark_value(conf, port_i, entry_i,
+				conf->mark.metric == RMT_MARK_SOJOURN ? ktime_get_ns() : 0);
+		}
+		f_shared_release(entry_i);
+		rmt_pool_put(&conf->buffer, entry_i);
+		if(value && rmt_mark_check(&conf->mark, value)) {
+			rmt_mark_pdu(PDU);
+		}
+		rmt_bp_update(&conf->bp, &port_i->bp_paused, &be_bp_chain, P, port_i->count);
+		if(RMT_CHECK_ENABLED) {
+			f_check_port(conf, port_i);
+		}
 	}
 	
 	return PDU;
@@ -184,6 +328,7 @@ struct pdu * f_rmt_dequeue_policy(struct rmt_ps * ps_i, struct rmt_n1_port * P)
 void * f_rmt_q_create_policy(struct rmt_ps *ps_i, struct rmt_n1_port * P) {
 	struct base_config * config;
 	struct port_instance * port_i;
+	uint_t i;
 		
 	if (!ps_i || !ps_i->priv || !P) {
 		LOG_ERR("Wrong input parameters for rmt_q_create_policy");
@@ -205,8 +350,42 @@ void * f_rmt_q_create_policy(struct rmt_ps *ps_i, struct rmt_n1_port * P) {
 	
 	port_i->P = P;
 	port_i->count = 0;
+	port_i->count_l = 0;
+	port_i->prob = 0;
+	port_i->qdelay_old = 0;
+	port_i->last_update = ktime_get_ns();
 	INIT_LIST_HEAD(&port_i->L);
 	INIT_LIST_HEAD(&port_i->Q);
+	INIT_LIST_HEAD(&port_i->QL);
+	
+	// Destination queues replace the single FIFO, not the dual queue
+	port_i->voq = NULL;
+	if(config->voq && !config->dualq) {
+		port_i->voq = rkzalloc(RMT_VOQ_SET_SIZE(config->voq), GFP_ATOMIC);
+		if(!port_i->voq) {
+			LOG_ERR("Memory alloc problem in rmt_q_create_policy");
+			rkfree(port_i);
+			return NULL;
+		}
+		rmt_voq_init(port_i->voq, config->voq);
+	}
+	
+	// Shards replace the single FIFO too
+	port_i->shards = NULL;
+	port_i->next_shard = 0;
+	spin_lock_init(&port_i->bp_lock);
+	if(config->shards && !config->dualq && !config->voq) {
+		port_i->shards = kzalloc(sizeof(struct port_shard) * config->shards, GFP_ATOMIC);
+		if(!port_i->shards) {
+			LOG_ERR("Memory alloc problem in rmt_q_create_policy");
+			rkfree(port_i);
+			return NULL;
+		}
+		for(i = 0; i < config->shards; i++) {
+			spin_lock_init(&port_i->shards[i].lock);
+			INIT_LIST_HEAD(&port_i->shards[i].Q);
+		}
+	}
 	
 	P->rmt_ps_queues = port_i;
 	list_add_tail(&port_i->L, &config->port_L);
@@ -220,7 +399,7 @@ int f_rmt_q_destroy_policy(struct rmt_ps *ps_i, struct rmt_n1_port * P) {
 		return -1;
 	}
 	
-	f_free_port_instance((struct port_instance *) P->rmt_ps_queues);
+	f_free_port_instance(ps_i->priv, (struct port_instance *) P->rmt_ps_queues);
 	return 0;
 }
 
@@ -244,6 +423,9 @@ static int f_set_policy_set_param(struct ps_base * bps, const char * name, const
 
 static int f_policy_set_param_pv(struct base_config * data, const char * name, const char * value) {
 	int v;
+	uint_t qos_id, reserved, * field;
+	struct qos_reserve * qos_i;
+	struct qos_l4s * l4s_i;
 		
 	if (!name) {
 		LOG_ERR("Null parameter name");
@@ -264,35 +446,554 @@ static int f_policy_set_param_pv(struct base_config * data, const char * name, c
 		LOG_INFO("Set max_count as \"%d\"", v);
 		return 0;
 	}
-	if(strcmp(name, "ecn_th") == 0) {
+	if(strncmp(name, "ecn_", 4) == 0) {
+		if(kstrtoint(value, 10, &v) || v < 0) {
+			LOG_ERR("Error parsing %s value \"%s\"", name, value);
+			return -1;
+		}
+		// Queued PDUs may lack an enqueue time
+		if(strcmp(name, "ecn_metric") == 0 && !list_empty(&data->port_L)) {
+			LOG_ERR("Cannot change ecn_metric with ports in use");
+			return -1;
+		}
+		
+		switch(rmt_mark_set_param(&data->mark, name + 4, v)) {
+		case 0:
+			LOG_INFO("Set %s as \"%d\"", name, v);
+			return 0;
+		case -1:
+			LOG_ERR("Invalid %s value \"%d\"", name, v);
+			return -1;
+		}
+	}
+	if(strncmp(name, "bp_", 3) == 0) {
+		if(kstrtoint(value, 10, &v) || v < 0) {
+			LOG_ERR("Error parsing %s value \"%s\"", name, value);
+			return -1;
+		}
+		if(rmt_bp_set_param(&data->bp, name + 3, v) == 0) {
+			LOG_INFO("Set %s as \"%d\"", name, v);
+			return 0;
+		}
+	}
+	if(strncmp(name, "pool_", 5) == 0) {
+		if(kstrtoint(value, 10, &v) || v < 0) {
+			LOG_ERR("Error parsing %s value \"%s\"", name, value);
+			return -1;
+		}
+		if(rmt_pool_set_param(&data->buffer, name + 5, v) == 0) {
+			LOG_INFO("Set %s as \"%d\"", name, v);
+			return 0;
+		}
+	}
+	if(strcmp(name, "shared_buffer") == 0) {
+		if(kstrtoint(value, 10, &v)) {
+			LOG_ERR("Error parsing shared_buffer value \"%s\"", value);
+			return -1;
+		}
+		
+		data->shared_size = v;
+		LOG_INFO("Set shared_buffer as \"%d\"", v);
+		return 0;
+	}
+	if(strcmp(name, "dt_alpha") == 0) {
 		if(kstrtoint(value, 10, &v)) {
-			LOG_ERR("Error parsing ecn_th value \"%s\"", value);
+			LOG_ERR("Error parsing dt_alpha value \"%s\"", value);
+			return -1;
+		}
+		
+		data->dt_alpha = v;
+		LOG_INFO("Set dt_alpha as \"%d\"", v);
+		return 0;
+	}
+	if(strcmp(name, "qos_reserved") == 0) {
+		if(sscanf(value, "%u.%u", &qos_id, &reserved) != 2) {
+			LOG_ERR("Error parsing qos_reserved value \"%s\"", value);
+			return -1;
+		}
+		
+		list_for_each_entry(qos_i, &data->qos_L, L) {
+			if(qos_i->qos_id == qos_id) {
+				qos_i->reserved = reserved;
+				LOG_INFO("Set qos_reserved for QoS %u as \"%u\"", qos_id, reserved);
+				return 0;
+			}
+		}
+		qos_i = rkzalloc(sizeof(struct qos_reserve), GFP_ATOMIC);
+		if(!qos_i) {
+			LOG_ERR("Failure allocating QoS reserve");
+			return -1;
+		}
+		qos_i->qos_id = qos_id;
+		qos_i->reserved = reserved;
+		atomic_set(&qos_i->used, 0);
+		list_add_tail(&qos_i->L, &data->qos_L);
+		LOG_INFO("Set qos_reserved for QoS %u as \"%u\"", qos_id, reserved);
+		return 0;
+	}
+	if(strcmp(name, "l4s_qos") == 0) {
+		if(kstrtouint(value, 10, &qos_id)) {
+			LOG_ERR("Error parsing l4s_qos value \"%s\"", value);
 			return -1;
 		}
 		
-		data->ecn_th = v;
-		LOG_INFO("Set ecn_th as \"%d\"", v);
+		list_for_each_entry(l4s_i, &data->l4s_L, L) {
+			if(l4s_i->qos_id == qos_id) {
+				return 0;
+			}
+		}
+		l4s_i = rkzalloc(sizeof(struct qos_l4s), GFP_ATOMIC);
+		if(!l4s_i) {
+			LOG_ERR("Failure allocating L4S QoS");
+			return -1;
+		}
+		l4s_i->qos_id = qos_id;
+		list_add_tail(&l4s_i->L, &data->l4s_L);
+		LOG_INFO("Set QoS %u as low latency", qos_id);
 		return 0;
 	}
-	LOG_ERR("Unknown attribute \"%s\"", name);
-	return 1;
+	
+	// Dual queue parameters
+	if(strcmp(name, "voq") == 0) {
+		field = &data->voq;
+	} else if(strcmp(name, "shards") == 0) {
+		field = &data->shards;
+	} else if(strcmp(name, "cut_through") == 0) {
+		field = &data->cut_through;
+	} else if(strcmp(name, "dualq") == 0) {
+		field = &data->dualq;
+	} else if(strcmp(name, "step_us") == 0) {
+		field = &data->step_us;
+	} else if(strcmp(name, "target_us") == 0) {
+		field = &data->target_us;
+	} else if(strcmp(name, "tupdate_us") == 0) {
+		field = &data->tupdate_us;
+	} else if(strcmp(name, "alpha") == 0) {
+		field = &data->alpha;
+	} else if(strcmp(name, "beta") == 0) {
+		field = &data->beta;
+	} else if(strcmp(name, "coupling") == 0) {
+		field = &data->coupling;
+	} else if(strcmp(name, "tshift_us") == 0) {
+		field = &data->tshift_us;
+	} else {
+		LOG_ERR("Unknown attribute \"%s\"", name);
+		return 1;
+	}
+	
+	if(kstrtoint(value, 10, &v) || v < 0) {
+		LOG_ERR("Error parsing %s value \"%s\"", name, value);
+		return -1;
+	}
+	if((field == &data->dualq || field == &data->voq || field == &data->shards) && !list_empty(&data->port_L)) {
+		LOG_ERR("Cannot change %s with ports in use", name);
+		return -1;
+	}
+	if(field == &data->shards && v && (v < 2 || v > BE_MAX_SHARDS || (v & (v - 1)))) {
+		LOG_ERR("Invalid shards \"%d\", a power of 2 up to %d", v, BE_MAX_SHARDS);
+		return -1;
+	}
+	
+	*field = v;
+	if(field == &data->shards) {
+		data->shard_bits = v ? ilog2(v) : 0;
+	}
+	LOG_INFO("Set %s as \"%d\"", name, v);
+	return 0;
 }
 
-void f_free_port_instance(struct port_instance * port_i) {
+void f_free_port_instance(struct base_config * conf, struct port_instance * port_i) {
 	struct q_entry * entry_i;
+	uint_t i;
 		
 	port_i->P->rmt_ps_queues = NULL;
 	list_del(&port_i->L);
 	
+	if(port_i->bp_paused) {
+		rmt_bp_notify(&be_bp_chain, port_i->P, 0, RMT_BP_RESUME);
+	}
+	
+	if(port_i->voq) {
+		rmt_voq_flush(port_i->voq, &port_i->Q);
+		rkfree(port_i->voq);
+	}
+	if(port_i->shards) {
+		for(i = 0; i < conf->shards; i++) {
+			list_splice_tail_init(&port_i->shards[i].Q, &port_i->Q);
+		}
+		kfree(port_i->shards);
+	}
 	while(!list_empty(&port_i->Q)) {
 		entry_i = list_first_entry(&port_i->Q, struct q_entry, L);
 		list_del(&entry_i->L);
-		rkfree(entry_i);
+		f_shared_release(entry_i);
+		pdu_destroy(entry_i->data);
+		rmt_pool_put(&conf->buffer, entry_i);
+	}
+	while(!list_empty(&port_i->QL)) {
+		entry_i = list_first_entry(&port_i->QL, struct q_entry, L);
+		list_del(&entry_i->L);
+		f_shared_release(entry_i);
+		pdu_destroy(entry_i->data);
+		rmt_pool_put(&conf->buffer, entry_i);
 	}
 		
 	rkfree(port_i);
 }
 
+/*
+ * Shared buffer admission (Choudhury-Hahne dynamic threshold).
+ * A PDU first takes a slot of its QoS reserve, if any is free. Otherwise it
+ * is admitted to the shared buffer while the port holds less than dt_alpha %
+ * of the free shared space. Returns the counter charged, NULL if dropped.
+ */
+static atomic_t * f_shared_admit(struct base_config * conf, struct port_instance * port_i, struct pdu * PDU) {
+	struct qos_reserve * qos_i;
+	qos_id_t qos_id;
+	int used;
+	
+	if(!list_empty(&conf->qos_L)) {
+		qos_id = pci_qos_id(pdu_pci_get_ro(PDU));
+		list_for_each_entry(qos_i, &conf->qos_L, L) {
+			if(qos_i->qos_id == qos_id) {
+				if(atomic_inc_return(&qos_i->used) <= qos_i->reserved) {
+					return &qos_i->used;
+				}
+				atomic_dec(&qos_i->used);
+				break;
+			}
+		}
+	}
+	
+	used = atomic_read(&conf->shared_used);
+	if(used >= conf->shared_size
+		|| (u64) f_port_count(conf, port_i) * 100 >= (u64) (conf->shared_size - used) * conf->dt_alpha) {
+		return NULL;
+	}
+	if(atomic_inc_return(&conf->shared_used) > conf->shared_size) {
+		atomic_dec(&conf->shared_used);
+		return NULL;
+	}
+	return &conf->shared_used;
+}
+
+static void f_shared_release(struct q_entry * entry_i) {
+	if(entry_i->pool) {
+		atomic_dec(entry_i->pool);
+		entry_i->pool = NULL;
+	}
+}
+
+/*
+ * Dual queue mode (DualPI2-like coupled AQM).
+ * PDUs of the QoS listed in l4s_qos use a low latency queue marked when
+ * their sojourn exceeds step_us; the rest use a classic queue. A PI
+ * controller, updated at most every tupdate_us from dequeue, keeps a base
+ * probability p'. Classic PDUs are marked with p'^2 and low latency PDUs
+ * also with coupling * p', so both traffic types get the same rate.
+ */
+static bool f_dualq_is_l4s(struct base_config * conf, struct pdu * PDU) {
+	struct qos_l4s * l4s_i;
+	qos_id_t qos_id;
+	
+	if(list_empty(&conf->l4s_L)) {
+		return false;
+	}
+	qos_id = pci_qos_id(pdu_pci_get_ro(PDU));
+	list_for_each_entry(l4s_i, &conf->l4s_L, L) {
+		if(l4s_i->qos_id == qos_id) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static struct q_entry * f_dualq_dequeue(struct base_config * conf, struct port_instance * port_i) {
+	struct q_entry * entry_l, * entry_c, * entry_i;
+	u64 now, p;
+	bool mark;
+	
+	now = ktime_get_ns();
+	if(now - port_i->last_update >= (u64) conf->tupdate_us * NSEC_PER_USEC) {
+		f_dualq_update(conf, port_i, now);
+	}
+	
+	entry_l = list_first_entry_or_null(&port_i->QL, struct q_entry, L);
+	entry_c = list_first_entry_or_null(&port_i->Q, struct q_entry, L);
+	if(!entry_l && !entry_c) {
+		return NULL;
+	}
+	
+	// Time shifted FIFO, the classic head goes first once it has waited
+	// tshift_us more than the low latency head
+	if(entry_l && (!entry_c
+		|| entry_c->enq_ns + (u64) conf->tshift_us * NSEC_PER_USEC >= entry_l->enq_ns)) {
+		entry_i = entry_l;
+		port_i->count_l--;
+		p = (u64) port_i->prob * conf->coupling;
+		mark = now - entry_i->enq_ns > (u64) conf->step_us * NSEC_PER_USEC
+			|| (p && (p >= DUALQ_MAX_PROB || prandom_u32() < p));
+	} else {
+		entry_i = entry_c;
+		// p'^2 as two independent draws under p'
+		mark = port_i->prob
+			&& prandom_u32() < port_i->prob && prandom_u32() < port_i->prob;
+	}
+	list_del(&entry_i->L);
+	port_i->count--;
+	
+	if(mark) {
+		rmt_mark_pdu(entry_i->data);
+	}
+	
+	return entry_i;
+}
+
+static void f_dualq_update(struct base_config * conf, struct port_instance * port_i, u64 now) {
+	struct q_entry * entry_i;
+	uint_t qdelay;
+	s64 delta, p;
+	
+	// Queue delay as the largest head sojourn of both queues
+	qdelay = 0;
+	entry_i = list_first_entry_or_null(&port_i->Q, struct q_entry, L);
+	if(entry_i) {
+		qdelay = div_u64(now - entry_i->enq_ns, NSEC_PER_USEC);
+	}
+	entry_i = list_first_entry_or_null(&port_i->QL, struct q_entry, L);
+	if(entry_i) {
+		qdelay = max_t(uint_t, qdelay, div_u64(now - entry_i->enq_ns, NSEC_PER_USEC));
+	}
+	
+	// alpha and beta are in 1/256 Hz, delays in us
+	delta = (s64) conf->alpha * ((s64) qdelay - conf->target_us)
+		+ (s64) conf->beta * ((s64) qdelay - port_i->qdelay_old);
+	delta = delta * (DUALQ_MAX_PROB / 1000000) / 256;
+	
+	p = (s64) port_i->prob + delta;
+	if(p < 0) {
+		p = 0;
+	} else if(p > DUALQ_MAX_PROB) {
+		p = DUALQ_MAX_PROB;
+	}
+	
+	port_i->prob = (u32) p;
+	port_i->qdelay_old = qdelay;
+	port_i->last_update = now;
+}
+
+// Measure of the marking metric, count and bytes already without the dequeued PDU
+static u32 f_mark_value(struct base_config * conf, struct port_instance * port_i, struct q_entry * entry_i, u64 now) {
+	switch(conf->mark.metric) {
+	case RMT_MARK_BYTES:
+		return f_port_bytes(conf, port_i);
+	case RMT_MARK_SOJOURN:
+		return div_u64(now - entry_i->enq_ns, NSEC_PER_USEC);
+	default:
+		return f_port_count(conf, port_i);
+	}
+}
+
+
+/*
+ * TX queue shards.
+ * With shards set, the single FIFO of a port is split into that many
+ * FIFOs, each with its own lock, and flows are steered to them by a hash
+ * of their destination address, CEP id and QoS. Each shard is always
+ * given its part of max_count, and more while the sum of the shards, read
+ * without their locks, is below it: the port limit holds approximately.
+ * The port counts are the sums of the shard counters. The RMT dequeue serves the
+ * shards round robin; an RMT that feeds several TX queues of the N-1 port
+ * at once can serve one shard per queue with rmt_be_dequeue_txq, each
+ * taking only the lock of its shard. Backpressure is checked on the sum
+ * of the shards under a lock of its own, so it stays right whichever
+ * path drained the port.
+ */
+static uint_t f_port_count(struct base_config * conf, struct port_instance * port_i) {
+	uint_t i, count;
+	
+	if(!port_i->shards) {
+		return port_i->count;
+	}
+	for(i = 0, count = 0; i < conf->shards; i++) {
+		count += READ_ONCE(port_i->shards[i].count);
+	}
+	return count;
+}
+
+static uint_t f_port_bytes(struct base_config * conf, struct port_instance * port_i) {
+	uint_t i, bytes;
+	
+	if(!port_i->shards) {
+		return port_i->bytes;
+	}
+	for(i = 0, bytes = 0; i < conf->shards; i++) {
+		bytes += READ_ONCE(port_i->shards[i].bytes);
+	}
+	return bytes;
+}
+
+static struct port_shard * f_shard_of(struct base_config * conf, struct port_instance * port_i, struct pdu * PDU) {
+	const struct pci * pci;
+	u32 key;
+	
+	pci = pdu_pci_get_ro(PDU);
+	key = ((u32) pci_destination(pci) * 31 + (u32) pci_cep_destination(pci)) * 31 + pci_qos_id(pci);
+	return port_i->shards + hash_32(key, conf->shard_bits);
+}
+
+static void f_shard_push(struct base_config * conf, struct port_instance * port_i, struct port_shard * shard, struct q_entry * entry_i) {
+	spin_lock_bh(&shard->lock);
+	list_add_tail(&entry_i->L, &shard->Q);
+	shard->count++;
+	shard->bytes += entry_i->len;
+	
+	// Sojourn at enqueue is the one of the head of the shard
+	if(conf->mark.point == RMT_MARK_ENQUEUE
+		&& rmt_mark_check(&conf->mark, f_mark_value(conf, port_i,
+			list_first_entry(&shard->Q, struct q_entry, L), entry_i->enq_ns))) {
+		rmt_mark_pdu(entry_i->data);
+	}
+	spin_unlock_bh(&shard->lock);
+}
+
+// Head of the shard, marked at dequeue if due, NULL if empty
+static struct pdu * f_shard_serve(struct base_config * conf, struct port_instance * port_i, struct port_shard * shard) {
+	struct q_entry * entry_i;
+	struct pdu * PDU;
+	u32 value;
+	
+	spin_lock_bh(&shard->lock);
+	entry_i = list_first_entry_or_null(&shard->Q, struct q_entry, L);
+	if(!entry_i) {
+		spin_unlock_bh(&shard->lock);
+		return NULL;
+	}
+	list_del(&entry_i->L);
+	shard->count--;
+	shard->bytes -= entry_i->len;
+	spin_unlock_bh(&shard->lock);
+	
+	PDU = entry_i->data;
+	value = 0;
+	if(conf->mark.point == RMT_MARK_DEQUEUE) {
+		value = f_mark_value(conf, port_i, entry_i,
+			conf->mark.metric == RMT_MARK_SOJOURN ? ktime_get_ns() : 0);
+	}
+	f_shared_release(entry_i);
+	rmt_pool_put(&conf->buffer, entry_i);
+	if(value && rmt_mark_check(&conf->mark, value)) {
+		rmt_mark_pdu(PDU);
+	}
+	return PDU;
+}
+
+// Backpressure of a sharded port on the sum of its shards
+static void f_shard_bp(struct base_config * conf, struct port_instance * port_i) {
+	if(!conf->bp.high) {
+		return;
+	}
+	spin_lock_bh(&port_i->bp_lock);
+	rmt_bp_update(&conf->bp, &port_i->bp_paused, &be_bp_chain, port_i->P, f_port_count(conf, port_i));
+	spin_unlock_bh(&port_i->bp_lock);
+}
+
+// Next PDU of TX queue txq, the caller needs no port lock
+struct pdu * rmt_be_dequeue_txq(struct rmt_ps * ps, struct rmt_n1_port * P, uint_t txq) {
+	struct base_config * conf;
+	struct port_instance * port_i;
+	struct pdu * PDU;
+	
+	if (!ps || !ps->priv || !P) {
+		LOG_ERR("Wrong input parameters for rmt_be_dequeue_txq");
+		return NULL;
+	}
+	conf = ps->priv;
+	port_i = P->rmt_ps_queues;
+	if(!port_i || !port_i->shards || txq >= conf->shards) {
+		return NULL;
+	}
+	PDU = f_shard_serve(conf, port_i, port_i->shards + txq);
+	if(PDU) {
+		f_shard_bp(conf, port_i);
+	}
+	return PDU;
+}
+EXPORT_SYMBOL(rmt_be_dequeue_txq);
+
+
+/*
+ * Invariant checks (make RMT_CHECK=1), see rmt-check.h.
+ * The counters of the port must match the PDUs actually queued.
+ */
+static void f_check_port(struct base_config * conf, struct port_instance * port_i) {
+	struct q_entry * entry_i;
+	struct rmt_voq * voq;
+	struct port_shard * shard;
+	uint_t count, count_l, bytes, n, n_bytes, i;
+	
+	count = 0;
+	count_l = 0;
+	bytes = 0;
+	list_for_each_entry(entry_i, &port_i->Q, L) {
+		count++;
+		bytes += entry_i->len;
+	}
+	list_for_each_entry(entry_i, &port_i->QL, L) {
+		count_l++;
+		bytes += entry_i->len;
+	}
+	if(port_i->voq) {
+		list_for_each_entry(voq, &port_i->voq->active, A) {
+			n = 0;
+			list_for_each_entry(entry_i, &voq->Q, L) {
+				n++;
+				bytes += entry_i->len;
+			}
+			rmt_check(n && n == voq->count, "port %d voq %u holds %u PDUs, counted %u",
+				port_i->P->port_id, voq->key, n, voq->count);
+			count += n;
+		}
+	}
+	
+	rmt_check(count_l == port_i->count_l, "port %d low latency queue holds %u PDUs, counted %u",
+		port_i->P->port_id, count_l, port_i->count_l);
+	rmt_check(count + count_l == port_i->count, "port %d holds %u PDUs, counted %u",
+		port_i->P->port_id, count + count_l, port_i->count);
+	rmt_check(bytes == port_i->bytes, "port %d holds %u bytes, counted %u",
+		port_i->P->port_id, bytes, port_i->bytes);
+	for(i = 0; port_i->shards && i < conf->shards; i++) {
+		shard = port_i->shards + i;
+		n = 0;
+		n_bytes = 0;
+		spin_lock_bh(&shard->lock);
+		list_for_each_entry(entry_i, &shard->Q, L) {
+			n++;
+			n_bytes += entry_i->len;
+		}
+		rmt_check(n == shard->count && n_bytes == shard->bytes, "port %d shard %u holds %u PDUs %u bytes, counted %u %u",
+			port_i->P->port_id, i, n, n_bytes, shard->count, shard->bytes);
+		spin_unlock_bh(&shard->lock);
+	}
+	rmt_check(!conf->shared_size || atomic_read(&conf->shared_used) <= conf->shared_size,
+		"shared buffer holds %d PDUs, size %u", atomic_read(&conf->shared_used), conf->shared_size);
+}
+
+
+/*
+ * Backpressure listeners, called with RMT_BP_PAUSE / RMT_BP_RESUME and a
+ * struct rmt_bp_info when a port crosses bp_high / bp_low.
+ */
+int rmt_be_bp_register(struct notifier_block * nb) {
+	return atomic_notifier_chain_register(&be_bp_chain, nb);
+}
+EXPORT_SYMBOL(rmt_be_bp_register);
+
+int rmt_be_bp_unregister(struct notifier_block * nb) {
+	return atomic_notifier_chain_unregister(&be_bp_chain, nb);
+}
+EXPORT_SYMBOL(rmt_be_bp_unregister);
+
 
 /// Policy init and exit
 
@@ -302,6 +1003,18 @@ static struct ps_factory qta_factory = {
 		.destroy = f_policy_destroy,
 };
 
+// Invariant checks failed so far, see rmt-check.h
+int rmt_be_check_failed(void) {
+	return atomic_read(&rmt_check_failed);
+}
+EXPORT_SYMBOL(rmt_be_check_failed);
+
+// Factory for in-kernel users other than the RMT (e.g. rmt_gen)
+struct ps_factory * rmt_be_ps_factory(void) {
+	return &qta_factory;
+}
+EXPORT_SYMBOL(rmt_be_ps_factory);
+
 static int __init mod_init(void) {
 	strcpy(qta_factory.name, RINA_BE_PS_NAME);
 	if (rmt_ps_publish(&qta_factory)) {
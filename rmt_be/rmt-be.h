@@ -3,12 +3,31 @@
 #include <linux/list.h>
 #include <linux/export.h>
 #include <linux/string.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/cache.h>
+#include <linux/spinlock.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
 
 #include "logs.h"
 #include "rds/rmem.h"
 #include "rmt-ps.h"
 #include "policies.h"
 #include "debug.h"
+#include "rmt-mark.h"
+#include "rmt-voq.h"
+#include "rmt-bp.h"
+#include "rmt-check.h"
+#include "rmt-pool.h"
+
+// Probability 1 in fixed point
+#define DUALQ_MAX_PROB 0xFFFFFFFFU
+
+// Most TX queue shards per port
+#define BE_MAX_SHARDS 64
 
 /// Data structures
 
@@ -16,28 +35,86 @@
 struct q_entry {
 	struct list_head L;
 	struct pdu * data;
+	atomic_t * pool; // Shared buffer counter charged by this PDU, if any
+	uint_t len;
+	u64 enq_ns; // Enqueue time, dual queue mode or sojourn marking
 };
 
+// Reserved share of the shared buffer for a QoS
+struct qos_reserve {
+	struct list_head L;
+	qos_id_t qos_id;
+	uint_t reserved;
+	atomic_t used;
+};
+
+// QoS served by the low latency queue
+struct qos_l4s {
+	struct list_head L;
+	qos_id_t qos_id;
+};
+
+// TX queue shard of a port, the flows hashed to it and its own lock
+struct port_shard {
+	spinlock_t lock;
+	struct list_head Q;
+	uint_t count;
+	uint_t bytes;
+} ____cacheline_aligned_in_smp;
+
 // port instance information
 struct port_instance {
 	struct list_head L;
 	struct rmt_n1_port * P;
 	
 	uint_t count;
-	struct list_head Q;
+	uint_t bytes;
+	u8 bp_paused; // Backpressure asserted
+	spinlock_t bp_lock; // Guards bp_paused of a sharded port, TX queues are served without the port lock
+	struct list_head Q; // Classic queue in dual queue mode
+	struct rmt_voq_set * voq; // Per destination queues, NULL -> single FIFO
+	struct port_shard * shards; // Per TX queue FIFOs, NULL -> single FIFO
+	uint_t next_shard; // Next shard served by the RMT dequeue
+	
+	// Dual queue mode
+	struct list_head QL; // Low latency queue
+	uint_t count_l;
+	u32 prob; // Base PI probability p', DUALQ_MAX_PROB -> 1
+	uint_t qdelay_old; // Queue delay at the last update in us
+	u64 last_update; // Time of the last update in ns
 };
 
 // Configuration of the policy
 struct base_config {
 	uint_t max_count;
-	uint_t ecn_th;
+	struct rmt_mark mark; // ECN marking of the single FIFO
+	struct rmt_bp_conf bp; // Backpressure watermarks on count
+	uint_t shared_size; // Shared buffer size in PDUs, 0 -> per port max_count
+	uint_t dt_alpha; // Dynamic threshold, % of the free shared buffer
+	atomic_t shared_used;
+	uint_t voq; // Per destination queues per port, 0 -> single FIFO
+	uint_t shards; // TX queue shards per port, power of 2, 0 -> single FIFO
+	uint_t shard_bits; // log2 of shards
+	uint_t cut_through; // Send PDUs found with an empty port at once
+	uint_t dualq; // Coupled low latency / classic queues, 0 -> single FIFO
+	uint_t step_us; // Low latency queue marking threshold
+	uint_t target_us; // Classic queue target delay
+	uint_t tupdate_us; // PI update period
+	uint_t alpha; // PI gain on the delay error, in 1/256 Hz
+	uint_t beta; // PI gain on the delay trend, in 1/256 Hz
+	uint_t coupling; // Low latency marking probability k * p'
+	uint_t tshift_us; // Time shift of the classic queue in the scheduler
+	struct list_head l4s_L;
 	struct list_head port_L;
-	struct list_head buffer_L;
+	struct rmt_pool buffer; // Free queue entries
+	struct list_head qos_L;
 };
 
 /// Function headers
 
 static struct ps_base * f_policy_create(struct rina_component * component);
+struct ps_factory * rmt_be_ps_factory(void);
+int rmt_be_check_failed(void);
 static void f_policy_destroy(struct ps_base * bps);
 
 void * f_rmt_q_create_policy(struct rmt_ps *ps, struct rmt_n1_port * P);
@@ -50,4 +127,20 @@ static int f_policy_base_config_apply(struct policy_parm * param, void * data);
 
 static int f_policy_set_param_pv(struct base_config * data, const char * name, const char * value);
 
-void f_free_port_instance(struct port_instance * entry);
+void f_free_port_instance(struct base_config * conf, struct port_instance * entry);
+static atomic_t * f_shared_admit(struct base_config * conf, struct port_instance * port_i, struct pdu * PDU);
+static void f_shared_release(struct q_entry * entry_i);
+static bool f_dualq_is_l4s(struct base_config * conf, struct pdu * PDU);
+static struct q_entry * f_dualq_dequeue(struct base_config * conf, struct port_instance * port_i);
+static void f_dualq_update(struct base_config * conf, struct port_instance * port_i, u64 now);
+int rmt_be_bp_register(struct notifier_block * nb);
+int rmt_be_bp_unregister(struct notifier_block * nb);
+static u32 f_mark_value(struct base_config * conf, struct port_instance * port_i, struct q_entry * entry_i, u64 now);
+static void f_check_port(struct base_config * conf, struct port_instance * port_i);
+static uint_t f_port_count(struct base_config * conf, struct port_instance * port_i);
+static uint_t f_port_bytes(struct base_config * conf, struct port_instance * port_i);
+static struct port_shard * f_shard_of(struct base_config * conf, struct port_instance * port_i, struct pdu * PDU);
+static void f_shard_push(struct base_config * conf, struct port_instance * port_i, struct port_shard * shard, struct q_entry * entry_i);
+static struct pdu * f_shard_serve(struct base_config * conf, struct port_instance * port_i, struct port_shard * shard);
+static void f_shard_bp(struct base_config * conf, struct port_instance * port_i);
+struct pdu * rmt_be_dequeue_txq(struct rmt_ps * ps, struct rmt_n1_port * P, uint_t txq);
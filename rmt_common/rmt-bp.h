@@ -0,0 +1,78 @@
+//rmt-bp.h
+#ifndef RMT_BP_H
+#define RMT_BP_H
+
+#include <linux/notifier.h>
+#include <linux/string.h>
+
+/*
+	Backpressure signalling with watermark hysteresis.
+	When the occupancy of a port reaches high the port is paused and the
+	policy set calls its notifier chain with RMT_BP_PAUSE; once it drains to
+	low it calls RMT_BP_RESUME. Listeners (e.g. the code feeding local flows
+	into the RMT) stop and restart the flows towards the port, so local
+	traffic is flow controlled before the queue cap forces drops.
+	Chains are atomic, called with the port lock held: listeners must not
+	sleep nor enqueue into the same port from the callback.
+*/
+
+enum rmt_bp_event {
+	RMT_BP_PAUSE = 1,
+	RMT_BP_RESUME = 2,
+};
+
+struct rmt_n1_port;
+
+// Data passed to the listeners
+struct rmt_bp_info {
+	struct rmt_n1_port * P;
+	u32 count; // Occupancy of the port when the event fired
+};
+
+struct rmt_bp_conf {
+	u32 high; // Pause at this occupancy, 0 -> backpressure disabled
+	u32 low; // Resume at this occupancy, must be < high
+};
+
+static inline void rmt_bp_init(struct rmt_bp_conf * bp) {
+	bp->high = 0;
+	bp->low = 0;
+}
+
+static inline void rmt_bp_notify(struct atomic_notifier_head * chain, struct rmt_n1_port * P, u32 count, unsigned long event) {
+	struct rmt_bp_info info;
+
+	info.P = P;
+	info.count = count;
+	atomic_notifier_call_chain(chain, event, &info);
+}
+
+// Call after the occupancy of the port changes; paused is per port state
+static inline void rmt_bp_update(const struct rmt_bp_conf * bp, u8 * paused,
+		struct atomic_notifier_head * chain, struct rmt_n1_port * P, u32 count) {
+	if(!bp->high) {
+		return;
+	}
+	if(!*paused && count >= bp->high) {
+		*paused = 1;
+		rmt_bp_notify(chain, P, count, RMT_BP_PAUSE);
+	} else if(*paused && count <= bp->low) {
+		*paused = 0;
+		rmt_bp_notify(chain, P, count, RMT_BP_RESUME);
+	}
+}
+
+// Parameter by name without its prefix: high and low. 0 if set, 1 if unknown
+static inline int rmt_bp_set_param(struct rmt_bp_conf * bp, const char * name, u32 v) {
+	if(strcmp(name, "high") == 0) {
+		bp->high = v;
+		return 0;
+	}
+	if(strcmp(name, "low") == 0) {
+		bp->low = v;
+		return 0;
+	}
+	return 1;
+}
+
+#endif
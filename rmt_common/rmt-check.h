@@ -0,0 +1,49 @@
+//rmt-check.h
+#ifndef RMT_CHECK_H
+#define RMT_CHECK_H
+
+#include <linux/list.h>
+#include <linux/bug.h>
+#include <linux/atomic.h>
+
+/*
+	Invariant checks of the policy set state, built with make RMT_CHECK=1.
+	Each policy set walks the state of a port after every enqueue and
+	dequeue and compares it with its counters (occupancy, bytes, credits,
+	heap order...). A broken invariant is logged with the values found,
+	warns once per check and is counted. Each policy set exports the count
+	(rmt_<ps>_check_failed), rmt_gen fails a run if it grew during it: the
+	warning taints the kernel only once, the count keeps failing every run
+	that breaks an invariant again.
+	Without RMT_CHECK the checks are dead code and compile to nothing.
+*/
+
+#ifdef RMT_CHECK
+#define RMT_CHECK_ENABLED 1
+#else
+#define RMT_CHECK_ENABLED 0
+#endif
+
+// Checks failed since the policy set was loaded, one policy set per module
+static atomic_t rmt_check_failed;
+
+#define rmt_check(cond, fmt, ...) do { \
+	if(RMT_CHECK_ENABLED && unlikely(!(cond))) { \
+		atomic_inc(&rmt_check_failed); \
+		LOG_ERR("Invariant failed: " fmt, ##__VA_ARGS__); \
+		WARN_ON_ONCE(1); \
+	} \
+} while(0)
+
+static inline u32 rmt_check_list_len(const struct list_head * head) {
+	const struct list_head * node;
+	u32 n;
+
+	n = 0;
+	for(node = head->next; node != head; node = node->next) {
+		n++;
+	}
+	return n;
+}
+
+#endif
@@ -0,0 +1,203 @@
+//rmt-conf.h
+#ifndef RMT_CONF_H
+#define RMT_CONF_H
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+/*
+	Two-phase loading of the policy set parameters at creation.
+	rmt_conf_stage_load parses every parameter of the policy once into an
+	array of staged values, without touching the parameter strings. The
+	policy set then applies the scalar parameters, sizes and allocates its
+	configuration in one block from them, applies the per policer, level or
+	QoS parameters and validates the result as a whole. The order of the
+	parameters in the policy does not matter, and a creation either gets
+	the whole configuration or fails.
+	Values are "v" or "id.v", id being the policer, level or QoS the
+	parameter applies to.
+	A policy set created without an RMT, as by rmt_gen, has no policy to
+	stage: it stages the parameters it gets through set_policy_set_param
+	with rmt_conf_stage_add instead, and loads them as a creation would
+	when its first port is created.
+*/
+
+#define RMT_CONF_NO_ID 0xFFFF
+#define RMT_CONF_MAX_ID 255
+
+struct policy;
+struct policy_parm;
+
+struct rmt_conf_param {
+	const char * name; // Name of the policy parameter, not copied
+	u16 id; // Before the dot, RMT_CONF_NO_ID if none
+	u64 v;
+};
+
+struct rmt_conf_stage {
+	struct rmt_conf_param * params;
+	u32 num;
+	u32 max;
+	u32 errors; // Parameters that could not be parsed
+	u8 owned; // Names copied by rmt_conf_stage_add, freed with the stage
+};
+
+// Bitmap of the ids seen for some parameter, e.g. the QoS ids mapped
+struct rmt_conf_ids {
+	u64 map[(RMT_CONF_MAX_ID + 64) / 64];
+	u32 num;
+};
+
+// 0 if parsed, -1 if the value is not a number nor id.number
+static inline int rmt_conf_parse(struct rmt_conf_param * param, const char * name, const char * value) {
+	const char * dot;
+	char id[4];
+	u8 id8;
+
+	if(!name || !value) {
+		return -1;
+	}
+	param->name = name;
+	param->id = RMT_CONF_NO_ID;
+	dot = strchr(value, '.');
+	if(!dot) {
+		return kstrtou64(value, 10, &param->v) ? -1 : 0;
+	}
+	if(dot == value || dot - value >= sizeof(id)) {
+		return -1;
+	}
+	memcpy(id, value, dot - value);
+	id[dot - value] = '\0';
+	if(kstrtou8(id, 10, &id8) || kstrtou64(dot + 1, 10, &param->v)) {
+		return -1;
+	}
+	param->id = id8;
+	return 0;
+}
+
+static inline int rmt_conf_count(struct policy_parm * param, void * data) {
+	(*(u32 *) data)++;
+	return 0;
+}
+
+static inline int rmt_conf_stage_one(struct policy_parm * param, void * data) {
+	struct rmt_conf_stage * stage = data;
+	struct rmt_conf_param * param_i;
+
+	if(stage->num >= stage->max) {
+		return -1;
+	}
+	param_i = stage->params + stage->num;
+	if(rmt_conf_parse(param_i, policy_param_name(param), policy_param_value(param))) {
+		LOG_ERR("Error while parsing parameter %s with value %s", policy_param_name(param), policy_param_value(param));
+		stage->errors++;
+		return 0;
+	}
+	stage->num++;
+	return 0;
+}
+
+static inline void rmt_conf_stage_init(struct rmt_conf_stage * stage) {
+	stage->params = NULL;
+	stage->num = 0;
+	stage->max = 0;
+	stage->errors = 0;
+	stage->owned = 0;
+}
+
+// Parses the whole policy in one allocation, 0 if it could be staged
+static inline int rmt_conf_stage_load(struct rmt_conf_stage * stage, struct policy * policy) {
+	rmt_conf_stage_init(stage);
+	if(!policy) {
+		return 0;
+	}
+	policy_for_each(policy, &stage->max, rmt_conf_count);
+	if(!stage->max) {
+		return 0;
+	}
+	stage->params = kmalloc(sizeof(struct rmt_conf_param) * stage->max, GFP_ATOMIC);
+	if(!stage->params) {
+		LOG_ERR("Failure allocating the parameter staging area");
+		return -1;
+	}
+	policy_for_each(policy, stage, rmt_conf_stage_one);
+	return 0;
+}
+
+// Stages one parameter, copying its name. 0 if staged, -1 if invalid or out of memory
+static inline int rmt_conf_stage_add(struct rmt_conf_stage * stage, const char * name, const char * value) {
+	struct rmt_conf_param * params;
+	char * copy;
+	u32 max;
+	
+	if(stage->num >= stage->max) {
+		max = stage->max ? stage->max * 2 : 16;
+		params = kmalloc(sizeof(struct rmt_conf_param) * max, GFP_ATOMIC);
+		if(!params) {
+			LOG_ERR("Failure allocating the parameter staging area");
+			return -1;
+		}
+		if(stage->num) {
+			memcpy(params, stage->params, sizeof(struct rmt_conf_param) * stage->num);
+		}
+		if(stage->params) {
+			kfree(stage->params);
+		}
+		stage->params = params;
+		stage->max = max;
+	}
+	if(rmt_conf_parse(stage->params + stage->num, name, value)) {
+		LOG_ERR("Error while parsing parameter %s with value %s", name, value);
+		return -1;
+	}
+	copy = kmalloc(strlen(name) + 1, GFP_ATOMIC);
+	if(!copy) {
+		LOG_ERR("Failure allocating parameter %s", name);
+		return -1;
+	}
+	strcpy(copy, name);
+	stage->params[stage->num++].name = copy;
+	stage->owned = 1;
+	return 0;
+}
+
+static inline void rmt_conf_stage_free(struct rmt_conf_stage * stage) {
+	u32 i;
+	
+	for(i = 0; stage->owned && i < stage->num; i++) {
+		kfree(stage->params[i].name);
+	}
+	if(stage->params) {
+		kfree(stage->params);
+	}
+	stage->params = NULL;
+	stage->num = 0;
+	stage->max = 0;
+	stage->owned = 0;
+}
+
+// Collects the ids of the parameters named with prefix
+static inline void rmt_conf_ids_get(const struct rmt_conf_stage * stage, const char * prefix, struct rmt_conf_ids * ids) {
+	const struct rmt_conf_param * param_i;
+	size_t len = strlen(prefix);
+	u32 i;
+
+	memset(ids, 0, sizeof(*ids));
+	for(i = 0; i < stage->num; i++) {
+		param_i = stage->params + i;
+		if(param_i->id > RMT_CONF_MAX_ID || strncmp(param_i->name, prefix, len) != 0) {
+			continue;
+		}
+		if(!(ids->map[param_i->id / 64] & (1ULL << (param_i->id % 64)))) {
+			ids->map[param_i->id / 64] |= 1ULL << (param_i->id % 64);
+			ids->num++;
+		}
+	}
+}
+
+static inline bool rmt_conf_ids_test(const struct rmt_conf_ids * ids, u16 id) {
+	return id <= RMT_CONF_MAX_ID && (ids->map[id / 64] & (1ULL << (id % 64)));
+}
+
+#endif
@@ -0,0 +1,126 @@
+//rmt-group.h
+#ifndef RMT_GROUP_H
+#define RMT_GROUP_H
+
+#include <linux/kernel.h>
+#include <linux/atomic.h>
+#include <linux/math64.h>
+#include <linux/time.h>
+#include <linux/string.h>
+
+/*
+	Port groups: N-1 ports that share one token bucket, e.g. the ports over
+	one physical uplink or under one contracted aggregate rate. Members are
+	served while the group has credits and spend them after the fact, so the
+	group overshoots by at most one PDU per member.
+	The bucket is only touched with atomics, ports of the group dequeued on
+	different CPUs take no common lock: the refill of the time elapsed is
+	claimed by moving last_ns forward with a cmpxchg, whole microseconds at
+	a time so that frequent calls do not round the gain away.
+*/
+
+#define RMT_GROUP_MAX_PORTS 16
+#define RMT_GROUP_MAX_GAP_US 2000000 // Refill after an idle period, as the policers
+
+struct rmt_group {
+	atomic64_t credits;
+	atomic64_t last_ns; // Time the credits were refilled up to
+	u8 id;
+	u8 num_ports;
+	u64 gain_us; // Credits per us shared by the members
+	u64 max_credits;
+	atomic64_t held; // Dequeues that found the group without credits
+	int ports[RMT_GROUP_MAX_PORTS]; // Port ids of the members
+};
+
+static inline void rmt_group_init(struct rmt_group * group, u8 id) {
+	memset(group, 0, sizeof(*group));
+	group->id = id;
+	group->gain_us = 100;
+	group->max_credits = 100000;
+	atomic64_set(&group->credits, group->max_credits);
+	atomic64_set(&group->last_ns, 0);
+	atomic64_set(&group->held, 0);
+}
+
+static inline void rmt_group_refill(struct rmt_group * group, u64 now) {
+	s64 last, credits, old;
+	u64 us;
+
+	last = atomic64_read(&group->last_ns);
+	if((s64) now <= last) {
+		return;
+	}
+	us = div_u64(now - last, NSEC_PER_USEC);
+	if(!us) {
+		return;
+	}
+	if(us > RMT_GROUP_MAX_GAP_US) {
+		us = RMT_GROUP_MAX_GAP_US;
+		if(atomic64_cmpxchg(&group->last_ns, last, now) != last) {
+			return;
+		}
+	} else if(atomic64_cmpxchg(&group->last_ns, last, last + us * NSEC_PER_USEC) != last) {
+		return; // Refilled by another member
+	}
+
+	credits = atomic64_add_return(us * group->gain_us, &group->credits);
+	while(credits > (s64) group->max_credits) {
+		old = atomic64_cmpxchg(&group->credits, credits, group->max_credits);
+		if(old == credits) {
+			break;
+		}
+		credits = old;
+	}
+}
+
+// True if a member may serve a PDU at now
+static inline bool rmt_group_admit(struct rmt_group * group, u64 now) {
+	rmt_group_refill(group, now);
+	if(atomic64_read(&group->credits) > 0) {
+		return true;
+	}
+	atomic64_inc(&group->held);
+	return false;
+}
+
+static inline void rmt_group_spend(struct rmt_group * group, u32 cost) {
+	atomic64_sub(cost, &group->credits);
+}
+
+// The group of port_id among num groups, NULL if none
+static inline struct rmt_group * rmt_group_find(struct rmt_group * groups, u8 num, int port_id) {
+	u8 i, j;
+
+	for(i = 0; i < num; i++) {
+		for(j = 0; j < groups[i].num_ports; j++) {
+			if(groups[i].ports[j] == port_id) {
+				return groups + i;
+			}
+		}
+	}
+	return NULL;
+}
+
+// Parameter by name without its prefix: gain_us, max_credit and port. 0 if set, 1 if unknown, -1 if invalid
+static inline int rmt_group_set_param(struct rmt_group * group, const char * name, u64 v) {
+	if(strcmp(name, "gain_us") == 0) {
+		group->gain_us = v;
+		return 0;
+	}
+	if(strcmp(name, "max_credit") == 0) {
+		group->max_credits = v;
+		atomic64_set(&group->credits, v);
+		return 0;
+	}
+	if(strcmp(name, "port") == 0) {
+		if(group->num_ports >= RMT_GROUP_MAX_PORTS || v > INT_MAX) {
+			return -1;
+		}
+		group->ports[group->num_ports++] = (int) v;
+		return 0;
+	}
+	return 1;
+}
+
+#endif
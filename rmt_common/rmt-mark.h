@@ -0,0 +1,110 @@
+//rmt-mark.h
+#ifndef RMT_MARK_H
+#define RMT_MARK_H
+
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+
+/*
+	ECN marking shared by the policy sets.
+	A marking configuration says where the PDU is checked (when it enters or
+	leaves its queue), what is measured (PDUs or bytes in the queue, or
+	sojourn time in us) and how the measure becomes a decision: a step at
+	min_th, or a probability ramping linearly from 0 at min_th to 1 at max_th.
+*/
+
+enum rmt_mark_point {
+	RMT_MARK_ENQUEUE = 0,
+	RMT_MARK_DEQUEUE = 1,
+};
+
+enum rmt_mark_curve {
+	RMT_MARK_STEP = 0,
+	RMT_MARK_RAMP = 1,
+};
+
+enum rmt_mark_metric {
+	RMT_MARK_COUNT = 0, // PDUs in the queue
+	RMT_MARK_BYTES = 1, // Bytes in the queue
+	RMT_MARK_SOJOURN = 2, // Time in the queue, us
+};
+
+struct rmt_mark {
+	u8 point;
+	u8 curve;
+	u8 metric;
+	u32 min_th;
+	u32 max_th; // Only for RMT_MARK_RAMP, <= min_th -> step
+};
+
+static inline void rmt_mark_init(struct rmt_mark * m, u8 point, u32 min_th) {
+	m->point = point;
+	m->curve = RMT_MARK_STEP;
+	m->metric = RMT_MARK_COUNT;
+	m->min_th = min_th;
+	m->max_th = min_th;
+}
+
+static inline bool rmt_mark_check(const struct rmt_mark * m, u32 value) {
+	if(value <= m->min_th) {
+		return false;
+	}
+	if(m->curve == RMT_MARK_STEP || value >= m->max_th) {
+		return true;
+	}
+	return prandom_u32() < div_u64((u64) (value - m->min_th) << 32, m->max_th - m->min_th);
+}
+
+// Set the congestion flag, without a writable PCI if it is already set
+static inline void rmt_mark_pdu(struct pdu * pdu) {
+	struct pci * pci;
+	unsigned long pci_flags;
+
+	if(pci_flags_get(pdu_pci_get_ro(pdu)) & PDU_FLAGS_EXPLICIT_CONGESTION) {
+		return;
+	}
+	pci = pdu_pci_get_rw(pdu);
+	pci_flags = pci_flags_get(pci);
+	pci_flags_set(pci, pci_flags | PDU_FLAGS_EXPLICIT_CONGESTION);
+}
+
+/*
+	Parameter of a marking configuration, by name without its prefix:
+	th, max, point, curve and metric.
+	Returns 0 if set, -1 if invalid, 1 if unknown.
+*/
+static inline int rmt_mark_set_param(struct rmt_mark * m, const char * name, u32 v) {
+	if(strcmp(name, "th") == 0) {
+		m->min_th = v;
+		return 0;
+	}
+	if(strcmp(name, "max") == 0) {
+		m->max_th = v;
+		return 0;
+	}
+	if(strcmp(name, "point") == 0) {
+		if(v > RMT_MARK_DEQUEUE) {
+			return -1;
+		}
+		m->point = v;
+		return 0;
+	}
+	if(strcmp(name, "curve") == 0) {
+		if(v > RMT_MARK_RAMP) {
+			return -1;
+		}
+		m->curve = v;
+		return 0;
+	}
+	if(strcmp(name, "metric") == 0) {
+		if(v > RMT_MARK_SOJOURN) {
+			return -1;
+		}
+		m->metric = v;
+		return 0;
+	}
+	return 1;
+}
+
+#endif
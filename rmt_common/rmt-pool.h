@@ -0,0 +1,240 @@
+//rmt-pool.h
+#ifndef RMT_POOL_H
+#define RMT_POOL_H
+
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/string.h>
+
+/*
+	Free list of queue entries sized from recent demand.
+	The pool tracks the entries out of it and a moving peak of that count,
+	which follows a new maximum at once and decays by 1/2^RMT_POOL_DECAY_SHIFT
+	every decay_ms. The target size is peak + low entries, never below the
+	ones pre-allocated with rmt_pool_fill. Below low free entries a get
+	queues the refill work, which allocates up to the target outside of the
+	packet path; above peak + high a put queues a lazy trim back to the
+	target, one decay period later. Gets only fall back to an atomic
+	allocation when the pool is empty, counted in misses.
+	Entries are opaque blocks of size bytes, zeroed when allocated. The pool
+	links them through their first bytes while free, so a reused entry
+	keeps whatever the policy set left in it except those.
+	Safe against the work, which runs in process context.
+*/
+
+#define RMT_POOL_DECAY_SHIFT 3
+
+struct rmt_pool {
+	spinlock_t lock;
+	struct list_head free;
+	size_t size; // Bytes per entry
+	u32 num_free;
+	u32 num_used; // Entries out of the pool
+	u32 peak; // Moving peak of num_used
+	u32 floor; // Pre-allocated entries, never trimmed
+	u32 low; // Refill below this many free entries
+	u32 high; // Trim above peak + high entries, 0 -> never trim
+	u32 decay_ms; // Period of the peak decay
+	unsigned long decay_at; // jiffies of the next decay step
+	u64 misses; // Gets that found the pool empty
+	u8 queued; // Work queued, refill or trim
+	u8 urgent; // Work queued to run at once
+	u8 dead; // Being destroyed, the work is not queued again
+	struct delayed_work work;
+};
+
+static inline u32 rmt_pool_target(const struct rmt_pool * pool) {
+	return max(pool->peak + pool->low, pool->floor);
+}
+
+static inline void rmt_pool_work(struct work_struct * work) {
+	struct rmt_pool * pool;
+	struct list_head pending, * node;
+	u32 total, target, n;
+
+	pool = container_of(to_delayed_work(work), struct rmt_pool, work);
+	INIT_LIST_HEAD(&pending);
+
+	spin_lock_bh(&pool->lock);
+	pool->queued = 0;
+	pool->urgent = 0;
+	if(time_after_eq(jiffies, pool->decay_at)) {
+		pool->peak = max(pool->num_used, pool->peak - max(pool->peak >> RMT_POOL_DECAY_SHIFT, 1U));
+		pool->decay_at = jiffies + msecs_to_jiffies(pool->decay_ms);
+	}
+	total = pool->num_free + pool->num_used;
+	target = rmt_pool_target(pool);
+	n = 0;
+	if(pool->high && total > max(pool->peak + pool->high, pool->floor)) {
+		// used <= peak, so the pool keeps low free entries
+		for(n = total - target; n && pool->num_free > pool->low; n--) {
+			node = pool->free.next;
+			list_move_tail(node, &pending);
+			pool->num_free--;
+		}
+		n = 0;
+	} else if(pool->num_free < pool->low && total < target) {
+		n = target - total;
+	}
+	spin_unlock_bh(&pool->lock);
+
+	// Trimmed entries
+	while(!list_empty(&pending)) {
+		node = pending.next;
+		list_del(node);
+		kfree(node);
+	}
+
+	// Refill
+	for(; n; n--) {
+		node = kzalloc(pool->size, GFP_KERNEL);
+		if(!node) {
+			break;
+		}
+		list_add(node, &pending);
+	}
+	spin_lock_bh(&pool->lock);
+	while(!list_empty(&pending)) {
+		node = pending.next;
+		list_move(node, &pool->free);
+		pool->num_free++;
+	}
+	// Keep decaying while the peak is above the demand
+	if(!pool->dead && !pool->queued && pool->high && pool->peak > pool->num_used) {
+		pool->queued = 1;
+		schedule_delayed_work(&pool->work, msecs_to_jiffies(pool->decay_ms));
+	}
+	spin_unlock_bh(&pool->lock);
+}
+
+static inline void rmt_pool_init(struct rmt_pool * pool, size_t size) {
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->free);
+	pool->size = max(size, sizeof(struct list_head));
+	pool->num_free = 0;
+	pool->num_used = 0;
+	pool->peak = 0;
+	pool->floor = 0;
+	pool->low = 16;
+	pool->high = 256;
+	pool->decay_ms = 1000;
+	pool->decay_at = jiffies;
+	pool->misses = 0;
+	pool->queued = 0;
+	pool->urgent = 0;
+	pool->dead = 0;
+	INIT_DELAYED_WORK(&pool->work, rmt_pool_work);
+}
+
+// Pre-allocates n entries that are never trimmed, returns how many it got
+static inline u32 rmt_pool_fill(struct rmt_pool * pool, u32 n) {
+	struct list_head * node;
+	u32 i;
+
+	for(i = 0; i < n; i++) {
+		node = kzalloc(pool->size, GFP_ATOMIC);
+		if(!node) {
+			break;
+		}
+		spin_lock_bh(&pool->lock);
+		list_add(node, &pool->free);
+		pool->num_free++;
+		pool->floor++;
+		spin_unlock_bh(&pool->lock);
+	}
+	return i;
+}
+
+// An entry, NULL only if the pool is empty and the atomic allocation fails
+static inline void * rmt_pool_get(struct rmt_pool * pool) {
+	struct list_head * node;
+
+	spin_lock_bh(&pool->lock);
+	node = NULL;
+	if(!list_empty(&pool->free)) {
+		node = pool->free.next;
+		list_del(node);
+		pool->num_free--;
+	} else {
+		pool->misses++;
+	}
+	pool->num_used++;
+	if(pool->num_used > pool->peak) {
+		pool->peak = pool->num_used;
+	}
+	if(pool->num_free < pool->low && !pool->urgent && !pool->dead) {
+		pool->queued = 1;
+		pool->urgent = 1;
+		mod_delayed_work(system_wq, &pool->work, 0);
+	}
+	spin_unlock_bh(&pool->lock);
+
+	if(node) {
+		return node;
+	}
+	node = kzalloc(pool->size, GFP_ATOMIC);
+	if(!node) {
+		spin_lock_bh(&pool->lock);
+		pool->num_used--;
+		spin_unlock_bh(&pool->lock);
+	}
+	return node;
+}
+
+static inline void rmt_pool_put(struct rmt_pool * pool, void * entry) {
+	struct list_head * node = entry;
+
+	spin_lock_bh(&pool->lock);
+	list_add(node, &pool->free);
+	pool->num_free++;
+	pool->num_used--;
+	// Starts the decay, the work trims once the peak has gone down
+	if(pool->high && !pool->queued && !pool->dead && (pool->peak > pool->num_used
+		|| pool->num_free + pool->num_used > max(pool->peak + pool->high, pool->floor))) {
+		pool->queued = 1;
+		schedule_delayed_work(&pool->work, msecs_to_jiffies(pool->decay_ms));
+	}
+	spin_unlock_bh(&pool->lock);
+}
+
+// Frees the free entries, the ones out of the pool must be put back before
+static inline void rmt_pool_destroy(struct rmt_pool * pool) {
+	struct list_head * node;
+
+	spin_lock_bh(&pool->lock);
+	pool->dead = 1;
+	spin_unlock_bh(&pool->lock);
+	cancel_delayed_work_sync(&pool->work);
+
+	if(pool->num_used) {
+		LOG_ERR("Destroying a pool with %u entries in use", pool->num_used);
+	}
+	while(!list_empty(&pool->free)) {
+		node = pool->free.next;
+		list_del(node);
+		kfree(node);
+	}
+	pool->num_free = 0;
+}
+
+// Parameter by name without its prefix: low, high and decay_ms. 0 if set, 1 if unknown
+static inline int rmt_pool_set_param(struct rmt_pool * pool, const char * name, u32 v) {
+	if(strcmp(name, "low") == 0) {
+		pool->low = v;
+		return 0;
+	}
+	if(strcmp(name, "high") == 0) {
+		pool->high = v;
+		return 0;
+	}
+	if(strcmp(name, "decay_ms") == 0) {
+		pool->decay_ms = v ? v : 1;
+		return 0;
+	}
+	return 1;
+}
+
+#endif
@@ -0,0 +1,149 @@
+//rmt-voq.h
+#ifndef RMT_VOQ_H
+#define RMT_VOQ_H
+
+#include <linux/list.h>
+#include <linux/hash.h>
+
+/*
+	Virtual output queues, one per destination key (next-hop address).
+	A set owns a fixed array of queues, so its memory is bounded: queues are
+	taken from the free list when a new destination shows up and returned
+	as soon as they empty. When all are in use, new destinations share
+	voqs[0], the overflow queue. Lookup is a short hash bucket walk and
+	selection is O(1): the active list keeps the queues with PDUs in round
+	robin order, one node per turn.
+	Not thread-safe, callers serialise as for the rest of the port state.
+*/
+
+#define RMT_VOQ_BITS 6
+#define RMT_VOQ_BUCKETS (1 << RMT_VOQ_BITS)
+
+struct rmt_voq {
+	struct list_head H; // Hash bucket while in use
+	struct list_head A; // Active list while not empty, else free list
+	struct list_head Q; // Queued nodes
+	u32 key;
+	u32 count;
+};
+
+struct rmt_voq_set {
+	u32 size; // Queues in voqs, overflow included
+	struct list_head active;
+	struct list_head free;
+	struct list_head hash[RMT_VOQ_BUCKETS];
+	struct rmt_voq voqs[]; // voqs[0] is the overflow queue
+};
+
+#define RMT_VOQ_SET_SIZE(n) (sizeof(struct rmt_voq_set) + (n) * sizeof(struct rmt_voq))
+
+// set must have room for size >= 1 queues
+static inline void rmt_voq_init(struct rmt_voq_set * set, u32 size) {
+	u32 i;
+
+	set->size = size;
+	INIT_LIST_HEAD(&set->active);
+	INIT_LIST_HEAD(&set->free);
+	for(i = 0; i < RMT_VOQ_BUCKETS; i++) {
+		INIT_LIST_HEAD(&set->hash[i]);
+	}
+	for(i = 0; i < size; i++) {
+		INIT_LIST_HEAD(&set->voqs[i].H);
+		INIT_LIST_HEAD(&set->voqs[i].Q);
+		set->voqs[i].key = 0;
+		set->voqs[i].count = 0;
+		if(i) {
+			list_add_tail(&set->voqs[i].A, &set->free);
+		} else {
+			INIT_LIST_HEAD(&set->voqs[i].A);
+		}
+	}
+}
+
+static inline bool rmt_voq_empty(struct rmt_voq_set * set) {
+	return list_empty(&set->active);
+}
+
+// Queue of key, a free or the overflow queue if it has none
+static inline struct rmt_voq * rmt_voq_get(struct rmt_voq_set * set, u32 key) {
+	struct list_head * bucket;
+	struct rmt_voq * voq;
+
+	bucket = &set->hash[hash_32(key, RMT_VOQ_BITS)];
+	list_for_each_entry(voq, bucket, H) {
+		if(voq->key == key) {
+			return voq;
+		}
+	}
+	if(list_empty(&set->free)) {
+		return &set->voqs[0];
+	}
+	voq = list_first_entry(&set->free, struct rmt_voq, A);
+	list_del_init(&voq->A);
+	voq->key = key;
+	list_add(&voq->H, bucket);
+	return voq;
+}
+
+static inline void rmt_voq_push(struct rmt_voq_set * set, struct rmt_voq * voq, struct list_head * node) {
+	list_add_tail(node, &voq->Q);
+	if(voq->count++ == 0) {
+		list_add_tail(&voq->A, &set->active);
+	}
+}
+
+// Remove node from voq, releasing the queue if it empties
+static inline void rmt_voq_del(struct rmt_voq_set * set, struct rmt_voq * voq, struct list_head * node) {
+	list_del(node);
+	if(--voq->count) {
+		return;
+	}
+	list_del_init(&voq->A);
+	if(voq != &set->voqs[0]) {
+		list_del_init(&voq->H);
+		list_add(&voq->A, &set->free);
+	}
+}
+
+// Head of the next active queue, NULL if none
+static inline struct list_head * rmt_voq_peek(struct rmt_voq_set * set) {
+	if(list_empty(&set->active)) {
+		return NULL;
+	}
+	return list_first_entry(&set->active, struct rmt_voq, A)->Q.next;
+}
+
+// Unlink and return the head of the next active queue, NULL if none
+static inline struct list_head * rmt_voq_pop(struct rmt_voq_set * set) {
+	struct rmt_voq * voq;
+	struct list_head * node;
+
+	if(list_empty(&set->active)) {
+		return NULL;
+	}
+	voq = list_first_entry(&set->active, struct rmt_voq, A);
+	node = voq->Q.next;
+	rmt_voq_del(set, voq, node);
+	if(voq->count) {
+		list_move_tail(&voq->A, &set->active);
+	}
+	return node;
+}
+
+// Remove every queued node into list and release all the queues
+static inline void rmt_voq_flush(struct rmt_voq_set * set, struct list_head * list) {
+	struct rmt_voq * voq;
+
+	while(!list_empty(&set->active)) {
+		voq = list_first_entry(&set->active, struct rmt_voq, A);
+		list_splice_tail_init(&voq->Q, list);
+		voq->count = 0;
+		list_del_init(&voq->A);
+		if(voq != &set->voqs[0]) {
+			list_del_init(&voq->H);
+			list_add(&voq->A, &set->free);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,129 @@
+//rmt-wheel.h
+#ifndef RMT_WHEEL_H
+#define RMT_WHEEL_H
+
+#include <linux/list.h>
+
+/*
+	Two level timing wheel (Carousel-style) for earliest departure time pacing.
+	Time is counted in slots of a granularity chosen by the user. Level 0 holds
+	the next RMT_WHEEL_SLOTS slots, one list each; level 1 holds the following
+	RMT_WHEEL_SLOTS rounds of level 0 and is cascaded one round at a time.
+	Departures beyond the horizon are clamped to it.
+	Insertion is O(1); popping is O(1) amortized, empty rounds are skipped.
+	Not thread-safe, callers serialise as for the rest of the port state.
+*/
+
+#define RMT_WHEEL_BITS 8
+#define RMT_WHEEL_SLOTS (1 << RMT_WHEEL_BITS)
+#define RMT_WHEEL_MASK (RMT_WHEEL_SLOTS - 1)
+#define RMT_WHEEL_HORIZON ((u64) RMT_WHEEL_SLOTS * RMT_WHEEL_SLOTS - 1)
+
+struct rmt_wheel_node {
+	struct list_head L;
+	u64 slot; // Departure slot
+};
+
+struct rmt_wheel {
+	u64 cur; // Next slot to drain
+	u32 count; // Nodes on the wheel
+	u32 count0; // Nodes on level 0
+	struct list_head l0[RMT_WHEEL_SLOTS];
+	struct list_head l1[RMT_WHEEL_SLOTS];
+};
+
+static inline void rmt_wheel_init(struct rmt_wheel * w, u64 now) {
+	int i;
+
+	w->cur = now;
+	w->count = 0;
+	w->count0 = 0;
+	for(i = 0; i < RMT_WHEEL_SLOTS; i++) {
+		INIT_LIST_HEAD(&w->l0[i]);
+		INIT_LIST_HEAD(&w->l1[i]);
+	}
+}
+
+static inline void rmt_wheel_add(struct rmt_wheel * w, struct rmt_wheel_node * n, u64 slot) {
+	if(slot < w->cur) {
+		slot = w->cur;
+	} else if(slot - w->cur > RMT_WHEEL_HORIZON) {
+		slot = w->cur + RMT_WHEEL_HORIZON;
+	}
+	n->slot = slot;
+	w->count++;
+
+	if(slot - w->cur < RMT_WHEEL_SLOTS) {
+		list_add_tail(&n->L, &w->l0[slot & RMT_WHEEL_MASK]);
+		w->count0++;
+	} else {
+		list_add_tail(&n->L, &w->l1[(slot >> RMT_WHEEL_BITS) & RMT_WHEEL_MASK]);
+	}
+}
+
+// Move the round starting at cur from level 1 to level 0
+static inline void rmt_wheel_cascade(struct rmt_wheel * w) {
+	struct list_head * l1;
+	struct rmt_wheel_node * n;
+
+	l1 = &w->l1[(w->cur >> RMT_WHEEL_BITS) & RMT_WHEEL_MASK];
+	while(!list_empty(l1)) {
+		n = list_first_entry(l1, struct rmt_wheel_node, L);
+		list_del(&n->L);
+		list_add_tail(&n->L, &w->l0[n->slot & RMT_WHEEL_MASK]);
+		w->count0++;
+	}
+}
+
+// Next node due at or before slot now, NULL if none
+static inline struct rmt_wheel_node * rmt_wheel_pop(struct rmt_wheel * w, u64 now) {
+	struct list_head * l0;
+	struct rmt_wheel_node * n;
+	u64 next;
+
+	if(w->count == 0) {
+		if(w->cur <= now) {
+			w->cur = now + 1;
+		}
+		return NULL;
+	}
+
+	while(w->cur <= now) {
+		l0 = &w->l0[w->cur & RMT_WHEEL_MASK];
+		if(!list_empty(l0)) {
+			n = list_first_entry(l0, struct rmt_wheel_node, L);
+			list_del(&n->L);
+			w->count--;
+			w->count0--;
+			return n;
+		}
+
+		// Skip the rest of an empty round
+		next = w->cur + 1;
+		if(w->count0 == 0) {
+			next = (w->cur | RMT_WHEEL_MASK) + 1;
+			if(next > now + 1) {
+				next = now + 1;
+			}
+		}
+		w->cur = next;
+		if((w->cur & RMT_WHEEL_MASK) == 0) {
+			rmt_wheel_cascade(w);
+		}
+	}
+	return NULL;
+}
+
+// Remove every node left on the wheel into list
+static inline void rmt_wheel_flush(struct rmt_wheel * w, struct list_head * list) {
+	int i;
+
+	for(i = 0; i < RMT_WHEEL_SLOTS; i++) {
+		list_splice_tail_init(&w->l0[i], list);
+		list_splice_tail_init(&w->l1[i], list);
+	}
+	w->count = 0;
+	w->count0 = 0;
+}
+
+#endif
@@ -8,6 +8,8 @@ MODULE_DESCRIPTION("RMT QTA MUX policy set");
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Sergio Leon <gaixas1@gmail.com>");
 
+static ATOMIC_NOTIFIER_HEAD(eqta_bp_chain);
+
 /* Main functions */
 
 static struct ps_base * f_policy_create(struct rina_component * component){
@@ -16,7 +18,7 @@ static struct ps_base * f_policy_create(struct rina_component * component){
 	struct rmt_config * rmt_cfg;
 	base_config * conf;
 
-	rmt = rmt_from_component(component);
+	rmt = component ? rmt_from_component(component) : NULL;
 	ps = rkzalloc(sizeof(*ps), GFP_ATOMIC);
 	if (!ps) {
 		return NULL;
@@ -28,9 +30,11 @@ static struct ps_base * f_policy_create(struct rina_component * component){
 		return NULL;
 	}
 		
-	INIT_LIST_HEAD(&conf->buffer);
+	rmt_pool_init(&conf->buffer, sizeof(q_entry));
 	INIT_LIST_HEAD(&conf->qos2modules);
 	INIT_LIST_HEAD(&conf->port_instances);
+	spin_lock_init(&conf->port_lock);
+	INIT_DELAYED_WORK(&conf->idle_work, f_idle_sweep);
 	
 	conf->state = 0;
 	conf->headers_weight = 0;
@@ -39,32 +43,51 @@ static struct ps_base * f_policy_create(struct rina_component * component){
 	conf->bytecost = 1;
 	conf->max_count = 100;
 	conf->global_max_count = 100;
-	conf->buffer_size = 0;
+	conf->global_max_bytes = 0;
+	conf->cal_window_us = 0;
+	conf->numa_node = NUMA_NO_NODE;
+	conf->pace_gran_us = 0;
+	conf->lifetimes = 0;
+	conf->cut_through = 0;
+	conf->age_us = 0;
+	conf->age_rate = 1000;
+	rmt_bp_init(&conf->bp);
+	conf->voq_size = 0;
+	conf->sweep_us = 0;
+	rmt_mark_init(&conf->def_mark, RMT_MARK_ENQUEUE, 50);
+	conf->idle_us = 0;
+	conf->shared_size = 0;
+	conf->dt_alpha = 100;
+	atomic_set(&conf->shared_used, 0);
 	conf->policers = NULL;
+	conf->groups = NULL;
+	conf->num_groups = 0;
+	conf->conf_block = NULL;
+	rmt_conf_stage_init(&conf->pending);
 
 	ps->base.set_policy_set_param = f_set_policy_set_param;
 	ps->dm = rmt;
 	ps->priv = conf;
 
-	rmt_cfg = rmt_config_get(rmt);
-	if (rmt_cfg) {
-		policy_for_each(rmt_cfg->policy_set, conf, f_policy_base_config_apply);
-	} else {
-		LOG_WARN("Using default conf (best-effort)");
-	}
-	
-	conf->state |= 1;
-	
-	if(conf->num_policers > 0 && !conf->policers) {
-		rkfree(conf);
-		return NULL;
-	}
-
 	ps->rmt_q_create_policy = f_rmt_q_create_policy;
 	ps->rmt_q_destroy_policy = f_rmt_q_destroy_policy;
 	ps->rmt_enqueue_policy = f_rmt_enqueue_policy;
 	ps->rmt_dequeue_policy = f_rmt_dequeue_policy;
 
+	rmt_cfg = rmt ? rmt_config_get(rmt) : NULL;
+	if (rmt_cfg) {
+		if(f_conf_load(conf, rmt_cfg->policy_set)) {
+			LOG_ERR("Invalid configuration, policy set not created");
+			f_conf_free(conf);
+			rkfree(conf);
+			rkfree(ps);
+			return NULL;
+		}
+		f_conf_start(ps, conf);
+	} else {
+		LOG_WARN("Created without an RMT, parameters are loaded at the first port");
+	}
+
 	LOG_INFO("Loaded QTA MUX policy set and its confuration");
 
 	return &ps->base;
@@ -74,8 +97,6 @@ static void f_policy_destroy(struct ps_base * bps) {
 	struct rmt_ps *ps;
 	base_config * conf;
 	port_instance * port_i;
-	q_entry * entry_i;
-	qos2module * qos2module_i;
 	
 	ps = container_of(bps, struct rmt_ps, base);
 	if (!bps || !ps || !ps->priv) {
@@ -84,6 +105,7 @@ static void f_policy_destroy(struct ps_base * bps) {
 	}
 	
 	conf = (base_config *) ps->priv;
+	cancel_delayed_work_sync(&conf->idle_work);
 	
 	// Delete all remaining port instances
 	while(!list_empty(&conf->port_instances)) {
@@ -91,25 +113,8 @@ static void f_policy_destroy(struct ps_base * bps) {
 		f_free_port_instance(conf, port_i);
 	}
 	
-	// Empty buffers
-	while(!list_empty(&conf->buffer)) {
-		entry_i = list_first_entry(&conf->buffer, q_entry, L);
-		list_del(&entry_i->L);
-		rkfree(entry_i);
-		conf->buffer_size--;
-	}
-	
-	//Remove qos 2 module mapping
-	while(!list_empty(&conf->qos2modules)) {
-		qos2module_i = list_first_entry(&conf->qos2modules, qos2module, L);
-		list_del(&qos2module_i->L);
-		rkfree(qos2module_i);
-	}
-	
-	// Delete base structures
-	if(conf->policers) {
-		rkfree(conf->policers);
-	}
+	// Buffers, QoS mappings and policers
+	f_conf_free(conf);
 	rkfree(conf);
 }
 
@@ -118,14 +123,16 @@ int f_rmt_enqueue_policy(struct rmt_ps *ps, port_p P, pdu_p pdu_i) {
 	qos_id_t qos_id;
 	base_config * conf;
 	u8 next_module, def_urgency;
-	u16 def_cherish_th, def_ecn_th;
-	qos2module * qos2module_i;
+	u32 def_cherish_th, def_cherish_bytes, def_ecn_bytes, len;
+	const struct rmt_mark * mark;
+	qos2module * qos2module_i, * qos_m;
 	port_instance * port_i;
 	policer_d * psh_d;
 	policer_c * psh_c;
 	q_entry * entry_i;
-    struct pci * pci;
-	unsigned long pci_flags;
+	atomic_t * pool;
+	u64 now;
+	list_h * head;
 	
 	if (!ps || !ps->priv || !P || !pdu_i) {
 		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_tx");
@@ -147,30 +154,56 @@ int f_rmt_enqueue_policy(struct rmt_ps *ps, port_p P, pdu_p pdu_i) {
 		return RMT_PS_ENQ_ERR;
 	}
 	
-	if(port_i->count >= conf->global_max_count) {
+	len = pdu_len(pdu_i);
+	if(!conf->shared_size && port_i->count >= conf->global_max_count) {
 		LOG_INFO("Length exceeded for Port, dropping PDU");
 		pdu_destroy(pdu_i);
 		return RMT_PS_ENQ_DROP;
 	}
+	if(conf->global_max_bytes && port_i->bytes + len > conf->global_max_bytes) {
+		LOG_INFO("Bytes exceeded for Port, dropping PDU");
+		pdu_destroy(pdu_i);
+		return RMT_PS_ENQ_DROP;
+	}
+	
+	if(!port_i->Qs && f_port_activate(conf, port_i)) {
+		LOG_ERR("Cannot allocate port queues, dropping PDU");
+		pdu_destroy(pdu_i);
+		return RMT_PS_ENQ_DROP;
+	}
 	
 	//Search next module id for the qos_id, default = 0 (MUX)
 	next_module = 0;
 	def_cherish_th = 100;
-	def_ecn_th = 50;
+	mark = &conf->def_mark;
+	def_cherish_bytes = 0;
+	def_ecn_bytes = 0;
 	def_urgency = conf->levels_urgency-1;
+	qos_m = NULL;
 	list_for_each_entry(qos2module_i, &conf->qos2modules, L) {
 		if (qos_id == qos2module_i->qos_id) {
+			qos_m = qos2module_i;
 			next_module = qos2module_i->next_module;
 			def_cherish_th = qos2module_i->def_cherish_th;
-			def_ecn_th = qos2module_i->def_ecn_th;
+			mark = &qos2module_i->mark;
+			def_cherish_bytes = qos2module_i->def_cherish_bytes;
+			def_ecn_bytes = qos2module_i->def_ecn_bytes;
 			def_urgency = qos2module_i->def_urgency;
 		}
 	}
 	
+#ifdef RMT_PS_ENQ_SEND
+	if(conf->cut_through && port_i->count == 0 && P->state == N1_PORT_STATE_ENABLED
+		&& f_cut_through(conf, port_i, next_module <= conf->num_policers ? next_module : 0, len)) {
+		return RMT_PS_ENQ_SEND;
+	}
+#endif
+	
 	if(next_module == 0 || next_module > conf->num_policers) {
 		//To MUX
 		next_module = 0;
-		if(port_i->mux_count >= def_cherish_th) {
+		if(port_i->mux_count >= def_cherish_th
+			|| (def_cherish_bytes && port_i->mux_bytes + len > def_cherish_bytes)) {
 			LOG_INFO("Length exceeded for Mux, dropping PDU");
 			pdu_destroy(pdu_i);
 			return RMT_PS_ENQ_DROP;
@@ -179,65 +212,117 @@ int f_rmt_enqueue_policy(struct rmt_ps *ps, port_p P, pdu_p pdu_i) {
 		//To PS
 		psh_c = conf->policers + next_module - 1;
 		psh_d = port_i->policers + next_module - 1;
-		if(psh_d->count >=  psh_c->max_count) {
+		if(psh_d->count >=  psh_c->max_count
+			|| (psh_c->max_bytes && psh_d->bytes + len > psh_c->max_bytes)) {
 			LOG_INFO("Length exceeded for policer/shaper id %u, dropping PDU", next_module);
 			pdu_destroy(pdu_i);
 			return RMT_PS_ENQ_DROP;
 		}
 	}	
 	
-	if(list_empty(&conf->buffer)) {
-		entry_i = rkzalloc(sizeof(q_entry), GFP_ATOMIC);
-	} else {
-		entry_i = list_first_entry(&conf->buffer, q_entry, L);
-		list_del(&entry_i->L);
-		conf->buffer_size--;
+	pool = NULL;
+	if(conf->shared_size) {
+		pool = f_shared_admit(conf, port_i, qos_m);
+		if(!pool) {
+			LOG_INFO("Shared buffer threshold exceeded, dropping PDU");
+			pdu_destroy(pdu_i);
+			return RMT_PS_ENQ_DROP;
+		}
 	}
 	
+	entry_i = rmt_pool_get(&conf->buffer);
 	if(!entry_i) {
 		LOG_ERR("Cannot allocate buffer, dropping PDU");
+		if(pool) {
+			atomic_dec(pool);
+		}
 		pdu_destroy(pdu_i);
 		return RMT_PS_ENQ_DROP;
 	}
 	
 	entry_i->data = pdu_i;
-	entry_i->cost = (u64) pdu_len(pdu_i) + conf->headers_weight;
+	entry_i->pool = pool;
+	entry_i->len = len;
+	entry_i->cost = (u64) len + conf->headers_weight;
 	entry_i->cost *= conf->bytecost;
+	entry_i->mark = NULL;
+	entry_i->enq_ns = 0;
+	entry_i->deadline = 0;
+	now = 0;
+	if(qos_m && qos_m->max_sojourn_us) {
+		now = ktime_get_ns();
+		entry_i->deadline = now + (u64) qos_m->max_sojourn_us * NSEC_PER_USEC;
+	}
 	
 	if(next_module == 0) {
 		//Insert PDU into MUX queue
-		list_add_tail(&entry_i->L, &port_i->Qs[def_urgency]);
+		if(!now && mark->metric == RMT_MARK_SOJOURN) {
+			now = ktime_get_ns();
+		}
+		entry_i->enq_ns = now;
+		head = f_mux_push(conf, port_i, def_urgency, entry_i);
 		port_i->mux_count++;
+		port_i->mux_bytes += len;
 		
-		if(port_i->mux_count > def_ecn_th) {
-			pci = pdu_pci_get_rw(entry_i->data);	
-			pci_flags = pci_flags_get(pci);
-			pci_flags_set(pci, pci_flags |= PDU_FLAGS_EXPLICIT_CONGESTION);
+		if(mark->point == RMT_MARK_DEQUEUE) {
+			entry_i->mark = mark;
+		} else if(rmt_mark_check(mark, f_mark_value(port_i, mark,
+			list_first_entry(head, q_entry, L), now))) {
+			rmt_mark_pdu(entry_i->data);
 		}
+		if(def_ecn_bytes && port_i->mux_bytes > def_ecn_bytes) {
+			rmt_mark_pdu(entry_i->data);
+		}
+	} else if(port_i->wheel) {
+		//Insert PDU into the pacing wheel at its departure time
+		entry_i->mark = mark;
+		psh_d->count++;
+		psh_d->bytes += len;
+		f_pace_stamp(conf, port_i, entry_i, next_module, now ? now : ktime_get_ns());
 	} else {
 		//Insert PDU into PS queue
+		entry_i->mark = mark;
 		list_add_tail(&entry_i->L, &psh_d->Q);
 		psh_d->count++;
+		psh_d->bytes += len;
 	}
 	
 	port_i->count++;
+	port_i->bytes += len;
 
+	rmt_bp_update(&conf->bp, &port_i->bp_paused, &eqta_bp_chain, P, port_i->count);
+	if(RMT_CHECK_ENABLED) {
+		f_check_port(conf, port_i);
+	}
+	
 	LOG_DBG("PDU enqueued");
 	return RMT_PS_ENQ_SCHED;
 }
 
-pdu_p f_rmt_dequeue_policy(struct rmt_ps * ps, port_p P) {
+/*
+	Dequeue
+	One body for every configuration, np policers and lu urgency levels.
+	The common configurations get their own copy with constant bounds, so
+	the policer and mux loops unroll; the policy set picks one at creation
+	(see f_dequeue_select), neither can change afterwards. Only the small
+	ones are measurably faster than the generic body: with 4 levels or 2
+	and more policers the loop overhead is lost in the rest of the work.
+*/
+static __always_inline pdu_p f_dequeue(struct rmt_ps * ps, port_p P, const u8 np, const u8 lu) {
 	base_config * conf;
 	port_instance * port_i;
 	q_entry * entry_i;
-	u8 num_policers, headers_weight, i, dst_max_count, mux_urgency;
+	u8 num_policers, mux_urgency, level, aged;
+	u16 i;
+	u32 dst_max_count, dst_max_bytes;
 	struct timespec t1, td;
 	int T;
 	policer_c * psh_c, * psh_n_c;
 	policer_d * psh_d, * psh_n_d;
 	pdu_p pdu_i;
-    struct pci * pci;
-	unsigned long pci_flags;
+	list_h * head;
+	u32 value;
+	u64 now;
 	
 	if (!ps || !P) {
 		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_rx");
@@ -253,8 +338,11 @@ pdu_p f_rmt_dequeue_policy(struct rmt_ps * ps, port_p P) {
 		return NULL;
 	}
 	
-	num_policers = conf->num_policers;
-	headers_weight = conf->headers_weight;
+	if(!port_i->Qs) {
+		return NULL;
+	}
+	
+	num_policers = np;
 	
 	//Compute ticks from last call
 	getnstimeofday (&t1);
@@ -270,35 +358,55 @@ pdu_p f_rmt_dequeue_policy(struct rmt_ps * ps, port_p P) {
 	}
 	
 	
+	//Discard PDUs past their deadline
+	now = 0;
+	if(conf->lifetimes) {
+		now = ktime_get_ns();
+		if(conf->sweep_us && now - port_i->last_sweep >= (u64) conf->sweep_us * NSEC_PER_USEC) {
+			f_expire_sweep(conf, port_i, now);
+		}
+	}
+	
+	//Paced policers release from the wheel instead of their token buckets
+	if(port_i->wheel) {
+		f_pace_release(conf, port_i);
+		num_policers = 0;
+	}
+	
 	for(i = 0; i < num_policers; i++) {
 		psh_c = conf->policers + i;
 		psh_d = port_i->policers + i;
-		psh_d->credits += T * psh_c->gain_us;
+		psh_d->credits += T * (psh_d->gain_us ? psh_d->gain_us : psh_c->gain_us);
 		
 		if(psh_c->next_module == 0) {
 			//To MUX
 			dst_max_count = psh_c->cherish_th;
+			dst_max_bytes = psh_c->cherish_bytes;
 			mux_urgency = psh_c->urgency_level;
 			
 			while(!list_empty(&psh_d->Q) && psh_d->credits > 0) {
 				entry_i = list_first_entry(&psh_d->Q, q_entry, L);
 				list_del(&entry_i->L);
-				psh_d->credits -= entry_i->cost;
 				psh_d->count--;
-				if(port_i->mux_count >= psh_c->cherish_th) {
-					LOG_INFO("Length exceeded for MUX queue for cherish_th %u, dropping PDU", psh_c->cherish_th);
+				psh_d->bytes -= entry_i->len;
+				if(entry_i->deadline && now >= entry_i->deadline) {
+					f_entry_expire(conf, port_i, entry_i);
+					continue;
+				}
+				psh_d->credits -= f_policer_cost(psh_c, entry_i->len, entry_i->cost);
+				if(port_i->mux_count >= dst_max_count
+					|| (dst_max_bytes && port_i->mux_bytes + entry_i->len > dst_max_bytes)) {
+					LOG_INFO("Length exceeded for MUX queue for cherish_th %u, dropping PDU", dst_max_count);
 					pdu_destroy(entry_i->data);
-					list_add(&entry_i->L, &conf->buffer);
-					conf->buffer_size++;
+					f_shared_release(entry_i);
 					port_i->count--;
+					port_i->bytes -= entry_i->len;
+					rmt_pool_put(&conf->buffer, entry_i);
 				} else {
-					list_add_tail(&entry_i->L, port_i->Qs+mux_urgency);
+					head = f_mux_push(conf, port_i, mux_urgency, entry_i);
 					port_i->mux_count++;
-					if(port_i->mux_count > psh_c->ecn_th) {
-						pci = pdu_pci_get_rw(entry_i->data);	
-						pci_flags = pci_flags_get(pci);
-						pci_flags_set(pci, pci_flags |= PDU_FLAGS_EXPLICIT_CONGESTION);
-					}
+					port_i->mux_bytes += entry_i->len;
+					f_policer_mark(psh_c, port_i, entry_i, head);
 				}
 			}
 		} else {
@@ -306,48 +414,142 @@ pdu_p f_rmt_dequeue_policy(struct rmt_ps * ps, port_p P) {
 			psh_n_c = conf->policers + psh_c->next_module - 1;
 			psh_n_d = port_i->policers + psh_c->next_module - 1;
 			dst_max_count = psh_n_c->max_count;
+			dst_max_bytes = psh_n_c->max_bytes;
 				
 			while(!list_empty(&psh_d->Q) && psh_d->credits > 0) {
 				entry_i = list_first_entry(&psh_d->Q, q_entry, L);
 				list_del(&entry_i->L);
-				psh_d->credits -= entry_i->cost;
 				psh_d->count--;
-				if(psh_n_d->count >= dst_max_count) {
+				psh_d->bytes -= entry_i->len;
+				if(entry_i->deadline && now >= entry_i->deadline) {
+					f_entry_expire(conf, port_i, entry_i);
+					continue;
+				}
+				psh_d->credits -= f_policer_cost(psh_c, entry_i->len, entry_i->cost);
+				if(psh_n_d->count >= dst_max_count
+					|| (dst_max_bytes && psh_n_d->bytes + entry_i->len > dst_max_bytes)) {
 					LOG_INFO("Length exceeded for dst PS (id %u), dropping PDU", psh_c->next_module);
 					pdu_destroy(entry_i->data);
-					list_add(&entry_i->L, &conf->buffer);
-					conf->buffer_size++;
+					f_shared_release(entry_i);
 					port_i->count--;
+					port_i->bytes -= entry_i->len;
+					rmt_pool_put(&conf->buffer, entry_i);
 				} else {
 					list_add_tail(&entry_i->L, &psh_n_d->Q);
 					psh_n_d->count++;
+					psh_n_d->bytes += entry_i->len;
 				}
 			}
 		}
 	}
 	
-	//Get next from MUX
-	mux_urgency = conf->levels_urgency;
-	for(i = 0; i < mux_urgency; i++) {
-		if(!list_empty(port_i->Qs+i)) {
-			entry_i = list_first_entry(port_i->Qs+i, q_entry, L);
-			list_del(&entry_i->L);
+	//Get next from MUX, an aged queue first
+	mux_urgency = lu;
+	if(port_i->group && port_i->mux_count && !f_group_admit(port_i, &now)) {
+		mux_urgency = 0; // Held until the port group has credits
+	}
+	aged = mux_urgency;
+	if(conf->age_us && port_i->mux_count && mux_urgency) {
+		if(!now) {
+			now = ktime_get_ns();
+		}
+		aged = f_age_pick(conf, port_i, now);
+	}
+	for(i = 0; i <= mux_urgency; i++) {
+		level = i ? i - 1 : aged;
+		while(level < mux_urgency && (entry_i = f_mux_pop(conf, port_i, level))) {
+			if(entry_i->deadline && now >= entry_i->deadline) {
+				port_i->mux_count--;
+				port_i->mux_bytes -= entry_i->len;
+				f_entry_expire(conf, port_i, entry_i);
+				continue;
+			}
 			pdu_i = entry_i->data;
-			list_add(&entry_i->L, &conf->buffer);
-			conf->buffer_size++;
+			f_shared_release(entry_i);
 			port_i->count--;
 			port_i->mux_count--;
+			port_i->bytes -= entry_i->len;
+			port_i->mux_bytes -= entry_i->len;
+			if(conf->cal_window_us) {
+				f_port_calibrate(conf, port_i, T, entry_i->cost);
+			}
+			if(entry_i->mark) {
+				value = f_mark_value(port_i, entry_i->mark, entry_i,
+					entry_i->enq_ns && !now ? ktime_get_ns() : now);
+				if(rmt_mark_check(entry_i->mark, value)) {
+					rmt_mark_pdu(pdu_i);
+				}
+			}
+			if(port_i->group) {
+				rmt_group_spend(port_i->group, entry_i->cost);
+			}
+			rmt_pool_put(&conf->buffer, entry_i);
+			if(!i) {
+				port_i->aged++;
+				port_i->age_next = conf->age_rate ? now + div_u64(NSEC_PER_SEC, conf->age_rate) : 0;
+			}
+			rmt_bp_update(&conf->bp, &port_i->bp_paused, &eqta_bp_chain, P, port_i->count);
+			if(RMT_CHECK_ENABLED) {
+				f_check_port(conf, port_i);
+			}
 			return pdu_i;
 		}
 	}
 	
+	port_i->cal_last_cost = 0;
+	rmt_bp_update(&conf->bp, &port_i->bp_paused, &eqta_bp_chain, P, port_i->count);
+	if(RMT_CHECK_ENABLED) {
+		f_check_port(conf, port_i);
+	}
 	return NULL;
 }
 
+#define EQTA_DEQUEUE(NP, LU) \
+	static pdu_p f_rmt_dequeue_##NP##p##LU##u(struct rmt_ps * ps, port_p P) { \
+		return f_dequeue(ps, P, NP, LU); \
+	}
+
+EQTA_DEQUEUE(0, 1)
+EQTA_DEQUEUE(0, 2)
+EQTA_DEQUEUE(1, 1)
+
+static const struct {
+	u8 num_policers;
+	u8 levels_urgency;
+	dequeue_f dequeue;
+} f_dequeue_variants[] = {
+	{ 0, 1, f_rmt_dequeue_0p1u },
+	{ 0, 2, f_rmt_dequeue_0p2u },
+	{ 1, 1, f_rmt_dequeue_1p1u },
+};
+
+// Any configuration
+pdu_p f_rmt_dequeue_policy(struct rmt_ps * ps, port_p P) {
+	base_config * conf;
+	
+	if (!ps || !ps->priv) {
+		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_rx");
+		return NULL;
+	}
+	conf = ps->priv;
+	return f_dequeue(ps, P, conf->num_policers, conf->levels_urgency);
+}
+
+static dequeue_f f_dequeue_select(base_config * conf) {
+	u8 i;
+	
+	for(i = 0; i < ARRAY_SIZE(f_dequeue_variants); i++) {
+		if(f_dequeue_variants[i].num_policers == conf->num_policers
+			&& f_dequeue_variants[i].levels_urgency == conf->levels_urgency) {
+			return f_dequeue_variants[i].dequeue;
+		}
+	}
+	return f_rmt_dequeue_policy;
+}
+
 void * f_rmt_q_create_policy(struct rmt_ps *ps, port_p P) {
 	base_config * conf;
 	port_instance * port_i;
-	u8 i;
 	
 	if (!ps || !ps->priv || !P) {
 		LOG_ERR("Wrong input parameters for rmt_create_p_policy");
@@ -362,7 +564,11 @@ void * f_rmt_q_create_policy(struct rmt_ps *ps, port_p P) {
 		return (port_instance *) P->rmt_ps_queues;
 	}
 	
-	port_i = kzalloc(sizeof(port_instance), GFP_ATOMIC);
+	if(!(conf->state & 1) && f_conf_load_pending(ps, conf)) {
+		return NULL;
+	}
+	
+	port_i = kzalloc_node(sizeof(port_instance), GFP_ATOMIC, conf->numa_node);
 	if(!port_i) {
 		LOG_ERR("Memory alloc problem in rmt_create_p_policy");
 		return NULL;
@@ -371,32 +577,19 @@ void * f_rmt_q_create_policy(struct rmt_ps *ps, port_p P) {
 	port_i->P = P;
 	port_i->mux_count = 0;
 	port_i->count = 0;
+	port_i->mux_bytes = 0;
+	port_i->bytes = 0;
+	port_i->rate = 0;
 	getnstimeofday (&port_i->lastT);
-	port_i->policers = kzalloc(sizeof(policer_d) * conf->num_policers, GFP_ATOMIC);
-	port_i->Qs = kzalloc(sizeof(list_h) * conf->levels_urgency, GFP_ATOMIC);
-	
-	if(!port_i->policers || !port_i->Qs) {
-		LOG_ERR("Memory alloc problem in rmt_create_p_policy");
-		if(port_i->policers) {
-			kzfree(port_i->policers);
-		}
-		if(port_i->Qs) {
-			kzfree(port_i->Qs);
-		}
-		kzfree(port_i);
-		return NULL;
-	}
-	 
-	for(i = 0 ; i < conf->num_policers; i++) {
-		port_i->policers[i].count = 0;
-		port_i->policers[i].credits = 0;
-		INIT_LIST_HEAD(&port_i->policers[i].Q);
-	}
-	
-	for(i = 0 ; i < conf->levels_urgency; i++) {
-		INIT_LIST_HEAD(port_i->Qs+i);
-	}
+	port_i->policers = NULL;
+	port_i->Qs = NULL;
+	port_i->wheel = NULL;
+	port_i->group = rmt_group_find(conf->groups, conf->num_groups, P->port_id);
 	
+	INIT_LIST_HEAD(&port_i->L);
+	spin_lock_bh(&conf->port_lock);
+	list_add_tail(&port_i->L, &conf->port_instances);
+	spin_unlock_bh(&conf->port_lock);
 	P->rmt_ps_queues = (void*)port_i;
 	return port_i;
 }
@@ -418,30 +611,21 @@ int f_rmt_q_destroy_policy(struct rmt_ps *ps, port_p P) {
 
 /* Helper functions */
 
-static int f_policy_base_config_apply(struct policy_parm * param, void * data) {
-	return f_policy_set_param_pv((base_config *) data, policy_param_name(param), policy_param_value(param));
-}
-
 static int f_set_policy_set_param(struct ps_base * bps, const char * name, const char * value) {
 	struct rmt_ps *ps;
+	base_config * conf;
 	ps = container_of(bps, struct rmt_ps, base);
-	return f_policy_set_param_pv((base_config *) ps->priv, name, value);
+	conf = ps->priv;
+	// Created without an RMT, staged until the first port
+	if(!(conf->state & 1)) {
+		return rmt_conf_stage_add(&conf->pending, name, value);
+	}
+	return f_policy_set_param_pv(conf, name, value);
 }
 
 
 static int f_policy_set_param_pv(base_config * conf, const char * name, const char * value) {
-	
-	char * v_name = (char *) name;
-	char * v_value = (char *) value;
-	char * p_ch;
-	u8 sub_id;
-	u8 v8;
-	u16 v16;
-	u32 v32;
-	u64 v64;
-	q_entry * entry_i;
-	policer_c * policer_i;
-	qos2module * qos2module_i, * qos2module_t;
+	struct rmt_conf_param param;
 	
 	if (!name) {
 		LOG_ERR("Null parameter name");
@@ -451,62 +635,399 @@ static int f_policy_set_param_pv(base_config * conf, const char * name, const ch
 		LOG_ERR("Null parameter value");
 		return -1;
 	}
+	if(rmt_conf_parse(&param, name, value)) {
+		LOG_ERR("Error while parsing parameter %s with value %s", name, value);
+		return -1;
+	}
+	return f_conf_apply(conf, &param);
+}
+
+/*
+	Configuration loading
+	At creation the parameters are staged and applied in two rounds: first
+	the scalar ones, which fix the number of policers and urgency levels,
+	then the per policer (ps_), per QoS (qos_) and per port group (group_)
+	ones, once the policers, QoS mappings and groups exist in a single block. The result is validated as a whole;
+	if anything fails the policy set is not created.
+*/
+static int f_conf_load(base_config * conf, struct policy * policy) {
+	struct rmt_conf_stage stage;
+	int ret;
+	
+	if(rmt_conf_stage_load(&stage, policy)) {
+		return -1;
+	}
+	ret = f_conf_load_stage(conf, &stage);
+	rmt_conf_stage_free(&stage);
+	return ret;
+}
+
+static int f_conf_load_stage(base_config * conf, const struct rmt_conf_stage * stage) {
+	struct rmt_conf_ids qos_ids, group_ids;
+	u32 i;
+	int ret;
+	
+	ret = stage->errors ? -1 : 0;
+	for(i = 0; !ret && i < stage->num; i++) {
+		if(!f_conf_indexed(stage->params[i].name)) {
+			ret = f_conf_apply_one(conf, stage->params + i);
+		}
+	}
+	if(!ret) {
+		rmt_conf_ids_get(stage, "qos_", &qos_ids);
+		rmt_conf_ids_get(stage, "group_", &group_ids);
+		ret = f_conf_alloc(conf, &qos_ids, &group_ids);
+	}
+	for(i = 0; !ret && i < stage->num; i++) {
+		if(f_conf_indexed(stage->params[i].name)) {
+			ret = f_conf_apply_one(conf, stage->params + i);
+		}
+	}
+	if(!ret) {
+		ret = f_conf_validate(conf);
+	}
+	return ret;
+}
+
+/*
+	A policy set created without an RMT (rmt_gen) loads the parameters
+	staged until then at its first port, which only its creator adds. If
+	they are invalid no port is ever created, as the creation would have
+	failed.
+*/
+static int f_conf_load_pending(struct rmt_ps * ps, base_config * conf) {
+	int ret;
+	
+	if(conf->state & 2) {
+		return -1;
+	}
+	ret = f_conf_load_stage(conf, &conf->pending);
+	rmt_conf_stage_free(&conf->pending);
+	if(ret) {
+		LOG_ERR("Invalid configuration, no port will be created");
+		conf->state |= 2;
+		return -1;
+	}
+	f_conf_start(ps, conf);
+	return 0;
+}
+
+// The configuration is in use from here on, parameters are then set one by one
+static void f_conf_start(struct rmt_ps * ps, base_config * conf) {
+	conf->state |= 1;
+	
+	f_port_layout(conf);
+	if(conf->idle_us) {
+		schedule_delayed_work(&conf->idle_work, usecs_to_jiffies(conf->idle_us));
+	}
+	ps->rmt_dequeue_policy = f_dequeue_select(conf);
+}
+
+// Per policer, per QoS and per group parameters, applied once the block exists
+static bool f_conf_indexed(const char * name) {
+	return strncmp(name, "ps_", 3) == 0 || strncmp(name, "qos_", 4) == 0 || strncmp(name, "group_", 6) == 0;
+}
+
+static int f_conf_apply_one(base_config * conf, const struct rmt_conf_param * param) {
+	int ret;
+	
+	ret = f_conf_apply(conf, param);
+	if(ret > 0) {
+		LOG_WARN("Unknown parameter %s, ignored", param->name);
+		return 0;
+	}
+	return ret;
+}
+
+// Policers, QoS mappings and port groups of the configuration, in one allocation
+static int f_conf_alloc(base_config * conf, const struct rmt_conf_ids * qos_ids, const struct rmt_conf_ids * group_ids) {
+	size_t off_qos, off_groups;
+	qos2module * qos2module_i;
+	u16 id;
+	u8 i;
+	
+	off_qos = ALIGN(sizeof(policer_c) * conf->num_policers, sizeof(u64));
+	off_groups = ALIGN(off_qos + sizeof(qos2module) * qos_ids->num, sizeof(u64));
+	if(!conf->num_policers && !qos_ids->num && !group_ids->num) {
+		return 0;
+	}
+	conf->conf_block = rkzalloc(off_groups + sizeof(struct rmt_group) * group_ids->num, GFP_ATOMIC);
+	if(!conf->conf_block) {
+		LOG_ERR("Failure allocating policer/shapers");
+		return -1;
+	}
+	
+	conf->policers = conf->num_policers ? conf->conf_block : NULL;
+	for(i = 0; i < conf->num_policers; i++) {
+		conf->policers[i].max_count = 100;
+		conf->policers[i].gain_us = 100;
+		conf->policers[i].gain_pct = 0;
+		conf->policers[i].max_credits = 100000;
+		conf->policers[i].next_module = 0;
+		conf->policers[i].cherish_th = 100;
+		conf->policers[i].ecn_th = 0;
+		conf->policers[i].max_bytes = 0;
+		conf->policers[i].cherish_bytes = 0;
+		conf->policers[i].ecn_bytes = 0;
+		conf->policers[i].urgency_level = conf->levels_urgency-1;
+		conf->policers[i].overhead = 0;
+		conf->policers[i].bytecost = 0;
+		conf->policers[i].cell = 0;
+		conf->policers[i].cell_bytes = 0;
+	}
+	
+	qos2module_i = (qos2module *) ((char *) conf->conf_block + off_qos);
+	for(id = 0; id <= RMT_CONF_MAX_ID; id++) {
+		if(rmt_conf_ids_test(qos_ids, id)) {
+			f_qos2module_init(conf, qos2module_i, id);
+			qos2module_i++;
+		}
+	}
+	
+	conf->groups = group_ids->num ? (struct rmt_group *) ((char *) conf->conf_block + off_groups) : NULL;
+	for(id = 0; id <= RMT_CONF_MAX_ID; id++) {
+		if(rmt_conf_ids_test(group_ids, id)) {
+			rmt_group_init(conf->groups + conf->num_groups, id);
+			conf->num_groups++;
+		}
+	}
+	return 0;
+}
+
+static void f_qos2module_init(base_config * conf, qos2module * qos2module_i, u8 qos_id) {
+	INIT_LIST_HEAD(&qos2module_i->L);
+	list_add(&qos2module_i->L, &conf->qos2modules);
+	qos2module_i->qos_id = (qos_id_t) qos_id;
+	qos2module_i->next_module = 0;
+	qos2module_i->def_cherish_th = 100;
+	qos2module_i->mark = conf->def_mark;
+	qos2module_i->def_cherish_bytes = 0;
+	qos2module_i->def_ecn_bytes = 0;
+	qos2module_i->def_urgency = conf->levels_urgency-1;
+	qos2module_i->reserved = 0;
+	atomic_set(&qos2module_i->reserved_used, 0);
+	qos2module_i->max_sojourn_us = 0;
+}
+
+// Mapping of a QoS id, QoS ids first seen after creation get their own allocation
+static qos2module * f_qos2module_get(base_config * conf, u8 qos_id) {
+	qos2module * qos2module_i;
+	
+	list_for_each_entry(qos2module_i, &conf->qos2modules, L) {
+		if (qos_id == (u8) qos2module_i->qos_id) {
+			return qos2module_i;
+		}
+	}
+	
+	qos2module_i = rkzalloc(sizeof(qos2module), GFP_ATOMIC);
+	if(!qos2module_i){
+		LOG_ERR("Failure allocating qos conf");
+		return NULL;
+	}
+	f_qos2module_init(conf, qos2module_i, qos_id);
+	qos2module_i->own = 1;
+	return qos2module_i;
+}
+
+// 0 if every policer chain reaches the mux
+static int f_conf_check_chains(base_config * conf) {
+	u8 i, next, hops;
 	
-	p_ch = strchr(v_value, '.');
-	sub_id = -1;
-	if(p_ch) {
-		*p_ch = '\0';
-		if(kstrtou8(v_value, 10, &sub_id) ||  kstrtou64(p_ch+1, 10, &v64) ) {
-			*p_ch = '.';
-			LOG_ERR("Error while parsing parameter %s with value %s", name, value);
+	for(i = 0; i < conf->num_policers; i++) {
+		next = conf->policers[i].next_module;
+		for(hops = 0; next && hops < conf->num_policers; hops++) {
+			next = conf->policers[next - 1].next_module;
+		}
+		if(next) {
+			LOG_ERR("P/S %u forwards in a loop that never reaches the mux", i + 1);
 			return -1;
 		}
-		*p_ch = '.';
-	} else if(kstrtou64(value, 10, &v64) ) {
-		LOG_ERR("Error while parsing parameter %s with value %s", name, value);
+	}
+	return 0;
+}
+
+static int f_conf_validate(base_config * conf) {
+	struct rmt_group * group_i;
+	u8 i, j;
+	
+	for(i = 0; i < conf->num_groups; i++) {
+		group_i = conf->groups + i;
+		if(!group_i->gain_us) {
+			LOG_ERR("Port group %u without gain", group_i->id);
+			return -1;
+		}
+		for(j = 0; j < group_i->num_ports; j++) {
+			if(rmt_group_find(conf->groups, conf->num_groups, group_i->ports[j]) != group_i) {
+				LOG_ERR("Port %d in more than one port group", group_i->ports[j]);
+				return -1;
+			}
+		}
+	}
+	if(conf->bp.high && conf->bp.low >= conf->bp.high) {
+		LOG_ERR("Backpressure low watermark %u not below high %u", conf->bp.low, conf->bp.high);
+		return -1;
+	}
+	if(conf->shared_size && conf->dt_alpha == 0) {
+		LOG_ERR("Shared buffer with a zero dynamic threshold");
 		return -1;
 	}
+	f_conf_costs(conf);
+	return f_conf_check_chains(conf);
+}
+
+// Releases the configuration, on destroy or on a failed creation
+static void f_conf_free(base_config * conf) {
+	qos2module * qos2module_i;
+	u8 i;
+	
+	rmt_conf_stage_free(&conf->pending);
+	
+	// Empty buffers
+	if(conf->buffer.misses) {
+		LOG_INFO("Buffer pool was empty on %llu enqueues", conf->buffer.misses);
+	}
+	rmt_pool_destroy(&conf->buffer);
+	
+	//Remove qos 2 module mapping
+	while(!list_empty(&conf->qos2modules)) {
+		qos2module_i = list_first_entry(&conf->qos2modules, qos2module, L);
+		list_del(&qos2module_i->L);
+		if(qos2module_i->own) {
+			rkfree(qos2module_i);
+		}
+	}
+	
+	for(i = 0; i < conf->num_groups; i++) {
+		if(atomic64_read(&conf->groups[i].held)) {
+			LOG_INFO("Port group %u held its members %lld times", conf->groups[i].id, atomic64_read(&conf->groups[i].held));
+		}
+	}
+	
+	if(conf->conf_block) {
+		rkfree(conf->conf_block);
+	}
+	conf->conf_block = NULL;
+	conf->policers = NULL;
+	conf->groups = NULL;
+	conf->num_groups = 0;
+}
+
+static int f_conf_apply(base_config * conf, const struct rmt_conf_param * param) {
+	const char * v_name = param->name;
+	u16 sub_id = param->id;
+	u8 v8, old8;
+	u16 v16;
+	u32 v32;
+	u64 v64;
+	policer_c * policer_i;
+	qos2module * qos2module_i;
+	struct rmt_group * group_i;
+	
+	v64 = param->v;
 	v32 = (u32) v64;
 	v16 = (u16) v64;
 	v8 = (u8) v64;
 		
 	switch(v_name[0]) {
+		case 'a':
+			if(strcmp(v_name, "age_us") == 0) {
+				conf->age_us = v32;
+				return 0;
+			}
+			if(strcmp(v_name, "age_rate") == 0) {
+				conf->age_rate = v32;
+				return 0;
+			}
+			break;
 		case 'b':
 			if(strcmp(v_name, "bytecost") == 0) {
 				conf->bytecost = v8;
+				if(conf->state & 1) {
+					f_conf_costs(conf);
+				}
 				return 0;
 			}
-			break;
-		case 'h':
-			if(strcmp(v_name, "header_weight") == 0) {
-				conf->headers_weight = v8;
+			if(v_name[1] == 'p' && v_name[2] == '_' && rmt_bp_set_param(&conf->bp, v_name + 3, v32) == 0) {
 				return 0;
 			}
 			break;
-		case 'i':
-			if(strcmp(v_name, "init_buffer") == 0) {
-				while(v16 > 0) {
-					entry_i = rkzalloc(sizeof(q_entry), GFP_ATOMIC);
-					if(!entry_i){						
-						LOG_ERR("Failure pre-allocating buffers");
-					} else {
-						INIT_LIST_HEAD(&entry_i->L);
-						list_add(&entry_i->L, &conf->buffer);
-						conf->buffer_size++;
-					}
-					v16--;
-				}
+		case 'c':
+			if(strcmp(v_name, "cal_window_us") == 0) {
+				conf->cal_window_us = v32;
+				return 0;
+			}
+			if(strcmp(v_name, "cut_through") == 0) {
+				conf->cut_through = v8;
+				return 0;
+			}
+			break;
+		case 'd':
+			if(strcmp(v_name, "dt_alpha") == 0) {
+				conf->dt_alpha = v16;
+				return 0;
+			}
+			break;
+		case 'e':
+			if(strncmp(v_name, "ecn_", 4) == 0) {
+				switch(rmt_mark_set_param(&conf->def_mark, v_name + 4, v32)) {
+					case 0:
+						return 0;
+					case -1:
+						LOG_ERR("Invalid ECN %s %u", v_name + 4, v32);
+						return -1;
+				}
+			}
+			break;
+		case 'g':
+			if(strncmp(v_name, "group_", 6) == 0) {
+				group_i = f_group_get(conf, sub_id);
+				if(!group_i) {
+					return -1;
+				}
+				// Members are looked up when their port is created, checked as a whole at creation
+				if((conf->state & 1) && strcmp(v_name + 6, "port") == 0
+					&& v64 <= INT_MAX && rmt_group_find(conf->groups, conf->num_groups, (int) v64)) {
+					LOG_ERR("Port %llu already in a port group", v64);
+					return -1;
+				}
+				switch(rmt_group_set_param(group_i, v_name + 6, v64)) {
+					case 0:
+						return 0;
+					case -1:
+						LOG_ERR("Invalid %s %llu at port group %u", v_name + 6, v64, sub_id);
+						return -1;
+				}
+			}
+			break;
+		case 'h':
+			if(strcmp(v_name, "header_weight") == 0) {
+				conf->headers_weight = v8;
+				return 0;
+			}
+			break;
+		case 'i':
+			if(strcmp(v_name, "idle_us") == 0) {
+				conf->idle_us = v32;
+				if((conf->state & 1) && v32) {
+					schedule_delayed_work(&conf->idle_work, usecs_to_jiffies(v32));
+				}
+				return 0;
+			}
+			if(strcmp(v_name, "init_buffer") == 0) {
+				if(rmt_pool_fill(&conf->buffer, v32) < v32) {
+					LOG_ERR("Failure pre-allocating buffers");
+				}
 				return 0;
 			}
 			break;
 		case 'l':
 			if(strcmp(v_name, "levels_urgency") == 0) {
 				if(conf->state & 1) {
-					LOG_ERR("Cannot re-confure the number of urgency queues after start-up");
+					LOG_ERR("Cannot re-configure the number of urgency queues after start-up");
 					return -1;
 				}
-				if(v8 == 0){
-					LOG_ERR("Required at least one urgency queue");
+				if(v64 == 0 || v64 > U8_MAX){
+					LOG_ERR("Required between 1 and %u urgency queues", U8_MAX);
 					return -1;
 				}
 				conf->levels_urgency = v8;
@@ -515,42 +1036,74 @@ static int f_policy_set_param_pv(base_config * conf, const char * name, const ch
 			break;
 		case 'm':
 			if(strcmp(v_name, "max_mux_count") == 0) {
-				conf->max_count = v16;
+				conf->max_count = v32;
 				return 0;
 			} else if(strcmp(v_name, "max_global_count") == 0) {
-				conf->global_max_count = v16;
+				conf->global_max_count = v32;
+				return 0;
+			} else if(strcmp(v_name, "max_global_bytes") == 0) {
+				conf->global_max_bytes = v32;
 				return 0;
 			}
 			break;
 		case 'n':
+			if(strcmp(v_name, "numa_node") == 0) {
+				if(conf->state & 1) {
+					LOG_ERR("Cannot re-configure the NUMA node after start-up");
+					return -1;
+				}
+				if((int) v32 != NUMA_NO_NODE && (v64 >= MAX_NUMNODES || !node_online(v32))) {
+					LOG_ERR("NUMA node %llu is not online", v64);
+					return -1;
+				}
+				conf->numa_node = v32;
+				return 0;
+			}
 			if(strcmp(v_name, "num_policers") == 0) {
-				if(conf->state & 2) {
-					LOG_ERR("Cannot re-confure the number of policers");
+				if(conf->state & 1) {
+					LOG_ERR("Cannot re-configure the number of policers");
 					return -1;
 				}
-				
-				conf->policers = rkzalloc(sizeof(policer_c) * v8, GFP_ATOMIC);
-				if(!conf->policers) {
-					LOG_ERR("Failure allocating policer/shapers");
+				if(v64 > U8_MAX) {
+					LOG_ERR("At most %u policer/shapers", U8_MAX);
 					return -1;
 				}
 				conf->num_policers = v8;
-				while(v8 >0){
-					v8--;
-					conf->policers[v8].max_count = 100;
-					conf->policers[v8].gain_us = 100;
-					conf->policers[v8].max_credits = 100000;
-					conf->policers[v8].next_module = 0;
-					conf->policers[v8].cherish_th = 100;
-					conf->policers[v8].ecn_th = 50;
-					conf->policers[v8].urgency_level =  conf->levels_urgency-1;
+				return 0;
+			}
+			break;
+		case 'v':
+			if(strcmp(v_name, "voq_size") == 0) {
+				if(conf->state & 1) {
+					LOG_ERR("Cannot re-configure destination queues after start-up");
+					return -1;
 				}
-				conf->state |= 2;
-				
+				conf->voq_size = v32;
+				return 0;
+			}
+			break;
+		case 's':
+			if(strcmp(v_name, "shared_buffer") == 0) {
+				conf->shared_size = v32;
+				return 0;
+			}
+			if(strcmp(v_name, "sweep_us") == 0) {
+				conf->sweep_us = v32;
 				return 0;
 			}
 			break;
 		case 'p':
+			if(strcmp(v_name, "pace_gran_us") == 0) {
+				if(conf->state & 1) {
+					LOG_ERR("Cannot re-configure pacing after start-up");
+					return -1;
+				}
+				conf->pace_gran_us = v32;
+				return 0;
+			}
+			if(strncmp(v_name, "pool_", 5) == 0 && rmt_pool_set_param(&conf->buffer, v_name + 5, v32) == 0) {
+				return 0;
+			}
 			if(v_name[1] == 's' && v_name[2] == '_') {
 				if(sub_id == 0 || sub_id > conf->num_policers){
 					LOG_ERR("Invalid policer id %u", sub_id);
@@ -560,79 +1113,125 @@ static int f_policy_set_param_pv(base_config * conf, const char * name, const ch
 				policer_i = conf->policers + sub_id -1;
 				
 				if(strcmp(v_name, "max_count") == 0) {
-					policer_i->max_count = v16;
+					policer_i->max_count = v32;
+					return 0;
+				} else if(strcmp(v_name, "max_bytes") == 0) {
+					policer_i->max_bytes = v32;
 					return 0;
 				} else if(strcmp(v_name, "gain_us") == 0) {
 					policer_i->gain_us = v64;
 					return 0;
+				} else if(strcmp(v_name, "gain_pct") == 0) {
+					policer_i->gain_pct = v16;
+					return 0;
 				} else if(strcmp(v_name, "max_credit") == 0) {
 					policer_i->max_credits = v64;
 					return 0;
 				} else if(strcmp(v_name, "next_module") == 0) {
-					if(v8 >= conf->num_policers) {
-						LOG_ERR("Invalid next P/S id %d", v8);
+					if(v64 > conf->num_policers) {
+						LOG_ERR("Invalid next P/S id %llu", v64);
+						return -1;
 					}
+					old8 = policer_i->next_module;
 					policer_i->next_module = v8;
+					// Checked as a whole at creation, one by one afterwards
+					if((conf->state & 1) && f_conf_check_chains(conf)) {
+						policer_i->next_module = old8;
+						return -1;
+					}
 					return 0;
 				} else if(strcmp(v_name, "cherish_th") == 0) {
-					policer_i->cherish_th = v16;
+					policer_i->cherish_th = v32;
 					return 0;
 				} else if(strcmp(v_name, "ecn_th") == 0) {
-					policer_i->ecn_th = v16;
+					policer_i->ecn_th = v32;
+					return 0;
+				} else if(strcmp(v_name, "cherish_bytes") == 0) {
+					policer_i->cherish_bytes = v32;
+					return 0;
+				} else if(strcmp(v_name, "ecn_bytes") == 0) {
+					policer_i->ecn_bytes = v32;
 					return 0;
 				} else if(strcmp(v_name, "urgency") == 0) {
-					if(v8 >= conf->levels_urgency) {
-						LOG_ERR("Invalid urgency level %u at P/S %u", v8, sub_id);
+					if(v64 >= conf->levels_urgency) {
+						LOG_ERR("Invalid urgency level %llu at P/S %u", v64, sub_id);
 						return -1;
 					}
 					policer_i->urgency_level = v8;
 					return 0;
+				} else if(strcmp(v_name, "overhead") == 0 || strcmp(v_name, "bytecost") == 0
+					|| strcmp(v_name, "cell") == 0 || strcmp(v_name, "cell_bytes") == 0) {
+					if(v64 > U16_MAX || (v_name[0] == 'b' && v64 > U8_MAX)) {
+						LOG_ERR("Invalid %s %llu at P/S %u", v_name, v64, sub_id);
+						return -1;
+					}
+					if(v_name[0] == 'o') {
+						policer_i->overhead = v16;
+					} else if(v_name[0] == 'b') {
+						policer_i->bytecost = v8;
+					} else if(v_name[4] == '\0') {
+						policer_i->cell = v16;
+					} else {
+						policer_i->cell_bytes = v16;
+					}
+					// Precomputed as a whole at creation
+					if(conf->state & 1) {
+						f_conf_costs(conf);
+					}
+					return 0;
 				}
 			}
 			break;
 		case 'q':
 			if(v_name[1] == 'o' && v_name[2] == 's' && v_name[3] == '_') {
-				if(sub_id == 0 || sub_id > conf->num_policers){
-					LOG_ERR("Invalid policer id %u", sub_id);
+				if(sub_id == 0 || sub_id > RMT_CONF_MAX_ID){
+					LOG_ERR("Invalid qos id %u", sub_id);
 					return -1;
 				}
 				v_name += 4;
-				qos2module_i = NULL;
-				list_for_each_entry(qos2module_t, &conf->qos2modules, L) {
-					if (sub_id == (u8) qos2module_t->qos_id) {
-						qos2module_i = qos2module_t;
-					}
-				}
+				qos2module_i = f_qos2module_get(conf, sub_id);
 				if(!qos2module_i) {
-					qos2module_i = rkzalloc(sizeof(qos2module), GFP_ATOMIC);
-					if(!qos2module_i){						
-						LOG_ERR("Failure allocating qos conf");
-						return -1;
-					} else {
-						INIT_LIST_HEAD(&qos2module_i->L);
-						list_add(&qos2module_i->L, &conf->qos2modules);
-						qos2module_i->qos_id = (qos_id_t) sub_id;
-						qos2module_i->next_module = 0;
-						qos2module_i->def_cherish_th = 0;
-						qos2module_i->def_urgency = conf->levels_urgency-1;
-					}
+					return -1;
 				}
 				if(strcmp(v_name, "next") == 0) {
-					if(v8 >= conf->num_policers) {
-						LOG_ERR("Invalid next P/S id %d", v8);
+					if(v64 > conf->num_policers) {
+						LOG_ERR("Invalid next P/S id %llu", v64);
+						return -1;
 					}
 					qos2module_i->next_module = v8;
 				} else if(strcmp(v_name, "urgency") == 0) {
-					if(v8 >= conf->levels_urgency) {
-						LOG_ERR("Invalid urgency level  %u at P/S %u", v8, sub_id);
+					if(v64 >= conf->levels_urgency) {
+						LOG_ERR("Invalid urgency level  %llu at QoS %u", v64, sub_id);
 						return -1;
 					}
 					qos2module_i->def_urgency = v8;
 				} else if(strcmp(v_name, "cherish_th") == 0) {
-					qos2module_i->def_cherish_th = v16;
-				} else if(strcmp(v_name, "ecn_th") == 0) {
-					qos2module_i->def_ecn_th = v16;
+					qos2module_i->def_cherish_th = v32;
+				} else if(strcmp(v_name, "cherish_bytes") == 0) {
+					qos2module_i->def_cherish_bytes = v32;
+				} else if(strcmp(v_name, "ecn_bytes") == 0) {
+					qos2module_i->def_ecn_bytes = v32;
+				} else if(strncmp(v_name, "ecn_", 4) == 0) {
+					switch(rmt_mark_set_param(&qos2module_i->mark, v_name + 4, v32)) {
+						case 0:
+							break;
+						case -1:
+							LOG_ERR("Invalid ECN %s %u at QoS %u", v_name + 4, v32, sub_id);
+							return -1;
+						default:
+							return 1;
+					}
+				} else if(strcmp(v_name, "reserved") == 0) {
+					qos2module_i->reserved = v16;
+				} else if(strcmp(v_name, "max_sojourn_us") == 0) {
+					qos2module_i->max_sojourn_us = v32;
+					if(v32) {
+						conf->lifetimes = 1;
+					}
+				} else {
+					return 1;
 				}
+				return 0;
 			}
 			break;
 	}
@@ -641,35 +1240,736 @@ static int f_policy_set_param_pv(base_config * conf, const char * name, const ch
 
 void f_free_port_instance(base_config * conf, port_instance * port_i) {
 	q_entry * entry_i;
+	list_h pending;
 	u8 i;
 	
 	port_i->P->rmt_ps_queues = NULL;
+	spin_lock_bh(&conf->port_lock);
 	list_del(&port_i->L);
+	spin_unlock_bh(&conf->port_lock);
+	
+	if(port_i->bp_paused) {
+		rmt_bp_notify(&eqta_bp_chain, port_i->P, 0, RMT_BP_RESUME);
+	}
+	
+	if(!port_i->Qs) {
+		kfree(port_i);
+		return;
+	}
 	
 	for(i = 0; i < conf->num_policers; i++) {
 		while(!list_empty(&port_i->policers[i].Q)) {
 			entry_i = list_first_entry(&port_i->policers[i].Q, q_entry, L);
 			list_del(&entry_i->L);
-			list_add(&entry_i->L, &conf->buffer);
-			conf->buffer_size++;
+			f_shared_release(entry_i);
+			pdu_destroy(entry_i->data);
+			rmt_pool_put(&conf->buffer, entry_i);
 		}
 	}
-	rkfree(port_i->policers);
 	
 	for(i = 0; i < conf->levels_urgency; i++) {
+		if(conf->voq_size) {
+			rmt_voq_flush(f_mux_voq(conf, port_i, i), port_i->Qs + i);
+		}
 		while(!list_empty(port_i->Qs + i)) {
 			entry_i = list_first_entry(port_i->Qs + i, q_entry, L);
 			list_del(&entry_i->L);
-			list_add(&entry_i->L, &conf->buffer);
-			conf->buffer_size++;
+			f_shared_release(entry_i);
+			pdu_destroy(entry_i->data);
+			rmt_pool_put(&conf->buffer, entry_i);
 		}
 	}
-	rkfree(port_i->Qs);
+	
+	if(port_i->wheel) {
+		INIT_LIST_HEAD(&pending);
+		rmt_wheel_flush(port_i->wheel, &pending);
+		while(!list_empty(&pending)) {
+			entry_i = list_first_entry(&pending, q_entry, W.L);
+			list_del(&entry_i->W.L);
+			f_shared_release(entry_i);
+			pdu_destroy(entry_i->data);
+			rmt_pool_put(&conf->buffer, entry_i);
+		}
+	}
+	
+	if(port_i->expired) {
+		LOG_INFO("Port discarded %llu PDUs past their deadline", port_i->expired);
+	}
+	if(port_i->aged) {
+		LOG_INFO("Port served %llu PDUs past age_us ahead of more urgent ones", port_i->aged);
+	}
+	f_port_compact(port_i);
+	kfree(port_i);
+}
+
+/*
+	Port instance layout
+	The port_instance keeps its hot fields in the first cacheline. Queue state
+	is a separate block: the policers, then the urgency queues starting on
+	their own cacheline.
+*/
+static void f_port_layout(base_config * conf) {
+	conf->state_off_qs = ALIGN(sizeof(policer_d) * conf->num_policers, L1_CACHE_BYTES);
+	conf->state_size = conf->state_off_qs + sizeof(list_h) * conf->levels_urgency;
+	if(conf->pace_gran_us) {
+		conf->state_off_wheel = ALIGN(conf->state_size, L1_CACHE_BYTES);
+		conf->state_size = conf->state_off_wheel + sizeof(struct rmt_wheel);
+	}
+	if(conf->voq_size) {
+		conf->voq_set_size = ALIGN(RMT_VOQ_SET_SIZE(conf->voq_size), sizeof(u64));
+		conf->state_off_voq = ALIGN(conf->state_size, L1_CACHE_BYTES);
+		conf->state_size = conf->state_off_voq + conf->voq_set_size * conf->levels_urgency;
+	}
+	
+	LOG_INFO("Port instance layout: %zu bytes, hot state %zu bytes, cold state at %zu; queue state %u bytes, urgency queues at %u, node %d",
+		sizeof(port_instance), offsetof(port_instance, bytes) + sizeof(u32), offsetof(port_instance, L),
+		conf->state_size, conf->state_off_qs, conf->numa_node);
+	if(offsetof(port_instance, bytes) + sizeof(u32) > L1_CACHE_BYTES) {
+		LOG_WARN("Port instance hot state spans more than one cacheline");
+	}
+}
+
+/*
+	Rate calibration
+	Called for every PDU served from the mux. The time between two consecutive
+	dequeues is accounted as service time of the first PDU only if the mux still
+	had PDUs waiting, so idle periods do not lower the measured rate.
+*/
+static void f_port_calibrate(base_config * conf, port_instance * port_i, int T, u32 cost) {
+	u64 sample;
+	
+	if(port_i->cal_last_cost) {
+		port_i->cal_us += T;
+		port_i->cal_credits += port_i->cal_last_cost;
+	}
+	port_i->cal_last_cost = port_i->mux_count > 0 ? cost : 0;
+	
+	if(port_i->cal_us == 0 || port_i->cal_us < conf->cal_window_us) {
+		return;
+	}
+	
+	sample = div_u64(port_i->cal_credits * 1000000, port_i->cal_us);
+	if(port_i->rate) {
+		port_i->rate = port_i->rate - (port_i->rate >> 3) + (sample >> 3);
+	} else {
+		port_i->rate = sample;
+	}
+	port_i->cal_us = 0;
+	port_i->cal_credits = 0;
+	
+	f_port_set_gains(conf, port_i);
+}
+
+static void f_port_set_gains(base_config * conf, port_instance * port_i) {
+	u8 i;
+	policer_c * psh_c;
+	
+	if(!port_i->rate) {
+		return;
+	}
+	for(i = 0; i < conf->num_policers; i++) {
+		psh_c = conf->policers + i;
+		if(psh_c->gain_pct) {
+			port_i->policers[i].gain_us = div_u64(port_i->rate * psh_c->gain_pct, 100000000);
+			if(!port_i->policers[i].gain_us) {
+				port_i->policers[i].gain_us = 1;
+			}
+		}
+	}
+}
+
+/*
+	Idle ports
+	Queue state is allocated on the first enqueue. Ports that stay empty for
+	idle_us are compacted back by a periodic sweep, which takes the RMT port
+	lock to serialise with enqueue/dequeue and skips ports it cannot lock.
+	The measured rate is kept in the port_instance, so gains are restored on
+	the next activation.
+*/
+static int f_port_activate(base_config * conf, port_instance * port_i) {
+	char * state;
+	u8 i;
+	
+	state = kzalloc_node(conf->state_size, GFP_ATOMIC, conf->numa_node);
+	if(!state) {
+		return -1;
+	}
+	port_i->policers = (policer_d *) state;
+	port_i->Qs = (list_h *) (state + conf->state_off_qs);
+	port_i->wheel = NULL;
+	if(conf->pace_gran_us) {
+		port_i->wheel = (struct rmt_wheel *) (state + conf->state_off_wheel);
+		rmt_wheel_init(port_i->wheel, div_u64(ktime_get_ns(), conf->pace_gran_us * NSEC_PER_USEC));
+	}
+	
+	for(i = 0 ; i < conf->num_policers; i++) {
+		port_i->policers[i].count = 0;
+		port_i->policers[i].bytes = 0;
+		port_i->policers[i].credits = 0;
+		port_i->policers[i].gain_us = 0;
+		port_i->policers[i].next_edt = 0;
+		INIT_LIST_HEAD(&port_i->policers[i].Q);
+	}
+	for(i = 0 ; i < conf->levels_urgency; i++) {
+		INIT_LIST_HEAD(port_i->Qs+i);
+		if(conf->voq_size) {
+			rmt_voq_init(f_mux_voq(conf, port_i, i), conf->voq_size);
+		}
+	}
+	f_port_set_gains(conf, port_i);
+	
+	return 0;
+}
+
+static void f_port_compact(port_instance * port_i) {
+	if(port_i->policers) {
+		kfree(port_i->policers);
+	}
+	port_i->policers = NULL;
+	port_i->Qs = NULL;
+	port_i->wheel = NULL;
+}
+
+static void f_idle_sweep(struct work_struct * work) {
+	base_config * conf;
+	port_instance * port_i;
+	struct timespec t1, td;
+	
+	conf = container_of(to_delayed_work(work), base_config, idle_work);
+	if(!conf->idle_us) {
+		return;
+	}
+	
+	getnstimeofday (&t1);
+	spin_lock_bh(&conf->port_lock);
+	list_for_each_entry(port_i, &conf->port_instances, L) {
+		if(!port_i->Qs || !spin_trylock(&port_i->P->lock)) {
+			continue;
+		}
+		if(port_i->Qs && port_i->count == 0 && timespec_compare(&port_i->lastT, &t1) < 0) {
+			td = timespec_sub(t1, port_i->lastT);
+			if((u64) td.tv_sec * 1000000 + td.tv_nsec / 1000 >= conf->idle_us) {
+				f_port_compact(port_i);
+			}
+		}
+		spin_unlock(&port_i->P->lock);
+	}
+	spin_unlock_bh(&conf->port_lock);
+	
+	schedule_delayed_work(&conf->idle_work, usecs_to_jiffies(conf->idle_us));
+}
+
+/*
+	Shared buffer admission (Choudhury-Hahne dynamic threshold)
+	A PDU first takes a slot of its QoS reserve, if any is free. Otherwise it is
+	admitted to the shared buffer while the port holds less than dt_alpha % of
+	the free shared space. Returns the counter charged, NULL if dropped.
+*/
+static atomic_t * f_shared_admit(base_config * conf, port_instance * port_i, qos2module * qos_i) {
+	int used;
+	
+	if(qos_i && qos_i->reserved) {
+		if(atomic_inc_return(&qos_i->reserved_used) <= qos_i->reserved) {
+			return &qos_i->reserved_used;
+		}
+		atomic_dec(&qos_i->reserved_used);
+	}
+	
+	used = atomic_read(&conf->shared_used);
+	if(used >= conf->shared_size
+		|| (u64) port_i->count * 100 >= (u64) (conf->shared_size - used) * conf->dt_alpha) {
+		return NULL;
+	}
+	if(atomic_inc_return(&conf->shared_used) > conf->shared_size) {
+		atomic_dec(&conf->shared_used);
+		return NULL;
+	}
+	return &conf->shared_used;
+}
+
+static void f_shared_release(q_entry * entry_i) {
+	if(entry_i->pool) {
+		atomic_dec(entry_i->pool);
+		entry_i->pool = NULL;
+	}
+}
+
+/*
+	Pacing
+	With pace_gran_us set, PDUs sent to a policer are not queued behind its
+	token bucket. Each one is stamped with an earliest departure time, one
+	cost / gain after the previous PDU of the same policer, and put on the
+	port timing wheel. Dequeue only pops what is due, so the cost per PDU
+	does not depend on the number of policers.
+*/
+static void f_pace_stamp(base_config * conf, port_instance * port_i, q_entry * entry_i, u8 module, u64 now) {
+	policer_c * psh_c;
+	policer_d * psh_d;
+	u64 gain, edt;
+	
+	psh_c = conf->policers + module - 1;
+	psh_d = port_i->policers + module - 1;
+	gain = psh_d->gain_us ? psh_d->gain_us : psh_c->gain_us;
+	
+	edt = max(now, psh_d->next_edt);
+	psh_d->next_edt = edt + div64_u64((u64) f_policer_cost(psh_c, entry_i->len, entry_i->cost) * NSEC_PER_USEC, gain ? gain : 1);
+	
+	entry_i->module = module;
+	rmt_wheel_add(port_i->wheel, &entry_i->W, div_u64(edt, conf->pace_gran_us * NSEC_PER_USEC));
+}
+
+static void f_pace_release(base_config * conf, port_instance * port_i) {
+	struct rmt_wheel_node * node;
+	q_entry * entry_i;
+	policer_c * psh_c, * psh_n_c;
+	policer_d * psh_d, * psh_n_d;
+	list_h * head;
+	u64 now;
+	
+	now = ktime_get_ns();
+	while((node = rmt_wheel_pop(port_i->wheel, div_u64(now, conf->pace_gran_us * NSEC_PER_USEC)))) {
+		entry_i = container_of(node, q_entry, W);
+		psh_c = conf->policers + entry_i->module - 1;
+		psh_d = port_i->policers + entry_i->module - 1;
+		psh_d->count--;
+		psh_d->bytes -= entry_i->len;
+		if(entry_i->deadline && now >= entry_i->deadline) {
+			f_entry_expire(conf, port_i, entry_i);
+			continue;
+		}
 		
-	rkfree(port_i);
+		if(psh_c->next_module == 0) {
+			//To MUX
+			if(port_i->mux_count >= psh_c->cherish_th
+				|| (psh_c->cherish_bytes && port_i->mux_bytes + entry_i->len > psh_c->cherish_bytes)) {
+				LOG_INFO("Length exceeded for MUX queue for cherish_th %u, dropping PDU", psh_c->cherish_th);
+				f_entry_drop(conf, port_i, entry_i);
+				continue;
+			}
+			head = f_mux_push(conf, port_i, psh_c->urgency_level, entry_i);
+			port_i->mux_count++;
+			port_i->mux_bytes += entry_i->len;
+			f_policer_mark(psh_c, port_i, entry_i, head);
+		} else {
+			//To another PS, paced again at its rate
+			psh_n_c = conf->policers + psh_c->next_module - 1;
+			psh_n_d = port_i->policers + psh_c->next_module - 1;
+			if(psh_n_d->count >= psh_n_c->max_count
+				|| (psh_n_c->max_bytes && psh_n_d->bytes + entry_i->len > psh_n_c->max_bytes)) {
+				LOG_INFO("Length exceeded for dst PS (id %u), dropping PDU", psh_c->next_module);
+				f_entry_drop(conf, port_i, entry_i);
+				continue;
+			}
+			psh_n_d->count++;
+			psh_n_d->bytes += entry_i->len;
+			f_pace_stamp(conf, port_i, entry_i, psh_c->next_module, now);
+		}
+	}
+}
+
+static void f_entry_drop(base_config * conf, port_instance * port_i, q_entry * entry_i) {
+	pdu_destroy(entry_i->data);
+	f_shared_release(entry_i);
+	port_i->count--;
+	port_i->bytes -= entry_i->len;
+	rmt_pool_put(&conf->buffer, entry_i);
+}
+
+/*
+	Mux queues
+	With voq_size each urgency level is a set of per destination queues
+	served round robin, so a congested next hop only blocks its own PDUs.
+	The sets follow the urgency queues in the queue state block. Callers
+	update the mux counters.
+*/
+static struct rmt_voq_set * f_mux_voq(base_config * conf, port_instance * port_i, u8 urgency) {
+	return (struct rmt_voq_set *) ((char *) port_i->policers + conf->state_off_voq + urgency * conf->voq_set_size);
+}
+
+// Returns the queue where entry_i was added
+static list_h * f_mux_push(base_config * conf, port_instance * port_i, u8 urgency, q_entry * entry_i) {
+	struct rmt_voq_set * set;
+	struct rmt_voq * voq;
+	
+	if(conf->age_us && !entry_i->enq_ns) {
+		entry_i->enq_ns = ktime_get_ns();
+	}
+	if(!conf->voq_size) {
+		list_add_tail(&entry_i->L, port_i->Qs + urgency);
+		return port_i->Qs + urgency;
+	}
+	set = f_mux_voq(conf, port_i, urgency);
+	voq = rmt_voq_get(set, pci_destination(pdu_pci_get_ro(entry_i->data)));
+	rmt_voq_push(set, voq, &entry_i->L);
+	return &voq->Q;
+}
+
+static q_entry * f_mux_pop(base_config * conf, port_instance * port_i, u8 urgency) {
+	q_entry * entry_i;
+	list_h * node;
+	
+	if(conf->voq_size) {
+		node = rmt_voq_pop(f_mux_voq(conf, port_i, urgency));
+		return node ? list_entry(node, q_entry, L) : NULL;
+	}
+	if(list_empty(port_i->Qs + urgency)) {
+		return NULL;
+	}
+	entry_i = list_first_entry(port_i->Qs + urgency, q_entry, L);
+	list_del(&entry_i->L);
+	return entry_i;
+}
+
+// Next entry f_mux_pop would return, NULL if none
+static q_entry * f_mux_peek(base_config * conf, port_instance * port_i, u8 urgency) {
+	list_h * node;
+	
+	if(conf->voq_size) {
+		node = rmt_voq_peek(f_mux_voq(conf, port_i, urgency));
+		return node ? list_entry(node, q_entry, L) : NULL;
+	}
+	return list_first_entry_or_null(port_i->Qs + urgency, q_entry, L);
+}
+
+/*
+	Aging guard
+	Strict urgency lets busy urgent queues starve the rest of the mux. Each
+	dequeue probes the head of one less urgent queue, in turn, and serves it
+	first if it has waited age_us and some more urgent queue would be served
+	instead, at most age_rate times a second per port. One probe per dequeue
+	keeps the selection O(1); a head waits about age_us plus a round of
+	probes. Returns the level to serve first, levels_urgency if none.
+*/
+static u8 f_age_pick(base_config * conf, port_instance * port_i, u64 now) {
+	q_entry * head;
+	u8 level, i;
+	
+	if(conf->levels_urgency < 2 || now < port_i->age_next) {
+		return conf->levels_urgency;
+	}
+	level = port_i->age_idx + 1;
+	if(++port_i->age_idx >= conf->levels_urgency - 1) {
+		port_i->age_idx = 0;
+	}
+	
+	head = f_mux_peek(conf, port_i, level);
+	if(!head || !head->enq_ns || now - head->enq_ns < (u64) conf->age_us * NSEC_PER_USEC) {
+		return conf->levels_urgency;
+	}
+	// Same scan as the strict order, up to the first busy queue
+	for(i = 0; i < level; i++) {
+		if(f_mux_peek(conf, port_i, i)) {
+			return level;
+		}
+	}
+	return conf->levels_urgency;
+}
+
+/*
+	Policer cost models
+	A policer that models a lower layer charges its own wire cost instead
+	of the PDU cost of the port: the PDU length plus its per PDU overhead,
+	times its byte cost, or rounded up to whole cells of cell payload bytes
+	and charged cell_bytes each. The multiplier and the reciprocal of the
+	cell size are precomputed, so the charge is a multiply and at most a
+	reciprocal divide per hop.
+*/
+static void f_conf_costs(base_config * conf) {
+	policer_c * psh_c;
+	u32 mult;
+	u8 i;
+	
+	for(i = 0; i < conf->num_policers; i++) {
+		psh_c = conf->policers + i;
+		mult = psh_c->bytecost ? psh_c->bytecost : conf->bytecost;
+		psh_c->own_cost = psh_c->overhead || psh_c->bytecost || psh_c->cell;
+		if(psh_c->cell) {
+			psh_c->cell_r = reciprocal_value(psh_c->cell);
+			psh_c->unit_cost = (psh_c->cell_bytes ? psh_c->cell_bytes : psh_c->cell) * mult;
+		} else {
+			psh_c->unit_cost = mult;
+		}
+	}
+}
+
+static inline u32 f_policer_cost(const policer_c * psh_c, u32 len, u32 cost) {
+	if(!psh_c->own_cost) {
+		return cost;
+	}
+	len += psh_c->overhead;
+	if(psh_c->cell) {
+		return reciprocal_divide(len + psh_c->cell - 1, psh_c->cell_r) * psh_c->unit_cost;
+	}
+	return len * psh_c->unit_cost;
+}
+
+/*
+	Port groups
+	Members of a group hold their mux while the group has no credits, and
+	spend the cost of every PDU served or cut through. The groups are set
+	at creation; a port joins the group listing it when its queues are
+	created.
+*/
+static struct rmt_group * f_group_get(base_config * conf, u16 id) {
+	u8 i;
+	
+	for(i = 0; i < conf->num_groups; i++) {
+		if(conf->groups[i].id == id) {
+			return conf->groups + i;
+		}
+	}
+	LOG_ERR("Unknown port group %u, groups are set at creation", id);
+	return NULL;
+}
+
+static bool f_group_admit(port_instance * port_i, u64 * now) {
+	if(!*now) {
+		*now = ktime_get_ns();
+	}
+	return rmt_group_admit(port_i->group, *now);
+}
+
+/*
+	Cut-through
+	With nothing queued in the port, a PDU for the mux would be the next one
+	served, and a policed PDU too if every policer on its path has the
+	credits for it now. Those credits are spent here. Paced policers always
+	queue, the departure time is set by the wheel.
+*/
+static bool f_cut_through(base_config * conf, port_instance * port_i, u8 module, u32 len) {
+	u32 cost;
+	u8 m, i;
+	
+	cost = ((u64) len + conf->headers_weight) * conf->bytecost;
+	if(port_i->group && !rmt_group_admit(port_i->group, ktime_get_ns())) {
+		return false;
+	}
+	if(module && port_i->wheel) {
+		return false;
+	}
+	
+	for(m = module, i = 0; m && i < conf->num_policers; m = conf->policers[m-1].next_module, i++) {
+		if(port_i->policers[m-1].credits < (s64) f_policer_cost(conf->policers + m - 1, len, cost)) {
+			return false;
+		}
+	}
+	if(m) {
+		return false;
+	}
+	for(m = module; m; m = conf->policers[m-1].next_module) {
+		port_i->policers[m-1].credits -= f_policer_cost(conf->policers + m - 1, len, cost);
+	}
+	if(port_i->group) {
+		rmt_group_spend(port_i->group, cost);
+	}
+	return true;
+}
+
+/*
+	PDU lifetime
+	PDUs of a QoS with max_sojourn_us get a deadline at enqueue. Expired PDUs
+	are discarded without being served when they reach the head of a policer
+	or mux queue, or leave the pacing wheel, and every sweep_us the dequeue
+	also sweeps the whole port. They are counted apart from overflow drops.
+	Callers update the policer/mux counters of the queue the PDU was in.
+*/
+static void f_entry_expire(base_config * conf, port_instance * port_i, q_entry * entry_i) {
+	port_i->expired++;
+	f_entry_drop(conf, port_i, entry_i);
+}
+
+static void f_expire_sweep(base_config * conf, port_instance * port_i, u64 now) {
+	q_entry * entry_i, * entry_n;
+	policer_d * psh_d;
+	struct rmt_voq_set * set;
+	struct rmt_voq * voq, * voq_n;
+	u8 i;
+	
+	port_i->last_sweep = now;
+	for(i = 0; i < conf->num_policers; i++) {
+		psh_d = port_i->policers + i;
+		list_for_each_entry_safe(entry_i, entry_n, &psh_d->Q, L) {
+			if(entry_i->deadline && now >= entry_i->deadline) {
+				list_del(&entry_i->L);
+				psh_d->count--;
+				psh_d->bytes -= entry_i->len;
+				f_entry_expire(conf, port_i, entry_i);
+			}
+		}
+	}
+	for(i = 0; i < conf->levels_urgency; i++) {
+		if(conf->voq_size) {
+			set = f_mux_voq(conf, port_i, i);
+			list_for_each_entry_safe(voq, voq_n, &set->active, A) {
+				list_for_each_entry_safe(entry_i, entry_n, &voq->Q, L) {
+					if(entry_i->deadline && now >= entry_i->deadline) {
+						rmt_voq_del(set, voq, &entry_i->L);
+						port_i->mux_count--;
+						port_i->mux_bytes -= entry_i->len;
+						f_entry_expire(conf, port_i, entry_i);
+					}
+				}
+			}
+			continue;
+		}
+		list_for_each_entry_safe(entry_i, entry_n, port_i->Qs + i, L) {
+			if(entry_i->deadline && now >= entry_i->deadline) {
+				list_del(&entry_i->L);
+				port_i->mux_count--;
+				port_i->mux_bytes -= entry_i->len;
+				f_entry_expire(conf, port_i, entry_i);
+			}
+		}
+	}
+}
+
+/*
+	ECN marking measure on the mux: PDUs or bytes waiting, or the sojourn of
+	entry_i in us. PDUs forwarded by policers are stamped when they reach the
+	mux, their time in the policer does not count.
+*/
+static u32 f_mark_value(port_instance * port_i, const struct rmt_mark * mark, q_entry * entry_i, u64 now) {
+	switch(mark->metric) {
+		case RMT_MARK_BYTES:
+			return port_i->mux_bytes;
+		case RMT_MARK_SOJOURN:
+			if(!entry_i->enq_ns || !now) {
+				return 0;
+			}
+			return div_u64(now - entry_i->enq_ns, NSEC_PER_USEC);
+		default:
+			return port_i->mux_count;
+	}
+}
+
+/*
+	ECN marking of a PDU a policer forwards to the mux, head being its mux
+	queue. A policer with an ecn_th keeps its own step, else the PDU gets
+	the marking of its QoS, carried in the entry since the enqueue: checked
+	now, or kept in the entry for the mux dequeue.
+*/
+static void f_policer_mark(policer_c * psh_c, port_instance * port_i, q_entry * entry_i, list_h * head) {
+	const struct rmt_mark * mark;
+	u64 now;
+	
+	mark = entry_i->mark;
+	entry_i->mark = NULL;
+	if(psh_c->ecn_bytes && port_i->mux_bytes > psh_c->ecn_bytes) {
+		rmt_mark_pdu(entry_i->data);
+		return;
+	}
+	if(psh_c->ecn_th) {
+		if(port_i->mux_count > psh_c->ecn_th) {
+			rmt_mark_pdu(entry_i->data);
+		}
+		return;
+	}
+	if(!mark) {
+		return;
+	}
+	
+	now = 0;
+	if(mark->metric == RMT_MARK_SOJOURN) {
+		now = ktime_get_ns();
+		entry_i->enq_ns = now;
+	}
+	if(mark->point == RMT_MARK_DEQUEUE) {
+		entry_i->mark = mark;
+	} else if(rmt_mark_check(mark, f_mark_value(port_i, mark, list_first_entry(head, q_entry, L), now))) {
+		rmt_mark_pdu(entry_i->data);
+	}
+}
+
+
+/*
+	Invariant checks (make RMT_CHECK=1), see rmt-check.h.
+	Policer, wheel and mux counters must match the PDUs actually queued,
+	and the port totals their sums.
+*/
+static void f_check_port(base_config * conf, port_instance * port_i) {
+	q_entry * entry_i;
+	policer_d * psh_d;
+	struct rmt_voq * voq;
+	u32 count, bytes, mux_count, mux_bytes, n, b;
+	u8 i;
+	
+	if(!port_i->Qs) {
+		rmt_check(!port_i->count && !port_i->bytes, "idle port %d counts %u PDUs and %u bytes",
+			port_i->P->port_id, port_i->count, port_i->bytes);
+		return;
+	}
+	
+	count = 0;
+	bytes = 0;
+	for(i = 0; i < conf->num_policers; i++) {
+		psh_d = port_i->policers + i;
+		if(!port_i->wheel) {
+			n = 0;
+			b = 0;
+			list_for_each_entry(entry_i, &psh_d->Q, L) {
+				n++;
+				b += entry_i->len;
+			}
+			rmt_check(n == psh_d->count && b == psh_d->bytes,
+				"port %d policer %u holds %u PDUs and %u bytes, counted %u and %u",
+				port_i->P->port_id, i + 1, n, b, psh_d->count, psh_d->bytes);
+		}
+		count += psh_d->count;
+		bytes += psh_d->bytes;
+	}
+	if(port_i->wheel) {
+		rmt_check(port_i->wheel->count == count, "port %d wheel holds %u PDUs, policers count %u",
+			port_i->P->port_id, port_i->wheel->count, count);
+	}
+	
+	mux_count = 0;
+	mux_bytes = 0;
+	for(i = 0; i < conf->levels_urgency; i++) {
+		if(!conf->voq_size) {
+			list_for_each_entry(entry_i, port_i->Qs + i, L) {
+				mux_count++;
+				mux_bytes += entry_i->len;
+			}
+			continue;
+		}
+		list_for_each_entry(voq, &f_mux_voq(conf, port_i, i)->active, A) {
+			n = 0;
+			list_for_each_entry(entry_i, &voq->Q, L) {
+				n++;
+				mux_bytes += entry_i->len;
+			}
+			rmt_check(n && n == voq->count, "port %d urgency %u voq %u holds %u PDUs, counted %u",
+				port_i->P->port_id, i, voq->key, n, voq->count);
+			mux_count += n;
+		}
+	}
+	rmt_check(mux_count == port_i->mux_count && mux_bytes == port_i->mux_bytes,
+		"port %d mux holds %u PDUs and %u bytes, counted %u and %u",
+		port_i->P->port_id, mux_count, mux_bytes, port_i->mux_count, port_i->mux_bytes);
+	
+	rmt_check(count + mux_count == port_i->count && bytes + mux_bytes == port_i->bytes,
+		"port %d holds %u PDUs and %u bytes, counted %u and %u",
+		port_i->P->port_id, count + mux_count, bytes + mux_bytes, port_i->count, port_i->bytes);
+	rmt_check(!conf->shared_size || atomic_read(&conf->shared_used) <= conf->shared_size,
+		"shared buffer holds %d PDUs, size %u", atomic_read(&conf->shared_used), conf->shared_size);
 }
 
 
+/*
+	Backpressure listeners, called with RMT_BP_PAUSE / RMT_BP_RESUME and a
+	struct rmt_bp_info when a port crosses bp_high / bp_low.
+*/
+int rmt_eqta_bp_register(struct notifier_block * nb) {
+	return atomic_notifier_chain_register(&eqta_bp_chain, nb);
+}
+EXPORT_SYMBOL(rmt_eqta_bp_register);
+
+int rmt_eqta_bp_unregister(struct notifier_block * nb) {
+	return atomic_notifier_chain_unregister(&eqta_bp_chain, nb);
+}
+EXPORT_SYMBOL(rmt_eqta_bp_unregister);
+
+
 /*
 	Policy init and exit
 */
@@ -679,6 +1979,18 @@ static struct ps_factory qta_factory = {
 		.destroy = f_policy_destroy,
 };
 
+// Invariant checks failed so far, see rmt-check.h
+int rmt_eqta_check_failed(void) {
+	return atomic_read(&rmt_check_failed);
+}
+EXPORT_SYMBOL(rmt_eqta_check_failed);
+
+// Factory for in-kernel users other than the RMT (e.g. rmt_gen)
+struct ps_factory * rmt_eqta_ps_factory(void) {
+	return &qta_factory;
+}
+EXPORT_SYMBOL(rmt_eqta_ps_factory);
+
 static int __init mod_init(void) {
 	strcpy(qta_factory.name, RINA_QTA_MUX_ps_NAME);
 	if (rmt_ps_publish(&qta_factory)) {
@@ -2,14 +2,31 @@
 #include <linux/module.h>
 #include <linux/list.h>
 #include <linux/time.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/cache.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
 #include <linux/export.h>
 #include <linux/string.h>
+#include <linux/reciprocal_div.h>
+#include <linux/nodemask.h>
 
 #include "logs.h"
 #include "rds/rmem.h"
 #include "rmt-ps.h"
 #include "policies.h"
 #include "debug.h"
+#include "rmt-wheel.h"
+#include "rmt-mark.h"
+#include "rmt-bp.h"
+#include "rmt-voq.h"
+#include "rmt-check.h"
+#include "rmt-conf.h"
+#include "rmt-pool.h"
+#include "rmt-group.h"
 
 /*
 typedef unsigned char u8;
@@ -25,6 +42,7 @@ typedef signed long long s64;
 typedef struct list_head list_h;
 typedef struct pdu * pdu_p;
 typedef struct rmt_n1_port * port_p;
+typedef pdu_p (* dequeue_f)(struct rmt_ps * ps, port_p P);
 
 /// Data structures
 
@@ -32,26 +50,47 @@ typedef struct q_entry_s {
 	list_h L;
 	pdu_p data;
 	u32 cost; // PDU + headers cost
+	u32 len; // PDU length in bytes
+	atomic_t * pool; // Shared buffer counter charged by this PDU, if any
+	u8 module; // Policer holding the PDU while on the pacing wheel
+	const struct rmt_mark * mark; // ECN marking at dequeue from the mux, of the QoS while in a policer, NULL -> none
+	u64 enq_ns; // Mux enqueue time for sojourn marking, 0 -> not stamped
+	u64 deadline; // Discard time in ns, 0 -> never
+	struct rmt_wheel_node W; // Pacing wheel node
 } q_entry;
 
 typedef struct policer_c_t {	
 	u8 next_module; //* Module towards where forward PDUs. N > 0 -> ps[N-1], else Mux
 	u8 urgency_level; //* Urgency level of the ps (Only if next < 0)
-	u16 cherish_th; //* Cherish thresold of the ps (Only if next < 0)
-	u16 ecn_th; //* ECN thresold of the ps (Only if next < 0)
-	u16 max_count; //* Max amount of PDUs admited
+	u32 cherish_th; //* Cherish thresold of the ps (Only if next < 0)
+	u32 ecn_th; //* ECN thresold of the ps (Only if next < 0, 0 -> marking of the QoS)
+	u32 max_count; //* Max amount of PDUs admited
+	u32 cherish_bytes; //* Cherish thresold in bytes (Only if next < 0, 0 -> unlimited)
+	u32 ecn_bytes; //* ECN thresold in bytes (Only if next < 0, 0 -> unlimited)
+	u32 max_bytes; //* Max amount of bytes admited (0 -> unlimited)
+	u16 gain_pct; //* Credits gain as % of the measured port rate (0 -> use gain_us)
 	u64 gain_us; //* Credits gain each us
 	u64 max_credits; //* Max amount of accumulated credits
+	u16 overhead; //* Bytes added per PDU by the layer it models, instead of header_weight
+	u8 bytecost; //* Credit cost per byte, 0 -> global bytecost
+	u16 cell; //* Payload bytes per cell, 0 -> no cell rounding
+	u16 cell_bytes; //* Wire bytes per cell, 0 -> cell
+	u8 own_cost; // Some of the above is set, else the PDU cost of the port
+	u32 unit_cost; // Cost per byte, or per cell if cell
+	struct reciprocal_value cell_r; // Divides by cell
 } policer_c;
 
 typedef struct policer_d_t {
 	list_h Q; // PS queue of q_entry (not part of list of ps_data_t)
-	u16 count; // Amount of PDUs stored
+	u32 count; // Amount of PDUs stored
+	u32 bytes; // Amount of bytes stored
 	s64 credits; // Amount of accumulated credits
+	u64 gain_us; // Calibrated credits gain each us (0 -> use policer_c gain_us)
+	u64 next_edt; // Earliest departure time of the next PDU in ns (pacing)
 } policer_d;
 
 typedef struct queue_t {
-	u16 count; // Amount of PDUs stored
+	u32 count; // Amount of PDUs stored
 } queue;
 
 typedef struct qos2module_t {
@@ -59,49 +98,142 @@ typedef struct qos2module_t {
 	qos_id_t qos_id;
 	u8 next_module;
 	u8 def_urgency; // Level of urgency
-	u16 def_cherish_th; // Level of cherish
-	u16 def_ecn_th; // Level of cherish
+	u32 def_cherish_th; // Level of cherish
+	struct rmt_mark mark; // ECN marking on the mux
+	u32 def_cherish_bytes; // Level of cherish in bytes (0 -> unlimited)
+	u32 def_ecn_bytes; // Level of ECN in bytes (0 -> unlimited)
+	u16 reserved; // Reserved slots of the shared buffer
+	atomic_t reserved_used;
+	u32 max_sojourn_us; // Lifetime of the PDUs in the port (0 -> unlimited)
+	u8 own; // Added after creation, allocated apart from the config block
 } qos2module;
 
+// Queue state (policers and Qs) is a single block allocated on the first
+// enqueue and released after idle_us without traffic (see f_port_layout)
 typedef struct port_instance_t {
-	list_h L;
-	port_p P;
+	// Hot state, used on every enqueue/dequeue (first cacheline)
 	struct timespec lastT;	// "Time" of last call
-	policer_d * policers; // ps modules, len == eqta_config.num_ps
-	list_h * Qs; // Urgency queues in the mux, len == eqta_config.levels_urgency
-	u16 mux_count; // Amount of PDUs waiting on the mux queues
-	u16 count; // Amount of PDUs waiting on all port queues
-	u16 max_count; // Max amount of PDUs waiting on all port queues
+	policer_d * policers; // ps modules, len == eqta_config.num_ps, NULL if idle
+	list_h * Qs; // Urgency queues in the mux, len == eqta_config.levels_urgency, NULL if idle
+	struct rmt_wheel * wheel; // Pacing wheel, NULL if idle or pacing disabled
+	u32 cal_last_cost; // Cost of the last PDU served with more waiting on the mux
+	u32 cal_us; // Back-to-back service time measured in the current window
+	u32 mux_count; // Amount of PDUs waiting on the mux queues
+	u32 count; // Amount of PDUs waiting on all port queues
+	u32 mux_bytes; // Amount of bytes waiting on the mux queues
+	u32 bytes; // Amount of bytes waiting on all port queues
+	
+	// Cold state
+	list_h L ____cacheline_aligned_in_smp;
+	port_p P;
+	struct rmt_group * group; // Port group sharing its credits, NULL if none, only read with a group
+	u64 cal_credits; // Credits served back-to-back in the current window
+	u64 rate; // Measured drain rate in credits per second (0 -> not calibrated)
+	u64 last_sweep; // Time of the last expired PDU sweep in ns
+	u64 expired; // PDUs discarded past their deadline
+	u8 bp_paused; // Backpressure asserted
+	u8 age_idx; // Next lower urgency queue probed by the aging guard
+	u64 age_next; // Earliest time of the next aged PDU in ns
+	u64 aged; // PDUs served past age_us ahead of more urgent queues
 } port_instance;
 
 typedef struct base_config_t {
-	u8 state;
+	u8 state; // 1 -> started, parameters are then set one by one; 2 -> staged parameters invalid
 	u8 headers_weight; //* Extra weight of headers
 	u8 num_policers; //*2 Number of ps in the module
 	u8 levels_urgency; //*1 Levels of urgency
 	u8 bytecost; // credit cost per byte
-	u16 max_count; //* Max ocupation on mux
-	u16 global_max_count; //* Max ocupation on port
-	u16 buffer_size; //* Size of buffer of q_entries
+	u32 max_count; //* Max ocupation on mux
+	u32 global_max_count; //* Max ocupation on port
+	u32 global_max_bytes; //* Max ocupation on port in bytes, 0 -> unlimited
+	u32 cal_window_us; //* Rate calibration window, 0 -> calibration disabled
+	int numa_node; //* NUMA node for port instances, NUMA_NO_NODE -> local
+	u32 idle_us; //* Release queue state of ports idle this long, 0 -> never
+	u32 shared_size; //* Shared buffer in PDUs, 0 -> static global_max_count per port
+	u16 dt_alpha; //* Dynamic threshold, % of the free shared buffer a port may take
+	atomic_t shared_used; // PDUs held in the shared buffer
+	u32 state_size; // Size of the port queue state block
+	u32 state_off_qs; // Offset of the urgency queues in the block
+	u32 state_off_wheel; // Offset of the pacing wheel in the block
+	u32 pace_gran_us; //* Pacing wheel slot, 0 -> token-bucket shaping
+	u32 voq_size; //* Per destination queues per urgency level, 0 -> one FIFO per level
+	u32 state_off_voq; // Offset of the destination queue sets in the block
+	u32 voq_set_size; // Size of one destination queue set
+	u8 lifetimes; // Some QoS has a max_sojourn_us
+	u32 sweep_us; //* Period of the expired PDU sweep, 0 -> only at queue heads
+	struct rmt_bp_conf bp; //* Backpressure watermarks on the port count
+	u8 cut_through; //* Send PDUs found with an empty port at once
+	u32 age_us; //* Head of line age that gets a mux queue served, 0 -> strict urgency
+	u32 age_rate; //* Aged PDUs served per second per port, 0 -> unbounded
+	struct rmt_mark def_mark; //* ECN marking of unmapped QoS, template of new qos mappings
 	policer_c * policers; // Configuration of policer/shaper modules, len == num_ps
-	list_h buffer; //* Buffer of q_entries
+	struct rmt_group * groups; //* Port groups, len == num_groups
+	u8 num_groups;
+	void * conf_block; // Policers, QoS mappings and port groups set at creation, one allocation
+	struct rmt_conf_stage pending; // Parameters set before the first port, created without an RMT
+	struct rmt_pool buffer; //* Buffer of q_entries, sized from the demand
 	list_h qos2modules; // List mapping QoS_id to ps index
 	list_h port_instances; // List storing port instances
+	spinlock_t port_lock; // Protects port_instances against the idle sweep
+	struct delayed_work idle_work; // Idle port sweep
 } base_config;
 
 /* Function headers */
 
 static struct ps_base * f_policy_create(struct rina_component * component);
+struct ps_factory * rmt_eqta_ps_factory(void);
+int rmt_eqta_check_failed(void);
 static void f_policy_destroy(struct ps_base * bps);
 
 void * f_rmt_q_create_policy(struct rmt_ps *ps, port_p P);
 int f_rmt_q_destroy_policy(struct rmt_ps *ps, port_p P);
 int f_rmt_enqueue_policy(struct rmt_ps *ps, port_p P, pdu_p pdu_i);
 pdu_p f_rmt_dequeue_policy(struct rmt_ps *ps, port_p P);
+static dequeue_f f_dequeue_select(base_config * conf);
 
 static int f_set_policy_set_param(struct ps_base * bps, const char * name, const char * value);
-static int f_policy_base_config_apply(struct policy_parm * param, void * data);
 
 static int f_policy_set_param_pv(base_config * data, const char * name, const char * value);
 
 void f_free_port_instance(base_config * conf, port_instance * port_i);
+static void f_port_calibrate(base_config * conf, port_instance * port_i, int T, u32 cost);
+static void f_port_layout(base_config * conf);
+static void f_port_set_gains(base_config * conf, port_instance * port_i);
+static int f_port_activate(base_config * conf, port_instance * port_i);
+static void f_port_compact(port_instance * port_i);
+static void f_idle_sweep(struct work_struct * work);
+static atomic_t * f_shared_admit(base_config * conf, port_instance * port_i, qos2module * qos_i);
+static void f_shared_release(q_entry * entry_i);
+static void f_pace_stamp(base_config * conf, port_instance * port_i, q_entry * entry_i, u8 module, u64 now);
+static void f_pace_release(base_config * conf, port_instance * port_i);
+static void f_entry_drop(base_config * conf, port_instance * port_i, q_entry * entry_i);
+static struct rmt_voq_set * f_mux_voq(base_config * conf, port_instance * port_i, u8 urgency);
+static list_h * f_mux_push(base_config * conf, port_instance * port_i, u8 urgency, q_entry * entry_i);
+static q_entry * f_mux_pop(base_config * conf, port_instance * port_i, u8 urgency);
+int rmt_eqta_bp_register(struct notifier_block * nb);
+int rmt_eqta_bp_unregister(struct notifier_block * nb);
+static bool f_cut_through(base_config * conf, port_instance * port_i, u8 module, u32 len);
+static void f_entry_expire(base_config * conf, port_instance * port_i, q_entry * entry_i);
+static void f_expire_sweep(base_config * conf, port_instance * port_i, u64 now);
+static u32 f_mark_value(port_instance * port_i, const struct rmt_mark * mark, q_entry * entry_i, u64 now);
+static void f_policer_mark(policer_c * psh_c, port_instance * port_i, q_entry * entry_i, list_h * head);
+static void f_check_port(base_config * conf, port_instance * port_i);
+static int f_conf_load(base_config * conf, struct policy * policy);
+static int f_conf_load_stage(base_config * conf, const struct rmt_conf_stage * stage);
+static int f_conf_load_pending(struct rmt_ps * ps, base_config * conf);
+static void f_conf_start(struct rmt_ps * ps, base_config * conf);
+static bool f_conf_indexed(const char * name);
+static int f_conf_apply_one(base_config * conf, const struct rmt_conf_param * param);
+static int f_conf_apply(base_config * conf, const struct rmt_conf_param * param);
+static int f_conf_alloc(base_config * conf, const struct rmt_conf_ids * qos_ids, const struct rmt_conf_ids * group_ids);
+static int f_conf_validate(base_config * conf);
+static int f_conf_check_chains(base_config * conf);
+static void f_conf_free(base_config * conf);
+static void f_qos2module_init(base_config * conf, qos2module * qos2module_i, u8 qos_id);
+static qos2module * f_qos2module_get(base_config * conf, u8 qos_id);
+static q_entry * f_mux_peek(base_config * conf, port_instance * port_i, u8 urgency);
+static u8 f_age_pick(base_config * conf, port_instance * port_i, u64 now);
+static struct rmt_group * f_group_get(base_config * conf, u16 id);
+static void f_conf_costs(base_config * conf);
+static inline u32 f_policer_cost(const policer_c * psh_c, u32 len, u32 cost);
+static bool f_group_admit(port_instance * port_i, u64 * now);
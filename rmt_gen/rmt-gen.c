@@ -0,0 +1,780 @@
+//rmt-gen.c
+#define RINA_PREFIX "rmt-gen"
+
+#include "rmt-gen.h"
+
+MODULE_DESCRIPTION("RMT policy set traffic generator");
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Sergio Leon <gaixas1@gmail.com>");
+
+/*
+	Benchmark of the RMT policy sets without an IPCP nor real N-1 flows.
+	The generator builds one instance of a policy set through its factory,
+	attaches synthetic ports to it and runs one kernel thread per CPU that
+	enqueues bursts of DT PDUs into its ports and drains them, measuring the
+	cycles of every enqueue and dequeue call.
+
+	Configured and run through /proc/rmt_gen, one command per write:
+		ps rmt-eqta-ps          policy set under test
+		threads 4               worker threads, bound round robin to CPUs
+		ports 8                 synthetic ports per thread
+		pdus 10000000           PDUs per thread
+		burst 32                PDUs enqueued on a port before draining it
+		dests 16                destination addresses, round robin
+		size 64:7,576:4,1500:1  PDU sizes and their relative weights
+		qos 1,2,3               QoS ids, chosen at random
+		param name value        policy set parameter, "param clear" drops all
+		mode random             random bursts and ports, partial drains
+		mode txq                threads share the ports, see below
+		max_p99 2000            fail above this p99 of cycles per call
+		min_kpps 5000           fail below this rate
+		run                     runs the test, returns once it ends
+	Reading the file shows the configuration and the results of the last run.
+	A run that fails its checks returns -ERANGE, so scripts can stop on
+	correctness (with policy sets built with RMT_CHECK=1, see rmt-check.h)
+	and performance regressions.
+
+	The txq mode drives a port from several CPUs as a multi-queue N-1 port
+	would. It needs rmt-be-ps with its shards parameter set to the number
+	of threads: all threads enqueue into the ports of the first one under
+	the port lock, and thread i then drains TX queue i of the port through
+	rmt_be_dequeue_txq without it. PDUs left in the TX queue of a thread
+	that already ended are freed with the ports and not counted.
+*/
+
+// Policy sets the generator knows, by their published name
+static const struct gen_ps gen_ps_list[] = {
+	{ "rmt-be-ps", "rmt_be_ps_factory", "rmt_be_check_failed" },
+	{ "rmt-eqta-ps", "rmt_eqta_ps_factory", "rmt_eqta_check_failed" },
+	{ "rmt-rlim-ps", "rmt_rlim_ps_factory", "rmt_rlim_check_failed" },
+	{ "rmt-pie-ps", "rmt_pie_ps_factory", "rmt_pie_check_failed" },
+	{ "rmt-wfq-ps", "rmt_wfq_ps_factory", "rmt_wfq_check_failed" },
+	{ NULL, NULL, NULL },
+};
+
+static DEFINE_MUTEX(gen_lock); // Serialises commands and runs
+static struct gen_config gen_conf;
+static struct gen_result gen_last;
+static int gen_last_ret = 1; // 1 -> never run
+
+/// Run
+
+static struct ps_factory * f_gen_factory_get(const char * name, const struct gen_ps ** entry) {
+	const struct gen_ps * ps_i;
+	struct ps_factory * (* get)(void);
+
+	for(ps_i = gen_ps_list; ps_i->name; ps_i++) {
+		if(strcmp(ps_i->name, name) == 0) {
+			get = __symbol_get(ps_i->getter);
+			if(!get) {
+				LOG_ERR("Policy set %s is not loaded", name);
+				return NULL;
+			}
+			*entry = ps_i;
+			return get();
+		}
+	}
+	LOG_ERR("Unknown policy set %s", name);
+	return NULL;
+}
+
+static int f_gen_run(struct gen_config * conf, struct gen_result * res) {
+	struct ps_factory * factory;
+	const struct gen_ps * entry;
+	const char * getter;
+	int (* check_failed)(void);
+	int failed;
+	struct ps_base * base;
+	struct rmt_ps * ps;
+	struct gen_param * param_i;
+	struct gen_thread * threads, * thread_i;
+	struct rmt_n1_port * P;
+	struct pdu * (* dequeue_txq)(struct rmt_ps * ps, struct rmt_n1_port * P, uint_t txq);
+	uint_t i, j, k;
+	u64 start;
+	int ret;
+
+	factory = f_gen_factory_get(conf->ps_name, &entry);
+	if(!factory) {
+		return -ENOENT;
+	}
+	getter = entry->getter;
+	dequeue_txq = NULL;
+	if(conf->txq) {
+		if(strcmp(conf->ps_name, GEN_TXQ_PS) == 0) {
+			dequeue_txq = __symbol_get(GEN_TXQ_DEQUEUE);
+		}
+		if(!dequeue_txq) {
+			LOG_ERR("Mode txq needs %s, %s has no TX queues", GEN_TXQ_PS, conf->ps_name);
+			__symbol_put(getter);
+			return -EINVAL;
+		}
+	}
+	base = factory->create(NULL);
+	if(!base) {
+		LOG_ERR("Could not create an instance of %s", conf->ps_name);
+		__symbol_put(getter);
+		return -ENOMEM;
+	}
+	ps = container_of(base, struct rmt_ps, base);
+
+	/*
+		There is no RMT to hand the parameters to the factory, they are all
+		given before the first port: the policy sets created without an RMT
+		stage them and load them there as a creation would, including the
+		ones that fix their structure (policers, levels, pacing...).
+	*/
+	ret = 0;
+	list_for_each_entry(param_i, &conf->params, L) {
+		if(!base->set_policy_set_param || base->set_policy_set_param(base, param_i->name, param_i->value)) {
+			LOG_ERR("%s rejected parameter %s = %s", conf->ps_name, param_i->name, param_i->value);
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	threads = NULL;
+	if(!ret) {
+		threads = rkzalloc(sizeof(struct gen_thread) * conf->threads, GFP_KERNEL);
+		if(!threads) {
+			ret = -ENOMEM;
+		}
+	}
+
+	// Synthetic ports, as the RMT sets them up for a new N-1 flow
+	for(i = 0; !ret && i < conf->threads; i++) {
+		thread_i = &threads[i];
+		thread_i->ps = ps;
+		thread_i->conf = conf;
+		thread_i->cpu = i % num_online_cpus();
+		thread_i->txq = i;
+		thread_i->dequeue_txq = dequeue_txq;
+		init_completion(&thread_i->done);
+		if(conf->txq && i) {
+			thread_i->ports = threads[0].ports;
+			continue;
+		}
+		thread_i->ports = rkzalloc(sizeof(struct rmt_n1_port *) * conf->ports, GFP_KERNEL);
+		if(!thread_i->ports) {
+			ret = -ENOMEM;
+			break;
+		}
+		for(j = 0; j < conf->ports; j++) {
+			P = rkzalloc(sizeof(struct rmt_n1_port), GFP_KERNEL);
+			if(!P) {
+				ret = -ENOMEM;
+				break;
+			}
+			thread_i->ports[j] = P;
+			spin_lock_init(&P->lock);
+			P->port_id = i * conf->ports + j;
+			P->state = N1_PORT_STATE_ENABLED;
+			P->rmt_ps_queues = ps->rmt_q_create_policy(ps, P);
+			if(!P->rmt_ps_queues) {
+				LOG_ERR("%s could not create the queues of port %d", conf->ps_name, P->port_id);
+				ret = -ENOMEM;
+				break;
+			}
+		}
+	}
+
+	// Threads are created first so none starts before all can run
+	for(i = 0; !ret && i < conf->threads; i++) {
+		thread_i = &threads[i];
+		thread_i->task = kthread_create(f_gen_thread, thread_i, "rmt_gen/%u", i);
+		if(IS_ERR(thread_i->task)) {
+			ret = PTR_ERR(thread_i->task);
+			for(k = 0; k < i; k++) {
+				kthread_stop(threads[k].task);
+			}
+			break;
+		}
+		kthread_bind(thread_i->task, thread_i->cpu);
+	}
+
+	// Exported by every policy set, failed invariants are counted with RMT_CHECK=1 only
+	check_failed = NULL;
+	failed = 0;
+	if(!ret) {
+		check_failed = __symbol_get(entry->checks);
+		if(check_failed) {
+			failed = check_failed();
+		}
+		start = ktime_get_ns();
+		for(i = 0; i < conf->threads; i++) {
+			wake_up_process(threads[i].task);
+		}
+		for(i = 0; i < conf->threads; i++) {
+			wait_for_completion(&threads[i].done);
+		}
+		memset(res, 0, sizeof(struct gen_result));
+		res->ns = ktime_get_ns() - start;
+		for(i = 0; i < conf->threads; i++) {
+			thread_i = &threads[i];
+			res->enq += thread_i->res.enq;
+			res->sent += thread_i->res.sent;
+			res->dropped += thread_i->res.dropped;
+			res->errors += thread_i->res.errors;
+			res->deq += thread_i->res.deq;
+			res->ops += thread_i->res.ops;
+			res->cycles += thread_i->res.cycles;
+			for(k = 0; k < GEN_LAT_BUCKETS; k++) {
+				res->lat[k] += thread_i->res.lat[k];
+			}
+		}
+		// Counted, the warning of a check fires only once per boot
+		if(check_failed) {
+			if(check_failed() != failed) {
+				res->failed |= GEN_FAIL_WARN;
+			}
+			__symbol_put(entry->checks);
+		}
+		ret = f_gen_verdict(conf, res);
+	}
+
+	// In txq mode the ports belong to the first thread
+	for(i = 0; threads && i < (conf->txq ? 1 : conf->threads); i++) {
+		thread_i = &threads[i];
+		for(j = 0; thread_i->ports && j < conf->ports; j++) {
+			P = thread_i->ports[j];
+			if(!P) {
+				continue;
+			}
+			if(P->rmt_ps_queues) {
+				ps->rmt_q_destroy_policy(ps, P);
+			}
+			rkfree(P);
+		}
+		if(thread_i->ports) {
+			rkfree(thread_i->ports);
+		}
+	}
+	if(threads) {
+		rkfree(threads);
+	}
+	factory->destroy(base);
+	if(dequeue_txq) {
+		__symbol_put(GEN_TXQ_DEQUEUE);
+	}
+	__symbol_put(getter);
+	return ret;
+}
+
+static int f_gen_thread(void * data) {
+	struct gen_thread * thread_i = data;
+	struct gen_config * conf = thread_i->conf;
+	struct rmt_n1_port * P;
+	u64 n;
+	uint_t p, b, burst;
+
+	p = 0;
+	for(n = 0; n < conf->pdus && !kthread_should_stop(); n += burst) {
+		burst = min_t(u64, conf->burst, conf->pdus - n);
+		if(conf->random) {
+			burst = 1 + prandom_u32() % burst;
+			P = thread_i->ports[prandom_u32() % conf->ports];
+		} else {
+			P = thread_i->ports[p];
+			p = (p + 1) % conf->ports;
+		}
+		// PDUs are built outside the lock, allocation is not measured
+		for(b = 0; b < burst; b++) {
+			thread_i->batch[b] = f_gen_pdu(thread_i, n + b);
+		}
+
+		spin_lock_bh(&P->lock);
+		f_gen_enqueue(thread_i, P, burst);
+		// Random mode leaves PDUs queued from one round to the next
+		if(!conf->txq) {
+			f_gen_dequeue(thread_i, P, conf->random ? prandom_u32() % (conf->burst + 1) : UINT_MAX);
+		}
+		spin_unlock_bh(&P->lock);
+		if(conf->txq) {
+			f_gen_dequeue_txq(thread_i, P);
+		}
+
+		cond_resched();
+	}
+
+	for(p = 0; conf->random && p < conf->ports; p++) {
+		P = thread_i->ports[p];
+		spin_lock_bh(&P->lock);
+		f_gen_dequeue(thread_i, P, UINT_MAX);
+		spin_unlock_bh(&P->lock);
+	}
+	for(p = 0; conf->txq && p < conf->ports; p++) {
+		f_gen_dequeue_txq(thread_i, thread_i->ports[p]);
+	}
+
+	complete_and_exit(&thread_i->done, 0);
+	return 0;
+}
+
+// Enqueue the first burst PDUs of the batch, with the port lock held
+static void f_gen_enqueue(struct gen_thread * thread_i, struct rmt_n1_port * P, uint_t burst) {
+	struct gen_result * res = &thread_i->res;
+	struct rmt_ps * ps = thread_i->ps;
+	struct pdu * pdu_i;
+	cycles_t c;
+	uint_t b;
+
+	for(b = 0; b < burst; b++) {
+		pdu_i = thread_i->batch[b];
+		if(!pdu_i) {
+			res->errors++;
+			continue;
+		}
+		c = get_cycles();
+		switch(ps->rmt_enqueue_policy(ps, P, pdu_i)) {
+		case RMT_PS_ENQ_SCHED:
+			f_gen_account(res, get_cycles() - c);
+			res->enq++;
+			break;
+#ifdef RMT_PS_ENQ_SEND
+		case RMT_PS_ENQ_SEND:
+			f_gen_account(res, get_cycles() - c);
+			res->sent++;
+			pdu_destroy(pdu_i);
+			break;
+#endif
+		case RMT_PS_ENQ_DROP:
+			f_gen_account(res, get_cycles() - c);
+			res->dropped++;
+			break;
+		default:
+			f_gen_account(res, get_cycles() - c);
+			res->errors++;
+		}
+	}
+}
+
+// Dequeue up to max PDUs or until the port returns none, with the port lock held
+static void f_gen_dequeue(struct gen_thread * thread_i, struct rmt_n1_port * P, uint_t max) {
+	struct gen_result * res = &thread_i->res;
+	struct rmt_ps * ps = thread_i->ps;
+	struct pdu * pdu_i;
+	cycles_t c;
+
+	for(; max > 0; max--) {
+		c = get_cycles();
+		pdu_i = ps->rmt_dequeue_policy(ps, P);
+		f_gen_account(res, get_cycles() - c);
+		if(!pdu_i) {
+			return;
+		}
+		res->deq++;
+		pdu_destroy(pdu_i);
+	}
+}
+
+// Drain the TX queue of the thread, without the port lock
+static void f_gen_dequeue_txq(struct gen_thread * thread_i, struct rmt_n1_port * P) {
+	struct gen_result * res = &thread_i->res;
+	struct pdu * pdu_i;
+	cycles_t c;
+
+	for(;;) {
+		c = get_cycles();
+		pdu_i = thread_i->dequeue_txq(thread_i->ps, P, thread_i->txq);
+		f_gen_account(res, get_cycles() - c);
+		if(!pdu_i) {
+			return;
+		}
+		res->deq++;
+		pdu_destroy(pdu_i);
+	}
+}
+
+static struct pdu * f_gen_pdu(struct gen_thread * thread_i, u64 n) {
+	struct gen_config * conf = thread_i->conf;
+	struct pdu * pdu_i;
+	struct buffer * buffer_i;
+	struct pci * pci_i;
+	address_t dst;
+	qos_id_t qos;
+	uint_t size, r, i;
+
+	r = prandom_u32() % conf->weight_sum;
+	for(i = 0; r >= conf->weight[i]; i++) {
+		r -= conf->weight[i];
+	}
+	size = conf->size[i];
+	qos = conf->qos[prandom_u32() % conf->num_qos];
+	dst = 2 + do_div(n, conf->dests); // Address 1 is the generator
+
+	pdu_i = pdu_create();
+	if(!pdu_i) {
+		return NULL;
+	}
+	buffer_i = buffer_create(size);
+	if(!buffer_i) {
+		pdu_destroy(pdu_i);
+		return NULL;
+	}
+	if(pdu_buffer_set(pdu_i, buffer_i)) {
+		buffer_destroy(buffer_i);
+		pdu_destroy(pdu_i);
+		return NULL;
+	}
+	pci_i = pci_create();
+	if(!pci_i) {
+		pdu_destroy(pdu_i);
+		return NULL;
+	}
+	if(pci_format(pci_i, 1, 1, 1, dst, thread_i->seq++, qos, PDU_TYPE_DT) || pdu_pci_set(pdu_i, pci_i)) {
+		pci_destroy(pci_i);
+		pdu_destroy(pdu_i);
+		return NULL;
+	}
+	return pdu_i;
+}
+
+/// Results
+
+static void f_gen_account(struct gen_result * res, cycles_t cycles) {
+	uint_t b;
+
+	res->ops++;
+	res->cycles += cycles;
+	b = cycles ? ilog2(cycles) : 0;
+	if(b >= GEN_LAT_BUCKETS) {
+		b = GEN_LAT_BUCKETS - 1;
+	}
+	res->lat[b]++;
+}
+
+// Upper bound, in cycles, of the bucket holding the permille-th call
+static u64 f_gen_percentile(struct gen_result * res, uint_t permille) {
+	u64 target, acc;
+	uint_t i;
+
+	target = div_u64(res->ops * permille, 1000);
+	acc = 0;
+	for(i = 0; i < GEN_LAT_BUCKETS - 1; i++) {
+		acc += res->lat[i];
+		if(acc > target) {
+			break;
+		}
+	}
+	return 2ULL << i;
+}
+
+/*
+	Checks of a finished run. PDUs queued but never dequeued may have been
+	dropped inside the policy set (AQM, lifetimes) or still be paced, so
+	only the opposite is an error. Thresholds let scripts fail on
+	performance regressions; the p99 is the upper bound of its log2 bucket.
+	Returns -ERANGE if any check failed, the results stay readable.
+*/
+static int f_gen_verdict(struct gen_config * conf, struct gen_result * res) {
+	u64 kpps;
+
+	if(res->deq > res->enq) {
+		res->failed |= GEN_FAIL_COUNT;
+	}
+	if(conf->max_p99 && f_gen_percentile(res, 990) > conf->max_p99) {
+		res->failed |= GEN_FAIL_P99;
+	}
+	kpps = res->ns ? div64_u64((res->deq + res->sent) * 1000000ULL, res->ns) : 0;
+	if(conf->min_kpps && kpps < conf->min_kpps) {
+		res->failed |= GEN_FAIL_RATE;
+	}
+	return res->failed ? -ERANGE : 0;
+}
+
+/// Configuration
+
+static void f_gen_params_clear(struct gen_config * conf) {
+	struct gen_param * param_i, * param_n;
+
+	list_for_each_entry_safe(param_i, param_n, &conf->params, L) {
+		list_del(&param_i->L);
+		rkfree(param_i);
+	}
+}
+
+static int f_gen_set(struct gen_config * conf, char * cmd) {
+	struct gen_param * param_i;
+	char * name, * arg, * item, * weight;
+	uint_t v, num, sum;
+	u64 v64;
+	uint_t size[GEN_MAX_SIZES], w[GEN_MAX_SIZES];
+	qos_id_t qos[GEN_MAX_QOS];
+
+	name = strsep(&cmd, " \t");
+	arg = cmd ? strim(cmd) : "";
+
+	if(strcmp(name, "ps") == 0) {
+		if(!*arg || strlen(arg) >= GEN_NAME_LEN) {
+			return -EINVAL;
+		}
+		strlcpy(conf->ps_name, arg, GEN_NAME_LEN);
+		return 0;
+	}
+	if(strcmp(name, "pdus") == 0) {
+		if(kstrtou64(arg, 10, &v64) || !v64) {
+			return -EINVAL;
+		}
+		conf->pdus = v64;
+		return 0;
+	}
+	if(strcmp(name, "mode") == 0) {
+		if(strcmp(arg, "burst") == 0) {
+			conf->random = 0;
+			conf->txq = 0;
+		} else if(strcmp(arg, "random") == 0) {
+			conf->random = 1;
+			conf->txq = 0;
+		} else if(strcmp(arg, "txq") == 0) {
+			conf->random = 0;
+			conf->txq = 1;
+		} else {
+			return -EINVAL;
+		}
+		return 0;
+	}
+	if(strcmp(name, "max_p99") == 0) {
+		if(kstrtou64(arg, 10, &v64)) {
+			return -EINVAL;
+		}
+		conf->max_p99 = v64;
+		return 0;
+	}
+	if(strcmp(name, "min_kpps") == 0) {
+		if(kstrtou64(arg, 10, &v64)) {
+			return -EINVAL;
+		}
+		conf->min_kpps = v64;
+		return 0;
+	}
+	if(strcmp(name, "threads") == 0) {
+		if(kstrtouint(arg, 10, &v) || !v || v > GEN_MAX_THREADS) {
+			return -EINVAL;
+		}
+		conf->threads = v;
+		return 0;
+	}
+	if(strcmp(name, "ports") == 0) {
+		if(kstrtouint(arg, 10, &v) || !v) {
+			return -EINVAL;
+		}
+		conf->ports = v;
+		return 0;
+	}
+	if(strcmp(name, "burst") == 0) {
+		if(kstrtouint(arg, 10, &v) || !v || v > GEN_MAX_BURST) {
+			return -EINVAL;
+		}
+		conf->burst = v;
+		return 0;
+	}
+	if(strcmp(name, "dests") == 0) {
+		if(kstrtouint(arg, 10, &v) || !v) {
+			return -EINVAL;
+		}
+		conf->dests = v;
+		return 0;
+	}
+	if(strcmp(name, "size") == 0) {
+		num = 0;
+		sum = 0;
+		while((item = strsep(&arg, ",")) != NULL) {
+			if(num == GEN_MAX_SIZES) {
+				return -EINVAL;
+			}
+			weight = strchr(item, ':');
+			if(weight) {
+				*weight++ = '\0';
+				if(kstrtouint(weight, 10, &w[num]) || !w[num]) {
+					return -EINVAL;
+				}
+			} else {
+				w[num] = 1;
+			}
+			if(kstrtouint(item, 10, &size[num]) || !size[num]) {
+				return -EINVAL;
+			}
+			sum += w[num];
+			num++;
+		}
+		if(!num) {
+			return -EINVAL;
+		}
+		memcpy(conf->size, size, sizeof(uint_t) * num);
+		memcpy(conf->weight, w, sizeof(uint_t) * num);
+		conf->num_sizes = num;
+		conf->weight_sum = sum;
+		return 0;
+	}
+	if(strcmp(name, "qos") == 0) {
+		num = 0;
+		while((item = strsep(&arg, ",")) != NULL) {
+			if(num == GEN_MAX_QOS || kstrtouint(item, 10, &v)) {
+				return -EINVAL;
+			}
+			qos[num++] = v;
+		}
+		if(!num) {
+			return -EINVAL;
+		}
+		memcpy(conf->qos, qos, sizeof(qos_id_t) * num);
+		conf->num_qos = num;
+		return 0;
+	}
+	if(strcmp(name, "param") == 0) {
+		if(strcmp(arg, "clear") == 0) {
+			f_gen_params_clear(conf);
+			return 0;
+		}
+		item = strsep(&arg, " \t");
+		if(!arg || !*item || strlen(item) >= GEN_NAME_LEN) {
+			return -EINVAL;
+		}
+		arg = strim(arg);
+		if(!*arg || strlen(arg) >= GEN_NAME_LEN) {
+			return -EINVAL;
+		}
+		param_i = rkzalloc(sizeof(struct gen_param), GFP_KERNEL);
+		if(!param_i) {
+			return -ENOMEM;
+		}
+		strlcpy(param_i->name, item, GEN_NAME_LEN);
+		strlcpy(param_i->value, arg, GEN_NAME_LEN);
+		list_add_tail(&param_i->L, &conf->params);
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/// Proc file
+
+static int f_gen_show(struct seq_file * m, void * v) {
+	struct gen_config * conf = &gen_conf;
+	struct gen_result * res = &gen_last;
+	struct gen_param * param_i;
+	u64 pdus, mpps;
+	uint_t i;
+
+	mutex_lock(&gen_lock);
+	seq_printf(m, "ps %s\nmode %s\nthreads %u\nports %u\npdus %llu\nburst %u\ndests %u\n",
+		conf->ps_name, conf->txq ? "txq" : conf->random ? "random" : "burst",
+		conf->threads, conf->ports, conf->pdus, conf->burst, conf->dests);
+	seq_printf(m, "max_p99 %llu\nmin_kpps %llu\n", conf->max_p99, conf->min_kpps);
+	seq_puts(m, "size ");
+	for(i = 0; i < conf->num_sizes; i++) {
+		seq_printf(m, "%s%u:%u", i ? "," : "", conf->size[i], conf->weight[i]);
+	}
+	seq_puts(m, "\nqos ");
+	for(i = 0; i < conf->num_qos; i++) {
+		seq_printf(m, "%s%u", i ? "," : "", conf->qos[i]);
+	}
+	seq_puts(m, "\n");
+	list_for_each_entry(param_i, &conf->params, L) {
+		seq_printf(m, "param %s %s\n", param_i->name, param_i->value);
+	}
+
+	if(gen_last_ret < 0 && gen_last_ret != -ERANGE) {
+		seq_printf(m, "\nLast run failed: %d\n", gen_last_ret);
+	} else if(gen_last_ret <= 0) {
+		pdus = res->enq + res->sent + res->dropped;
+		mpps = res->ns ? div64_u64((res->deq + res->sent) * 1000000ULL, res->ns) : 0;
+		seq_printf(m, "\nenqueued %llu\nsent %llu\ndropped %llu\nerrors %llu\ndequeued %llu\n",
+			res->enq, res->sent, res->dropped, res->errors, res->deq);
+		seq_printf(m, "time %llu ns\nrate %llu.%03llu Mpps\n",
+			res->ns, div_u64(mpps, 1000), mpps - div_u64(mpps, 1000) * 1000);
+		seq_printf(m, "cycles/pdu %llu\ncycles/call %llu\n",
+			pdus ? div64_u64(res->cycles, pdus) : 0,
+			res->ops ? div64_u64(res->cycles, res->ops) : 0);
+		seq_printf(m, "call p50 < %llu\ncall p99 < %llu\ncall p99.9 < %llu\n",
+			f_gen_percentile(res, 500), f_gen_percentile(res, 990), f_gen_percentile(res, 999));
+		seq_printf(m, "check %s\n", res->failed ? "FAIL" : "PASS");
+		if(res->failed & GEN_FAIL_WARN) {
+			seq_puts(m, "  policy set invariants failed, see the kernel log\n");
+		}
+		if(res->failed & GEN_FAIL_COUNT) {
+			seq_puts(m, "  more PDUs dequeued than enqueued\n");
+		}
+		if(res->failed & GEN_FAIL_P99) {
+			seq_puts(m, "  p99 above max_p99\n");
+		}
+		if(res->failed & GEN_FAIL_RATE) {
+			seq_puts(m, "  rate below min_kpps\n");
+		}
+	}
+	mutex_unlock(&gen_lock);
+	return 0;
+}
+
+static int f_gen_open(struct inode * inode, struct file * file) {
+	return single_open(file, f_gen_show, NULL);
+}
+
+static ssize_t f_gen_write(struct file * file, const char __user * ubuf, size_t len, loff_t * off) {
+	char buf[256];
+	char * cmd;
+	int ret;
+
+	if(len >= sizeof(buf)) {
+		return -EINVAL;
+	}
+	if(copy_from_user(buf, ubuf, len)) {
+		return -EFAULT;
+	}
+	buf[len] = '\0';
+	cmd = strim(buf);
+
+	mutex_lock(&gen_lock);
+	if(strcmp(cmd, "run") == 0) {
+		LOG_INFO("Running %s: %u threads, %u ports, %llu PDUs", gen_conf.ps_name, gen_conf.threads, gen_conf.ports, gen_conf.pdus);
+		ret = f_gen_run(&gen_conf, &gen_last);
+		gen_last_ret = ret;
+	} else {
+		ret = f_gen_set(&gen_conf, cmd);
+	}
+	mutex_unlock(&gen_lock);
+
+	return ret ? ret : len;
+}
+
+static const struct file_operations gen_fops = {
+	.owner   = THIS_MODULE,
+	.open    = f_gen_open,
+	.read    = seq_read,
+	.write   = f_gen_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+/// Module
+
+static int __init mod_init(void) {
+	strlcpy(gen_conf.ps_name, "rmt-be-ps", GEN_NAME_LEN);
+	gen_conf.threads = 1;
+	gen_conf.ports = 1;
+	gen_conf.pdus = 1000000;
+	gen_conf.burst = 32;
+	gen_conf.dests = 1;
+	gen_conf.num_qos = 1;
+	gen_conf.qos[0] = 1;
+	gen_conf.num_sizes = 1;
+	gen_conf.size[0] = 1500;
+	gen_conf.weight[0] = 1;
+	gen_conf.weight_sum = 1;
+	INIT_LIST_HEAD(&gen_conf.params);
+
+	if(!proc_create(GEN_PROC_NAME, 0644, NULL, &gen_fops)) {
+		LOG_ERR("Could not create /proc/%s", GEN_PROC_NAME);
+		return -ENOMEM;
+	}
+	LOG_INFO("RMT traffic generator loaded");
+	return 0;
+}
+
+static void __exit mod_exit(void) {
+	remove_proc_entry(GEN_PROC_NAME, NULL);
+	f_gen_params_clear(&gen_conf);
+	LOG_INFO("RMT traffic generator unloaded");
+}
+
+module_init(mod_init);
+module_exit(mod_exit);
@@ -0,0 +1,123 @@
+//rmt-gen.h
+#include <linux/module.h>
+#include <linux/list.h>
+#include <linux/export.h>
+#include <linux/string.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/timex.h>
+#include <linux/cpumask.h>
+#include <linux/log2.h>
+#include <linux/kernel.h>
+
+#include "logs.h"
+#include "rds/rmem.h"
+#include "rmt-ps.h"
+#include "pdu.h"
+#include "pci.h"
+#include "buffer.h"
+#include "policies.h"
+#include "debug.h"
+
+#define GEN_PROC_NAME "rmt_gen"
+#define GEN_MAX_THREADS 64
+#define GEN_MAX_QOS 16
+#define GEN_MAX_SIZES 8
+#define GEN_MAX_BURST 256
+#define GEN_LAT_BUCKETS 32 // log2 of cycles per operation
+#define GEN_NAME_LEN 64
+#define GEN_TXQ_PS "rmt-be-ps" // Only policy set with TX queues
+#define GEN_TXQ_DEQUEUE "rmt_be_dequeue_txq"
+
+// Reasons a run fails its checks
+#define GEN_FAIL_WARN 0x1 // A policy set invariant failed (RMT_CHECK builds)
+#define GEN_FAIL_COUNT 0x2 // More PDUs dequeued than enqueued
+#define GEN_FAIL_P99 0x4 // p99 of the policy calls above max_p99
+#define GEN_FAIL_RATE 0x8 // Rate below min_kpps
+
+/// Data structures
+
+// Parameter passed to the policy set before its first port
+struct gen_param {
+	struct list_head L;
+	char name[GEN_NAME_LEN];
+	char value[GEN_NAME_LEN];
+};
+
+// Policy set name -> exported factory getter and failed checks counter
+struct gen_ps {
+	const char * name;
+	const char * getter;
+	const char * checks;
+};
+
+// Test configuration, set through the proc file
+struct gen_config {
+	char ps_name[GEN_NAME_LEN];
+	uint_t threads; // Kernel threads, bound round robin to online CPUs
+	uint_t ports; // Synthetic N-1 ports per thread
+	u64 pdus; // PDUs generated per thread
+	uint_t burst; // PDUs enqueued in a row on a port before draining it
+	uint_t dests; // Destination addresses, round robin
+	uint_t num_qos;
+	qos_id_t qos[GEN_MAX_QOS]; // Chosen at random
+	uint_t num_sizes;
+	uint_t size[GEN_MAX_SIZES]; // PDU sizes in bytes
+	uint_t weight[GEN_MAX_SIZES]; // Relative frequency of each size
+	uint_t weight_sum;
+	u8 random; // Random bursts, ports and partial drains instead of burst and drain
+	u8 txq; // Threads share the ports, each drains its own TX queue without the port lock
+	u64 max_p99; // Fail above this p99 of cycles per call, 0 -> no limit
+	u64 min_kpps; // Fail below this rate, 0 -> no limit
+	struct list_head params;
+};
+
+// Counters of a run
+struct gen_result {
+	u64 enq; // RMT_PS_ENQ_SCHED
+	u64 sent; // RMT_PS_ENQ_SEND, cut-through
+	u64 dropped; // RMT_PS_ENQ_DROP
+	u64 errors; // RMT_PS_ENQ_ERR and PDU allocation failures
+	u64 deq; // PDUs returned by the dequeue
+	u64 ops; // Policy calls measured
+	u64 cycles; // Cycles spent in policy calls
+	u64 ns; // Wall time of the run
+	u64 lat[GEN_LAT_BUCKETS]; // Policy calls by log2 cycles
+	u32 failed; // GEN_FAIL_* of the checks not passed
+};
+
+// Worker thread
+struct gen_thread {
+	struct task_struct * task;
+	struct rmt_ps * ps;
+	struct rmt_n1_port ** ports;
+	struct gen_config * conf;
+	struct gen_result res;
+	struct completion done;
+	seq_num_t seq;
+	int cpu;
+	uint_t txq; // TX queue drained in txq mode
+	struct pdu * (* dequeue_txq)(struct rmt_ps * ps, struct rmt_n1_port * P, uint_t txq);
+	struct pdu * batch[GEN_MAX_BURST]; // Built before taking the port lock
+};
+
+/// Function headers
+
+static int f_gen_run(struct gen_config * conf, struct gen_result * res);
+static int f_gen_thread(void * data);
+static struct pdu * f_gen_pdu(struct gen_thread * thread_i, u64 n);
+static void f_gen_account(struct gen_result * res, cycles_t cycles);
+static void f_gen_enqueue(struct gen_thread * thread_i, struct rmt_n1_port * P, uint_t burst);
+static void f_gen_dequeue(struct gen_thread * thread_i, struct rmt_n1_port * P, uint_t max);
+static void f_gen_dequeue_txq(struct gen_thread * thread_i, struct rmt_n1_port * P);
+static int f_gen_verdict(struct gen_config * conf, struct gen_result * res);
+static int f_gen_set(struct gen_config * conf, char * cmd);
+static struct ps_factory * f_gen_factory_get(const char * name, const struct gen_ps ** entry);
+static u64 f_gen_percentile(struct gen_result * res, uint_t permille);
@@ -0,0 +1,556 @@
+ //rmt-pie.c
+#define RINA_PREFIX "rmt-pie-plugin"
+#define RINA_PIE_PS_NAME "rmt-pie-ps"
+#include "rmt-pie.h"
+
+MODULE_DESCRIPTION("RMT PIE policy set");
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Sergio Leon <gaixas1@gmail.com>");
+
+/// Main functions
+
+
+static struct ps_base * f_policy_create(struct rina_component * component){
+
+	struct rmt * rmt_i;
+	struct rmt_ps * ps_i;
+	struct rmt_config * rmt_cfg;
+	struct base_config * conf;
+
+	rmt_i = component ? rmt_from_component(component) : NULL;
+
+	ps_i = rkzalloc(sizeof(struct rmt_ps), GFP_ATOMIC);
+	if (!ps_i) {
+		return NULL;
+	}
+
+	conf = kzalloc(sizeof(struct base_config), GFP_ATOMIC);
+	if (!conf) {
+		LOG_ERR("Could not create config queue");
+		return NULL;
+	}
+
+	conf->max_count = 1000;
+	conf->target_us = 15000;
+	conf->tupdate_us = 15000;
+	conf->max_burst_us = 150000;
+	conf->alpha = 2;
+	conf->beta = 20;
+	conf->ecn = 0;
+	conf->ecn_max = PIE_MAX_PROB / 10;
+	conf->dq_threshold = 16384;
+	INIT_LIST_HEAD(&conf->port_L);
+	INIT_LIST_HEAD(&conf->buffer_L);
+
+	ps_i->base.set_policy_set_param = f_set_policy_set_param;
+	ps_i->dm = rmt_i;
+	ps_i->priv = conf;
+
+	rmt_cfg = rmt_i ? rmt_config_get(rmt_i) : NULL;
+	if (rmt_cfg) {
+		policy_for_each(rmt_cfg->policy_set, conf, f_policy_base_config_apply);
+	} else {
+		LOG_WARN("Using default config (1000 buffers, target delay 15ms)");
+	}
+
+	ps_i->rmt_q_create_policy = f_rmt_q_create_policy;
+	ps_i->rmt_q_destroy_policy = f_rmt_q_destroy_policy;
+	ps_i->rmt_enqueue_policy = f_rmt_enqueue_policy;
+	ps_i->rmt_dequeue_policy = f_rmt_dequeue_policy;
+
+	LOG_INFO("Loaded PIE policy set and its configuration");
+
+	return &ps_i->base;
+}
+
+static void f_policy_destroy(struct ps_base * bps) {
+
+	struct rmt_ps * ps_i;
+	struct base_config * conf;
+	struct port_instance * port_i;
+	struct q_entry * entry_i;
+
+	if (!bps) {
+		LOG_ERR("Error on rmt policy destroy. Some modules not set.");
+		return;
+	}
+
+	ps_i = container_of(bps, struct rmt_ps, base);
+	if (!ps_i || !ps_i->priv) {
+		LOG_ERR("Error on rmt policy destroy. Some modules not set.");
+		return;
+	}
+
+	conf = ps_i->priv;
+
+	// Delete all remaining port instances
+	while(!list_empty(&conf->port_L)) {
+		port_i = list_first_entry(&conf->port_L, struct port_instance, L);
+		f_free_port_instance(port_i);
+	}
+
+	// Empty buffers
+	while(!list_empty(&conf->buffer_L)) {
+		entry_i = list_first_entry(&conf->buffer_L, struct q_entry, L);
+		list_del(&entry_i->L);
+		rkfree(entry_i);
+	}
+
+	// Delete base structure
+	rkfree(conf);
+}
+
+
+int f_rmt_enqueue_policy(struct rmt_ps *ps_i, struct rmt_n1_port * P, struct pdu *PDU) {
+	struct base_config * conf;
+	struct port_instance * port_i;
+	struct q_entry * entry_i;
+	struct pci * pci;
+	unsigned long pci_flags;
+	uint_t len;
+	bool mark;
+
+	if (!ps_i || !ps_i->priv || !P || !PDU) {
+		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_tx");
+		return RMT_PS_ENQ_ERR;
+	}
+
+	//Policy global config
+	conf = ps_i->priv;
+
+	//Search for Port instance
+	port_i = P->rmt_ps_queues;
+	if(!port_i) {
+		LOG_ERR("Unknown rmt_port for rmt_enqueue_scheduling_policy_tx, dropping PDU");
+		pdu_destroy(PDU);
+		return RMT_PS_ENQ_ERR;
+	}
+
+	if(port_i->count >= conf->max_count) {
+		LOG_INFO("Length exceeded for queue, dropping PDU");
+		pdu_destroy(PDU);
+		return RMT_PS_ENQ_DROP;
+	}
+
+	len = pdu_len(PDU);
+	mark = false;
+	if(f_pie_drop_early(conf, port_i, len)) {
+		if(conf->ecn && READ_ONCE(port_i->prob) <= conf->ecn_max) {
+			mark = true;
+		} else {
+			LOG_DBG("Early drop, dropping PDU");
+			pdu_destroy(PDU);
+			return RMT_PS_ENQ_DROP;
+		}
+	}
+
+	if(list_empty(&conf->buffer_L)) {
+		entry_i = rkzalloc(sizeof(struct q_entry), GFP_ATOMIC);
+	} else {
+		entry_i = list_first_entry(&conf->buffer_L, struct q_entry, L);
+		list_del(&entry_i->L);
+	}
+
+	if(!entry_i) {
+		LOG_ERR("Cannot allocate buffer, dropping PDU");
+		pdu_destroy(PDU);
+		return RMT_PS_ENQ_DROP;
+	}
+
+	if(mark) {
+		pci = pdu_pci_get_rw(PDU);
+		pci_flags = pci_flags_get(pci);
+		pci_flags_set(pci, pci_flags |= PDU_FLAGS_EXPLICIT_CONGESTION);
+	}
+
+	entry_i->data = PDU;
+	entry_i->len = len;
+	list_add_tail(&entry_i->L, &port_i->Q);
+
+	port_i->count++;
+	port_i->bytes += len;
+	if(RMT_CHECK_ENABLED) {
+		f_check_port(conf, port_i);
+	}
+
+	LOG_DBG("PDU enqueued");
+	return RMT_PS_ENQ_SCHED;
+}
+
+struct pdu * f_rmt_dequeue_policy(struct rmt_ps * ps_i, struct rmt_n1_port * P) {
+	struct base_config * conf;
+	struct port_instance * port_i;
+	struct pdu * PDU;
+	struct q_entry * entry_i;
+
+	if (!ps_i || !P) {
+		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_rx");
+		return NULL;
+	}
+
+	conf = ps_i->priv;
+
+	port_i = P->rmt_ps_queues;
+	if(!port_i) {
+		LOG_ERR("Unknown rmt_port for rmt_dequeue_scheduling_policy_rx, dropping PDU");
+		return NULL;
+	}
+
+	if(list_empty(&port_i->Q)) {
+		return NULL;
+	}
+
+	entry_i = list_first_entry(&port_i->Q, struct q_entry, L);
+	list_del(&entry_i->L);
+	PDU = entry_i->data;
+	f_pie_dq_rate(conf, port_i, entry_i->len);
+	port_i->count--;
+	port_i->bytes -= entry_i->len;
+	list_add(&entry_i->L, &conf->buffer_L);
+	if(RMT_CHECK_ENABLED) {
+		f_check_port(conf, port_i);
+	}
+
+	return PDU;
+}
+
+void * f_rmt_q_create_policy(struct rmt_ps *ps_i, struct rmt_n1_port * P) {
+	struct base_config * config;
+	struct port_instance * port_i;
+
+	if (!ps_i || !ps_i->priv || !P) {
+		LOG_ERR("Wrong input parameters for rmt_q_create_policy");
+		return NULL;
+	}
+
+	config = ps_i->priv;
+
+	if(P->rmt_ps_queues) {
+		LOG_WARN("Try to create port queues for an already set port");
+		return (struct port_instance *) P->rmt_ps_queues;
+	}
+
+	port_i = kzalloc(sizeof(struct port_instance), GFP_ATOMIC);
+	if(!port_i) {
+		LOG_ERR("Memory alloc problem in rmt_q_create_policy");
+		return NULL;
+	}
+
+	port_i->P = P;
+	port_i->conf = config;
+	port_i->count = 0;
+	port_i->bytes = 0;
+	port_i->prob = 0;
+	port_i->qdelay_old = 0;
+	port_i->burst_allowance = config->max_burst_us;
+	port_i->dq_rate = 0;
+	port_i->in_measurement = false;
+	INIT_LIST_HEAD(&port_i->L);
+	INIT_LIST_HEAD(&port_i->Q);
+
+	P->rmt_ps_queues = port_i;
+	list_add_tail(&port_i->L, &config->port_L);
+
+	setup_timer(&port_i->timer, f_pie_update, (unsigned long) port_i);
+	mod_timer(&port_i->timer, jiffies + usecs_to_jiffies(config->tupdate_us));
+
+	return port_i;
+}
+
+int f_rmt_q_destroy_policy(struct rmt_ps *ps_i, struct rmt_n1_port * P) {
+	if(!P->rmt_ps_queues) {
+		LOG_ERR("Unknown rmt_port for rmt_destroy_p_policy");
+		return -1;
+	}
+
+	f_free_port_instance((struct port_instance *) P->rmt_ps_queues);
+	return 0;
+}
+
+
+/// Helper functions
+
+static int f_policy_base_config_apply(struct policy_parm * param, void * data) {
+	struct base_config * conf;
+
+	conf = (struct base_config *) data;
+	return f_policy_set_param_pv(conf, policy_param_name(param), policy_param_value(param));
+}
+
+static int f_set_policy_set_param(struct ps_base * bps, const char * name, const char * value) {
+	struct rmt_ps * ps_i;
+
+	ps_i = container_of(bps, struct rmt_ps, base);
+	return f_policy_set_param_pv((struct base_config *) ps_i->priv, name, value);
+}
+
+
+static int f_policy_set_param_pv(struct base_config * data, const char * name, const char * value) {
+	uint_t * field;
+	int v;
+
+	if (!name) {
+		LOG_ERR("Null parameter name");
+		return -1;
+	}
+	if (!value) {
+		LOG_ERR("Null parameter value");
+		return -1;
+	}
+
+	if(strcmp(name, "max_count") == 0) {
+		field = &data->max_count;
+	} else if(strcmp(name, "target_us") == 0) {
+		field = &data->target_us;
+	} else if(strcmp(name, "tupdate_us") == 0) {
+		field = &data->tupdate_us;
+	} else if(strcmp(name, "max_burst_us") == 0) {
+		field = &data->max_burst_us;
+	} else if(strcmp(name, "alpha") == 0) {
+		field = &data->alpha;
+	} else if(strcmp(name, "beta") == 0) {
+		field = &data->beta;
+	} else if(strcmp(name, "ecn") == 0) {
+		field = &data->ecn;
+	} else if(strcmp(name, "dq_threshold") == 0) {
+		field = &data->dq_threshold;
+	} else if(strcmp(name, "ecn_max_pct") == 0) {
+		if(kstrtoint(value, 10, &v) || v < 0 || v > 100) {
+			LOG_ERR("Error parsing ecn_max_pct value \"%s\"", value);
+			return -1;
+		}
+
+		data->ecn_max = div_u64((u64) PIE_MAX_PROB * v, 100);
+		LOG_INFO("Set ecn_max_pct as \"%d\"", v);
+		return 0;
+	} else {
+		LOG_ERR("Unknown attribute \"%s\"", name);
+		return 1;
+	}
+
+	if(kstrtoint(value, 10, &v) || v < 0) {
+		LOG_ERR("Error parsing %s value \"%s\"", name, value);
+		return -1;
+	}
+	if(field == &data->tupdate_us && v == 0) {
+		LOG_ERR("Update period cannot be 0");
+		return -1;
+	}
+
+	*field = v;
+	LOG_INFO("Set %s as \"%d\"", name, v);
+	return 0;
+}
+
+void f_free_port_instance(struct port_instance * port_i) {
+	struct q_entry * entry_i;
+
+	del_timer_sync(&port_i->timer);
+	port_i->P->rmt_ps_queues = NULL;
+	list_del(&port_i->L);
+
+	while(!list_empty(&port_i->Q)) {
+		entry_i = list_first_entry(&port_i->Q, struct q_entry, L);
+		list_del(&entry_i->L);
+		pdu_destroy(entry_i->data);
+		rkfree(entry_i);
+	}
+
+	rkfree(port_i);
+}
+
+/*
+ * PIE (RFC 8033).
+ * The drop probability is updated every tupdate_us from the queue delay,
+ * estimated as bytes / dq_rate, so PDUs need no timestamps. The timer owns
+ * prob, qdelay_old and burst_allowance; enqueue only reads them.
+ */
+static bool f_pie_drop_early(struct base_config * conf, struct port_instance * port_i, uint_t len) {
+	u32 prob;
+
+	if(READ_ONCE(port_i->burst_allowance) > 0) {
+		return false;
+	}
+
+	prob = READ_ONCE(port_i->prob);
+	if(READ_ONCE(port_i->qdelay_old) < conf->target_us / 2 && prob < PIE_MAX_PROB / 5) {
+		return false;
+	}
+	if(port_i->bytes < 2 * len) {
+		return false;
+	}
+
+	return prob && prandom_u32() < prob;
+}
+
+/*
+ * Dequeue rate is measured only while at least dq_threshold bytes are
+ * queued, so the sample reflects the link and not the arrivals.
+ */
+static void f_pie_dq_rate(struct base_config * conf, struct port_instance * port_i, uint_t len) {
+	struct timespec t1, td;
+	u64 us, sample, rate;
+
+	if(!port_i->in_measurement) {
+		if(port_i->bytes < conf->dq_threshold) {
+			return;
+		}
+		port_i->in_measurement = true;
+		port_i->dq_count = 0;
+		getnstimeofday(&port_i->dq_start);
+	}
+
+	port_i->dq_count += len;
+	if(port_i->dq_count < conf->dq_threshold) {
+		return;
+	}
+
+	getnstimeofday(&t1);
+	td = timespec_sub(t1, port_i->dq_start);
+	us = (u64) td.tv_sec * 1000000 + td.tv_nsec / 1000;
+	if(us > 0 && us < 1000000000) {
+		sample = div_u64((u64) port_i->dq_count * 1000000, (u32) us);
+		rate = port_i->dq_rate;
+		if(rate) {
+			rate = rate - (rate >> 3) + (sample >> 3);
+		} else {
+			rate = sample;
+		}
+		WRITE_ONCE(port_i->dq_rate, rate);
+	}
+
+	if(port_i->bytes - len < conf->dq_threshold) {
+		port_i->in_measurement = false;
+	} else {
+		port_i->dq_count = 0;
+		port_i->dq_start = t1;
+	}
+}
+
+static void f_pie_update(unsigned long data) {
+	struct port_instance * port_i;
+	struct base_config * conf;
+	u64 dq_rate;
+	uint_t qdelay, qdelay_old, burst;
+	u32 prob;
+	s64 delta, p;
+
+	port_i = (struct port_instance *) data;
+	conf = port_i->conf;
+
+	dq_rate = READ_ONCE(port_i->dq_rate);
+	qdelay = 0;
+	if(dq_rate) {
+		qdelay = div64_u64((u64) READ_ONCE(port_i->bytes) * 1000000, dq_rate);
+	}
+	qdelay_old = port_i->qdelay_old;
+	prob = port_i->prob;
+
+	// alpha and beta are in 1/16 Hz, delays in us
+	delta = (s64) conf->alpha * ((s64) qdelay - conf->target_us)
+		+ (s64) conf->beta * ((s64) qdelay - qdelay_old);
+	delta = delta * (PIE_MAX_PROB / 1000000) / 16;
+
+	// Auto-tuning, smaller steps while the probability is low
+	if(prob < PIE_MAX_PROB / 1000000) {
+		delta /= 2048;
+	} else if(prob < PIE_MAX_PROB / 100000) {
+		delta /= 512;
+	} else if(prob < PIE_MAX_PROB / 10000) {
+		delta /= 128;
+	} else if(prob < PIE_MAX_PROB / 1000) {
+		delta /= 32;
+	} else if(prob < PIE_MAX_PROB / 100) {
+		delta /= 8;
+	} else if(prob < PIE_MAX_PROB / 10) {
+		delta /= 2;
+	} else if(delta > PIE_MAX_PROB / 50) {
+		delta = PIE_MAX_PROB / 50;
+	}
+
+	p = (s64) prob + delta;
+	if(p < 0) {
+		p = 0;
+	} else if(p > PIE_MAX_PROB) {
+		p = PIE_MAX_PROB;
+	}
+
+	// Decay while the queue stays empty
+	if(qdelay == 0 && qdelay_old == 0) {
+		p -= p / 64;
+	}
+
+	burst = port_i->burst_allowance;
+	burst = burst > conf->tupdate_us ? burst - conf->tupdate_us : 0;
+	if(p == 0 && qdelay < conf->target_us / 2 && qdelay_old < conf->target_us / 2) {
+		burst = conf->max_burst_us;
+	}
+
+	WRITE_ONCE(port_i->prob, (u32) p);
+	WRITE_ONCE(port_i->qdelay_old, qdelay);
+	WRITE_ONCE(port_i->burst_allowance, burst);
+
+	mod_timer(&port_i->timer, jiffies + usecs_to_jiffies(conf->tupdate_us));
+}
+
+
+/*
+ * Invariant checks (make RMT_CHECK=1), see rmt-check.h.
+ * The counters of the port must match the PDUs actually queued.
+ */
+static void f_check_port(struct base_config * conf, struct port_instance * port_i) {
+	struct q_entry * entry_i;
+	uint_t count, bytes;
+
+	count = 0;
+	bytes = 0;
+	list_for_each_entry(entry_i, &port_i->Q, L) {
+		count++;
+		bytes += entry_i->len;
+	}
+	rmt_check(count == port_i->count && bytes == port_i->bytes,
+		"port %d holds %u PDUs and %u bytes, counted %u and %u",
+		port_i->P->port_id, count, bytes, port_i->count, port_i->bytes);
+}
+
+
+/// Policy init and exit
+
+static struct ps_factory pie_factory = {
+		.owner = THIS_MODULE,
+		.create = f_policy_create,
+		.destroy = f_policy_destroy,
+};
+
+// Invariant checks failed so far, see rmt-check.h
+int rmt_pie_check_failed(void) {
+	return atomic_read(&rmt_check_failed);
+}
+EXPORT_SYMBOL(rmt_pie_check_failed);
+
+// Factory for in-kernel users other than the RMT (e.g. rmt_gen)
+struct ps_factory * rmt_pie_ps_factory(void) {
+	return &pie_factory;
+}
+EXPORT_SYMBOL(rmt_pie_ps_factory);
+
+static int __init mod_init(void) {
+	strcpy(pie_factory.name, RINA_PIE_PS_NAME);
+	if (rmt_ps_publish(&pie_factory)) {
+		LOG_ERR("Failed to publish policy set factory");
+		return -1;
+	}
+	LOG_INFO("rmt_i PIE policy set loaded successfully");
+	return 0;
+}
+
+static void __exit mod_exit(void) {
+	if (rmt_ps_unpublish(RINA_PIE_PS_NAME)) {
+		LOG_ERR("Failed to unpublish policy set factory");
+	} else {
+		LOG_INFO("rmt_i PIE policy set unloaded successfully");
+	}
+}
+
+module_init(mod_init);
+module_exit(mod_exit);
@@ -0,0 +1,89 @@
+//rmt-pie.h
+#include <linux/module.h>
+#include <linux/list.h>
+#include <linux/time.h>
+#include <linux/timer.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/export.h>
+#include <linux/string.h>
+
+#include "logs.h"
+#include "rds/rmem.h"
+#include "rmt-ps.h"
+#include "policies.h"
+#include "debug.h"
+#include "rmt-check.h"
+
+// Probability 1 in fixed point
+#define PIE_MAX_PROB 0xFFFFFFFFU
+
+/// Data structures
+
+//Queue entry
+struct q_entry {
+	struct list_head L;
+	struct pdu * data;
+	uint_t len;
+};
+
+// port instance information
+struct port_instance {
+	struct list_head L;
+	struct rmt_n1_port * P;
+	struct base_config * conf;
+
+	uint_t count;
+	uint_t bytes;
+	struct list_head Q;
+
+	// PIE state, written only by the update timer
+	u32 prob; // Drop/mark probability, PIE_MAX_PROB -> 1
+	uint_t qdelay_old; // Queue delay at the last update in us
+	uint_t burst_allowance; // Remaining burst allowance in us
+	struct timer_list timer;
+
+	// Dequeue rate estimation, written only on dequeue
+	u64 dq_rate; // Average dequeue rate in bytes per second, 0 -> unknown
+	uint_t dq_count; // Bytes dequeued in the current measurement
+	struct timespec dq_start; // Start of the current measurement
+	bool in_measurement;
+};
+
+// Configuration of the policy
+struct base_config {
+	uint_t max_count;
+	uint_t target_us; // Target queue delay
+	uint_t tupdate_us; // Probability update period
+	uint_t max_burst_us; // Burst allowed without drops after an idle period
+	uint_t alpha; // Gain on the delay error, in 1/16 Hz
+	uint_t beta; // Gain on the delay trend, in 1/16 Hz
+	uint_t ecn; // Mark instead of drop while prob <= ecn_max
+	u32 ecn_max;
+	uint_t dq_threshold; // Bytes needed on the queue to measure the dequeue rate
+	struct list_head port_L;
+	struct list_head buffer_L;
+};
+
+/// Function headers
+
+static struct ps_base * f_policy_create(struct rina_component * component);
+struct ps_factory * rmt_pie_ps_factory(void);
+int rmt_pie_check_failed(void);
+static void f_policy_destroy(struct ps_base * bps);
+
+void * f_rmt_q_create_policy(struct rmt_ps *ps, struct rmt_n1_port * P);
+int f_rmt_q_destroy_policy(struct rmt_ps *ps, struct rmt_n1_port * P);
+int f_rmt_enqueue_policy(struct rmt_ps *ps, struct rmt_n1_port * P, struct pdu * PDU);
+struct pdu * f_rmt_dequeue_policy(struct rmt_ps *ps, struct rmt_n1_port * P);
+
+static int f_set_policy_set_param(struct ps_base * bps, const char * name, const char * value);
+static int f_policy_base_config_apply(struct policy_parm * param, void * data);
+
+static int f_policy_set_param_pv(struct base_config * data, const char * name, const char * value);
+
+void f_free_port_instance(struct port_instance * entry);
+static bool f_pie_drop_early(struct base_config * conf, struct port_instance * port_i, uint_t len);
+static void f_pie_dq_rate(struct base_config * conf, struct port_instance * port_i, uint_t len);
+static void f_pie_update(unsigned long data);
+static void f_check_port(struct base_config * conf, struct port_instance * port_i);
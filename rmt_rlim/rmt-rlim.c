@@ -6,10 +6,12 @@
 
 #ifdef DEBUG
 #define KALLOC(x) rkzalloc(x,GFP_ATOMIC) 
+#define KALLOC_NODE(x,n) rkzalloc(x,GFP_ATOMIC) 
 #define KFREE(x) rkfree(x) 
 #else
 #include "linux/slab.h"
 #define KALLOC(x) kmalloc(x,GFP_ATOMIC)
+#define KALLOC_NODE(x,n) kmalloc_node(x,GFP_ATOMIC,n)
 #define KFREE(x) kfree(x) 
 #endif
 
@@ -17,6 +19,8 @@ MODULE_DESCRIPTION("RMT R-LIM policy set");
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Sergio Leon <gaixas1@gmail.com>");
 
+static ATOMIC_NOTIFIER_HEAD(rlim_bp_chain);
+
 /* Main functions */
 
 static struct ps_base * f_policy_create(struct rina_component * component){
@@ -25,7 +29,7 @@ static struct ps_base * f_policy_create(struct rina_component * component){
 	struct rmt_config * rmt_cfg;
 	base_config * conf;
 
-	rmt = rmt_from_component(component);
+	rmt = component ? rmt_from_component(component) : NULL;
 	ps = (struct rmt_ps *) KALLOC(sizeof(*ps));
 	if (!ps) {
 		return NULL;
@@ -34,94 +38,67 @@ static struct ps_base * f_policy_create(struct rina_component * component){
 	conf = (base_config *) KALLOC(sizeof(base_config));
 	if (!conf) {
 		LOG_ERR("Could not create conf queue");
+		KFREE(ps);
 		return NULL;
 	}
 		
-	INIT_LIST_HEAD(&conf->buffer);
+	rmt_pool_init(&conf->buffer, sizeof(q_entry));
 	INIT_LIST_HEAD(&conf->port_instances);
 	INIT_LIST_HEAD(&conf->Q2CU);
+	spin_lock_init(&conf->port_lock);
+	INIT_DELAYED_WORK(&conf->idle_work, f_idle_sweep);
 	
+	conf->state = 0;
 	conf->max_count = 100;
-	conf->default_ecn = 50;
-	conf->buffer_size = 0;
+	conf->max_bytes = 0;
+	rmt_mark_init(&conf->def_mark, RMT_MARK_ENQUEUE, 50);
 	conf->levels_urgency = 1;
 	conf->levels_cherish = 1;
 	conf->headers_weight = 0;
 	conf->bytecost = 1;
-	conf->S = 0;
+	conf->red_wq = 4;
+	conf->cal_window_us = 0;
+	conf->numa_node = NUMA_NO_NODE;
+	conf->pace_gran_us = 0;
+	conf->lifetimes = 0;
+	conf->cut_through = 0;
+	conf->age_us = 0;
+	conf->age_rate = 1000;
+	rmt_bp_init(&conf->bp);
+	conf->sweep_us = 0;
+	conf->idle_us = 0;
+	conf->shared_size = 0;
+	conf->dt_alpha = 100;
+	atomic_set(&conf->shared_used, 0);
 	
-	conf->gain_us_u = NULL;
-	conf->max_credit_u = NULL;
-	conf->gain_us_c = NULL;
-	conf->max_credit_c = NULL;
-	conf->th_c = NULL;
+	conf->groups = NULL;
+	conf->num_groups = 0;
+	conf->conf_block = NULL;
+	rmt_conf_stage_init(&conf->pending);
 
-	ps->base.set_policy_set_param = NULL;//f_set_policy_set_param;
+	ps->base.set_policy_set_param = f_set_policy_set_param;
 	ps->dm = rmt;
 	ps->priv = conf;
 
-	rmt_cfg = rmt_config_get(rmt);
-	if (rmt_cfg) {
-		policy_for_each(rmt_cfg->policy_set, conf, f_policy_base_config_apply);
-	} else {
-		LOG_WARN("Using default conf (best-effort)");
-	}
-	
-	if(!(conf->S & 1)) {
-		conf->gain_us_u = (u64 *) KALLOC(sizeof(u64));
-		conf->max_credit_u = (u64 *) KALLOC(sizeof(u64));
-		if(conf->gain_us_u == NULL ||conf->max_credit_u == NULL) {
-			conf->gain_us_u[0] = 1;
-			conf->max_credit_u[0] = 10000;
-			conf->levels_urgency = 1;
-		}
-		conf->S |= 1;
-	}
-	if(!(conf->S & 2)) {
-		conf->gain_us_c = (u64 *) KALLOC(sizeof(u64));
-		conf->max_credit_c = (u64 *) KALLOC(sizeof(u64));
-		conf->th_c = (u16 *) KALLOC(sizeof(u16));
-		if(conf->gain_us_c == NULL ||conf->max_credit_c == NULL) {
-			conf->gain_us_c[0] = 1;
-			conf->max_credit_c[0] = 10000;
-			conf->th_c[0] = 100;
-			conf->levels_cherish = 1;
-		}
-		conf->S |= 1;
-	}
-	
-	conf->num_queues = conf->levels_urgency * conf->levels_cherish; 
-		
-	if(conf->gain_us_u == NULL || conf->max_credit_u == NULL 
-		|| conf->gain_us_c == NULL || conf->max_credit_c == NULL
-		|| conf->th_c == NULL ) {
-		if(conf->gain_us_u){
-			KFREE(conf->gain_us_u);
-		}
-		if(conf->max_credit_u){
-			KFREE(conf->max_credit_u);
-		}
-		if(conf->gain_us_c){
-			KFREE(conf->gain_us_c);
-		}
-		if(conf->max_credit_c){
-			KFREE(conf->max_credit_c);
-		}
-		if(conf->th_c){
-			KFREE(conf->th_c);
-		}
-			
-		KFREE(conf);
-		
-		LOG_ERR("Failure allocating memory");
-		return NULL;
-	}
-
 	ps->rmt_q_create_policy = f_rmt_q_create_policy;
 	ps->rmt_q_destroy_policy = f_rmt_q_destroy_policy;
 	ps->rmt_enqueue_policy = f_rmt_enqueue_policy;
 	ps->rmt_dequeue_policy = f_rmt_dequeue_policy;
 
+	rmt_cfg = rmt ? rmt_config_get(rmt) : NULL;
+	if (rmt_cfg) {
+		if(f_conf_load(conf, rmt_cfg->policy_set)) {
+			LOG_ERR("Invalid configuration, policy set not created");
+			f_conf_free(conf);
+			KFREE(conf);
+			KFREE(ps);
+			return NULL;
+		}
+		f_conf_start(ps, conf);
+	} else {
+		LOG_WARN("Created without an RMT, parameters are loaded at the first port");
+	}
+
 	LOG_INFO("Loaded R-LIM policy set and its confuration");
 
 	return &ps->base;
@@ -131,7 +108,6 @@ static void f_policy_destroy(struct ps_base * bps) {
 	struct rmt_ps *ps;
 	base_config * conf;
 	port_instance * port_i;
-	q_entry * entry_i;
 	
 	ps = container_of(bps, struct rmt_ps, base);
 	if (!bps || !ps || !ps->priv) {
@@ -141,6 +117,7 @@ static void f_policy_destroy(struct ps_base * bps) {
 	
 	conf = (base_config *) ps->priv;
 	ps->priv = NULL;
+	cancel_delayed_work_sync(&conf->idle_work);
 	
 	// Delete all remaining port instances
 	while(!list_empty(&conf->port_instances)) {
@@ -148,29 +125,8 @@ static void f_policy_destroy(struct ps_base * bps) {
 		f_free_port_instance(conf, port_i);
 	}
 	
-	// Empty buffers
-	while(!list_empty(&conf->buffer)) {
-		entry_i = list_first_entry(&conf->buffer, q_entry, L);
-		list_del(&entry_i->L);
-		KFREE(entry_i);
-		conf->buffer_size--;
-	}
-	
-	if(conf->gain_us_u){
-		KFREE(conf->gain_us_u);
-	}
-	if(conf->max_credit_u){
-		KFREE(conf->max_credit_u);
-	}
-	if(conf->gain_us_c){
-		KFREE(conf->gain_us_c);
-	}
-	if(conf->max_credit_c){
-		KFREE(conf->max_credit_c);
-	}
-	if(conf->th_c){
-		KFREE(conf->th_c);
-	}
+	// Buffers, QoS mappings and level arrays
+	f_conf_free(conf);
 	
 	KFREE(conf);
 }
@@ -184,11 +140,12 @@ int f_rmt_enqueue_policy(struct rmt_ps *ps, port_p P, pdu_p pdu_i) {
 	q_entry * entry_i;
 	u8 next_urgency;
 	u8 next_cherish;
-	u16 ecn;
+	u32 ecn_bytes, len;
 	u16 q_id;
-	qos2CU * qos2cu_i;
-    struct pci * pci;
-	unsigned long pci_flags;
+	qos2CU * qos2cu_i, * qos_m;
+	const struct rmt_mark * mark;
+	atomic_t * pool;
+	u64 now;
 	
 	if (!ps || !ps->priv || !P || !pdu_i) {
 		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_tx");
@@ -210,64 +167,127 @@ int f_rmt_enqueue_policy(struct rmt_ps *ps, port_p P, pdu_p pdu_i) {
 		return RMT_PS_ENQ_ERR;
 	}
 	
-	if(port_i->count >= conf->max_count) {
+	len = pdu_len(pdu_i);
+	if(!conf->shared_size && port_i->count >= conf->max_count) {
 		LOG_INFO("Length exceeded for Port, dropping PDU");
 		pdu_destroy(pdu_i);
 		return RMT_PS_ENQ_DROP;
 	}
+	if(conf->max_bytes && port_i->bytes + len > conf->max_bytes) {
+		LOG_INFO("Bytes exceeded for Port, dropping PDU");
+		pdu_destroy(pdu_i);
+		return RMT_PS_ENQ_DROP;
+	}
+	
+	if(!port_i->Q && f_port_activate(conf, port_i)) {
+		LOG_ERR("Cannot allocate port queues, dropping PDU");
+		pdu_destroy(pdu_i);
+		return RMT_PS_ENQ_DROP;
+	}
 	
 	next_urgency = conf->levels_urgency -1;
 	next_cherish = conf->levels_cherish -1;
-	ecn = conf->default_ecn;
+	mark = &conf->def_mark;
+	ecn_bytes = 0;
+	qos_m = NULL;
 	list_for_each_entry(qos2cu_i, &conf->Q2CU, L) {
 		if (qos_id == qos2cu_i->qos_id) {
+			qos_m = qos2cu_i;
 			next_urgency = qos2cu_i->urgency;
 			next_cherish = qos2cu_i->cherish;
-			ecn = qos2cu_i->ecn;
+			mark = &qos2cu_i->mark;
+			ecn_bytes = qos2cu_i->ecn_bytes;
 			break;
 		}
 	}
 	
-	if(port_i->count >= conf->th_c[next_cherish]) {
+#ifdef RMT_PS_ENQ_SEND
+	if(conf->cut_through && port_i->count == 0 && P->state == N1_PORT_STATE_ENABLED
+		&& f_cut_through(conf, port_i, next_urgency, next_cherish, len)) {
+		return RMT_PS_ENQ_SEND;
+	}
+#endif
+	
+	if(port_i->count >= conf->th_c[next_cherish]
+		|| (conf->th_bytes_c[next_cherish] && port_i->bytes + len > conf->th_bytes_c[next_cherish])) {
 		LOG_INFO("Length exceeded for Cherish level, dropping PDU");
 		pdu_destroy(pdu_i);
 		return RMT_PS_ENQ_DROP;
 	}
 	
+	port_i->red_avg += (((u64) port_i->count << RED_AVG_SHIFT) >> conf->red_wq)
+		- (port_i->red_avg >> conf->red_wq);
+	if(conf->red_c[next_cherish].max_th && f_red_drop(conf, port_i, next_cherish)) {
+		LOG_DBG("Early drop for Cherish level %u", next_cherish);
+		pdu_destroy(pdu_i);
+		return RMT_PS_ENQ_DROP;
+	}
 	
-	if(list_empty(&conf->buffer)) {
-		entry_i = (q_entry *) KALLOC(sizeof(q_entry));
-	} else {
-		entry_i = list_first_entry(&conf->buffer, q_entry, L);
-		list_del(&entry_i->L);
-		conf->buffer_size--;
+	pool = NULL;
+	if(conf->shared_size) {
+		pool = f_shared_admit(conf, port_i, qos_m);
+		if(!pool) {
+			LOG_INFO("Shared buffer threshold exceeded, dropping PDU");
+			pdu_destroy(pdu_i);
+			return RMT_PS_ENQ_DROP;
+		}
 	}
 	
+	entry_i = rmt_pool_get(&conf->buffer);
 	if(!entry_i) {
 		LOG_ERR("Cannot allocate buffer, dropping PDU");
+		if(pool) {
+			atomic_dec(pool);
+		}
 		pdu_destroy(pdu_i);
 		return RMT_PS_ENQ_DROP;
 	}
 	
 	entry_i->data = pdu_i;
-	entry_i->cost = (u64) pdu_len(pdu_i) + (u64) conf->headers_weight;
+	entry_i->pool = pool;
+	entry_i->len = len;
+	entry_i->cost = (u64) len + (u64) conf->headers_weight;
 	entry_i->cost *= conf->bytecost;
+	entry_i->mark = mark->point == RMT_MARK_DEQUEUE ? mark : NULL;
+	now = 0;
+	if(port_i->wheel || conf->age_us || mark->metric == RMT_MARK_SOJOURN || (qos_m && qos_m->max_sojourn_us)) {
+		now = ktime_get_ns();
+	}
+	entry_i->enq_ns = now;
+	entry_i->deadline = 0;
+	if(qos_m && qos_m->max_sojourn_us) {
+		entry_i->deadline = now + (u64) qos_m->max_sojourn_us * NSEC_PER_USEC;
+	}
 	
 	q_id = next_cherish + next_urgency * conf->levels_cherish;
-	list_add_tail(&entry_i->L, &port_i->Q[q_id].q);
+	if(port_i->wheel) {
+		entry_i->q_id = q_id;
+		f_pace_stamp(conf, port_i, entry_i, now);
+	} else {
+		list_add_tail(&entry_i->L, &port_i->Q[q_id].q);
+		port_i->Q[q_id].count++;
+	}
 	port_i->count++;
+	port_i->bytes += len;
+	
+	// Sojourn at enqueue is the one of the head of the queue
+	if((mark->point == RMT_MARK_ENQUEUE
+			&& rmt_mark_check(mark, f_mark_value(port_i, mark,
+				list_first_entry_or_null(&port_i->Q[q_id].q, q_entry, L), now)))
+		|| (ecn_bytes && port_i->bytes > ecn_bytes)) {
+		rmt_mark_pdu(pdu_i);
+	}
 	
-	if(port_i->count > ecn) {
-		pci = pdu_pci_get_rw(pdu_i);	
-		pci_flags = pci_flags_get(pci);
-		pci_flags_set(pci, pci_flags |= PDU_FLAGS_EXPLICIT_CONGESTION);
+	rmt_bp_update(&conf->bp, &port_i->bp_paused, &rlim_bp_chain, P, port_i->count);
+	if(RMT_CHECK_ENABLED) {
+		f_check_port(conf, port_i);
 	}
 	
 	LOG_DBG("PDU enqueued");
 	return RMT_PS_ENQ_SCHED;
 }
 
-inline void gain(u64 * credits, u64 T, u8 L, u64 * gain_us) {
+static __always_inline void gain(s64 * credits, u64 T, u8 L, u64 * gain_us) {
 	u8 i, j;
 	s64 g, k;
 	
@@ -293,16 +313,17 @@ inline void gain(u64 * credits, u64 T, u8 L, u64 * gain_us) {
 	}
 }
 
-inline void spend(u64 * credits, u32 cost, u8 l, u8 L, u64 * max_credit) {
+static __always_inline void spend(s64 * credits, u32 cost, u8 l, u8 L, u64 * max_credit) {
 	u8 i;
 	s64 k;
-	u64 * current_cred, * current_max;
+	s64 * current_cred;
+	u64 * current_max;
 	
 	for(i = l; i < L && cost > 0; i--) {
 		if ( credits[i] >= cost) {
 			credits[i] -= cost;
 			cost = 0;
-		} else {
+		} else if(credits[i] > 0) {
 			cost -= credits[i];
 			credits[i] = 0;
 		}
@@ -316,7 +337,7 @@ inline void spend(u64 * credits, u32 cost, u8 l, u8 L, u64 * max_credit) {
 	current_max = max_credit;
 	for(i = 0; i < L; i++) {
 		*current_cred += k;
-		if(*current_cred > *current_max) {
+		if(*current_cred > (s64) *current_max) {
 			k += *current_cred - *current_max;
 			*current_cred = *current_max;
 		}
@@ -325,16 +346,27 @@ inline void spend(u64 * credits, u32 cost, u8 l, u8 L, u64 * max_credit) {
 	}
 }
 
-pdu_p f_rmt_dequeue_policy(struct rmt_ps * ps, port_p P) {
+/*
+	Dequeue
+	One body for every level configuration, lu and lc being the urgency and
+	cherish levels. The common configurations get their own copy with
+	constant levels, so the credit and queue loops unroll; the policy set
+	picks one at creation (see f_dequeue_select), the levels cannot change
+	afterwards. Unrolled 4x4 levels were slower than the generic body, so
+	only the smaller configurations have a copy.
+*/
+static __always_inline pdu_p f_dequeue(struct rmt_ps * ps, port_p P, const u8 lu, const u8 lc) {
 	base_config * conf;
 	port_instance * port_i;
 	q_entry * entry_i;
 	struct timespec t1, td;
 	u64 T;
 	pdu_p pdu_i;
-	u8 mu, mc, lu, lc, i, j;
-	queue * current_q, * sel_q;
+	u8 mu, mc, i, j;
+	queue * current_q, * sel_q, * aged_q;
 	u32 cost;
+	u64 now;
+	bool expired, held;
 	
 	if (!ps || !P || !P->rmt_ps_queues) {
 		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_rx");
@@ -343,12 +375,13 @@ pdu_p f_rmt_dequeue_policy(struct rmt_ps * ps, port_p P) {
 	
 	conf = ps->priv;
 	port_i = P->rmt_ps_queues;
-	
-	lu = conf->levels_urgency;
-	lc = conf->levels_cherish;
+	if(!port_i->Q) {
+		return NULL;
+	}
 	
 	//Compute ticks from last call
 	getnstimeofday (&t1);
+	T = 0;
 	if(timespec_compare(&port_i->lastT, &t1) < 0) {
 		td = timespec_sub(t1, port_i->lastT);
 		if(td.tv_sec < 2) { // MAX 2s
@@ -356,62 +389,172 @@ pdu_p f_rmt_dequeue_policy(struct rmt_ps * ps, port_p P) {
 		} else {
 			T = 2000000;
 		}
-		if(T > 0){
+		if(T > 0 && !port_i->wheel){
+			port_i->lastT = t1;
+			gain(port_i->credits_u, T, lu, port_i->gain_u);
+			gain(port_i->credits_c, T, lc, port_i->gain_c);
+		} else if(T > 0) {
 			port_i->lastT = t1;
-			gain(port_i->credits_u, T, lu, conf->gain_us_u);
-			gain(port_i->credits_c, T, lc, conf->gain_us_c);
 		}
 	}
 	
-	mu = lu;
-	for(i = 0; i < mu; i++) {
-		if(port_i->credits_u[i] > 0) {
-			mu = i; 
-		}
-	}
-	mc = lc;
-	for(i = 0; i < mc; i++) {
-		if(port_i->credits_c[i] > 0) { 
-			mc = i; 
+	//Discard PDUs past their deadline
+	now = 0;
+	if(conf->lifetimes) {
+		now = ktime_get_ns();
+		if(conf->sweep_us && now - port_i->last_sweep >= (u64) conf->sweep_us * NSEC_PER_USEC) {
+			f_expire_sweep(conf, port_i, now);
 		}
 	}
 	
-	current_q = port_i->Q;
-	current_q += mu*lc + mc;
-	sel_q = NULL;
-	for(i = mu; !sel_q && i < lu; i++) {
-		for(j = mc; !sel_q && j < lc; j++) {
-			if(current_q->count > 0) {
-				sel_q = current_q;
+	if(port_i->wheel) {
+		//Paced PDUs are already eligible, serve by priority only
+		f_pace_release(conf, port_i);
+		mu = 0;
+		mc = 0;
+	} else {
+		mu = lu;
+		for(i = 0; i < mu; i++) {
+			if(port_i->credits_u[i] > 0) {
+				mu = i; 
+			}
+		}
+		mc = lc;
+		for(i = 0; i < mc; i++) {
+			if(port_i->credits_c[i] > 0) { 
+				mc = i; 
 			}
-			current_q++;
 		}
-		current_q += mc;
 	}
 	
-	if(sel_q == NULL) {
-		return NULL;
-	}
+	//Members of a port group hold their queues while the group has no credits
+	held = port_i->group && port_i->count && !f_group_admit(port_i, &now);
 	
-	entry_i = list_first_entry(&sel_q->q, q_entry, L);
-	list_del(&entry_i->L);
-	sel_q->count--;
+	do {
+		current_q = port_i->Q;
+		current_q += mu*lc + mc;
+		sel_q = NULL;
+		for(i = mu; !sel_q && i < lu; i++) {
+			for(j = mc; !sel_q && j < lc; j++) {
+				if(current_q->count > 0) {
+					sel_q = current_q;
+				}
+				current_q++;
+			}
+			current_q += mc;
+		}
+		
+		aged_q = NULL;
+		if(conf->age_us && port_i->count && !held) {
+			if(!now) {
+				now = ktime_get_ns();
+			}
+			aged_q = f_age_pick(conf, port_i, sel_q, now);
+			if(aged_q) {
+				sel_q = aged_q;
+			}
+		}
+		
+		if(sel_q == NULL || held) {
+			port_i->cal_last_cost = 0;
+			rmt_bp_update(&conf->bp, &port_i->bp_paused, &rlim_bp_chain, P, port_i->count);
+			if(RMT_CHECK_ENABLED) {
+				f_check_port(conf, port_i);
+			}
+			return NULL;
+		}
+		
+		entry_i = list_first_entry(&sel_q->q, q_entry, L);
+		list_del(&entry_i->L);
+		sel_q->count--;
+		port_i->count--;
+		port_i->bytes -= entry_i->len;
+		
+		expired = entry_i->deadline && now >= entry_i->deadline;
+		if(expired) {
+			f_entry_expire(conf, port_i, entry_i);
+		}
+	} while(expired);
 	
 	pdu_i = entry_i->data;
 	cost = entry_i->cost;
-	list_add(&entry_i->L, &conf->buffer);
+	if(entry_i->mark && rmt_mark_check(entry_i->mark, f_mark_value(port_i, entry_i->mark, entry_i,
+		entry_i->mark->metric != RMT_MARK_SOJOURN ? 0 : now ? now : ktime_get_ns()))) {
+		rmt_mark_pdu(pdu_i);
+	}
+	f_shared_release(entry_i);
+	rmt_pool_put(&conf->buffer, entry_i);
+	if(port_i->group) {
+		rmt_group_spend(port_i->group, cost);
+	}
+	if(aged_q) {
+		port_i->aged++;
+		port_i->age_next = conf->age_rate ? now + div_u64(NSEC_PER_SEC, conf->age_rate) : 0;
+	}
 	
-	spend(port_i->credits_u, cost, sel_q->urgency, lu, conf->max_credit_u);
-	spend(port_i->credits_c, cost, sel_q->cherish, lc, conf->max_credit_c);
+	if(!port_i->wheel) {
+		spend(port_i->credits_u, cost, sel_q->urgency, lu, conf->max_credit_u);
+		spend(port_i->credits_c, cost, sel_q->cherish, lc, conf->max_credit_c);
+		if(RMT_CHECK_ENABLED) {
+			f_check_credits(conf, port_i);
+		}
+	}
+	
+	if(conf->cal_window_us) {
+		f_port_calibrate(conf, port_i, T, cost);
+	}
 	
+	rmt_bp_update(&conf->bp, &port_i->bp_paused, &rlim_bp_chain, P, port_i->count);
+	if(RMT_CHECK_ENABLED) {
+		f_check_port(conf, port_i);
+	}
 	return pdu_i;
 }
 
+#define RLIM_DEQUEUE(U, C) \
+	static pdu_p f_rmt_dequeue_##U##x##C(struct rmt_ps * ps, port_p P) { \
+		return f_dequeue(ps, P, U, C); \
+	}
+
+RLIM_DEQUEUE(1, 1)
+RLIM_DEQUEUE(2, 2)
+
+static const struct {
+	u8 levels_urgency;
+	u8 levels_cherish;
+	dequeue_f dequeue;
+} f_dequeue_variants[] = {
+	{ 1, 1, f_rmt_dequeue_1x1 },
+	{ 2, 2, f_rmt_dequeue_2x2 },
+};
+
+// Any level configuration
+pdu_p f_rmt_dequeue_policy(struct rmt_ps * ps, port_p P) {
+	base_config * conf;
+	
+	if (!ps || !ps->priv) {
+		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_rx");
+		return NULL;
+	}
+	conf = ps->priv;
+	return f_dequeue(ps, P, conf->levels_urgency, conf->levels_cherish);
+}
+
+static dequeue_f f_dequeue_select(base_config * conf) {
+	u8 i;
+	
+	for(i = 0; i < ARRAY_SIZE(f_dequeue_variants); i++) {
+		if(f_dequeue_variants[i].levels_urgency == conf->levels_urgency
+			&& f_dequeue_variants[i].levels_cherish == conf->levels_cherish) {
+			return f_dequeue_variants[i].dequeue;
+		}
+	}
+	return f_rmt_dequeue_policy;
+}
+
 void * f_rmt_q_create_policy(struct rmt_ps *ps, port_p P) {
 	base_config * conf;
 	port_instance * port_i;
-	u8 i, j;
-	queue * q;
 	
 	if (!ps || !ps->priv || !P) {
 		LOG_ERR("Wrong input parameters for rmt_create_p_policy");
@@ -426,54 +569,43 @@ void * f_rmt_q_create_policy(struct rmt_ps *ps, port_p P) {
 		return (port_instance *) P->rmt_ps_queues;
 	}
 	
-	port_i = (port_instance *) KALLOC(sizeof(port_instance));
-	if(!port_i) {
-		LOG_ERR("Memory alloc problem in rmt_create_p_policy");
+	if(!(conf->state & 1) && f_conf_load_pending(ps, conf)) {
 		return NULL;
 	}
 	
-	port_i->credits_u = (s64 *) KALLOC(sizeof(s64) * conf->levels_urgency);
-	port_i->credits_c = (s64 *) KALLOC(sizeof(s64) * conf->levels_cherish);
-	port_i->Q = (queue *) KALLOC(sizeof(queue) * conf->num_queues);
-	
-	if(port_i->credits_u == NULL
-		|| port_i->credits_c == NULL
-		|| port_i->Q == NULL) {
-		if(port_i->credits_u) {
-			KFREE(port_i->credits_u);
-		}
-		if(port_i->credits_c) {
-			KFREE(port_i->credits_c);
-		}
-		if(port_i->Q) {
-			KFREE(port_i->Q);
-		}
-		KFREE(port_i);
-		
+	port_i = (port_instance *) KALLOC_NODE(sizeof(port_instance), conf->numa_node);
+	if(!port_i) {
 		LOG_ERR("Memory alloc problem in rmt_create_p_policy");
 		return NULL;
 	}
 	
+	port_i->credits_u = NULL;
+	port_i->credits_c = NULL;
+	port_i->gain_u = NULL;
+	port_i->gain_c = NULL;
+	port_i->Q = NULL;
+	port_i->group = rmt_group_find(conf->groups, conf->num_groups, P->port_id);
+	
 	port_i->count = 0;
+	port_i->bytes = 0;
+	port_i->red_avg = 0;
+	port_i->cal_last_cost = 0;
+	port_i->cal_us = 0;
+	port_i->cal_credits = 0;
+	port_i->rate = 0;
+	port_i->bp_paused = 0;
+	port_i->last_sweep = 0;
+	port_i->expired = 0;
+	port_i->age_q = 0;
+	port_i->age_next = 0;
+	port_i->aged = 0;
 	getnstimeofday (&port_i->lastT);
 	
-	for(i = 0 ; i < conf->levels_urgency; i++) {
-		port_i->credits_u[i] = 0;
-	}
-	for(i = 0 ; i < conf->levels_cherish; i++) {
-		port_i->credits_c[i] = 0;
-	}
-	for(i = 0 ; i < conf->levels_urgency; i++) {
-		for(j = 0 ; j < conf->levels_cherish; j++) {
-			q = &port_i->Q[i*conf->levels_cherish + j];
-			q->count = 0;
-			q->urgency = i;
-			q->cherish = j;
-			INIT_LIST_HEAD(&q->q);
-		}
-	}
-	
 	port_i->P = P;
+	INIT_LIST_HEAD(&port_i->L);
+	spin_lock_bh(&conf->port_lock);
+	list_add_tail(&port_i->L, &conf->port_instances);
+	spin_unlock_bh(&conf->port_lock);
 	P->rmt_ps_queues = (void*)port_i;
 	return port_i;
 }
@@ -495,31 +627,21 @@ int f_rmt_q_destroy_policy(struct rmt_ps *ps, port_p P) {
 
 /* Helper functions */
 
-static int f_policy_base_config_apply(struct policy_parm * param, void * data) {
-	return f_policy_set_param_pv((base_config *) data, policy_param_name(param), policy_param_value(param));
-}
-
-/*
 static int f_set_policy_set_param(struct ps_base * bps, const char * name, const char * value) {
 	struct rmt_ps *ps;
+	base_config * conf;
 	ps = container_of(bps, struct rmt_ps, base);
-	return f_policy_set_param_pv((base_config *) ps->priv, name, value);
+	conf = ps->priv;
+	// Created without an RMT, staged until the first port
+	if(!(conf->state & 1)) {
+		return rmt_conf_stage_add(&conf->pending, name, value);
+	}
+	return f_policy_set_param_pv(conf, name, value);
 }
-*/
+
 
 static int f_policy_set_param_pv(base_config * conf, const char * name, const char * value) {
-	
-	char * v_name;
-	char * v_value;
-	char * p_ch;
-	u8 sub_id;
-	u8 v8;
-	u16 v16;
-	u32 v32;
-	u64 v64;
-	q_entry * entry_i;
-	qos2CU * qos2CU_i, * qos2CU_t;
-	
+	struct rmt_conf_param param;
 	
 	if (!name) {
 		LOG_ERR("Null parameter name");
@@ -529,73 +651,408 @@ static int f_policy_set_param_pv(base_config * conf, const char * name, const ch
 		LOG_ERR("Null parameter value");
 		return -1;
 	}
+	if(rmt_conf_parse(&param, name, value)) {
+		LOG_ERR("Error while parsing parameter %s with value %s", name, value);
+		return -1;
+	}
+	return f_conf_apply(conf, &param);
+}
+
+/*
+	Configuration loading
+	The parameters are staged and applied in two rounds: first the scalar
+	ones, which fix the urgency and cherish levels, then the per level (_u
+	and _c suffixes), per QoS (qos_ prefix) and per port group (group_
+	prefix) ones, once the level arrays, QoS mappings and groups exist in a
+	single block. The result is validated as a
+	whole; if anything fails the policy set is not created. Without
+	parameters it sizes the defaults, one urgency and one cherish level.
+*/
+static int f_conf_load(base_config * conf, struct policy * policy) {
+	struct rmt_conf_stage stage;
+	int ret;
 	
-	v_name = (char *) name;
-	v_value = (char *) value;
+	if(rmt_conf_stage_load(&stage, policy)) {
+		return -1;
+	}
+	ret = f_conf_load_stage(conf, &stage);
+	rmt_conf_stage_free(&stage);
+	return ret;
+}
+
+static int f_conf_load_stage(base_config * conf, const struct rmt_conf_stage * stage) {
+	struct rmt_conf_ids qos_ids, group_ids;
+	u32 i;
+	int ret;
 	
-	p_ch = strchr(v_value, '.');
-	sub_id = 0;
-	if(p_ch) {
-		*p_ch = '\0';
-		if(kstrtou8(v_value, 10, &sub_id) ||  kstrtou64(p_ch+1, 10, &v64) ) {
-			*p_ch = '.';
-			LOG_ERR("Error while parsing parameter %s with value %s", name, value);
-			return -1;
+	ret = stage->errors ? -1 : 0;
+	for(i = 0; !ret && i < stage->num; i++) {
+		if(!f_conf_indexed(stage->params[i].name)) {
+			ret = f_conf_apply_one(conf, stage->params + i);
 		}
-		*p_ch = '.';
-	} else if(kstrtou64(value, 10, &v64) ) {
-		LOG_ERR("Error while parsing parameter %s with value %s", name, value);
+	}
+	if(!ret) {
+		rmt_conf_ids_get(stage, "qos_", &qos_ids);
+		rmt_conf_ids_get(stage, "group_", &group_ids);
+		ret = f_conf_alloc(conf, &qos_ids, &group_ids);
+	}
+	for(i = 0; !ret && i < stage->num; i++) {
+		if(f_conf_indexed(stage->params[i].name)) {
+			ret = f_conf_apply_one(conf, stage->params + i);
+		}
+	}
+	if(!ret) {
+		ret = f_conf_validate(conf);
+	}
+	return ret;
+}
+
+/*
+	A policy set created without an RMT (rmt_gen) loads the parameters
+	staged until then at its first port, which only its creator adds. If
+	they are invalid no port is ever created, as the creation would have
+	failed.
+*/
+static int f_conf_load_pending(struct rmt_ps * ps, base_config * conf) {
+	int ret;
+	
+	if(conf->state & 2) {
 		return -1;
 	}
-	v32 = (u32) v64;
-	v16 = (u16) v64;
-	v8 = (u8) v64;
-		
-	switch(v_name[0]) {
-		case 'a':
-			if(strcmp(v_name, "add_buffer") == 0) {
-				while(v16 > 0) {
-					entry_i = (q_entry *) KALLOC(sizeof(q_entry));
-					if(!entry_i){						
-						LOG_ERR("Failure pre-allocating buffers");
-					} else {
-						INIT_LIST_HEAD(&entry_i->L);
-						list_add(&entry_i->L, &conf->buffer);
-						conf->buffer_size++;
-					}
-					v16--;
-				}
-				return 0;
-			}
-			break;
-		case 'b':
-			if(strcmp(v_name, "bytecost") == 0) {
-				conf->bytecost = v8;
-				return 0;
-			}
-			break;
-		case 'm' :
-			if(strcmp(v_name, "max_count") == 0) {
-				conf->max_count = v16;
-				return 0;
-			}
-			if(strcmp(v_name, "max_credit_u") == 0) {
-				if(!(conf->S & 1)) {
-					LOG_ERR("Urgency not set yet");
-					return -1;
-				}
-				conf->max_credit_u[sub_id] = v64;
-				return 0;
+	ret = f_conf_load_stage(conf, &conf->pending);
+	rmt_conf_stage_free(&conf->pending);
+	if(ret) {
+		LOG_ERR("Invalid configuration, no port will be created");
+		conf->state |= 2;
+		return -1;
+	}
+	f_conf_start(ps, conf);
+	return 0;
+}
+
+// The configuration is in use from here on, parameters are then set one by one
+static void f_conf_start(struct rmt_ps * ps, base_config * conf) {
+	conf->state |= 1;
+	
+	f_port_layout(conf);
+	if(conf->idle_us) {
+		schedule_delayed_work(&conf->idle_work, usecs_to_jiffies(conf->idle_us));
+	}
+	ps->rmt_dequeue_policy = f_dequeue_select(conf);
+}
+
+static bool f_conf_indexed(const char * name) {
+	size_t len = strlen(name);
+	
+	if(strncmp(name, "qos_", 4) == 0 || strncmp(name, "group_", 6) == 0) {
+		return true;
+	}
+	return len > 2 && name[len - 2] == '_' && (name[len - 1] == 'u' || name[len - 1] == 'c');
+}
+
+static int f_conf_apply_one(base_config * conf, const struct rmt_conf_param * param) {
+	int ret;
+	
+	ret = f_conf_apply(conf, param);
+	if(ret > 0) {
+		LOG_WARN("Unknown parameter %s, ignored", param->name);
+		return 0;
+	}
+	return ret;
+}
+
+static void * f_conf_carve(char * block, size_t * off, size_t size) {
+	void * p;
+	
+	p = block ? block + *off : NULL;
+	*off += ALIGN(size, sizeof(u64));
+	return p;
+}
+
+// Points the level arrays into block (NULL only sizes it), returns the size
+static size_t f_conf_layout(base_config * conf, char * block, u32 num_qos, qos2CU ** qos, u32 num_groups) {
+	size_t off = 0;
+	
+	*qos = f_conf_carve(block, &off, sizeof(qos2CU) * num_qos);
+	conf->gain_us_u = f_conf_carve(block, &off, sizeof(u64) * conf->levels_urgency);
+	conf->max_credit_u = f_conf_carve(block, &off, sizeof(u64) * conf->levels_urgency);
+	conf->gain_us_c = f_conf_carve(block, &off, sizeof(u64) * conf->levels_cherish);
+	conf->max_credit_c = f_conf_carve(block, &off, sizeof(u64) * conf->levels_cherish);
+	conf->red_c = f_conf_carve(block, &off, sizeof(red_c) * conf->levels_cherish);
+	conf->th_c = f_conf_carve(block, &off, sizeof(u32) * conf->levels_cherish);
+	conf->th_bytes_c = f_conf_carve(block, &off, sizeof(u32) * conf->levels_cherish);
+	conf->gain_pct_u = f_conf_carve(block, &off, sizeof(u16) * conf->levels_urgency);
+	conf->gain_pct_c = f_conf_carve(block, &off, sizeof(u16) * conf->levels_cherish);
+	conf->groups = f_conf_carve(block, &off, sizeof(struct rmt_group) * num_groups);
+	return off;
+}
+
+// Level arrays, QoS mappings and port groups of the configuration, in one allocation
+static int f_conf_alloc(base_config * conf, const struct rmt_conf_ids * qos_ids, const struct rmt_conf_ids * group_ids) {
+	qos2CU * qos2CU_i;
+	size_t size;
+	u16 id;
+	u8 i;
+	
+	size = f_conf_layout(conf, NULL, qos_ids->num, &qos2CU_i, group_ids->num);
+	conf->conf_block = KALLOC(size);
+	if(!conf->conf_block) {
+		LOG_ERR("Failure allocating memory");
+		return -1;
+	}
+	memset(conf->conf_block, 0, size);
+	f_conf_layout(conf, conf->conf_block, qos_ids->num, &qos2CU_i, group_ids->num);
+	
+	for(i = 0; i < conf->levels_urgency; i++) {
+		conf->gain_us_u[i] = 1;
+		conf->max_credit_u[i] = 10000;
+		conf->gain_pct_u[i] = 0;
+	}
+	for(i = 0; i < conf->levels_cherish; i++) {
+		conf->gain_us_c[i] = 1;
+		conf->max_credit_c[i] = 10000;
+		conf->gain_pct_c[i] = 0;
+		conf->th_c[i] = 100;
+		conf->th_bytes_c[i] = 0;
+		conf->red_c[i].min_th = 0;
+		conf->red_c[i].max_th = 0;
+		conf->red_c[i].max_p = 0;
+	}
+	conf->num_queues = conf->levels_urgency * conf->levels_cherish;
+	
+	for(id = 0; id <= RMT_CONF_MAX_ID; id++) {
+		if(!rmt_conf_ids_test(qos_ids, id)) {
+			continue;
+		}
+		list_add(&qos2CU_i->L, &conf->Q2CU);
+		qos2CU_i->qos_id = id;
+		qos2CU_i->urgency = conf->levels_urgency-1;
+		qos2CU_i->cherish = conf->levels_cherish-1;
+		qos2CU_i->mark = conf->def_mark;
+		qos2CU_i->ecn_bytes = 0;
+		qos2CU_i->reserved = 0;
+		atomic_set(&qos2CU_i->reserved_used, 0);
+		qos2CU_i->max_sojourn_us = 0;
+		qos2CU_i++;
+	}
+	
+	for(id = 0; id <= RMT_CONF_MAX_ID; id++) {
+		if(rmt_conf_ids_test(group_ids, id)) {
+			rmt_group_init(conf->groups + conf->num_groups, id);
+			conf->num_groups++;
+		}
+	}
+	return 0;
+}
+
+static int f_conf_validate(base_config * conf) {
+	struct rmt_group * group_i;
+	u8 i, j;
+	
+	for(i = 0; i < conf->num_groups; i++) {
+		group_i = conf->groups + i;
+		if(!group_i->gain_us) {
+			LOG_ERR("Port group %u without gain", group_i->id);
+			return -1;
+		}
+		for(j = 0; j < group_i->num_ports; j++) {
+			if(rmt_group_find(conf->groups, conf->num_groups, group_i->ports[j]) != group_i) {
+				LOG_ERR("Port %d in more than one port group", group_i->ports[j]);
+				return -1;
 			}
-			if(strcmp(v_name, "max_credit_c") == 0) {
-				if(!(conf->S & 2)) {
-					LOG_ERR("Cherish not set yet");
+		}
+	}
+	if(conf->bp.high && conf->bp.low >= conf->bp.high) {
+		LOG_ERR("Backpressure low watermark %u not below high %u", conf->bp.low, conf->bp.high);
+		return -1;
+	}
+	if(conf->shared_size && conf->dt_alpha == 0) {
+		LOG_ERR("Shared buffer with a zero dynamic threshold");
+		return -1;
+	}
+	for(i = 0; i < conf->levels_cherish; i++) {
+		if(conf->red_c[i].max_th && conf->red_c[i].min_th >= conf->red_c[i].max_th) {
+			LOG_ERR("RED min %u not below max %u at cherish level %u", conf->red_c[i].min_th, conf->red_c[i].max_th, i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Releases the configuration, on destroy or on a failed creation
+static void f_conf_free(base_config * conf) {
+	u8 i;
+	
+	rmt_conf_stage_free(&conf->pending);
+	
+	// Empty buffers
+	if(conf->buffer.misses) {
+		LOG_INFO("Buffer pool was empty on %llu enqueues", conf->buffer.misses);
+	}
+	rmt_pool_destroy(&conf->buffer);
+	
+	for(i = 0; i < conf->num_groups; i++) {
+		if(atomic64_read(&conf->groups[i].held)) {
+			LOG_INFO("Port group %u held its members %lld times", conf->groups[i].id, atomic64_read(&conf->groups[i].held));
+		}
+	}
+	
+	// QoS mappings and port groups live in the block
+	INIT_LIST_HEAD(&conf->Q2CU);
+	conf->groups = NULL;
+	conf->num_groups = 0;
+	if(conf->conf_block) {
+		KFREE(conf->conf_block);
+	}
+	conf->conf_block = NULL;
+}
+
+static int f_conf_apply(base_config * conf, const struct rmt_conf_param * param) {
+	const char * v_name = param->name;
+	u8 sub_id;
+	u8 v8;
+	u16 v16;
+	u32 v32;
+	u64 v64;
+	qos2CU * qos2CU_i;
+	struct rmt_group * group_i;
+	
+	// Level and QoS ids default to 0
+	if(param->id > RMT_CONF_MAX_ID && param->id != RMT_CONF_NO_ID) {
+		LOG_ERR("Invalid id %u for parameter %s", param->id, v_name);
+		return -1;
+	}
+	sub_id = param->id == RMT_CONF_NO_ID ? 0 : (u8) param->id;
+	v64 = param->v;
+	v32 = (u32) v64;
+	v16 = (u16) v64;
+	v8 = (u8) v64;
+		
+	switch(v_name[0]) {
+		case 'a':
+			if(strcmp(v_name, "age_us") == 0) {
+				conf->age_us = v32;
+				return 0;
+			}
+			if(strcmp(v_name, "age_rate") == 0) {
+				conf->age_rate = v32;
+				return 0;
+			}
+			if(strcmp(v_name, "add_buffer") == 0) {
+				if(rmt_pool_fill(&conf->buffer, v32) < v32) {
+					LOG_ERR("Failure pre-allocating buffers");
+				}
+				return 0;
+			}
+			break;
+		case 'b':
+			if(strcmp(v_name, "bytecost") == 0) {
+				conf->bytecost = v8;
+				return 0;
+			}
+			if(v_name[1] == 'p' && v_name[2] == '_' && rmt_bp_set_param(&conf->bp, v_name + 3, v32) == 0) {
+				return 0;
+			}
+			break;
+		case 'e':
+			if(strncmp(v_name, "ecn_", 4) == 0) {
+				switch(rmt_mark_set_param(&conf->def_mark, v_name + 4, v32)) {
+					case 0:
+						return 0;
+					case -1:
+						LOG_ERR("Invalid ECN %s %u", v_name + 4, v32);
+						return -1;
+				}
+			}
+			break;
+		case 'd':
+			if(strcmp(v_name, "dt_alpha") == 0) {
+				conf->dt_alpha = v16;
+				return 0;
+			}
+			break;
+		case 's':
+			if(strcmp(v_name, "shared_buffer") == 0) {
+				conf->shared_size = v32;
+				return 0;
+			}
+			if(strcmp(v_name, "sweep_us") == 0) {
+				conf->sweep_us = v32;
+				return 0;
+			}
+			break;
+		case 'c':
+			if(strcmp(v_name, "cal_window_us") == 0) {
+				conf->cal_window_us = v32;
+				return 0;
+			}
+			if(strcmp(v_name, "cut_through") == 0) {
+				conf->cut_through = v8;
+				return 0;
+			}
+			break;
+		case 'm' :
+			if(strcmp(v_name, "max_count") == 0) {
+				conf->max_count = v32;
+				return 0;
+			}
+			if(strcmp(v_name, "max_bytes") == 0) {
+				conf->max_bytes = v32;
+				return 0;
+			}
+			if(strcmp(v_name, "max_credit_u") == 0) {
+				if(sub_id >= conf->levels_urgency) {
+					LOG_ERR("Invalid urgency level %u", sub_id);
+					return -1;
+				}
+				conf->max_credit_u[sub_id] = v64;
+				return 0;
+			}
+			if(strcmp(v_name, "max_credit_c") == 0) {
+				if(sub_id >= conf->levels_cherish) {
+					LOG_ERR("Invalid cherish level %u", sub_id);
 					return -1;
 				}
 				conf->max_credit_c[sub_id] = v64;
 				return 0;
 			}
 			break;
+		case 'p':
+			if(strcmp(v_name, "pace_gran_us") == 0) {
+				if(conf->state & 1) {
+					LOG_ERR("Cannot re-configure pacing after start-up");
+					return -1;
+				}
+				conf->pace_gran_us = v32;
+				return 0;
+			}
+			if(strncmp(v_name, "pool_", 5) == 0 && rmt_pool_set_param(&conf->buffer, v_name + 5, v32) == 0) {
+				return 0;
+			}
+			break;
+		case 'n':
+			if(strcmp(v_name, "numa_node") == 0) {
+				if(conf->state & 1) {
+					LOG_ERR("Cannot re-configure the NUMA node after start-up");
+					return -1;
+				}
+				if((int) v32 != NUMA_NO_NODE && (v64 >= MAX_NUMNODES || !node_online(v32))) {
+					LOG_ERR("NUMA node %llu is not online", v64);
+					return -1;
+				}
+				conf->numa_node = v32;
+				return 0;
+			}
+			break;
+		case 'i':
+			if(strcmp(v_name, "idle_us") == 0) {
+				conf->idle_us = v32;
+				if((conf->state & 1) && v32) {
+					schedule_delayed_work(&conf->idle_work, usecs_to_jiffies(v32));
+				}
+				return 0;
+			}
+			break;
 		case 'h':
 			if(strcmp(v_name, "header_weight") == 0) {
 				conf->headers_weight = v8;
@@ -604,171 +1061,211 @@ static int f_policy_set_param_pv(base_config * conf, const char * name, const ch
 			break;
 		case 'l':
 			if(strcmp(v_name, "levels_urgency") == 0) {
-				if(conf->S & 1) {
+				if(conf->conf_block) {
 					LOG_ERR("Urgency already set");
 					return -1;
 				}
-				if(v8 == 0){
-					LOG_ERR("Required at least one urgency level");
+				if(v64 == 0 || v64 > U8_MAX){
+					LOG_ERR("Required between 1 and %u urgency levels", U8_MAX);
 					return -1;
 				}
-				conf->gain_us_u = (u64 *) KALLOC(sizeof(u64) * v8);
-				conf->max_credit_u = (u64 *) KALLOC(sizeof(u64) * v8);
-				if(conf->gain_us_u == NULL ||conf->max_credit_u == NULL) {
-					if(conf->gain_us_u) {
-						KFREE(conf->gain_us_u);
-						conf->gain_us_u = NULL;
-					}
-					if(conf->max_credit_u) {
-						KFREE(conf->max_credit_u);
-						conf->max_credit_u = NULL;
-					}
-					LOG_ERR("Failure allocating memory");
-					return -1;
-				}
-				
-				while(v8 > 0) {
-					v8--;
-					conf->gain_us_u[v8] = 1;
-					conf->max_credit_u[v8] = 10000;
-				}
-				
 				conf->levels_urgency = v8;
-				conf->S |= 1;
 				return 0;
 			}
 			if(strcmp(v_name, "levels_cherish") == 0) {
-				if(conf->S & 2) {
+				if(conf->conf_block) {
 					LOG_ERR("Cherish already set");
 					return -1;
 				}
-				if(v8 == 0){
-					LOG_ERR("Required at least one cherish level");
+				if(v64 == 0 || v64 > U8_MAX){
+					LOG_ERR("Required between 1 and %u cherish levels", U8_MAX);
 					return -1;
 				}
-				conf->gain_us_c = (u64 *) KALLOC(sizeof(u64) * v8);
-				conf->max_credit_c = (u64 *) KALLOC(sizeof(u64) * v8);
-				conf->th_c = (u16 *) KALLOC(sizeof(u16) * v8);
-				if(conf->gain_us_c == NULL ||conf->max_credit_c == NULL
-					||conf->th_c == NULL) {
-					if(conf->gain_us_c) {
-						KFREE(conf->gain_us_c);
-						conf->gain_us_c = NULL;
-					}
-					if(conf->max_credit_c) {
-						KFREE(conf->max_credit_c);
-						conf->max_credit_c = NULL;
-					}
-					if(conf->th_c) {
-						KFREE(conf->th_c);
-						conf->th_c = NULL;
-					}
-					LOG_ERR("Failure allocating memory");
-					return -1;
-				}
-				
-				while(v8 > 0) {
-					v8--;
-					conf->gain_us_c[v8] = 1;
-					conf->max_credit_c[v8] = 10000;
-					conf->th_c[v8] = 100;
-				}
 				conf->levels_cherish = v8;
-				conf->S |= 2;
 				return 0;
 			}
 			break;
 		case 'g':
-			if(strcmp(v_name, "gain_us_u") == 0) {
-				if(!(conf->S & 1)) {
-					LOG_ERR("Urgency not set yet");
+			if(strncmp(v_name, "group_", 6) == 0) {
+				group_i = f_group_get(conf, sub_id);
+				if(!group_i) {
+					return -1;
+				}
+				// Members are looked up when their port is created, checked as a whole at creation
+				if((conf->state & 1) && strcmp(v_name + 6, "port") == 0
+					&& v64 <= INT_MAX && rmt_group_find(conf->groups, conf->num_groups, (int) v64)) {
+					LOG_ERR("Port %llu already in a port group", v64);
 					return -1;
 				}
-				conf->gain_us_u[sub_id] = v64;
+				switch(rmt_group_set_param(group_i, v_name + 6, v64)) {
+					case 0:
+						return 0;
+					case -1:
+						LOG_ERR("Invalid %s %llu at port group %u", v_name + 6, v64, sub_id);
+						return -1;
+				}
+				break;
+			}
+			if(strcmp(v_name, "gain_us_u") == 0 || strcmp(v_name, "gain_pct_u") == 0) {
+				if(sub_id >= conf->levels_urgency) {
+					LOG_ERR("Invalid urgency level %u", sub_id);
+					return -1;
+				}
+				if(v_name[5] == 'u') {
+					conf->gain_us_u[sub_id] = v64;
+				} else {
+					conf->gain_pct_u[sub_id] = v16;
+				}
 				return 0;
 			}
-			if(strcmp(v_name, "gain_us_c") == 0) {
-				if(!(conf->S & 2)) {
-					LOG_ERR("Cherish not set yet");
+			if(strcmp(v_name, "gain_us_c") == 0 || strcmp(v_name, "gain_pct_c") == 0) {
+				if(sub_id >= conf->levels_cherish) {
+					LOG_ERR("Invalid cherish level %u", sub_id);
 					return -1;
 				}
-				conf->gain_us_c[sub_id] = v64;
+				if(v_name[5] == 'u') {
+					conf->gain_us_c[sub_id] = v64;
+				} else {
+					conf->gain_pct_c[sub_id] = v16;
+				}
 				return 0;
 			}
 			break;
 		case 't':
-			if(strcmp(v_name, "th_c") == 0) {
-				if(!(conf->S & 2)) {
-					LOG_ERR("Cherish not set yet");
+			if(strcmp(v_name, "th_c") == 0 || strcmp(v_name, "th_bytes_c") == 0) {
+				if(sub_id >= conf->levels_cherish) {
+					LOG_ERR("Invalid cherish level %u", sub_id);
 					return -1;
 				}
-				conf->th_c[sub_id] = v16;
+				if(v_name[3] == 'c') {
+					conf->th_c[sub_id] = v32;
+				} else {
+					conf->th_bytes_c[sub_id] = v32;
+				}
 				return 0;
 			}
 			break;
-		case 'q':
-			qos2CU_i = NULL;
-			list_for_each_entry(qos2CU_t, &conf->Q2CU, L) {
-				if (sub_id == (u8) qos2CU_t->qos_id) {
-					qos2CU_i = qos2CU_t;
+		case 'r':
+			if(strcmp(v_name, "red_wq") == 0) {
+				if(v8 > 16) {
+					LOG_ERR("Invalid RED weight %u", v8);
+					return -1;
 				}
+				conf->red_wq = v8;
+				return 0;
 			}
-			if(strcmp(v_name, "qos_urgency") == 0) {
-				if(qos2CU_i == NULL) {
-					qos2CU_i = (qos2CU *) KALLOC(sizeof(qos2CU));
-					if(!qos2CU_i){						
-						LOG_ERR("Failure allocating qos conf");
+			if(v_name[1] == 'e' && v_name[2] == 'd' && v_name[3] == '_') {
+				if(sub_id >= conf->levels_cherish) {
+					LOG_ERR("Invalid cherish level %u", sub_id);
+					return -1;
+				}
+				if(strcmp(v_name, "red_min_c") == 0) {
+					conf->red_c[sub_id].min_th = v32;
+					return 0;
+				}
+				if(strcmp(v_name, "red_max_c") == 0) {
+					conf->red_c[sub_id].max_th = v32;
+					return 0;
+				}
+				if(strcmp(v_name, "red_pmax_c") == 0) {
+					if(v64 > 100) {
+						LOG_ERR("Invalid RED max probability %llu", v64);
 						return -1;
 					}
-					list_add(&qos2CU_i->L, &conf->Q2CU);
-					qos2CU_i->qos_id = sub_id;
-					qos2CU_i->urgency = v8;
-					qos2CU_i->cherish = conf->levels_cherish-1;
-					qos2CU_i->ecn = conf->default_ecn;
-				} else {
-					qos2CU_i->urgency = v8;
+					conf->red_c[sub_id].max_p = v64 < 100 ? (u16) div_u64(v64 << 16, 100) : 0xFFFF;
+					return 0;
+				}
+			}
+			break;
+		case 'q':
+			if(strncmp(v_name, "qos_", 4) != 0) {
+				break;
+			}
+			qos2CU_i = f_qos2CU_get(conf, sub_id);
+			if(!qos2CU_i) {
+				return -1;
+			}
+			if(strcmp(v_name, "qos_urgency") == 0) {
+				if(v64 >= conf->levels_urgency) {
+					LOG_ERR("Invalid urgency level %llu at QoS %u", v64, sub_id);
+					return -1;
 				}
+				qos2CU_i->urgency = v8;
+				return 0;
 			}
 			if(strcmp(v_name, "qos_cherish") == 0) {
-				if(qos2CU_i == NULL) {
-					qos2CU_i = (qos2CU *) KALLOC(sizeof(qos2CU));
-					if(!qos2CU_i){						
-						LOG_ERR("Failure allocating qos conf");
-						return -1;
-					}
-					list_add(&qos2CU_i->L, &conf->Q2CU);
-					qos2CU_i->qos_id = sub_id;
-					qos2CU_i->urgency = conf->levels_urgency-1;
-					qos2CU_i->ecn = conf->default_ecn;
-					qos2CU_i->cherish = v8;
-				} else {
-					qos2CU_i->cherish = v8;
+				if(v64 >= conf->levels_cherish) {
+					LOG_ERR("Invalid cherish level %llu at QoS %u", v64, sub_id);
+					return -1;
 				}
+				qos2CU_i->cherish = v8;
+				return 0;
 			}
 			if(strcmp(v_name, "qos_ecn") == 0) {
-				if(qos2CU_i == NULL) {
-					qos2CU_i = (qos2CU *) KALLOC(sizeof(qos2CU));
-					if(!qos2CU_i){						
-						LOG_ERR("Failure allocating qos conf");
+				qos2CU_i->mark.min_th = v32;
+				return 0;
+			}
+			if(strcmp(v_name, "qos_ecn_bytes") == 0) {
+				qos2CU_i->ecn_bytes = v32;
+				return 0;
+			}
+			if(strncmp(v_name, "qos_ecn_", 8) == 0) {
+				switch(rmt_mark_set_param(&qos2CU_i->mark, v_name + 8, v32)) {
+					case 0:
+						return 0;
+					case -1:
+						LOG_ERR("Invalid ECN %s %u at QoS %u", v_name + 8, v32, sub_id);
 						return -1;
-					}
-					list_add(&qos2CU_i->L, &conf->Q2CU);
-					qos2CU_i->qos_id = sub_id;
-					qos2CU_i->urgency = conf->levels_urgency-1;
-					qos2CU_i->ecn = v16;
-				} else {
-					qos2CU_i->ecn = v16;
 				}
 			}
+			if(strcmp(v_name, "qos_reserved") == 0) {
+				qos2CU_i->reserved = v16;
+				return 0;
+			}
+			if(strcmp(v_name, "qos_max_sojourn_us") == 0) {
+				qos2CU_i->max_sojourn_us = v32;
+				if(v32) {
+					conf->lifetimes = 1;
+				}
+				return 0;
+			}
 			break;
 	}
 	return 1;
 }
 
+// QoS mappings are all created with the configuration block
+static qos2CU * f_qos2CU_get(base_config * conf, u8 qos_id) {
+	qos2CU * qos2CU_i;
+	
+	list_for_each_entry(qos2CU_i, &conf->Q2CU, L) {
+		if (qos_id == (u8) qos2CU_i->qos_id) {
+			return qos2CU_i;
+		}
+	}
+	LOG_ERR("No mapping for QoS %u", qos_id);
+	return NULL;
+}
+
 void f_free_port_instance(base_config * conf, port_instance * port_i) {
 	q_entry * entry_i;
 	u16 nQ;
 	queue * current_q;
+	list_h pending;
+	
+	port_i->P->rmt_ps_queues = NULL;
+	spin_lock_bh(&conf->port_lock);
+	list_del(&port_i->L);
+	spin_unlock_bh(&conf->port_lock);
+	
+	if(port_i->bp_paused) {
+		rmt_bp_notify(&rlim_bp_chain, port_i->P, 0, RMT_BP_RESUME);
+	}
+	
+	if(!port_i->Q) {
+		KFREE(port_i);
+		return;
+	}
 	
 	current_q = port_i->Q;
 	nQ = conf->num_queues;
@@ -776,29 +1273,543 @@ void f_free_port_instance(base_config * conf, port_instance * port_i) {
 		while(current_q->count != 0) {
 			entry_i = list_first_entry(&current_q->q, q_entry, L);
 			list_del(&entry_i->L);
-			list_add(&entry_i->L, &conf->buffer);
-			
+			f_shared_release(entry_i);
+			pdu_destroy(entry_i->data);
+			rmt_pool_put(&conf->buffer, entry_i);
 			current_q->count--;
-			conf->buffer_size++;
 		}
 		current_q++;
 	}
 	
-	port_i->P->rmt_ps_queues = NULL;
-	list_del(&port_i->L);
+	if(port_i->wheel) {
+		INIT_LIST_HEAD(&pending);
+		rmt_wheel_flush(port_i->wheel, &pending);
+		while(!list_empty(&pending)) {
+			entry_i = list_first_entry(&pending, q_entry, W.L);
+			list_del(&entry_i->W.L);
+			f_shared_release(entry_i);
+			pdu_destroy(entry_i->data);
+			rmt_pool_put(&conf->buffer, entry_i);
+		}
+	}
+	
+	if(port_i->expired) {
+		LOG_INFO("Port discarded %llu PDUs past their deadline", port_i->expired);
+	}
+	if(port_i->aged) {
+		LOG_INFO("Port served %llu PDUs past age_us ahead of their turn", port_i->aged);
+	}
+	f_port_compact(port_i);
+	KFREE(port_i);
+}
+
+/*
+	Port instance layout
+	The port_instance keeps its hot fields in the first cacheline. Queue state
+	is a separate block: credits and gains of every level, then the queues
+	starting on their own cacheline and, with pacing, the wheel and the
+	departure times of every level.
+*/
+static void f_port_layout(base_config * conf) {
+	conf->state_off_q = ALIGN((sizeof(s64) + sizeof(u64)) * (conf->levels_urgency + conf->levels_cherish), L1_CACHE_BYTES);
+	conf->state_size = conf->state_off_q + sizeof(queue) * conf->num_queues;
+	if(conf->pace_gran_us) {
+		conf->state_off_wheel = ALIGN(conf->state_size, L1_CACHE_BYTES);
+		conf->state_size = conf->state_off_wheel + sizeof(struct rmt_wheel)
+			+ sizeof(u64) * (conf->levels_urgency + conf->levels_cherish);
+	}
+	
+	LOG_INFO("Port instance layout: %zu bytes, hot state %zu bytes, cold state at %zu; queue state %u bytes, queues at %u, node %d",
+		sizeof(port_instance), offsetof(port_instance, bytes) + sizeof(u32), offsetof(port_instance, L),
+		conf->state_size, conf->state_off_q, conf->numa_node);
+	if(offsetof(port_instance, bytes) + sizeof(u32) > L1_CACHE_BYTES) {
+		LOG_WARN("Port instance hot state spans more than one cacheline");
+	}
+}
+
+/*
+	Rate calibration
+	Called for every PDU served. The time between two consecutive dequeues is
+	accounted as service time of the first PDU only if PDUs were still waiting,
+	so idle periods do not lower the measured rate.
+*/
+static void f_port_calibrate(base_config * conf, port_instance * port_i, u64 T, u32 cost) {
+	u64 sample;
 	
+	if(port_i->cal_last_cost) {
+		port_i->cal_us += T;
+		port_i->cal_credits += port_i->cal_last_cost;
+	}
+	port_i->cal_last_cost = port_i->count > 0 ? cost : 0;
+	
+	if(port_i->cal_us == 0 || port_i->cal_us < conf->cal_window_us) {
+		return;
+	}
+	
+	sample = div_u64(port_i->cal_credits * 1000000, port_i->cal_us);
+	if(port_i->rate) {
+		port_i->rate = port_i->rate - (port_i->rate >> 3) + (sample >> 3);
+	} else {
+		port_i->rate = sample;
+	}
+	port_i->cal_us = 0;
+	port_i->cal_credits = 0;
+	
+	f_port_set_gains(conf, port_i);
+}
+
+static void f_port_set_gains(base_config * conf, port_instance * port_i) {
+	u8 i;
+	
+	for(i = 0; i < conf->levels_urgency; i++) {
+		if(port_i->rate && conf->gain_pct_u[i]) {
+			port_i->gain_u[i] = div_u64(port_i->rate * conf->gain_pct_u[i], 100000000);
+			if(!port_i->gain_u[i]) {
+				port_i->gain_u[i] = 1;
+			}
+		} else {
+			port_i->gain_u[i] = conf->gain_us_u[i];
+		}
+	}
+	for(i = 0; i < conf->levels_cherish; i++) {
+		if(port_i->rate && conf->gain_pct_c[i]) {
+			port_i->gain_c[i] = div_u64(port_i->rate * conf->gain_pct_c[i], 100000000);
+			if(!port_i->gain_c[i]) {
+				port_i->gain_c[i] = 1;
+			}
+		} else {
+			port_i->gain_c[i] = conf->gain_us_c[i];
+		}
+	}
+}
+
+/*
+	Idle ports
+	Queue state is allocated on the first enqueue. Ports that stay empty for
+	idle_us are compacted back by a periodic sweep, which takes the RMT port
+	lock to serialise with enqueue/dequeue and skips ports it cannot lock.
+	The measured rate is kept in the port_instance, so gains are restored on
+	the next activation.
+*/
+static int f_port_activate(base_config * conf, port_instance * port_i) {
+	char * state;
+	u8 i, j;
+	queue * q;
+	
+	state = (char *) KALLOC_NODE(conf->state_size, conf->numa_node);
+	if(!state) {
+		return -1;
+	}
+	port_i->credits_u = (s64 *) state;
+	port_i->credits_c = port_i->credits_u + conf->levels_urgency;
+	port_i->gain_u = (u64 *) (port_i->credits_c + conf->levels_cherish);
+	port_i->gain_c = port_i->gain_u + conf->levels_urgency;
+	port_i->Q = (queue *) (state + conf->state_off_q);
+	port_i->wheel = NULL;
+	port_i->next_u = NULL;
+	port_i->next_c = NULL;
+	if(conf->pace_gran_us) {
+		port_i->wheel = (struct rmt_wheel *) (state + conf->state_off_wheel);
+		rmt_wheel_init(port_i->wheel, div_u64(ktime_get_ns(), conf->pace_gran_us * NSEC_PER_USEC));
+		port_i->next_u = (u64 *) (port_i->wheel + 1);
+		port_i->next_c = port_i->next_u + conf->levels_urgency;
+		for(i = 0 ; i < conf->levels_urgency; i++) {
+			port_i->next_u[i] = 0;
+		}
+		for(i = 0 ; i < conf->levels_cherish; i++) {
+			port_i->next_c[i] = 0;
+		}
+	}
+	
+	for(i = 0 ; i < conf->levels_urgency; i++) {
+		port_i->credits_u[i] = 0;
+	}
+	for(i = 0 ; i < conf->levels_cherish; i++) {
+		port_i->credits_c[i] = 0;
+	}
+	for(i = 0 ; i < conf->levels_urgency; i++) {
+		for(j = 0 ; j < conf->levels_cherish; j++) {
+			q = &port_i->Q[i*conf->levels_cherish + j];
+			q->count = 0;
+			q->urgency = i;
+			q->cherish = j;
+			INIT_LIST_HEAD(&q->q);
+		}
+	}
+	f_port_set_gains(conf, port_i);
+	
+	return 0;
+}
+
+static void f_port_compact(port_instance * port_i) {
 	if(port_i->credits_u) {
 		KFREE(port_i->credits_u);
 	}
-	if(port_i->credits_c) {
-		KFREE(port_i->credits_c);
+	port_i->credits_u = NULL;
+	port_i->credits_c = NULL;
+	port_i->gain_u = NULL;
+	port_i->gain_c = NULL;
+	port_i->Q = NULL;
+	port_i->wheel = NULL;
+	port_i->next_u = NULL;
+	port_i->next_c = NULL;
+}
+
+static void f_idle_sweep(struct work_struct * work) {
+	base_config * conf;
+	port_instance * port_i;
+	Time_t t1, td;
+	
+	conf = container_of(to_delayed_work(work), base_config, idle_work);
+	if(!conf->idle_us) {
+		return;
 	}
-	if(port_i->Q) {
-		KFREE(port_i->Q);
+	
+	getnstimeofday (&t1);
+	spin_lock_bh(&conf->port_lock);
+	list_for_each_entry(port_i, &conf->port_instances, L) {
+		if(!port_i->Q || !spin_trylock(&port_i->P->lock)) {
+			continue;
+		}
+		if(port_i->Q && port_i->count == 0 && timespec_compare(&port_i->lastT, &t1) < 0) {
+			td = timespec_sub(t1, port_i->lastT);
+			if((u64) td.tv_sec * 1000000 + td.tv_nsec / 1000 >= conf->idle_us) {
+				f_port_compact(port_i);
+			}
+		}
+		spin_unlock(&port_i->P->lock);
 	}
-	KFREE(port_i);
+	spin_unlock_bh(&conf->port_lock);
+	
+	schedule_delayed_work(&conf->idle_work, usecs_to_jiffies(conf->idle_us));
 }
 
+/*
+	Shared buffer admission (Choudhury-Hahne dynamic threshold)
+	A PDU first takes a slot of its QoS reserve, if any is free. Otherwise it is
+	admitted to the shared buffer while the port holds less than dt_alpha % of
+	the free shared space. Returns the counter charged, NULL if dropped.
+*/
+static atomic_t * f_shared_admit(base_config * conf, port_instance * port_i, qos2CU * qos_i) {
+	int used;
+	
+	if(qos_i && qos_i->reserved) {
+		if(atomic_inc_return(&qos_i->reserved_used) <= qos_i->reserved) {
+			return &qos_i->reserved_used;
+		}
+		atomic_dec(&qos_i->reserved_used);
+	}
+	
+	used = atomic_read(&conf->shared_used);
+	if(used >= conf->shared_size
+		|| (u64) port_i->count * 100 >= (u64) (conf->shared_size - used) * conf->dt_alpha) {
+		return NULL;
+	}
+	if(atomic_inc_return(&conf->shared_used) > conf->shared_size) {
+		atomic_dec(&conf->shared_used);
+		return NULL;
+	}
+	return &conf->shared_used;
+}
+
+static void f_shared_release(q_entry * entry_i) {
+	if(entry_i->pool) {
+		atomic_dec(entry_i->pool);
+		entry_i->pool = NULL;
+	}
+}
+
+/*
+	Pacing
+	With pace_gran_us set, credits are not used to decide eligibility. Each
+	urgency and each cherish level keeps the departure time of its next PDU.
+	A PDU leaves at the later of the two of its queue, and moves both on by
+	its cost over the gain of their level, so every level, whichever queues
+	it spreads over, stays at its own gain. It is then put on the port
+	timing wheel. Dequeue moves what is due to the queues and serves them by
+	priority.
+*/
+static void f_pace_stamp(base_config * conf, port_instance * port_i, q_entry * entry_i, u64 now) {
+	queue * q;
+	u64 gain, edt;
+	
+	q = port_i->Q + entry_i->q_id;
+	edt = max(now, max(port_i->next_u[q->urgency], port_i->next_c[q->cherish]));
+	gain = port_i->gain_u[q->urgency];
+	port_i->next_u[q->urgency] = edt + div64_u64((u64) entry_i->cost * NSEC_PER_USEC, gain ? gain : 1);
+	gain = port_i->gain_c[q->cherish];
+	port_i->next_c[q->cherish] = edt + div64_u64((u64) entry_i->cost * NSEC_PER_USEC, gain ? gain : 1);
+	
+	rmt_wheel_add(port_i->wheel, &entry_i->W, div_u64(edt, conf->pace_gran_us * NSEC_PER_USEC));
+}
+
+static void f_pace_release(base_config * conf, port_instance * port_i) {
+	struct rmt_wheel_node * node;
+	q_entry * entry_i;
+	queue * q;
+	u64 now, slot;
+	
+	now = ktime_get_ns();
+	slot = div_u64(now, conf->pace_gran_us * NSEC_PER_USEC);
+	while((node = rmt_wheel_pop(port_i->wheel, slot))) {
+		entry_i = container_of(node, q_entry, W);
+		if(entry_i->deadline && now >= entry_i->deadline) {
+			port_i->count--;
+			port_i->bytes -= entry_i->len;
+			f_entry_expire(conf, port_i, entry_i);
+			continue;
+		}
+		q = port_i->Q + entry_i->q_id;
+		list_add_tail(&entry_i->L, &q->q);
+		q->count++;
+	}
+}
+
+/*
+	Aging guard
+	Urgency order and credits cascading to the urgent levels can hold a
+	queue back indefinitely. Each dequeue probes the head of one queue, in
+	turn, and serves it instead of sel_q if it has waited age_us, at most
+	age_rate times a second per port. One probe per dequeue keeps the
+	selection O(1); a head waits about age_us plus a round of probes.
+*/
+static queue * f_age_pick(base_config * conf, port_instance * port_i, queue * sel_q, u64 now) {
+	queue * q;
+	q_entry * head;
+	
+	if(now < port_i->age_next) {
+		return NULL;
+	}
+	q = port_i->Q + port_i->age_q;
+	if(++port_i->age_q >= conf->num_queues) {
+		port_i->age_q = 0;
+	}
+	if(q == sel_q || q->count == 0) {
+		return NULL;
+	}
+	head = list_first_entry(&q->q, q_entry, L);
+	if(!head->enq_ns || now - head->enq_ns < (u64) conf->age_us * NSEC_PER_USEC) {
+		return NULL;
+	}
+	return q;
+}
+
+/*
+	Port groups
+	Members of a group hold their queues while the group has no credits,
+	and spend the cost of every PDU served or cut through. A port joins the
+	group listing it when its queues are created.
+*/
+static struct rmt_group * f_group_get(base_config * conf, u16 id) {
+	u8 i;
+	
+	for(i = 0; i < conf->num_groups; i++) {
+		if(conf->groups[i].id == id) {
+			return conf->groups + i;
+		}
+	}
+	LOG_ERR("Unknown port group %u", id);
+	return NULL;
+}
+
+static bool f_group_admit(port_instance * port_i, u64 * now) {
+	if(!*now) {
+		*now = ktime_get_ns();
+	}
+	return rmt_group_admit(port_i->group, *now);
+}
+
+/*
+	Cut-through
+	With nothing queued in the port, a PDU would be served at once if some
+	urgency level up to its own and some cherish level up to its own have
+	credits, as in the dequeue. Those credits are spent here. With pacing
+	PDUs always go through the wheel.
+*/
+static bool f_cut_through(base_config * conf, port_instance * port_i, u8 urgency, u8 cherish, u32 len) {
+	u32 cost;
+	u8 i;
+	
+	if(port_i->wheel) {
+		return false;
+	}
+	if(port_i->group && !rmt_group_admit(port_i->group, ktime_get_ns())) {
+		return false;
+	}
+	for(i = 0; i <= urgency && port_i->credits_u[i] <= 0; i++);
+	if(i > urgency) {
+		return false;
+	}
+	for(i = 0; i <= cherish && port_i->credits_c[i] <= 0; i++);
+	if(i > cherish) {
+		return false;
+	}
+	
+	cost = (len + conf->headers_weight) * conf->bytecost;
+	spend(port_i->credits_u, cost, urgency, conf->levels_urgency, conf->max_credit_u);
+	spend(port_i->credits_c, cost, cherish, conf->levels_cherish, conf->max_credit_c);
+	if(port_i->group) {
+		rmt_group_spend(port_i->group, cost);
+	}
+	return true;
+}
+
+/*
+	PDU lifetime
+	PDUs of a QoS with qos_max_sojourn_us get a deadline at enqueue. Expired
+	PDUs are discarded without being served when they reach the head of
+	their queue or leave the pacing wheel, and every sweep_us the dequeue
+	also sweeps all the queues of the port. They are counted apart from
+	overflow drops. Callers update the queue and port counters.
+*/
+static void f_entry_expire(base_config * conf, port_instance * port_i, q_entry * entry_i) {
+	pdu_destroy(entry_i->data);
+	f_shared_release(entry_i);
+	rmt_pool_put(&conf->buffer, entry_i);
+	port_i->expired++;
+}
+
+static void f_expire_sweep(base_config * conf, port_instance * port_i, u64 now) {
+	q_entry * entry_i, * entry_n;
+	queue * current_q;
+	u16 nQ;
+	
+	port_i->last_sweep = now;
+	current_q = port_i->Q;
+	for(nQ = conf->num_queues; nQ > 0; nQ--, current_q++) {
+		list_for_each_entry_safe(entry_i, entry_n, &current_q->q, L) {
+			if(entry_i->deadline && now >= entry_i->deadline) {
+				list_del(&entry_i->L);
+				current_q->count--;
+				port_i->count--;
+				port_i->bytes -= entry_i->len;
+				f_entry_expire(conf, port_i, entry_i);
+			}
+		}
+	}
+}
+
+/*
+	ECN marking measure: PDUs or bytes waiting on the port, or the time
+	entry_i has spent since its enqueue in us (0 without entry).
+*/
+static u32 f_mark_value(port_instance * port_i, const struct rmt_mark * mark, q_entry * entry_i, u64 now) {
+	switch(mark->metric) {
+		case RMT_MARK_BYTES:
+			return port_i->bytes;
+		case RMT_MARK_SOJOURN:
+			if(!entry_i || now < entry_i->enq_ns) {
+				return 0;
+			}
+			return div_u64(now - entry_i->enq_ns, NSEC_PER_USEC);
+		default:
+			return port_i->count;
+	}
+}
+
+
+/*
+	Early drop (RED)
+	red_avg is updated on every enqueue. Below min_th nothing is dropped, from
+	max_th on everything is, and in between PDUs are dropped with a probability
+	growing linearly up to max_p. prandom_u32 keeps its state per CPU.
+*/
+static int f_red_drop(base_config * conf, port_instance * port_i, u8 cherish) {
+	red_c * red_i;
+	u64 min_fp, max_fp;
+	u64 p;
+	
+	red_i = conf->red_c + cherish;
+	min_fp = (u64) red_i->min_th << RED_AVG_SHIFT;
+	max_fp = (u64) red_i->max_th << RED_AVG_SHIFT;
+	
+	if(port_i->red_avg >= max_fp) {
+		return 1;
+	}
+	if(port_i->red_avg < min_fp) {
+		return 0;
+	}
+	
+	p = div64_u64((u64) red_i->max_p * (port_i->red_avg - min_fp), max_fp - min_fp);
+	return (prandom_u32() & 0xFFFF) < p;
+}
+
+
+/*
+	Invariant checks (make RMT_CHECK=1), see rmt-check.h.
+	Queue and wheel counters must match the PDUs actually queued, and no
+	level may keep more credits than its max_credit once spend() has
+	carried the excess over.
+*/
+static void f_check_port(base_config * conf, port_instance * port_i) {
+	q_entry * entry_i;
+	queue * current_q;
+	u32 count, bytes, n;
+	u16 i;
+	
+	if(!port_i->Q) {
+		rmt_check(!port_i->count && !port_i->bytes, "idle port %d counts %u PDUs and %u bytes",
+			port_i->P->port_id, port_i->count, port_i->bytes);
+		return;
+	}
+	
+	count = 0;
+	bytes = 0;
+	current_q = port_i->Q;
+	for(i = 0; i < conf->num_queues; i++, current_q++) {
+		n = 0;
+		list_for_each_entry(entry_i, &current_q->q, L) {
+			n++;
+			bytes += entry_i->len;
+		}
+		rmt_check(n == current_q->count, "port %d queue %u holds %u PDUs, counted %u",
+			port_i->P->port_id, i, n, current_q->count);
+		count += n;
+	}
+	
+	// Bytes on the wheel are not walked
+	if(port_i->wheel) {
+		count += port_i->wheel->count;
+	} else {
+		rmt_check(bytes == port_i->bytes, "port %d holds %u bytes, counted %u",
+			port_i->P->port_id, bytes, port_i->bytes);
+	}
+	rmt_check(count == port_i->count, "port %d holds %u PDUs, counted %u",
+		port_i->P->port_id, count, port_i->count);
+	rmt_check(!conf->shared_size || atomic_read(&conf->shared_used) <= conf->shared_size,
+		"shared buffer holds %d PDUs, size %u", atomic_read(&conf->shared_used), conf->shared_size);
+}
+
+static void f_check_credits(base_config * conf, port_instance * port_i) {
+	u8 i;
+	
+	for(i = 0; i < conf->levels_urgency; i++) {
+		rmt_check(port_i->credits_u[i] <= (s64) conf->max_credit_u[i],
+			"port %d urgency %u has %lld credits, max %llu",
+			port_i->P->port_id, i, port_i->credits_u[i], conf->max_credit_u[i]);
+	}
+	for(i = 0; i < conf->levels_cherish; i++) {
+		rmt_check(port_i->credits_c[i] <= (s64) conf->max_credit_c[i],
+			"port %d cherish %u has %lld credits, max %llu",
+			port_i->P->port_id, i, port_i->credits_c[i], conf->max_credit_c[i]);
+	}
+}
+
+
+/*
+	Backpressure listeners, called with RMT_BP_PAUSE / RMT_BP_RESUME and a
+	struct rmt_bp_info when a port crosses bp_high / bp_low.
+*/
+int rmt_rlim_bp_register(struct notifier_block * nb) {
+	return atomic_notifier_chain_register(&rlim_bp_chain, nb);
+}
+EXPORT_SYMBOL(rmt_rlim_bp_register);
+
+int rmt_rlim_bp_unregister(struct notifier_block * nb) {
+	return atomic_notifier_chain_unregister(&rlim_bp_chain, nb);
+}
+EXPORT_SYMBOL(rmt_rlim_bp_unregister);
+
 
 /*
 	Policy init and exit
@@ -809,6 +1820,18 @@ static struct ps_factory qta_factory = {
 		.destroy = f_policy_destroy,
 };
 
+// Invariant checks failed so far, see rmt-check.h
+int rmt_rlim_check_failed(void) {
+	return atomic_read(&rmt_check_failed);
+}
+EXPORT_SYMBOL(rmt_rlim_check_failed);
+
+// Factory for in-kernel users other than the RMT (e.g. rmt_gen)
+struct ps_factory * rmt_rlim_ps_factory(void) {
+	return &qta_factory;
+}
+EXPORT_SYMBOL(rmt_rlim_ps_factory);
+
 static int __init mod_init(void) {
 	strcpy(qta_factory.name, RINA_QTA_MUX_ps_NAME);
 	if (rmt_ps_publish(&qta_factory)) {
@@ -2,14 +2,29 @@
 #include <linux/module.h>
 #include <linux/list.h>
 #include <linux/time.h>
+#include <linux/math64.h>
+#include <linux/cache.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
 #include <linux/export.h>
 #include <linux/string.h>
+#include <linux/nodemask.h>
 
 #include "logs.h"
 #include "rds/rmem.h"
 #include "rmt-ps.h"
 #include "policies.h"
 #include "debug.h"
+#include "rmt-wheel.h"
+#include "rmt-mark.h"
+#include "rmt-bp.h"
+#include "rmt-check.h"
+#include "rmt-conf.h"
+#include "rmt-pool.h"
+#include "rmt-group.h"
 
 /*
 typedef unsigned char u8;
@@ -26,6 +41,10 @@ typedef struct list_head list_h;
 typedef struct pdu * pdu_p;
 typedef struct rmt_n1_port * port_p;
 typedef struct timespec Time_t;
+typedef pdu_p (* dequeue_f)(struct rmt_ps * ps, port_p P);
+
+// Fixed point shift of the RED average occupancy
+#define RED_AVG_SHIFT 10
 
 /// Data structures
 
@@ -34,69 +53,172 @@ typedef struct q_entry_s {
 	
 	pdu_p data;
 	u32 cost;
+	u32 len; // PDU length in bytes
+	atomic_t * pool; // Shared buffer counter charged by this PDU, if any
+	u16 q_id; // Queue of the PDU while on the pacing wheel
+	const struct rmt_mark * mark; // ECN marking at dequeue, NULL -> none
+	u64 enq_ns; // Enqueue time for sojourn marking
+	u64 deadline; // Discard time in ns, 0 -> never
+	struct rmt_wheel_node W; // Pacing wheel node
 } q_entry;
 
 typedef struct queue_t {
-	u16 count;
+	u32 count;
 	u8 urgency;
 	u8 cherish;
 	
 	list_h q;
 } queue;
 
+typedef struct red_c_t {
+	u32 min_th; // Average occupancy where early drop starts
+	u32 max_th; // Average occupancy where every PDU is dropped, 0 -> RED disabled
+	u16 max_p; // Drop probability at max_th, in 1/65536
+} red_c;
+
 typedef struct qos2CU_t {
 	list_h L;
 	
 	qos_id_t qos_id;
 	u8 urgency;
 	u8 cherish;
-	u16 ecn;
+	struct rmt_mark mark;
+	u32 ecn_bytes; // 0 -> no byte threshold
+	u16 reserved; // Reserved slots of the shared buffer
+	atomic_t reserved_used;
+	u32 max_sojourn_us; // Lifetime of the PDUs in the port, 0 -> unlimited
 } qos2CU;
 
+// Queue state (credits, gains and Q) is a single block allocated on the first
+// enqueue and released after idle_us without traffic (see f_port_layout)
 typedef struct port_instance_t {
-	list_h L;
-	port_p P;
-	
-	u16 count;
+	// Hot state, used on every enqueue/dequeue (first cacheline)
+	Time_t lastT;
 	s64 * credits_u;
 	s64 * credits_c;
-	queue * Q;
-	Time_t lastT;
+	u64 * gain_u; // Per port gains, updated by calibration
+	u64 * gain_c;
+	queue * Q; // NULL while the port is idle
+	u32 count;
+	u32 bytes;
+	
+	// Cold state
+	list_h L ____cacheline_aligned_in_smp;
+	port_p P;
+	struct rmt_group * group; // Port group sharing its credits, NULL if none, only read with a group
+	
+	u32 cal_last_cost; // Cost of the last PDU served with more PDUs waiting
+	u32 cal_us; // Back-to-back service time measured in the current window
+	u64 cal_credits; // Credits served back-to-back in the current window
+	u64 rate; // Measured drain rate in credits per second (0 -> not calibrated)
+	u64 red_avg; // EWMA of count, << RED_AVG_SHIFT, in 64 bits as count and thresholds may take 32
+	struct rmt_wheel * wheel; // Pacing wheel, NULL if idle or pacing disabled
+	u64 * next_u; // Earliest departure time of the next PDU of each urgency level in ns (pacing)
+	u64 * next_c; // Same for each cherish level
+	u64 last_sweep; // Time of the last expired PDU sweep in ns
+	u64 expired; // PDUs discarded past their deadline
+	u8 bp_paused; // Backpressure asserted
+	u16 age_q; // Next queue probed by the aging guard
+	u64 age_next; // Earliest time of the next aged PDU in ns
+	u64 aged; // PDUs served past age_us ahead of their turn
 } port_instance;
 
 typedef struct base_config_s {
-	u16 max_count;
-	u16 default_ecn;
-	u16 buffer_size;
+	u8 state; // 1 -> started, parameters are then set one by one; 2 -> staged parameters invalid
+	u32 max_count;
+	u32 max_bytes; // 0 -> no byte limit
+	struct rmt_mark def_mark; // ECN marking of unmapped QoS, template of new mappings
 	u8 levels_urgency;
 	u8 levels_cherish;
 	u16 num_queues;
 	u16 headers_weight;
 	u8 bytecost;
-	u8 S;
+	u8 red_wq; // RED EWMA weight, 1/2^red_wq
+	u32 cal_window_us;
+	int numa_node;
+	u32 idle_us;
+	u32 shared_size;
+	u16 dt_alpha;
+	atomic_t shared_used;
+	u32 state_size;
+	u32 state_off_q;
+	u32 state_off_wheel;
+	u32 pace_gran_us; // Pacing wheel slot, 0 -> credit based scheduling
+	u8 lifetimes; // Some QoS has a max_sojourn_us
+	u32 sweep_us; // Period of the expired PDU sweep, 0 -> only at queue heads
+	struct rmt_bp_conf bp; // Backpressure watermarks on the port count
+	u8 cut_through; // Send PDUs found with an empty port at once
+	u32 age_us; // Head of line age that gets a queue served, 0 -> no aging guard
+	u32 age_rate; // Aged PDUs served per second per port, 0 -> unbounded
 	u64 * gain_us_u;
 	u64 * max_credit_u;
 	u64 * gain_us_c;
 	u64 * max_credit_c;
-	u16 * th_c;
-	list_h buffer;
+	u16 * gain_pct_u;
+	u16 * gain_pct_c;
+	u32 * th_c;
+	u32 * th_bytes_c; // 0 -> no byte threshold
+	red_c * red_c; // Early drop curve per cherish level
+	struct rmt_group * groups; // Port groups, len == num_groups
+	u8 num_groups;
+	void * conf_block; // Level arrays, QoS mappings and port groups
+	struct rmt_conf_stage pending; // Parameters set before the first port, created without an RMT
+	struct rmt_pool buffer; // Free q_entries, sized from the demand
 	list_h port_instances;
 	list_h Q2CU;
+	spinlock_t port_lock;
+	struct delayed_work idle_work;
 } base_config;
 
 /* Function headers */
 
 static struct ps_base * f_policy_create(struct rina_component * component);
+struct ps_factory * rmt_rlim_ps_factory(void);
+int rmt_rlim_check_failed(void);
 static void f_policy_destroy(struct ps_base * bps);
 
 void * f_rmt_q_create_policy(struct rmt_ps *ps, port_p P);
 int f_rmt_q_destroy_policy(struct rmt_ps *ps, port_p P);
 int f_rmt_enqueue_policy(struct rmt_ps *ps, port_p P, pdu_p pdu_i);
 pdu_p f_rmt_dequeue_policy(struct rmt_ps *ps, port_p P);
+static dequeue_f f_dequeue_select(base_config * conf);
 
-//static int f_set_policy_set_param(struct ps_base * bps, const char * name, const char * value);
-static int f_policy_base_config_apply(struct policy_parm * param, void * data);
-
+static int f_set_policy_set_param(struct ps_base * bps, const char * name, const char * value);
 static int f_policy_set_param_pv(base_config * data, const char * name, const char * value);
 
 void f_free_port_instance(base_config * conf, port_instance * port_i);
+static void f_port_calibrate(base_config * conf, port_instance * port_i, u64 T, u32 cost);
+static void f_port_layout(base_config * conf);
+static void f_port_set_gains(base_config * conf, port_instance * port_i);
+static int f_port_activate(base_config * conf, port_instance * port_i);
+static void f_port_compact(port_instance * port_i);
+static void f_idle_sweep(struct work_struct * work);
+static qos2CU * f_qos2CU_get(base_config * conf, u8 qos_id);
+static atomic_t * f_shared_admit(base_config * conf, port_instance * port_i, qos2CU * qos_i);
+static void f_shared_release(q_entry * entry_i);
+static int f_red_drop(base_config * conf, port_instance * port_i, u8 cherish);
+static void f_pace_stamp(base_config * conf, port_instance * port_i, q_entry * entry_i, u64 now);
+static void f_pace_release(base_config * conf, port_instance * port_i);
+int rmt_rlim_bp_register(struct notifier_block * nb);
+int rmt_rlim_bp_unregister(struct notifier_block * nb);
+static bool f_cut_through(base_config * conf, port_instance * port_i, u8 urgency, u8 cherish, u32 len);
+static void f_entry_expire(base_config * conf, port_instance * port_i, q_entry * entry_i);
+static void f_expire_sweep(base_config * conf, port_instance * port_i, u64 now);
+static u32 f_mark_value(port_instance * port_i, const struct rmt_mark * mark, q_entry * entry_i, u64 now);
+static void f_check_port(base_config * conf, port_instance * port_i);
+static void f_check_credits(base_config * conf, port_instance * port_i);
+static int f_conf_load(base_config * conf, struct policy * policy);
+static int f_conf_load_stage(base_config * conf, const struct rmt_conf_stage * stage);
+static int f_conf_load_pending(struct rmt_ps * ps, base_config * conf);
+static void f_conf_start(struct rmt_ps * ps, base_config * conf);
+static bool f_conf_indexed(const char * name);
+static int f_conf_apply_one(base_config * conf, const struct rmt_conf_param * param);
+static int f_conf_apply(base_config * conf, const struct rmt_conf_param * param);
+static void * f_conf_carve(char * block, size_t * off, size_t size);
+static size_t f_conf_layout(base_config * conf, char * block, u32 num_qos, qos2CU ** qos, u32 num_groups);
+static int f_conf_alloc(base_config * conf, const struct rmt_conf_ids * qos_ids, const struct rmt_conf_ids * group_ids);
+static int f_conf_validate(base_config * conf);
+static void f_conf_free(base_config * conf);
+static queue * f_age_pick(base_config * conf, port_instance * port_i, queue * sel_q, u64 now);
+static struct rmt_group * f_group_get(base_config * conf, u16 id);
+static bool f_group_admit(port_instance * port_i, u64 * now);
@@ -0,0 +1,2 @@
+//debug.h
+#include "sim-kernel.h"
@@ -0,0 +1,2 @@
+//atomic.h
+#include "sim-kernel.h"
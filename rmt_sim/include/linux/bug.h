@@ -0,0 +1,2 @@
+//bug.h
+#include "sim-kernel.h"
@@ -0,0 +1,2 @@
+//cache.h
+#include "sim-kernel.h"
@@ -0,0 +1,2 @@
+//export.h
+#include "sim-kernel.h"
@@ -0,0 +1,2 @@
+//hash.h
+#include "sim-kernel.h"
@@ -0,0 +1,2 @@
+//jiffies.h
+#include "sim-kernel.h"
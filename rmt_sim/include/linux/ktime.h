@@ -0,0 +1,2 @@
+//ktime.h
+#include "sim-kernel.h"
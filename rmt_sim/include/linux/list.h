@@ -0,0 +1,2 @@
+//list.h
+#include "sim-kernel.h"
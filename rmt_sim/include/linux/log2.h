@@ -0,0 +1,2 @@
+//log2.h
+#include "sim-kernel.h"
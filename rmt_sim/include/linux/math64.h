@@ -0,0 +1,2 @@
+//math64.h
+#include "sim-kernel.h"
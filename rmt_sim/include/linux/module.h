@@ -0,0 +1,2 @@
+//module.h
+#include "sim-kernel.h"
@@ -0,0 +1,2 @@
+//nodemask.h
+#include "sim-kernel.h"
@@ -0,0 +1,2 @@
+//notifier.h
+#include "sim-kernel.h"
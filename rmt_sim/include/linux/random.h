@@ -0,0 +1,2 @@
+//random.h
+#include "sim-kernel.h"
@@ -0,0 +1,2 @@
+//reciprocal_div.h
+#include "sim-kernel.h"
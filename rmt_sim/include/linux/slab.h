@@ -0,0 +1,2 @@
+//slab.h
+#include "sim-kernel.h"
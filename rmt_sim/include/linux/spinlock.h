@@ -0,0 +1,2 @@
+//spinlock.h
+#include "sim-kernel.h"
@@ -0,0 +1,2 @@
+//time.h
+#include "sim-kernel.h"
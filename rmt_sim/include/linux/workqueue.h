@@ -0,0 +1,2 @@
+//workqueue.h
+#include "sim-kernel.h"
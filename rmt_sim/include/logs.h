@@ -0,0 +1,2 @@
+//logs.h
+#include "sim-kernel.h"
@@ -0,0 +1,22 @@
+//policies.h
+#ifndef SIM_POLICIES_H
+#define SIM_POLICIES_H
+
+#include "sim-kernel.h"
+
+// Policy set parameters of a node, from the param lines of the scenario
+struct policy_parm {
+	struct list_head L;
+	char * name;
+	char * value;
+};
+
+struct policy {
+	struct list_head params;
+};
+
+const char * policy_param_name(const struct policy_parm * param);
+const char * policy_param_value(const struct policy_parm * param);
+int policy_for_each(struct policy * policy, void * opaque, int (* f)(struct policy_parm * param, void * opaque));
+
+#endif
@@ -0,0 +1,2 @@
+//rmem.h
+#include "sim-kernel.h"
@@ -0,0 +1,107 @@
+//rmt-ps.h
+#ifndef SIM_RMT_PS_H
+#define SIM_RMT_PS_H
+
+#include "sim-kernel.h"
+#include "policies.h"
+
+typedef unsigned int qos_id_t;
+typedef unsigned int address_t;
+typedef int port_id_t;
+typedef int cep_id_t;
+typedef unsigned int seq_num_t;
+typedef unsigned char pdu_type_t;
+typedef unsigned char pdu_flags_t;
+
+#define PDU_TYPE_DT 0x80
+#define PDU_FLAGS_EXPLICIT_CONGESTION 0x01
+
+#define RMT_PS_ENQ_SEND 0
+#define RMT_PS_ENQ_SCHED 1
+#define RMT_PS_ENQ_ERR 2
+#define RMT_PS_ENQ_DROP 3
+
+struct rmt;
+struct pdu;
+struct rina_component;
+struct sim_port;
+struct sim_flow;
+
+struct rmt_config {
+	struct policy * policy_set;
+};
+
+struct ps_base {
+	int (* set_policy_set_param)(struct ps_base * ps, const char * name, const char * value);
+};
+
+struct ps_factory {
+	struct list_head node;
+	struct module * owner;
+	char name[64];
+	struct ps_base * (* create)(struct rina_component * component);
+	void (* destroy)(struct ps_base * ps);
+};
+
+enum flow_state {
+	N1_PORT_STATE_ENABLED,
+	N1_PORT_STATE_DISABLED,
+	N1_PORT_STATE_DO_NOT_DISABLE,
+	N1_PORT_STATE_DEALLOCATED,
+};
+
+struct rmt_n1_port {
+	spinlock_t lock;
+	port_id_t port_id;
+	enum flow_state state;
+	void * rmt_ps_queues;
+};
+
+struct rmt_ps {
+	struct ps_base base;
+	int (* rmt_enqueue_policy)(struct rmt_ps * ps, struct rmt_n1_port * P, struct pdu * pdu);
+	struct pdu * (* rmt_dequeue_policy)(struct rmt_ps * ps, struct rmt_n1_port * P);
+	void * (* rmt_q_create_policy)(struct rmt_ps * ps, struct rmt_n1_port * P);
+	int (* rmt_q_destroy_policy)(struct rmt_ps * ps, struct rmt_n1_port * P);
+	struct rmt * dm;
+	void * priv;
+};
+
+struct pci {
+	address_t src;
+	address_t dst;
+	qos_id_t qos;
+	cep_id_t cep_src;
+	cep_id_t cep_dst;
+	seq_num_t seq;
+	pdu_type_t type;
+	pdu_flags_t flags;
+};
+
+// PDU of the simulation, with the bookkeeping of the simulator
+struct pdu {
+	struct pci pci;
+	ssize_t len;
+	struct sim_flow * flow;
+	u64 t_sent; // ns, at the source
+	struct sim_port * port; // Handed to the policy set of this port, NULL otherwise
+};
+
+struct rmt * rmt_from_component(struct rina_component * component);
+struct rmt_config * rmt_config_get(struct rmt * rmt);
+int rmt_ps_publish(struct ps_factory * factory);
+int rmt_ps_unpublish(const char * name);
+
+const struct pci * pdu_pci_get_ro(const struct pdu * pdu);
+struct pci * pdu_pci_get_rw(struct pdu * pdu);
+ssize_t pdu_len(const struct pdu * pdu);
+int pdu_destroy(struct pdu * pdu);
+qos_id_t pci_qos_id(const struct pci * pci);
+pdu_flags_t pci_flags_get(const struct pci * pci);
+int pci_flags_set(struct pci * pci, pdu_flags_t flags);
+address_t pci_destination(const struct pci * pci);
+address_t pci_source(const struct pci * pci);
+cep_id_t pci_cep_destination(const struct pci * pci);
+cep_id_t pci_cep_source(const struct pci * pci);
+
+#endif
@@ -0,0 +1,331 @@
+//sim-kernel.h
+#ifndef SIM_KERNEL_H
+#define SIM_KERNEL_H
+
+/*
+	The part of the kernel API used by the policy sets, in userspace.
+	The simulator is single threaded and event driven: locks are no-ops,
+	atomics are plain operations and time is the virtual clock of the
+	simulation. Timers and delayed work become events of the simulation.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+
+typedef uint8_t u8;
+typedef int8_t s8;
+typedef uint16_t u16;
+typedef int16_t s16;
+typedef uint32_t u32;
+typedef int32_t s32;
+typedef unsigned long long u64;
+typedef long long s64;
+typedef unsigned int uint_t;
+typedef unsigned int gfp_t;
+typedef u64 cycles_t;
+
+/// Compiler and module
+
+#define __init
+#define __exit
+#define __read_mostly
+#define L1_CACHE_BYTES 64
+#define ____cacheline_aligned_in_smp __attribute__((aligned(L1_CACHE_BYTES)))
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define READ_ONCE(x) (x)
+#define WRITE_ONCE(x, v) ((x) = (v))
+#define BUILD_BUG_ON(c) _Static_assert(!(c), #c)
+
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((typeof(x)) (a) - 1))
+#define U8_MAX ((u8) ~0U)
+#define U16_MAX ((u16) ~0U)
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) ((t) (a) < (t) (b) ? (t) (a) : (t) (b))
+#define max_t(t, a, b) ((t) (a) > (t) (b) ? (t) (a) : (t) (b))
+
+struct module;
+#define THIS_MODULE ((struct module *) NULL)
+#define EXPORT_SYMBOL(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+// The simulator links one policy set and calls its entry points itself
+#define module_init(x) int sim_ps_init(void) { return x(); }
+#define module_exit(x) void sim_ps_exit(void) { x(); }
+int sim_ps_init(void);
+void sim_ps_exit(void);
+
+// Invariant warnings are counted, the simulator exits with an error
+extern unsigned long sim_warnings;
+#define WARN_ON_ONCE(c) ({ int __w = !!(c); if(__w) sim_warnings++; __w; })
+#define WARN_ON(c) WARN_ON_ONCE(c)
+
+/// Lists
+
+struct list_head {
+	struct list_head * next, * prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head * l) {
+	l->next = l;
+	l->prev = l;
+}
+
+static inline void __list_add(struct list_head * n, struct list_head * prev, struct list_head * next) {
+	next->prev = n;
+	n->next = next;
+	n->prev = prev;
+	prev->next = n;
+}
+
+static inline void list_add(struct list_head * n, struct list_head * h) {
+	__list_add(n, h, h->next);
+}
+
+static inline void list_add_tail(struct list_head * n, struct list_head * h) {
+	__list_add(n, h->prev, h);
+}
+
+static inline void list_del(struct list_head * e) {
+	e->next->prev = e->prev;
+	e->prev->next = e->next;
+}
+
+static inline void list_del_init(struct list_head * e) {
+	list_del(e);
+	INIT_LIST_HEAD(e);
+}
+
+static inline int list_empty(const struct list_head * h) {
+	return h->next == h;
+}
+
+static inline void list_move(struct list_head * e, struct list_head * h) {
+	list_del(e);
+	list_add(e, h);
+}
+
+static inline void list_move_tail(struct list_head * e, struct list_head * h) {
+	list_del(e);
+	list_add_tail(e, h);
+}
+
+static inline void list_splice_tail_init(struct list_head * l, struct list_head * h) {
+	if(!list_empty(l)) {
+		l->next->prev = h->prev;
+		h->prev->next = l->next;
+		l->prev->next = h;
+		h->prev = l->prev;
+		INIT_LIST_HEAD(l);
+	}
+}
+
+#define list_entry(p, t, m) container_of(p, t, m)
+#define list_first_entry(p, t, m) list_entry((p)->next, t, m)
+#define list_first_entry_or_null(p, t, m) (list_empty(p) ? NULL : list_first_entry(p, t, m))
+#define list_for_each_entry(pos, head, member) \
+	for(pos = list_entry((head)->next, typeof(*pos), member); &pos->member != (head); \
+		pos = list_entry(pos->member.next, typeof(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+	for(pos = list_entry((head)->next, typeof(*pos), member), \
+		n = list_entry(pos->member.next, typeof(*pos), member); &pos->member != (head); \
+		pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+/// Memory
+
+#define GFP_ATOMIC 0
+#define GFP_KERNEL 1
+#define NUMA_NO_NODE (-1)
+#define MAX_NUMNODES 1
+#define node_online(n) ((n) == 0)
+
+static inline void * kzalloc(size_t s, gfp_t f) { return calloc(1, s); }
+static inline void * kmalloc(size_t s, gfp_t f) { return malloc(s); }
+static inline void * kzalloc_node(size_t s, gfp_t f, int n) { return calloc(1, s); }
+static inline void * kmalloc_node(size_t s, gfp_t f, int n) { return malloc(s); }
+static inline void kfree(const void * p) { free((void *) p); }
+static inline void * rkzalloc(size_t s, gfp_t f) { return calloc(1, s); }
+static inline void * rkmalloc(size_t s, gfp_t f) { return malloc(s); }
+static inline void rkfree(void * p) { free(p); }
+static inline int numa_node_id(void) { return 0; }
+
+/// Atomics and locks, single threaded
+
+typedef struct { int counter; } atomic_t;
+#define ATOMIC_INIT(i) { (i) }
+static inline int atomic_read(const atomic_t * v) { return v->counter; }
+static inline void atomic_set(atomic_t * v, int i) { v->counter = i; }
+static inline void atomic_inc(atomic_t * v) { v->counter++; }
+static inline void atomic_dec(atomic_t * v) { v->counter--; }
+static inline int atomic_inc_return(atomic_t * v) { return ++v->counter; }
+static inline int atomic_dec_return(atomic_t * v) { return --v->counter; }
+
+typedef struct { s64 counter; } atomic64_t;
+static inline s64 atomic64_read(const atomic64_t * v) { return v->counter; }
+static inline void atomic64_set(atomic64_t * v, s64 i) { v->counter = i; }
+static inline void atomic64_inc(atomic64_t * v) { v->counter++; }
+static inline void atomic64_add(s64 i, atomic64_t * v) { v->counter += i; }
+static inline void atomic64_sub(s64 i, atomic64_t * v) { v->counter -= i; }
+static inline s64 atomic64_add_return(s64 i, atomic64_t * v) { return v->counter += i; }
+static inline s64 atomic64_cmpxchg(atomic64_t * v, s64 o, s64 n) {
+	s64 r = v->counter;
+
+	if(r == o) {
+		v->counter = n;
+	}
+	return r;
+}
+
+typedef struct { int unused; } spinlock_t;
+static inline void spin_lock_init(spinlock_t * l) {}
+static inline void spin_lock(spinlock_t * l) {}
+static inline void spin_unlock(spinlock_t * l) {}
+static inline int spin_trylock(spinlock_t * l) { return 1; }
+static inline void spin_lock_bh(spinlock_t * l) {}
+static inline void spin_unlock_bh(spinlock_t * l) {}
+
+/// Arithmetic
+
+static inline u64 div_u64(u64 a, u32 b) { return a / b; }
+static inline u64 div64_u64(u64 a, u64 b) { return a / b; }
+static inline s64 div_s64(s64 a, s32 b) { return a / b; }
+static inline int fls64(u64 x) { return x ? 64 - __builtin_clzll(x) : 0; }
+static inline int ilog2(u64 x) { return fls64(x) - 1; }
+static inline u32 hash_32(u32 v, unsigned int bits) { return (v * 0x61C88647U) >> (32 - bits); }
+
+struct reciprocal_value {
+	u32 m;
+	u8 sh1, sh2;
+};
+
+struct reciprocal_value reciprocal_value(u32 d);
+static inline u32 reciprocal_divide(u32 a, struct reciprocal_value R) {
+	u32 t = (u32) (((u64) a * R.m) >> 32);
+
+	return (t + ((a - t) >> R.sh1)) >> R.sh2;
+}
+
+u32 prandom_u32(void);
+void sim_seed(u64 seed);
+
+int kstrtoint(const char * s, unsigned int base, int * res);
+int kstrtouint(const char * s, unsigned int base, unsigned int * res);
+int kstrtou8(const char * s, unsigned int base, u8 * res);
+int kstrtou16(const char * s, unsigned int base, u16 * res);
+int kstrtou32(const char * s, unsigned int base, u32 * res);
+int kstrtou64(const char * s, unsigned int base, u64 * res);
+
+/// Time, from the simulation clock
+
+#define HZ 1000
+#define NSEC_PER_USEC 1000L
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_SEC 1000000000L
+#define USEC_PER_SEC 1000000L
+#define MSEC_PER_SEC 1000L
+
+extern u64 sim_now; // ns
+
+#define jiffies ((unsigned long) (sim_now / (NSEC_PER_SEC / HZ)))
+static inline unsigned long usecs_to_jiffies(unsigned int u) { return (u + USEC_PER_SEC / HZ - 1) / (USEC_PER_SEC / HZ); }
+static inline unsigned long msecs_to_jiffies(unsigned int m) { return (m + MSEC_PER_SEC / HZ - 1) / (MSEC_PER_SEC / HZ); }
+#define time_after(a, b) ((long) ((b) - (a)) < 0)
+#define time_after_eq(a, b) ((long) ((a) - (b)) >= 0)
+static inline u64 ktime_get_ns(void) { return sim_now; }
+static inline cycles_t get_cycles(void) { return sim_now; }
+
+void getnstimeofday(struct timespec * ts);
+int timespec_compare(const struct timespec * a, const struct timespec * b);
+struct timespec timespec_sub(struct timespec a, struct timespec b);
+
+/*
+	Alarms are the simulation events behind timers and delayed work.
+	Cancelling marks the pending event, so the owner may be freed before
+	the event is popped.
+*/
+struct sim_event;
+
+struct sim_alarm {
+	struct sim_event * ev; // Pending event, NULL if none
+	void (* fire)(struct sim_alarm * a);
+};
+
+void sim_alarm_set(struct sim_alarm * a, u64 at);
+void sim_alarm_cancel(struct sim_alarm * a);
+
+struct timer_list {
+	struct sim_alarm A;
+	unsigned long expires;
+	void (* function)(unsigned long data);
+	unsigned long data;
+};
+
+void setup_timer(struct timer_list * t, void (* f)(unsigned long), unsigned long data);
+int mod_timer(struct timer_list * t, unsigned long expires);
+int del_timer_sync(struct timer_list * t);
+
+struct work_struct {
+	void (* func)(struct work_struct * w);
+};
+
+struct delayed_work {
+	struct work_struct work;
+	struct sim_alarm A;
+};
+
+#define to_delayed_work(w) container_of(w, struct delayed_work, work)
+void INIT_DELAYED_WORK(struct delayed_work * w, void (* f)(struct work_struct *));
+bool schedule_delayed_work(struct delayed_work * w, unsigned long delay);
+bool cancel_delayed_work_sync(struct delayed_work * w);
+
+// One queue, the work runs as a simulation event
+struct workqueue_struct;
+#define system_wq ((struct workqueue_struct *) NULL)
+bool mod_delayed_work(struct workqueue_struct * wq, struct delayed_work * w, unsigned long delay);
+
+/// Notifiers
+
+struct notifier_block {
+	int (* notifier_call)(struct notifier_block * nb, unsigned long event, void * data);
+	struct notifier_block * next;
+	int priority;
+};
+
+struct atomic_notifier_head {
+	struct notifier_block * head;
+};
+
+#define ATOMIC_NOTIFIER_HEAD(name) struct atomic_notifier_head name = { NULL }
+int atomic_notifier_chain_register(struct atomic_notifier_head * h, struct notifier_block * nb);
+int atomic_notifier_chain_unregister(struct atomic_notifier_head * h, struct notifier_block * nb);
+int atomic_notifier_call_chain(struct atomic_notifier_head * h, unsigned long event, void * data);
+
+/// Logs
+
+// 0 -> errors and warnings, 1 -> info, 2 -> debug
+extern int sim_verbose;
+
+#define LOG_ERR(fmt, ...) fprintf(stderr, RINA_PREFIX ": " fmt "\n", ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) fprintf(stderr, RINA_PREFIX ": " fmt "\n", ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...) do { \
+	if(sim_verbose > 0) fprintf(stderr, RINA_PREFIX ": " fmt "\n", ##__VA_ARGS__); \
+} while(0)
+#define LOG_DBG(fmt, ...) do { \
+	if(sim_verbose > 1) fprintf(stderr, RINA_PREFIX ": " fmt "\n", ##__VA_ARGS__); \
+} while(0)
+
+#endif
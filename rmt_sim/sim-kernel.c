@@ -0,0 +1,221 @@
+//sim-kernel.c
+#define RINA_PREFIX "rmt-sim"
+
+#include "sim-kernel.h"
+
+u64 sim_now;
+int sim_verbose;
+unsigned long sim_warnings;
+
+/// Random
+
+static u64 sim_rand_state = 0x9E3779B97F4A7C15ULL;
+
+void sim_seed(u64 seed) {
+	sim_rand_state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+}
+
+// xorshift64*, reproducible from the seed of the scenario
+u32 prandom_u32(void) {
+	sim_rand_state ^= sim_rand_state >> 12;
+	sim_rand_state ^= sim_rand_state << 25;
+	sim_rand_state ^= sim_rand_state >> 27;
+	return (u32) ((sim_rand_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/// Arithmetic
+
+// Same as the kernel, d > 0
+struct reciprocal_value reciprocal_value(u32 d) {
+	struct reciprocal_value R;
+	u64 m;
+	int l;
+
+	l = fls64(d - 1);
+	m = ((1ULL << 32) * ((1ULL << l) - d)) / d + 1;
+	R.m = (u32) m;
+	R.sh1 = min(l, 1);
+	R.sh2 = max(l - 1, 0);
+	return R;
+}
+
+/// Parsing, same rules as the kernel: whole string, optional trailing newline
+
+static int f_kstrto(const char * s, unsigned int base, int sign, long long lo, unsigned long long hi, void * res, size_t len) {
+	char * end;
+	unsigned long long u;
+	long long v;
+
+	if(!s || !*s || (!sign && *s == '-')) {
+		return -EINVAL;
+	}
+	errno = 0;
+	if(sign) {
+		v = strtoll(s, &end, base);
+		u = (unsigned long long) v;
+	} else {
+		u = strtoull(s, &end, base);
+		v = 0;
+	}
+	if(end == s || (*end && !(end[0] == '\n' && !end[1]))) {
+		return -EINVAL;
+	}
+	if(errno == ERANGE || (sign && (v < lo || v > (long long) hi)) || (!sign && u > hi)) {
+		return -ERANGE;
+	}
+	switch(len) {
+		case 1: *(u8 *) res = (u8) u; break;
+		case 2: *(u16 *) res = (u16) u; break;
+		case 4: *(u32 *) res = (u32) u; break;
+		default: *(u64 *) res = (u64) u; break;
+	}
+	return 0;
+}
+
+int kstrtoint(const char * s, unsigned int base, int * res) {
+	return f_kstrto(s, base, 1, INT_MIN, INT_MAX, res, sizeof(*res));
+}
+
+int kstrtouint(const char * s, unsigned int base, unsigned int * res) {
+	return f_kstrto(s, base, 0, 0, UINT_MAX, res, sizeof(*res));
+}
+
+int kstrtou8(const char * s, unsigned int base, u8 * res) {
+	return f_kstrto(s, base, 0, 0, UCHAR_MAX, res, sizeof(*res));
+}
+
+int kstrtou16(const char * s, unsigned int base, u16 * res) {
+	return f_kstrto(s, base, 0, 0, USHRT_MAX, res, sizeof(*res));
+}
+
+int kstrtou32(const char * s, unsigned int base, u32 * res) {
+	return f_kstrto(s, base, 0, 0, UINT_MAX, res, sizeof(*res));
+}
+
+int kstrtou64(const char * s, unsigned int base, u64 * res) {
+	return f_kstrto(s, base, 0, 0, ULLONG_MAX, res, sizeof(*res));
+}
+
+/// Time
+
+void getnstimeofday(struct timespec * ts) {
+	ts->tv_sec = sim_now / NSEC_PER_SEC;
+	ts->tv_nsec = sim_now % NSEC_PER_SEC;
+}
+
+int timespec_compare(const struct timespec * a, const struct timespec * b) {
+	if(a->tv_sec != b->tv_sec) {
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	}
+	return a->tv_nsec - b->tv_nsec;
+}
+
+struct timespec timespec_sub(struct timespec a, struct timespec b) {
+	struct timespec r;
+
+	r.tv_sec = a.tv_sec - b.tv_sec;
+	r.tv_nsec = a.tv_nsec - b.tv_nsec;
+	if(r.tv_nsec < 0) {
+		r.tv_sec--;
+		r.tv_nsec += NSEC_PER_SEC;
+	}
+	return r;
+}
+
+/// Timers and delayed work
+
+static void f_timer_fire(struct sim_alarm * a) {
+	struct timer_list * t = container_of(a, struct timer_list, A);
+
+	t->function(t->data);
+}
+
+void setup_timer(struct timer_list * t, void (* f)(unsigned long), unsigned long data) {
+	t->A.ev = NULL;
+	t->A.fire = f_timer_fire;
+	t->function = f;
+	t->data = data;
+}
+
+int mod_timer(struct timer_list * t, unsigned long expires) {
+	int pending = t->A.ev != NULL;
+
+	t->expires = expires;
+	sim_alarm_set(&t->A, (u64) expires * (NSEC_PER_SEC / HZ));
+	return pending;
+}
+
+int del_timer_sync(struct timer_list * t) {
+	int pending = t->A.ev != NULL;
+
+	sim_alarm_cancel(&t->A);
+	return pending;
+}
+
+static void f_work_fire(struct sim_alarm * a) {
+	struct delayed_work * w = container_of(a, struct delayed_work, A);
+
+	w->work.func(&w->work);
+}
+
+void INIT_DELAYED_WORK(struct delayed_work * w, void (* f)(struct work_struct *)) {
+	w->work.func = f;
+	w->A.ev = NULL;
+	w->A.fire = f_work_fire;
+}
+
+bool schedule_delayed_work(struct delayed_work * w, unsigned long delay) {
+	if(w->A.ev) {
+		return false;
+	}
+	sim_alarm_set(&w->A, sim_now + (u64) delay * (NSEC_PER_SEC / HZ));
+	return true;
+}
+
+bool mod_delayed_work(struct workqueue_struct * wq, struct delayed_work * w, unsigned long delay) {
+	bool pending = w->A.ev != NULL;
+
+	sim_alarm_set(&w->A, sim_now + (u64) delay * (NSEC_PER_SEC / HZ));
+	return pending;
+}
+
+bool cancel_delayed_work_sync(struct delayed_work * w) {
+	bool pending = w->A.ev != NULL;
+
+	sim_alarm_cancel(&w->A);
+	return pending;
+}
+
+/// Notifiers
+
+int atomic_notifier_chain_register(struct atomic_notifier_head * h, struct notifier_block * nb) {
+	struct notifier_block ** p;
+
+	for(p = &h->head; *p && (*p)->priority >= nb->priority; p = &(*p)->next);
+	nb->next = *p;
+	*p = nb;
+	return 0;
+}
+
+int atomic_notifier_chain_unregister(struct atomic_notifier_head * h, struct notifier_block * nb) {
+	struct notifier_block ** p;
+
+	for(p = &h->head; *p; p = &(*p)->next) {
+		if(*p == nb) {
+			*p = nb->next;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+int atomic_notifier_call_chain(struct atomic_notifier_head * h, unsigned long event, void * data) {
+	struct notifier_block * nb, * next;
+	int ret = 0;
+
+	for(nb = h->head; nb; nb = next) {
+		next = nb->next;
+		ret = nb->notifier_call(nb, event, data);
+	}
+	return ret;
+}
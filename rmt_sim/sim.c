@@ -0,0 +1,914 @@
+//sim.c
+#define RINA_PREFIX "rmt-sim"
+
+#include <unistd.h>
+
+#include "sim.h"
+
+/*
+	Discrete-event simulator of a network of RMTs running one policy set.
+	Every node gets its own instance of the policy set, created through its
+	factory with the parameters of the scenario, and one port per outgoing
+	link. Links serialise PDUs at their rate and deliver them after their
+	delay; a port is disabled while it transmits, as an N-1 flow that
+	cannot take more, and the policy set is asked for the next PDU once it
+	ends. Timers and delayed work of the policy sets run on the virtual
+	clock, so a run is deterministic for a given seed.
+
+	Flows are constant rate or Poisson. ECN flows get the marks echoed back
+	after the propagation delay of the path and cut their rate at most once
+	per round trip, increasing it again while no marks come back.
+
+	Scenario file, one command per line, # starts a comment:
+		seed 1                       PRNG seed of flows and policy sets
+		duration_ms 100              flows emit until then
+		drain_ms 50                  extra time for the queues to empty
+		poll_us 10                   retry of ports with PDUs held by the policy set
+		ecn_beta 0.2                 rate decrease on an ECN echo
+		ecn_ai 0.01                  rate increase per round trip, of the flow rate
+		ecn_min 0.01                 rate floor, of the flow rate
+		node 1                       node and its address
+		link 1 2 100 50              one way link, Mbps and us of delay
+		duplex 1 2 100 50            both ways
+		param * max_count 100        policy set parameter of every node
+		param 2 qos_ecn 20           policy set parameter of one node
+		flow 1 3 2 20 1000 ecn       src dst qos Mbps bytes [ecn] [poisson]
+	Routes are shortest paths in hops. The report gives, per QoS, the PDUs
+	sent, delivered and lost, the share marked and the end-to-end latency
+	percentiles, then the state of flows and links.
+*/
+
+// Built once per policy set, they all export the same callback names
+struct ps_factory * SIM_PS_FACTORY(void);
+
+static struct sim_config sim_conf;
+static struct sim_node sim_nodes[SIM_MAX_NODES];
+static struct sim_flow * sim_flows;
+static struct sim_qos_stats sim_qos[SIM_MAX_QOS];
+static struct ps_factory * sim_factory;
+static uint_t sim_num_nodes;
+static uint_t sim_num_ports;
+static uint_t sim_num_flows;
+
+static struct sim_event ** sim_heap;
+static size_t sim_heap_len;
+static size_t sim_heap_cap;
+static u64 sim_seq;
+static u64 sim_events; // Events processed
+
+static bool sim_ending; // PDUs destroyed at teardown are not losses
+static u64 sim_unfinished; // PDUs still queued or in a link at the end
+
+/// RMT and PDU API, as the policy sets see it
+
+struct rmt * rmt_from_component(struct rina_component * component) {
+	return (struct rmt *) component;
+}
+
+struct rmt_config * rmt_config_get(struct rmt * rmt) {
+	return rmt ? &((struct sim_node *) rmt)->cfg : NULL;
+}
+
+int rmt_ps_publish(struct ps_factory * factory) {
+	return 0;
+}
+
+int rmt_ps_unpublish(const char * name) {
+	return 0;
+}
+
+const char * policy_param_name(const struct policy_parm * param) {
+	return param->name;
+}
+
+const char * policy_param_value(const struct policy_parm * param) {
+	return param->value;
+}
+
+int policy_for_each(struct policy * policy, void * opaque, int (* f)(struct policy_parm * param, void * opaque)) {
+	struct policy_parm * param_i;
+
+	if(!policy) {
+		return -EINVAL;
+	}
+	list_for_each_entry(param_i, &policy->params, L) {
+		if(f(param_i, opaque)) {
+			LOG_WARN("Parameter %s = %s not accepted by the policy set", param_i->name, param_i->value);
+		}
+	}
+	return 0;
+}
+
+const struct pci * pdu_pci_get_ro(const struct pdu * pdu) {
+	return pdu ? &pdu->pci : NULL;
+}
+
+struct pci * pdu_pci_get_rw(struct pdu * pdu) {
+	return pdu ? &pdu->pci : NULL;
+}
+
+ssize_t pdu_len(const struct pdu * pdu) {
+	return pdu ? pdu->len : -1;
+}
+
+// Called by the policy sets on drops, and by the teardown of their queues
+int pdu_destroy(struct pdu * pdu) {
+	if(!pdu) {
+		return -1;
+	}
+	if(pdu->port) {
+		pdu->port->queued--;
+	}
+	if(sim_ending) {
+		sim_unfinished++;
+	} else {
+		pdu->flow->lost++;
+		sim_qos[pdu->pci.qos].lost++;
+	}
+	free(pdu);
+	return 0;
+}
+
+qos_id_t pci_qos_id(const struct pci * pci) {
+	return pci->qos;
+}
+
+pdu_flags_t pci_flags_get(const struct pci * pci) {
+	return pci->flags;
+}
+
+int pci_flags_set(struct pci * pci, pdu_flags_t flags) {
+	pci->flags = flags;
+	return 0;
+}
+
+address_t pci_destination(const struct pci * pci) {
+	return pci->dst;
+}
+
+address_t pci_source(const struct pci * pci) {
+	return pci->src;
+}
+
+cep_id_t pci_cep_destination(const struct pci * pci) {
+	return pci->cep_dst;
+}
+
+cep_id_t pci_cep_source(const struct pci * pci) {
+	return pci->cep_src;
+}
+
+/// Event queue, binary heap on (time, insertion order)
+
+static inline bool f_sim_before(const struct sim_event * a, const struct sim_event * b) {
+	return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static struct sim_event * f_sim_event(u64 at, enum sim_ev_type type) {
+	struct sim_event * ev;
+
+	ev = calloc(1, sizeof(struct sim_event));
+	if(!ev) {
+		LOG_ERR("Out of memory for events");
+		exit(1);
+	}
+	ev->at = at < sim_now ? sim_now : at;
+	ev->type = type;
+	return ev;
+}
+
+static void f_sim_push(struct sim_event * ev) {
+	struct sim_event ** heap;
+	size_t i, parent;
+
+	if(sim_heap_len == sim_heap_cap) {
+		sim_heap_cap = sim_heap_cap ? sim_heap_cap * 2 : 1024;
+		heap = realloc(sim_heap, sizeof(struct sim_event *) * sim_heap_cap);
+		if(!heap) {
+			LOG_ERR("Out of memory for events");
+			exit(1);
+		}
+		sim_heap = heap;
+	}
+	ev->seq = sim_seq++;
+	for(i = sim_heap_len++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if(!f_sim_before(ev, sim_heap[parent])) {
+			break;
+		}
+		sim_heap[i] = sim_heap[parent];
+	}
+	sim_heap[i] = ev;
+}
+
+static struct sim_event * f_sim_pop(void) {
+	struct sim_event * top, * last;
+	size_t i, child;
+
+	if(!sim_heap_len) {
+		return NULL;
+	}
+	top = sim_heap[0];
+	last = sim_heap[--sim_heap_len];
+	for(i = 0; (child = 2 * i + 1) < sim_heap_len; i = child) {
+		if(child + 1 < sim_heap_len && f_sim_before(sim_heap[child + 1], sim_heap[child])) {
+			child++;
+		}
+		if(!f_sim_before(sim_heap[child], last)) {
+			break;
+		}
+		sim_heap[i] = sim_heap[child];
+	}
+	if(sim_heap_len) {
+		sim_heap[i] = last;
+	}
+	return top;
+}
+
+void sim_alarm_set(struct sim_alarm * a, u64 at) {
+	struct sim_event * ev;
+
+	sim_alarm_cancel(a);
+	ev = f_sim_event(at, SIM_EV_ALARM);
+	ev->alarm = a;
+	a->ev = ev;
+	f_sim_push(ev);
+}
+
+void sim_alarm_cancel(struct sim_alarm * a) {
+	if(a->ev) {
+		a->ev->cancelled = true;
+		a->ev = NULL;
+	}
+}
+
+/// Forwarding
+
+static void f_sim_forward(struct sim_node * node, struct pdu * pdu) {
+	struct sim_port * port;
+	int ret;
+
+	if(pdu->pci.dst == node->addr) {
+		f_sim_deliver(node, pdu);
+		return;
+	}
+	port = node->route[pdu->pci.dst];
+	if(!port) {
+		LOG_DBG("Node %u has no route to %u", node->addr, pdu->pci.dst);
+		pdu_destroy(pdu);
+		return;
+	}
+
+	pdu->port = port;
+	port->queued++;
+	ret = node->ps->rmt_enqueue_policy(node->ps, &port->P, pdu);
+	switch(ret) {
+		case RMT_PS_ENQ_SEND:
+			port->queued--;
+			pdu->port = NULL;
+			f_sim_transmit(port, pdu);
+			break;
+		case RMT_PS_ENQ_SCHED:
+			f_sim_kick(port);
+			break;
+		default:
+			// Dropped, the policy set destroyed it
+			break;
+	}
+}
+
+static void f_sim_deliver(struct sim_node * node, struct pdu * pdu) {
+	struct sim_flow * flow = pdu->flow;
+	struct sim_qos_stats * stats = &sim_qos[pdu->pci.qos];
+	struct sim_event * ev;
+	u64 * lat;
+
+	flow->delivered++;
+	stats->delivered++;
+	if(stats->lat_len == stats->lat_cap) {
+		stats->lat_cap = stats->lat_cap ? stats->lat_cap * 2 : 1024;
+		lat = realloc(stats->lat, sizeof(u64) * stats->lat_cap);
+		if(!lat) {
+			LOG_ERR("Out of memory for latency samples");
+			exit(1);
+		}
+		stats->lat = lat;
+	}
+	stats->lat[stats->lat_len++] = sim_now - pdu->t_sent;
+
+	if(pdu->pci.flags & PDU_FLAGS_EXPLICIT_CONGESTION) {
+		flow->marked++;
+		stats->marked++;
+		if(flow->ecn) {
+			ev = f_sim_event(sim_now + flow->rtt / 2, SIM_EV_ECHO);
+			ev->flow = flow;
+			f_sim_push(ev);
+		}
+	}
+	free(pdu);
+}
+
+static void f_sim_transmit(struct sim_port * port, struct pdu * pdu) {
+	struct sim_event * ev;
+	u64 ser;
+
+	ser = div64_u64((u64) pdu->len * 8 * NSEC_PER_SEC, port->rate);
+	port->P.state = N1_PORT_STATE_DISABLED;
+	port->busy_ns += ser;
+	port->tx_pdus++;
+	port->tx_bytes += pdu->len;
+
+	ev = f_sim_event(sim_now + ser, SIM_EV_TX_DONE);
+	ev->port = port;
+	f_sim_push(ev);
+	ev = f_sim_event(sim_now + ser + port->delay, SIM_EV_ARRIVE);
+	ev->arrive.pdu = pdu;
+	ev->arrive.node = port->to;
+	f_sim_push(ev);
+}
+
+// Asks the policy set for a PDU if the port can send
+static void f_sim_kick(struct sim_port * port) {
+	struct rmt_ps * ps = port->from->ps;
+	struct sim_event * ev;
+	struct pdu * pdu;
+
+	if(port->P.state != N1_PORT_STATE_ENABLED) {
+		return;
+	}
+	pdu = ps->rmt_dequeue_policy(ps, &port->P);
+	if(pdu) {
+		port->queued--;
+		pdu->port = NULL;
+		f_sim_transmit(port, pdu);
+		return;
+	}
+	// Held by pacing or shaping, nothing else will ask again
+	if(port->queued && !port->polling) {
+		port->polling = true;
+		ev = f_sim_event(sim_now + sim_conf.poll, SIM_EV_POLL);
+		ev->port = port;
+		f_sim_push(ev);
+	}
+}
+
+/// Sources
+
+static void f_sim_send(struct sim_flow * flow) {
+	struct sim_event * ev;
+	struct pdu * pdu;
+	double gap;
+
+	if(sim_now >= sim_conf.duration) {
+		return;
+	}
+	if(flow->ecn && sim_now - flow->last_inc >= flow->rtt) {
+		flow->rate = min(flow->max_rate, flow->rate + (u64) (flow->max_rate * sim_conf.ecn_ai));
+		flow->last_inc = sim_now;
+	}
+
+	pdu = calloc(1, sizeof(struct pdu));
+	if(!pdu) {
+		LOG_ERR("Out of memory for PDUs");
+		exit(1);
+	}
+	pdu->pci.src = flow->src;
+	pdu->pci.dst = flow->dst;
+	pdu->pci.qos = flow->qos;
+	pdu->pci.cep_src = flow->qos;
+	pdu->pci.cep_dst = flow->qos;
+	pdu->pci.seq = flow->seq++;
+	pdu->pci.type = PDU_TYPE_DT;
+	pdu->len = flow->size;
+	pdu->flow = flow;
+	pdu->t_sent = sim_now;
+	flow->sent++;
+	sim_qos[flow->qos].sent++;
+	f_sim_forward(&sim_nodes[flow->src], pdu);
+
+	gap = (double) flow->size * 8 * NSEC_PER_SEC / flow->rate;
+	if(flow->poisson) {
+		gap *= -log((prandom_u32() + 1.0) / 4294967296.0);
+	}
+	ev = f_sim_event(sim_now + (u64) gap, SIM_EV_SEND);
+	ev->flow = flow;
+	f_sim_push(ev);
+}
+
+static void f_sim_echo(struct sim_flow * flow) {
+	u64 floor;
+
+	if(sim_now - flow->last_cut < flow->rtt) {
+		return;
+	}
+	floor = (u64) (flow->max_rate * sim_conf.ecn_min);
+	flow->rate = max(floor, (u64) (flow->rate * (1 - sim_conf.ecn_beta)));
+	flow->last_cut = sim_now;
+	flow->last_inc = sim_now;
+}
+
+/// Run
+
+static void f_sim_run(void) {
+	struct sim_event * ev;
+	u64 end = sim_conf.duration + sim_conf.drain;
+
+	while(sim_heap_len && sim_heap[0]->at <= end) {
+		ev = f_sim_pop();
+		sim_now = ev->at;
+		sim_events++;
+		switch(ev->type) {
+			case SIM_EV_SEND:
+				f_sim_send(ev->flow);
+				break;
+			case SIM_EV_TX_DONE:
+				ev->port->P.state = N1_PORT_STATE_ENABLED;
+				f_sim_kick(ev->port);
+				break;
+			case SIM_EV_ARRIVE:
+				f_sim_forward(ev->arrive.node, ev->arrive.pdu);
+				break;
+			case SIM_EV_POLL:
+				ev->port->polling = false;
+				f_sim_kick(ev->port);
+				break;
+			case SIM_EV_ECHO:
+				f_sim_echo(ev->flow);
+				break;
+			case SIM_EV_ALARM:
+				if(!ev->cancelled) {
+					ev->alarm->ev = NULL;
+					ev->alarm->fire(ev->alarm);
+				}
+				break;
+		}
+		free(ev);
+	}
+	sim_now = end;
+}
+
+/// Setup
+
+static int f_sim_param_add(struct list_head * params, const char * name, const char * value) {
+	struct policy_parm * param;
+
+	param = calloc(1, sizeof(struct policy_parm));
+	if(!param) {
+		return -ENOMEM;
+	}
+	param->name = strdup(name);
+	param->value = strdup(value);
+	if(!param->name || !param->value) {
+		free(param->name);
+		free(param->value);
+		free(param);
+		return -ENOMEM;
+	}
+	list_add_tail(&param->L, params);
+	return 0;
+}
+
+static int f_sim_node_get(const char * s, struct sim_node ** node) {
+	uint_t addr;
+
+	if(kstrtouint(s, 10, &addr) || addr == 0 || addr >= SIM_MAX_NODES || !sim_nodes[addr].used) {
+		return -EINVAL;
+	}
+	*node = &sim_nodes[addr];
+	return 0;
+}
+
+static int f_sim_link_add(struct sim_node * from, struct sim_node * to, double mbps, double delay_us) {
+	struct sim_port * port, ** tail;
+
+	if(mbps <= 0 || delay_us < 0) {
+		return -EINVAL;
+	}
+	port = calloc(1, sizeof(struct sim_port));
+	if(!port) {
+		return -ENOMEM;
+	}
+	port->P.port_id = ++sim_num_ports;
+	port->P.state = N1_PORT_STATE_ENABLED;
+	port->from = from;
+	port->to = to;
+	port->rate = (u64) (mbps * 1000000);
+	port->delay = (u64) (delay_us * NSEC_PER_USEC);
+	for(tail = &from->ports; *tail; tail = &(*tail)->next);
+	*tail = port;
+	return 0;
+}
+
+static int f_sim_line(char * line) {
+	char * tok[8];
+	struct sim_node * a, * b;
+	struct sim_flow * flow, ** tail;
+	double mbps;
+	uint_t n, addr, qos, size, i;
+
+	for(n = 0; n < 8 && (tok[n] = strtok(n ? NULL : line, " \t\r\n")); n++);
+	if(!n) {
+		return 0;
+	}
+
+	if(n == 2 && strcmp(tok[0], "seed") == 0) {
+		return kstrtou64(tok[1], 10, &sim_conf.seed);
+	}
+	if(n == 2 && strcmp(tok[0], "duration_ms") == 0) {
+		sim_conf.duration = (u64) (atof(tok[1]) * NSEC_PER_MSEC);
+		return sim_conf.duration ? 0 : -EINVAL;
+	}
+	if(n == 2 && strcmp(tok[0], "drain_ms") == 0) {
+		sim_conf.drain = (u64) (atof(tok[1]) * NSEC_PER_MSEC);
+		return 0;
+	}
+	if(n == 2 && strcmp(tok[0], "poll_us") == 0) {
+		sim_conf.poll = (u64) (atof(tok[1]) * NSEC_PER_USEC);
+		return sim_conf.poll ? 0 : -EINVAL;
+	}
+	if(n == 2 && strcmp(tok[0], "ecn_beta") == 0) {
+		sim_conf.ecn_beta = atof(tok[1]);
+		return sim_conf.ecn_beta > 0 && sim_conf.ecn_beta < 1 ? 0 : -EINVAL;
+	}
+	if(n == 2 && strcmp(tok[0], "ecn_ai") == 0) {
+		sim_conf.ecn_ai = atof(tok[1]);
+		return sim_conf.ecn_ai > 0 ? 0 : -EINVAL;
+	}
+	if(n == 2 && strcmp(tok[0], "ecn_min") == 0) {
+		sim_conf.ecn_min = atof(tok[1]);
+		return sim_conf.ecn_min > 0 && sim_conf.ecn_min <= 1 ? 0 : -EINVAL;
+	}
+	if(n == 2 && strcmp(tok[0], "node") == 0) {
+		if(kstrtouint(tok[1], 10, &addr) || addr == 0 || addr >= SIM_MAX_NODES || sim_nodes[addr].used) {
+			return -EINVAL;
+		}
+		sim_nodes[addr].used = true;
+		sim_nodes[addr].addr = addr;
+		INIT_LIST_HEAD(&sim_nodes[addr].policy.params);
+		sim_num_nodes++;
+		return 0;
+	}
+	if(n == 5 && (strcmp(tok[0], "link") == 0 || strcmp(tok[0], "duplex") == 0)) {
+		if(f_sim_node_get(tok[1], &a) || f_sim_node_get(tok[2], &b) || a == b) {
+			return -EINVAL;
+		}
+		if(f_sim_link_add(a, b, atof(tok[3]), atof(tok[4]))) {
+			return -EINVAL;
+		}
+		return tok[0][0] == 'd' ? f_sim_link_add(b, a, atof(tok[3]), atof(tok[4])) : 0;
+	}
+	if(n == 4 && strcmp(tok[0], "param") == 0) {
+		if(strcmp(tok[1], "*") == 0) {
+			return f_sim_param_add(&sim_conf.params, tok[2], tok[3]);
+		}
+		if(f_sim_node_get(tok[1], &a)) {
+			return -EINVAL;
+		}
+		return f_sim_param_add(&a->policy.params, tok[2], tok[3]);
+	}
+	if(n >= 6 && strcmp(tok[0], "flow") == 0) {
+		if(f_sim_node_get(tok[1], &a) || f_sim_node_get(tok[2], &b) || a == b) {
+			return -EINVAL;
+		}
+		mbps = atof(tok[4]);
+		if(kstrtouint(tok[3], 10, &qos) || qos >= SIM_MAX_QOS
+			|| kstrtouint(tok[5], 10, &size) || !size || mbps <= 0) {
+			return -EINVAL;
+		}
+		flow = calloc(1, sizeof(struct sim_flow));
+		if(!flow) {
+			return -ENOMEM;
+		}
+		flow->src = a->addr;
+		flow->dst = b->addr;
+		flow->qos = qos;
+		flow->size = size;
+		flow->max_rate = (u64) (mbps * 1000000);
+		flow->rate = flow->max_rate;
+		for(i = 6; i < n; i++) {
+			if(strcmp(tok[i], "ecn") == 0) {
+				flow->ecn = 1;
+			} else if(strcmp(tok[i], "poisson") == 0) {
+				flow->poisson = 1;
+			} else if(strcmp(tok[i], "cbr") != 0) {
+				free(flow);
+				return -EINVAL;
+			}
+		}
+		for(tail = &sim_flows; *tail; tail = &(*tail)->next);
+		*tail = flow;
+		sim_num_flows++;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+static int f_sim_load(const char * file) {
+	char line[SIM_LINE_LEN], * comment;
+	FILE * f;
+	int n, ret;
+
+	f = fopen(file, "r");
+	if(!f) {
+		LOG_ERR("Could not open %s", file);
+		return -ENOENT;
+	}
+	ret = 0;
+	for(n = 1; !ret && fgets(line, sizeof(line), f); n++) {
+		comment = strchr(line, '#');
+		if(comment) {
+			*comment = '\0';
+		}
+		ret = f_sim_line(line);
+		if(ret) {
+			LOG_ERR("%s:%d: invalid line", file, n);
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+// Shortest paths in hops, from a breadth-first search towards each destination
+static void f_sim_routes(void) {
+	struct sim_node * queue[SIM_MAX_NODES], * node_i;
+	struct sim_port * port_i;
+	bool seen[SIM_MAX_NODES];
+	uint_t dst, head, tail, i;
+
+	for(dst = 1; dst < SIM_MAX_NODES; dst++) {
+		if(!sim_nodes[dst].used) {
+			continue;
+		}
+		memset(seen, 0, sizeof(seen));
+		seen[dst] = true;
+		head = tail = 0;
+		queue[tail++] = &sim_nodes[dst];
+		while(head < tail) {
+			node_i = queue[head++];
+			for(i = 1; i < SIM_MAX_NODES; i++) {
+				if(!sim_nodes[i].used || seen[i]) {
+					continue;
+				}
+				for(port_i = sim_nodes[i].ports; port_i; port_i = port_i->next) {
+					if(port_i->to == node_i) {
+						sim_nodes[i].route[dst] = port_i;
+						seen[i] = true;
+						queue[tail++] = &sim_nodes[i];
+						break;
+					}
+				}
+			}
+		}
+	}
+}
+
+static int f_sim_setup(void) {
+	struct list_head params;
+	struct policy_parm * param_i;
+	struct sim_node * node;
+	struct sim_port * port_i;
+	struct sim_flow * flow_i;
+	struct sim_event * ev;
+	struct ps_base * base;
+	address_t addr;
+
+	sim_seed(sim_conf.seed);
+	if(sim_ps_init()) {
+		LOG_ERR("Could not load the policy set");
+		return -EINVAL;
+	}
+	sim_factory = SIM_PS_FACTORY();
+	f_sim_routes();
+
+	for(addr = 1; addr < SIM_MAX_NODES; addr++) {
+		node = &sim_nodes[addr];
+		if(!node->used) {
+			continue;
+		}
+		// Parameters of every node first, the ones of the node override them
+		INIT_LIST_HEAD(&params);
+		list_for_each_entry(param_i, &sim_conf.params, L) {
+			if(f_sim_param_add(&params, param_i->name, param_i->value)) {
+				return -ENOMEM;
+			}
+		}
+		list_splice_tail_init(&node->policy.params, &params);
+		list_splice_tail_init(&params, &node->policy.params);
+		node->cfg.policy_set = &node->policy;
+
+		base = sim_factory->create((struct rina_component *) node);
+		if(!base) {
+			LOG_ERR("Could not create %s on node %u", sim_factory->name, addr);
+			return -ENOMEM;
+		}
+		node->ps = container_of(base, struct rmt_ps, base);
+		for(port_i = node->ports; port_i; port_i = port_i->next) {
+			port_i->P.rmt_ps_queues = node->ps->rmt_q_create_policy(node->ps, &port_i->P);
+			if(!port_i->P.rmt_ps_queues) {
+				LOG_ERR("Could not create the queues of port %u -> %u", addr, port_i->to->addr);
+				return -ENOMEM;
+			}
+		}
+	}
+
+	for(flow_i = sim_flows; flow_i; flow_i = flow_i->next) {
+		for(node = &sim_nodes[flow_i->src]; node->addr != flow_i->dst; node = node->route[flow_i->dst]->to) {
+			if(!node->route[flow_i->dst]) {
+				LOG_ERR("No route from %u to %u", flow_i->src, flow_i->dst);
+				return -EINVAL;
+			}
+			flow_i->rtt += 2 * node->route[flow_i->dst]->delay;
+		}
+		flow_i->rtt = max(flow_i->rtt, sim_conf.poll);
+		ev = f_sim_event(0, SIM_EV_SEND);
+		ev->flow = flow_i;
+		f_sim_push(ev);
+	}
+	return 0;
+}
+
+static void f_sim_cleanup(void) {
+	struct sim_node * node;
+	struct sim_port * port_i, * port_n;
+	struct sim_flow * flow_i, * flow_n;
+	struct policy_parm * param_i, * param_n;
+	struct sim_event * ev;
+	address_t addr;
+	uint_t i;
+
+	sim_ending = true;
+	for(addr = 1; addr < SIM_MAX_NODES; addr++) {
+		node = &sim_nodes[addr];
+		if(!node->used) {
+			continue;
+		}
+		for(port_i = node->ports; port_i; port_i = port_n) {
+			port_n = port_i->next;
+			if(node->ps && port_i->P.rmt_ps_queues) {
+				node->ps->rmt_q_destroy_policy(node->ps, &port_i->P);
+			}
+			free(port_i);
+		}
+		if(node->ps) {
+			sim_factory->destroy(&node->ps->base);
+		}
+		list_for_each_entry_safe(param_i, param_n, &node->policy.params, L) {
+			list_del(&param_i->L);
+			free(param_i->name);
+			free(param_i->value);
+			free(param_i);
+		}
+	}
+	list_for_each_entry_safe(param_i, param_n, &sim_conf.params, L) {
+		list_del(&param_i->L);
+		free(param_i->name);
+		free(param_i->value);
+		free(param_i);
+	}
+
+	// Alarms of the policy sets are cancelled by now
+	while((ev = f_sim_pop())) {
+		if(ev->type == SIM_EV_ARRIVE) {
+			sim_unfinished++;
+			free(ev->arrive.pdu);
+		}
+		free(ev);
+	}
+	free(sim_heap);
+	if(sim_factory) {
+		sim_ps_exit();
+	}
+
+	for(flow_i = sim_flows; flow_i; flow_i = flow_n) {
+		flow_n = flow_i->next;
+		free(flow_i);
+	}
+	for(i = 0; i < SIM_MAX_QOS; i++) {
+		free(sim_qos[i].lat);
+	}
+}
+
+/// Report
+
+static int f_sim_cmp(const void * a, const void * b) {
+	u64 x = *(const u64 *) a, y = *(const u64 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double f_sim_percentile(struct sim_qos_stats * stats, uint_t permille) {
+	if(!stats->lat_len) {
+		return 0;
+	}
+	return stats->lat[(stats->lat_len - 1) * permille / 1000] / 1000.0;
+}
+
+static void f_sim_report(void) {
+	struct sim_qos_stats * stats;
+	struct sim_flow * flow_i;
+	struct sim_port * port_i;
+	address_t addr;
+	uint_t i;
+
+	printf("Policy set %s, %u nodes, %u ports, %u flows, %.3f ms + %.3f ms drain, seed %llu\n",
+		sim_factory->name, sim_num_nodes, sim_num_ports, sim_num_flows,
+		sim_conf.duration / 1e6, sim_conf.drain / 1e6, (unsigned long long) sim_conf.seed);
+
+	printf("\n%5s %10s %10s %10s %7s %7s %10s %10s %10s %10s\n",
+		"qos", "sent", "delivered", "lost", "lost%", "ecn%", "p50 us", "p99 us", "p99.9 us", "max us");
+	for(i = 0; i < SIM_MAX_QOS; i++) {
+		stats = &sim_qos[i];
+		if(!stats->sent) {
+			continue;
+		}
+		qsort(stats->lat, stats->lat_len, sizeof(u64), f_sim_cmp);
+		printf("%5u %10llu %10llu %10llu %7.3f %7.3f %10.1f %10.1f %10.1f %10.1f\n", i,
+			(unsigned long long) stats->sent, (unsigned long long) stats->delivered,
+			(unsigned long long) stats->lost, 100.0 * stats->lost / stats->sent,
+			stats->delivered ? 100.0 * stats->marked / stats->delivered : 0.0,
+			f_sim_percentile(stats, 500), f_sim_percentile(stats, 990),
+			f_sim_percentile(stats, 999), f_sim_percentile(stats, 1000));
+	}
+
+	printf("\n%5s %5s %5s %10s %10s %10s %10s %10s %10s\n",
+		"src", "dst", "qos", "sent", "delivered", "lost", "marked", "Mbps", "now Mbps");
+	for(flow_i = sim_flows; flow_i; flow_i = flow_i->next) {
+		printf("%5u %5u %5u %10llu %10llu %10llu %10llu %10.3f %10.3f\n",
+			flow_i->src, flow_i->dst, flow_i->qos,
+			(unsigned long long) flow_i->sent, (unsigned long long) flow_i->delivered,
+			(unsigned long long) flow_i->lost, (unsigned long long) flow_i->marked,
+			flow_i->max_rate / 1e6, flow_i->rate / 1e6);
+	}
+
+	printf("\n%5s %5s %10s %10s %10s %7s\n", "from", "to", "Mbps", "tx pdus", "tx MB", "busy%");
+	for(addr = 1; addr < SIM_MAX_NODES; addr++) {
+		for(port_i = sim_nodes[addr].ports; port_i; port_i = port_i->next) {
+			printf("%5u %5u %10.3f %10llu %10.3f %7.2f\n", addr, port_i->to->addr,
+				port_i->rate / 1e6, (unsigned long long) port_i->tx_pdus, port_i->tx_bytes / 1e6,
+				min(100.0, 100.0 * port_i->busy_ns / sim_now));
+		}
+	}
+	printf("\n%llu events\n", (unsigned long long) sim_events);
+}
+
+static void f_sim_usage(const char * name) {
+	fprintf(stderr, "Usage: %s [-v]... [-s seed] scenario\n", name);
+}
+
+int main(int argc, char ** argv) {
+	bool seeded = false;
+	u64 seed = 0;
+	int opt, ret;
+
+	while((opt = getopt(argc, argv, "vs:h")) != -1) {
+		switch(opt) {
+			case 'v':
+				sim_verbose++;
+				break;
+			case 's':
+				if(kstrtou64(optarg, 10, &seed)) {
+					f_sim_usage(argv[0]);
+					return 2;
+				}
+				seeded = true;
+				break;
+			default:
+				f_sim_usage(argv[0]);
+				return 2;
+		}
+	}
+	if(optind != argc - 1) {
+		f_sim_usage(argv[0]);
+		return 2;
+	}
+
+	sim_conf.duration = 100 * NSEC_PER_MSEC;
+	sim_conf.drain = 50 * NSEC_PER_MSEC;
+	sim_conf.poll = 10 * NSEC_PER_USEC;
+	sim_conf.seed = 1;
+	sim_conf.ecn_beta = 0.2;
+	sim_conf.ecn_ai = 0.01;
+	sim_conf.ecn_min = 0.01;
+	INIT_LIST_HEAD(&sim_conf.params);
+
+	ret = f_sim_load(argv[optind]);
+	if(!ret) {
+		if(seeded) {
+			sim_conf.seed = seed;
+		}
+		ret = f_sim_setup();
+	}
+	if(!ret) {
+		f_sim_run();
+		f_sim_report();
+	}
+	f_sim_cleanup();
+	if(!ret) {
+		printf("%llu PDUs unfinished at the end\n", (unsigned long long) sim_unfinished);
+	}
+	if(sim_warnings) {
+		LOG_ERR("%lu invariant warnings", sim_warnings);
+		return 1;
+	}
+	return ret ? 1 : 0;
+}
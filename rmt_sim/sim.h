@@ -0,0 +1,126 @@
+//sim.h
+#ifndef SIM_H
+#define SIM_H
+
+#include <math.h>
+
+#include "sim-kernel.h"
+#include "rmt-ps.h"
+#include "policies.h"
+
+#define SIM_MAX_NODES 256 // Node ids are the addresses, 1..255
+#define SIM_MAX_QOS 256
+#define SIM_LINE_LEN 256
+
+enum sim_ev_type {
+	SIM_EV_SEND, // A flow emits a PDU
+	SIM_EV_TX_DONE, // A port ends the serialisation of a PDU
+	SIM_EV_ARRIVE, // A PDU reaches the far end of a link
+	SIM_EV_POLL, // A port with held PDUs asks the policy set again
+	SIM_EV_ECHO, // An ECN mark is echoed back to the source of a flow
+	SIM_EV_ALARM, // A timer or delayed work of a policy set
+};
+
+/// Data structures
+
+struct sim_event {
+	u64 at; // ns
+	u64 seq; // Ties are served in insertion order, runs are reproducible
+	enum sim_ev_type type;
+	bool cancelled; // Alarms only
+	union {
+		struct sim_flow * flow;
+		struct sim_port * port;
+		struct sim_alarm * alarm;
+		struct {
+			struct pdu * pdu;
+			struct sim_node * node;
+		} arrive;
+	};
+};
+
+// One direction of a link, served by the policy set of its node
+struct sim_port {
+	struct rmt_n1_port P;
+	struct sim_node * from;
+	struct sim_node * to;
+	u64 rate; // bps
+	u64 delay; // ns, propagation
+	u32 queued; // PDUs handed to the policy set, not yet dequeued nor destroyed
+	bool polling; // SIM_EV_POLL pending
+	u64 busy_ns; // Time spent serialising
+	u64 tx_pdus;
+	u64 tx_bytes;
+	struct sim_port * next; // Ports of the same node
+};
+
+struct sim_node {
+	address_t addr;
+	bool used;
+	struct policy policy; // Policy set parameters, given at create
+	struct rmt_config cfg;
+	struct rmt_ps * ps;
+	struct sim_port * ports;
+	struct sim_port * route[SIM_MAX_NODES]; // Destination -> first hop
+};
+
+struct sim_flow {
+	address_t src;
+	address_t dst;
+	qos_id_t qos;
+	uint_t size; // bytes per PDU
+	u64 max_rate; // bps, configured
+	u64 rate; // bps, current
+	u8 ecn; // Reacts to the ECN marks echoed
+	u8 poisson; // Exponential inter-arrivals instead of constant
+	u64 rtt; // ns, propagation there and back
+	u64 last_cut; // Last decrease, at most one per rtt
+	u64 last_inc; // Last increase, one per rtt without decreases
+	seq_num_t seq;
+	u64 sent;
+	u64 delivered;
+	u64 lost;
+	u64 marked;
+	struct sim_flow * next;
+};
+
+struct sim_qos_stats {
+	u64 sent;
+	u64 delivered;
+	u64 lost;
+	u64 marked;
+	u64 * lat; // ns, one per delivered PDU
+	size_t lat_len;
+	size_t lat_cap;
+};
+
+struct sim_config {
+	u64 duration; // ns, flows emit until then
+	u64 drain; // ns, extra time for the queues to empty
+	u64 poll; // ns, retry interval of ports with held PDUs
+	u64 seed;
+	double ecn_beta; // Multiplicative decrease on an ECN echo
+	double ecn_ai; // Additive increase per rtt, fraction of the configured rate
+	double ecn_min; // Floor of the rate, fraction of the configured rate
+	struct list_head params; // Policy set parameters of every node
+};
+
+/// Function headers
+
+static int f_sim_load(const char * file);
+static int f_sim_setup(void);
+static void f_sim_run(void);
+static void f_sim_report(void);
+static void f_sim_cleanup(void);
+static void f_sim_push(struct sim_event * ev);
+static struct sim_event * f_sim_pop(void);
+static struct sim_event * f_sim_event(u64 at, enum sim_ev_type type);
+static void f_sim_forward(struct sim_node * node, struct pdu * pdu);
+static void f_sim_deliver(struct sim_node * node, struct pdu * pdu);
+static void f_sim_transmit(struct sim_port * port, struct pdu * pdu);
+static void f_sim_kick(struct sim_port * port);
+static void f_sim_send(struct sim_flow * flow);
+static void f_sim_echo(struct sim_flow * flow);
+static int f_sim_param_add(struct list_head * params, const char * name, const char * value);
+
+#endif
@@ -0,0 +1,590 @@
+ //rmt-wfq.c
+#define RINA_PREFIX "rmt-wfq-plugin"
+#define RINA_WFQ_PS_NAME "rmt-wfq-ps"
+#include "rmt-wfq.h"
+
+MODULE_DESCRIPTION("RMT WFQ policy set");
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Sergio Leon <gaixas1@gmail.com>");
+
+/// Main functions
+
+
+static struct ps_base * f_policy_create(struct rina_component * component){
+
+	struct rmt * rmt_i;
+	struct rmt_ps * ps_i;
+	struct rmt_config * rmt_cfg;
+	struct base_config * conf;
+
+	rmt_i = component ? rmt_from_component(component) : NULL;
+
+	ps_i = rkzalloc(sizeof(struct rmt_ps), GFP_ATOMIC);
+	if (!ps_i) {
+		return NULL;
+	}
+
+	conf = kzalloc(sizeof(struct base_config), GFP_ATOMIC);
+	if (!conf) {
+		LOG_ERR("Could not create config queue");
+		return NULL;
+	}
+
+	conf->max_count = 100;
+	conf->ecn_th = 50;
+	conf->default_weight = 1;
+	INIT_LIST_HEAD(&conf->port_L);
+	INIT_LIST_HEAD(&conf->buffer_L);
+	INIT_LIST_HEAD(&conf->qos_L);
+
+	ps_i->base.set_policy_set_param = f_set_policy_set_param;
+	ps_i->dm = rmt_i;
+	ps_i->priv = conf;
+
+	rmt_cfg = rmt_i ? rmt_config_get(rmt_i) : NULL;
+	if (rmt_cfg) {
+		policy_for_each(rmt_cfg->policy_set, conf, f_policy_base_config_apply);
+	} else {
+		LOG_WARN("Using default config (100 buffers, ecn at 50, equal weights)");
+	}
+
+	ps_i->rmt_q_create_policy = f_rmt_q_create_policy;
+	ps_i->rmt_q_destroy_policy = f_rmt_q_destroy_policy;
+	ps_i->rmt_enqueue_policy = f_rmt_enqueue_policy;
+	ps_i->rmt_dequeue_policy = f_rmt_dequeue_policy;
+
+	LOG_INFO("Loaded WFQ policy set and its configuration");
+
+	return &ps_i->base;
+}
+
+static void f_policy_destroy(struct ps_base * bps) {
+
+	struct rmt_ps * ps_i;
+	struct base_config * conf;
+	struct port_instance * port_i;
+	struct q_entry * entry_i;
+	struct qos_weight * qos_i;
+
+	if (!bps) {
+		LOG_ERR("Error on rmt policy destroy. Some modules not set.");
+		return;
+	}
+
+	ps_i = container_of(bps, struct rmt_ps, base);
+	if (!ps_i || !ps_i->priv) {
+		LOG_ERR("Error on rmt policy destroy. Some modules not set.");
+		return;
+	}
+
+	conf = ps_i->priv;
+
+	// Delete all remaining port instances
+	while(!list_empty(&conf->port_L)) {
+		port_i = list_first_entry(&conf->port_L, struct port_instance, L);
+		f_free_port_instance(port_i);
+	}
+
+	// Empty buffers
+	while(!list_empty(&conf->buffer_L)) {
+		entry_i = list_first_entry(&conf->buffer_L, struct q_entry, L);
+		list_del(&entry_i->L);
+		rkfree(entry_i);
+	}
+
+	// Remove QoS weights
+	while(!list_empty(&conf->qos_L)) {
+		qos_i = list_first_entry(&conf->qos_L, struct qos_weight, L);
+		list_del(&qos_i->L);
+		rkfree(qos_i);
+	}
+
+	// Delete base structure
+	rkfree(conf);
+}
+
+
+int f_rmt_enqueue_policy(struct rmt_ps *ps_i, struct rmt_n1_port * P, struct pdu *PDU) {
+	struct base_config * conf;
+	struct port_instance * port_i;
+	struct q_entry * entry_i;
+	struct wfq_queue * q_i;
+	u64 start;
+
+	if (!ps_i || !ps_i->priv || !P || !PDU) {
+		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_tx");
+		return RMT_PS_ENQ_ERR;
+	}
+
+	//Policy global config
+	conf = ps_i->priv;
+
+	//Search for Port instance
+	port_i = P->rmt_ps_queues;
+	if(!port_i) {
+		LOG_ERR("Unknown rmt_port for rmt_enqueue_scheduling_policy_tx, dropping PDU");
+		pdu_destroy(PDU);
+		return RMT_PS_ENQ_ERR;
+	}
+
+	if(port_i->count >= conf->max_count) {
+		LOG_INFO("Length exceeded for queue, dropping PDU");
+		pdu_destroy(PDU);
+		return RMT_PS_ENQ_DROP;
+	}
+
+	q_i = f_wfq_queue_get(conf, port_i, pci_qos_id(pdu_pci_get_ro(PDU)));
+	if(!q_i) {
+		LOG_ERR("Cannot allocate QoS queue, dropping PDU");
+		pdu_destroy(PDU);
+		return RMT_PS_ENQ_DROP;
+	}
+
+	if(list_empty(&conf->buffer_L)) {
+		entry_i = rkzalloc(sizeof(struct q_entry), GFP_ATOMIC);
+	} else {
+		entry_i = list_first_entry(&conf->buffer_L, struct q_entry, L);
+		list_del(&entry_i->L);
+	}
+
+	if(!entry_i) {
+		LOG_ERR("Cannot allocate buffer, dropping PDU");
+		pdu_destroy(PDU);
+		return RMT_PS_ENQ_DROP;
+	}
+
+	// F = max(V, F_last) + len / weight
+	start = max(port_i->vtime, q_i->last_finish);
+	entry_i->data = PDU;
+	entry_i->finish = start + div_u64((u64) pdu_len(PDU) << WFQ_VT_SHIFT, q_i->weight);
+	q_i->last_finish = entry_i->finish;
+
+	if(list_empty(&q_i->Q)) {
+		q_i->head_finish = entry_i->finish;
+		list_add_tail(&entry_i->L, &q_i->Q);
+		f_heap_push(port_i, q_i);
+	} else {
+		list_add_tail(&entry_i->L, &q_i->Q);
+	}
+
+	port_i->count++;
+	if(RMT_CHECK_ENABLED) {
+		f_check_port(conf, port_i);
+	}
+
+	LOG_DBG("PDU enqueued");
+	return RMT_PS_ENQ_SCHED;
+}
+
+struct pdu * f_rmt_dequeue_policy(struct rmt_ps * ps_i, struct rmt_n1_port * P) {
+	struct base_config * conf;
+	struct port_instance * port_i;
+	struct pdu * PDU;
+	struct q_entry * entry_i;
+	struct wfq_queue * q_i;
+	struct pci * pci;
+	unsigned long pci_flags;
+
+	if (!ps_i || !P) {
+		LOG_ERR("Wrong input parameters for rmt_enqueu_scheduling_policy_rx");
+		return NULL;
+	}
+
+	conf = ps_i->priv;
+
+	port_i = P->rmt_ps_queues;
+	if(!port_i) {
+		LOG_ERR("Unknown rmt_port for rmt_dequeue_scheduling_policy_rx, dropping PDU");
+		return NULL;
+	}
+
+	if(port_i->heap_len == 0) {
+		return NULL;
+	}
+
+	q_i = port_i->heap[0];
+	entry_i = list_first_entry(&q_i->Q, struct q_entry, L);
+	list_del(&entry_i->L);
+	PDU = entry_i->data;
+	port_i->vtime = entry_i->finish;
+	list_add(&entry_i->L, &conf->buffer_L);
+	port_i->count--;
+
+	if(list_empty(&q_i->Q)) {
+		port_i->heap_len--;
+		port_i->heap[0] = port_i->heap[port_i->heap_len];
+	} else {
+		q_i->head_finish = list_first_entry(&q_i->Q, struct q_entry, L)->finish;
+	}
+	f_heap_sift_down(port_i);
+
+	if(port_i->count > conf->ecn_th) {
+		pci = pdu_pci_get_rw(PDU);
+		pci_flags = pci_flags_get(pci);
+		pci_flags_set(pci, pci_flags |= PDU_FLAGS_EXPLICIT_CONGESTION);
+	}
+	if(RMT_CHECK_ENABLED) {
+		f_check_port(conf, port_i);
+	}
+
+	return PDU;
+}
+
+void * f_rmt_q_create_policy(struct rmt_ps *ps_i, struct rmt_n1_port * P) {
+	struct base_config * config;
+	struct port_instance * port_i;
+	int i;
+
+	if (!ps_i || !ps_i->priv || !P) {
+		LOG_ERR("Wrong input parameters for rmt_q_create_policy");
+		return NULL;
+	}
+
+	config = ps_i->priv;
+
+	if(P->rmt_ps_queues) {
+		LOG_WARN("Try to create port queues for an already set port");
+		return (struct port_instance *) P->rmt_ps_queues;
+	}
+
+	port_i = kzalloc(sizeof(struct port_instance), GFP_ATOMIC);
+	if(!port_i) {
+		LOG_ERR("Memory alloc problem in rmt_q_create_policy");
+		return NULL;
+	}
+
+	port_i->P = P;
+	port_i->count = 0;
+	port_i->vtime = 0;
+	port_i->heap = NULL;
+	port_i->heap_len = 0;
+	port_i->heap_size = 0;
+	port_i->num_queues = 0;
+	INIT_LIST_HEAD(&port_i->L);
+	for(i = 0; i < WFQ_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&port_i->qmap[i]);
+	}
+
+	P->rmt_ps_queues = port_i;
+	list_add_tail(&port_i->L, &config->port_L);
+
+	return port_i;
+}
+
+int f_rmt_q_destroy_policy(struct rmt_ps *ps_i, struct rmt_n1_port * P) {
+	if(!P->rmt_ps_queues) {
+		LOG_ERR("Unknown rmt_port for rmt_destroy_p_policy");
+		return -1;
+	}
+
+	f_free_port_instance((struct port_instance *) P->rmt_ps_queues);
+	return 0;
+}
+
+
+/// Helper functions
+
+static int f_policy_base_config_apply(struct policy_parm * param, void * data) {
+	struct base_config * conf;
+
+	conf = (struct base_config *) data;
+	return f_policy_set_param_pv(conf, policy_param_name(param), policy_param_value(param));
+}
+
+static int f_set_policy_set_param(struct ps_base * bps, const char * name, const char * value) {
+	struct rmt_ps * ps_i;
+
+	ps_i = container_of(bps, struct rmt_ps, base);
+	return f_policy_set_param_pv((struct base_config *) ps_i->priv, name, value);
+}
+
+
+static int f_policy_set_param_pv(struct base_config * data, const char * name, const char * value) {
+	int v;
+	uint_t qos_id, weight, i;
+	struct qos_weight * qos_i;
+	struct port_instance * port_i;
+	struct wfq_queue * q_i;
+
+	if (!name) {
+		LOG_ERR("Null parameter name");
+		return -1;
+	}
+	if (!value) {
+		LOG_ERR("Null parameter value");
+		return -1;
+	}
+
+	if(strcmp(name, "max_count") == 0) {
+		if(kstrtoint(value, 10, &v)) {
+			LOG_ERR("Error parsing max_count value \"%s\"", value);
+			return -1;
+		}
+
+		data->max_count = v;
+		LOG_INFO("Set max_count as \"%d\"", v);
+		return 0;
+	}
+	if(strcmp(name, "ecn_th") == 0) {
+		if(kstrtoint(value, 10, &v)) {
+			LOG_ERR("Error parsing ecn_th value \"%s\"", value);
+			return -1;
+		}
+
+		data->ecn_th = v;
+		LOG_INFO("Set ecn_th as \"%d\"", v);
+		return 0;
+	}
+	if(strcmp(name, "default_weight") == 0) {
+		if(kstrtoint(value, 10, &v) || v <= 0) {
+			LOG_ERR("Error parsing default_weight value \"%s\"", value);
+			return -1;
+		}
+
+		data->default_weight = v;
+		LOG_INFO("Set default_weight as \"%d\"", v);
+		return 0;
+	}
+	if(strcmp(name, "qos_weight") == 0) {
+		if(sscanf(value, "%u.%u", &qos_id, &weight) != 2 || weight == 0) {
+			LOG_ERR("Error parsing qos_weight value \"%s\"", value);
+			return -1;
+		}
+
+		// Update queues already created for this QoS
+		list_for_each_entry(port_i, &data->port_L, L) {
+			for(i = 0; i < WFQ_HASH_SIZE; i++) {
+				list_for_each_entry(q_i, &port_i->qmap[i], L) {
+					if(q_i->qos_id == qos_id) {
+						q_i->weight = weight;
+					}
+				}
+			}
+		}
+
+		list_for_each_entry(qos_i, &data->qos_L, L) {
+			if(qos_i->qos_id == qos_id) {
+				qos_i->weight = weight;
+				LOG_INFO("Set qos_weight for QoS %u as \"%u\"", qos_id, weight);
+				return 0;
+			}
+		}
+		qos_i = rkzalloc(sizeof(struct qos_weight), GFP_ATOMIC);
+		if(!qos_i) {
+			LOG_ERR("Failure allocating QoS weight");
+			return -1;
+		}
+		qos_i->qos_id = qos_id;
+		qos_i->weight = weight;
+		list_add_tail(&qos_i->L, &data->qos_L);
+		LOG_INFO("Set qos_weight for QoS %u as \"%u\"", qos_id, weight);
+		return 0;
+	}
+	LOG_ERR("Unknown attribute \"%s\"", name);
+	return 1;
+}
+
+void f_free_port_instance(struct port_instance * port_i) {
+	struct q_entry * entry_i;
+	struct wfq_queue * q_i;
+	int i;
+
+	port_i->P->rmt_ps_queues = NULL;
+	list_del(&port_i->L);
+
+	for(i = 0; i < WFQ_HASH_SIZE; i++) {
+		while(!list_empty(&port_i->qmap[i])) {
+			q_i = list_first_entry(&port_i->qmap[i], struct wfq_queue, L);
+			list_del(&q_i->L);
+			while(!list_empty(&q_i->Q)) {
+				entry_i = list_first_entry(&q_i->Q, struct q_entry, L);
+				list_del(&entry_i->L);
+				pdu_destroy(entry_i->data);
+				rkfree(entry_i);
+			}
+			rkfree(q_i);
+		}
+	}
+
+	if(port_i->heap) {
+		rkfree(port_i->heap);
+	}
+	rkfree(port_i);
+}
+
+/*
+ * Queue of a QoS in a port, created on its first PDU with the configured
+ * weight (default_weight if none).
+ */
+static struct wfq_queue * f_wfq_queue_get(struct base_config * conf, struct port_instance * port_i, qos_id_t qos_id) {
+	struct list_head * bucket;
+	struct wfq_queue * q_i, ** heap;
+	struct qos_weight * qos_i;
+
+	bucket = &port_i->qmap[qos_id & (WFQ_HASH_SIZE - 1)];
+	list_for_each_entry(q_i, bucket, L) {
+		if(q_i->qos_id == qos_id) {
+			return q_i;
+		}
+	}
+
+	// Room in the heap for one more backlogged queue
+	if(port_i->num_queues == port_i->heap_size) {
+		heap = rkzalloc(sizeof(struct wfq_queue *) * (port_i->heap_size + WFQ_HASH_SIZE), GFP_ATOMIC);
+		if(!heap) {
+			return NULL;
+		}
+		if(port_i->heap) {
+			memcpy(heap, port_i->heap, sizeof(struct wfq_queue *) * port_i->heap_len);
+			rkfree(port_i->heap);
+		}
+		port_i->heap = heap;
+		port_i->heap_size += WFQ_HASH_SIZE;
+	}
+
+	q_i = rkzalloc(sizeof(struct wfq_queue), GFP_ATOMIC);
+	if(!q_i) {
+		return NULL;
+	}
+	q_i->qos_id = qos_id;
+	q_i->weight = conf->default_weight;
+	list_for_each_entry(qos_i, &conf->qos_L, L) {
+		if(qos_i->qos_id == qos_id) {
+			q_i->weight = qos_i->weight;
+			break;
+		}
+	}
+	q_i->last_finish = 0;
+	q_i->head_finish = 0;
+	INIT_LIST_HEAD(&q_i->Q);
+	list_add_tail(&q_i->L, bucket);
+	port_i->num_queues++;
+
+	return q_i;
+}
+
+/*
+ * Min-heap of backlogged queues keyed by the finish time of their head PDU
+ * (self-clocked fair queueing). A queue is pushed when it becomes backlogged
+ * and is replaced or re-keyed at the root after each dequeue. The heap always
+ * has room for every queue of the port, see f_wfq_queue_get.
+ */
+static void f_heap_push(struct port_instance * port_i, struct wfq_queue * q_i) {
+	struct wfq_queue ** heap;
+	uint_t i, parent;
+
+	heap = port_i->heap;
+	i = port_i->heap_len++;
+	while(i > 0) {
+		parent = (i - 1) / 2;
+		if(heap[parent]->head_finish <= q_i->head_finish) {
+			break;
+		}
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = q_i;
+}
+
+static void f_heap_sift_down(struct port_instance * port_i) {
+	struct wfq_queue ** heap, * q_i;
+	uint_t i, child, len;
+
+	heap = port_i->heap;
+	len = port_i->heap_len;
+	if(len == 0) {
+		return;
+	}
+
+	q_i = heap[0];
+	i = 0;
+	while((child = 2 * i + 1) < len) {
+		if(child + 1 < len && heap[child + 1]->head_finish < heap[child]->head_finish) {
+			child++;
+		}
+		if(q_i->head_finish <= heap[child]->head_finish) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = q_i;
+}
+
+
+/*
+ * Invariant checks (make RMT_CHECK=1), see rmt-check.h.
+ * The heap holds exactly the backlogged queues, in heap order and keyed by
+ * the finish time of their head PDU, and the queues hold count PDUs.
+ */
+static void f_check_port(struct base_config * conf, struct port_instance * port_i) {
+	struct wfq_queue * q_i;
+	uint_t i, count, backlogged;
+
+	count = 0;
+	backlogged = 0;
+	for(i = 0; i < WFQ_HASH_SIZE; i++) {
+		list_for_each_entry(q_i, &port_i->qmap[i], L) {
+			if(!list_empty(&q_i->Q)) {
+				backlogged++;
+				count += rmt_check_list_len(&q_i->Q);
+			}
+		}
+	}
+	rmt_check(count == port_i->count, "port %d holds %u PDUs, counted %u",
+		port_i->P->port_id, count, port_i->count);
+	rmt_check(backlogged == port_i->heap_len && port_i->heap_len <= port_i->heap_size,
+		"port %d has %u backlogged queues, heap holds %u of %u",
+		port_i->P->port_id, backlogged, port_i->heap_len, port_i->heap_size);
+
+	for(i = 0; i < port_i->heap_len; i++) {
+		q_i = port_i->heap[i];
+		rmt_check(!list_empty(&q_i->Q)
+			&& q_i->head_finish == list_first_entry(&q_i->Q, struct q_entry, L)->finish,
+			"port %d queue of qos %u has a stale heap key", port_i->P->port_id, q_i->qos_id);
+		rmt_check(i == 0 || port_i->heap[(i - 1) / 2]->head_finish <= q_i->head_finish,
+			"port %d heap out of order at %u", port_i->P->port_id, i);
+	}
+}
+
+
+/// Policy init and exit
+
+static struct ps_factory wfq_factory = {
+		.owner = THIS_MODULE,
+		.create = f_policy_create,
+		.destroy = f_policy_destroy,
+};
+
+// Invariant checks failed so far, see rmt-check.h
+int rmt_wfq_check_failed(void) {
+	return atomic_read(&rmt_check_failed);
+}
+EXPORT_SYMBOL(rmt_wfq_check_failed);
+
+// Factory for in-kernel users other than the RMT (e.g. rmt_gen)
+struct ps_factory * rmt_wfq_ps_factory(void) {
+	return &wfq_factory;
+}
+EXPORT_SYMBOL(rmt_wfq_ps_factory);
+
+static int __init mod_init(void) {
+	strcpy(wfq_factory.name, RINA_WFQ_PS_NAME);
+	if (rmt_ps_publish(&wfq_factory)) {
+		LOG_ERR("Failed to publish policy set factory");
+		return -1;
+	}
+	LOG_INFO("rmt_i WFQ policy set loaded successfully");
+	return 0;
+}
+
+static void __exit mod_exit(void) {
+	if (rmt_ps_unpublish(RINA_WFQ_PS_NAME)) {
+		LOG_ERR("Failed to unpublish policy set factory");
+	} else {
+		LOG_INFO("rmt_i WFQ policy set unloaded successfully");
+	}
+}
+
+module_init(mod_init);
+module_exit(mod_exit);
@@ -0,0 +1,91 @@
+//rmt-wfq.h
+#include <linux/module.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/export.h>
+#include <linux/string.h>
+
+#include "logs.h"
+#include "rds/rmem.h"
+#include "rmt-ps.h"
+#include "policies.h"
+#include "debug.h"
+#include "rmt-check.h"
+
+// Buckets of the per port qos_id -> queue map (power of 2)
+#define WFQ_HASH_SIZE 16
+// Fixed point shift of the virtual time
+#define WFQ_VT_SHIFT 10
+
+/// Data structures
+
+//Queue entry
+struct q_entry {
+	struct list_head L;
+	struct pdu * data;
+	u64 finish; // Virtual finish time
+};
+
+// Weight of a QoS
+struct qos_weight {
+	struct list_head L;
+	qos_id_t qos_id;
+	uint_t weight;
+};
+
+// Queue of a QoS in a port
+struct wfq_queue {
+	struct list_head L; // Bucket of the qos map
+	qos_id_t qos_id;
+	uint_t weight;
+	u64 last_finish; // Finish time of the last PDU enqueued
+	u64 head_finish; // Finish time of the PDU at the head, heap key
+	struct list_head Q;
+};
+
+// port instance information
+struct port_instance {
+	struct list_head L;
+	struct rmt_n1_port * P;
+
+	uint_t count;
+	u64 vtime; // Finish time of the last PDU served (SCFQ)
+	struct wfq_queue ** heap; // Backlogged queues, min-heap on head_finish
+	uint_t heap_len;
+	uint_t heap_size; // Always >= num_queues
+	uint_t num_queues;
+	struct list_head qmap[WFQ_HASH_SIZE];
+};
+
+// Configuration of the policy
+struct base_config {
+	uint_t max_count;
+	uint_t ecn_th;
+	uint_t default_weight;
+	struct list_head port_L;
+	struct list_head buffer_L;
+	struct list_head qos_L;
+};
+
+/// Function headers
+
+static struct ps_base * f_policy_create(struct rina_component * component);
+struct ps_factory * rmt_wfq_ps_factory(void);
+int rmt_wfq_check_failed(void);
+static void f_policy_destroy(struct ps_base * bps);
+
+void * f_rmt_q_create_policy(struct rmt_ps *ps, struct rmt_n1_port * P);
+int f_rmt_q_destroy_policy(struct rmt_ps *ps, struct rmt_n1_port * P);
+int f_rmt_enqueue_policy(struct rmt_ps *ps, struct rmt_n1_port * P, struct pdu * PDU);
+struct pdu * f_rmt_dequeue_policy(struct rmt_ps *ps, struct rmt_n1_port * P);
+
+static int f_set_policy_set_param(struct ps_base * bps, const char * name, const char * value);
+static int f_policy_base_config_apply(struct policy_parm * param, void * data);
+
+static int f_policy_set_param_pv(struct base_config * data, const char * name, const char * value);
+
+void f_free_port_instance(struct port_instance * entry);
+static struct wfq_queue * f_wfq_queue_get(struct base_config * conf, struct port_instance * port_i, qos_id_t qos_id);
+static void f_heap_push(struct port_instance * port_i, struct wfq_queue * q_i);
+static void f_heap_sift_down(struct port_instance * port_i);
+static void f_check_port(struct base_config * conf, struct port_instance * port_i);